@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Tag matching queue shared by providers that implement FI_TAGGED (and
+ * FI_MSG with FI_DIRECTED_RECV) in software.
+ *
+ * Entries whose tag is fully specified (ignore == 0) are kept in hash
+ * buckets keyed by (source, tag); receives with wildcard tag bits are kept
+ * on a separate wildcard list.  Every entry is also linked on a list in
+ * insertion order and stamped with a sequence number, so that lookups that
+ * look at more than one bucket still return the oldest matching entry, as
+ * required by the MPI ordering rules.  Queues that are both tagged and
+ * directed also index fully specified entries by tag alone, for receives
+ * from any source.
+ *
+ * The same structure serves as the posted receive queue, searched with
+ * ofi_mq_find_recv() when a message arrives, and as the unexpected message
+ * queue, searched with ofi_mq_find_msg() when a receive is posted.  Entries
+ * on an unexpected queue must have ignore set to 0.
+ *
+ * Without OFI_MQ_DIRECTED the source address does not take part in
+ * matching; without OFI_MQ_TAGGED the tag and ignore fields are ignored.
+ * Addresses match as ofi_match_addr(): FI_ADDR_UNSPEC on a receive matches
+ * any source, while a message from an unknown source (FI_ADDR_UNSPEC) only
+ * matches receives for any source.
+ */
+
+#ifndef _OFI_MATCH_H_
+#define _OFI_MATCH_H_
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <ofi_list.h>
+#include <rdma/fabric.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define OFI_MQ_TAGGED		(1 << 0)
+#define OFI_MQ_DIRECTED		(1 << 1)
+
+struct ofi_mq_entry {
+	struct dlist_entry	entry;		/* hash bucket or wildcard list */
+	struct dlist_entry	list_entry;	/* insertion order */
+	struct dlist_entry	tag_entry;	/* tag bucket */
+	fi_addr_t		addr;
+	uint64_t		tag;
+	uint64_t		ignore;
+	uint64_t		seq;
+};
+
+struct ofi_mq {
+	struct dlist_entry	list;
+	struct dlist_entry	wild_list;
+	struct dlist_entry	*bucket;
+	struct dlist_entry	*tag_bucket;
+	size_t			bucket_mask;
+	uint64_t		seq;
+	uint64_t		flags;
+};
+
+typedef int ofi_mq_match_func(struct ofi_mq_entry *entry, const void *arg);
+
+int ofi_mq_init(struct ofi_mq *mq, size_t size, uint64_t flags);
+void ofi_mq_close(struct ofi_mq *mq);
+
+void ofi_mq_insert(struct ofi_mq *mq, struct ofi_mq_entry *entry);
+void ofi_mq_reinsert(struct ofi_mq *mq, struct ofi_mq_entry *entry);
+
+/* Oldest posted receive that accepts a message from addr with tag */
+struct ofi_mq_entry *ofi_mq_find_recv(struct ofi_mq *mq, fi_addr_t addr,
+				      uint64_t tag);
+/* Oldest unexpected message accepted by a receive for (addr, tag, ignore) */
+struct ofi_mq_entry *ofi_mq_find_msg(struct ofi_mq *mq, fi_addr_t addr,
+				     uint64_t tag, uint64_t ignore);
+/* Oldest entry for which match returns true, e.g. to cancel by context */
+struct ofi_mq_entry *ofi_mq_find(struct ofi_mq *mq, ofi_mq_match_func *match,
+				 const void *arg);
+
+static inline int ofi_mq_empty(struct ofi_mq *mq)
+{
+	return dlist_empty(&mq->list);
+}
+
+static inline struct ofi_mq_entry *ofi_mq_first(struct ofi_mq *mq)
+{
+	return ofi_mq_empty(mq) ? NULL :
+	       container_of(mq->list.next, struct ofi_mq_entry, list_entry);
+}
+
+static inline void ofi_mq_remove(struct ofi_mq_entry *entry)
+{
+	dlist_remove(&entry->entry);
+	dlist_remove(&entry->list_entry);
+	dlist_remove(&entry->tag_entry);
+}
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _OFI_MATCH_H_ */
@@ -40,6 +40,7 @@
 #include <string.h>
 #include <ofi_list.h>
 #include <ofi_osd.h>
+#include <ofi_atom.h>
 
 
 #ifdef INCLUDE_VALGRIND
@@ -161,68 +162,49 @@ static inline void name ## _free(struct name *fs)		\
 }
 
 /*
- * Buffer pool (free stack) template for shared memory regions
+ * Lock-free buffer pool (free stack) template for shared memory regions
+ *
+ * Entries are linked by index rather than by address, so the stack can be
+ * accessed by processes that map the region at different addresses.  The
+ * top of the stack carries a generation count in its upper 32 bits, which
+ * protects against ABA when several processes push and pop concurrently.
  */
-#define SMR_FREESTACK_EMPTY	NULL
-
-#define SMR_FREESTACK_HEADER 					\
-	void		*base_addr;				\
-	size_t		size;					\
-	void		*next;					\
-
-#define smr_freestack_isempty(fs)	((fs)->next == SMR_FREESTACK_EMPTY)
-#define smr_freestack_push(fs, local_p)				\
-do {								\
-	void *p = (char **) fs->base_addr +			\
-	    ((char **) freestack_get_next(local_p) -		\
-		(char **) fs);					\
-	*(void **) freestack_get_next(local_p) = (fs)->next;	\
-	(fs)->next = p;						\
-} while (0)
-#define smr_freestack_pop(fs) smr_freestack_pop_impl(fs, fs->next)
-
-static inline void* smr_freestack_pop_impl(void *fs, void *next)
-{
-	void *local;
+#define SMR_FREESTACK_EMPTY	UINT32_MAX
 
-	struct {
-		SMR_FREESTACK_HEADER
-	} *freestack = fs;
-	assert(next != NULL);
-
-	local = (char **) fs + ((char **) next -
-		(char **) freestack->base_addr);
-	next = *((void **) local);
-	return freestack_get_user_buf(local);
-}
+#define smr_freestack_top(index, gen)				\
+	((int64_t) (((uint64_t) (gen) << 32) | (uint32_t) (index)))
+#define smr_freestack_index(top)	((uint32_t) (top))
+#define smr_freestack_gen(top)		((uint32_t) ((uint64_t) (top) >> 32))
 
 #define DECLARE_SMR_FREESTACK(entrytype, name)			\
 struct name ## _entry {						\
-	void		*next;					\
+	uint64_t	next;					\
 	entrytype	buf;					\
 };								\
 struct name {							\
-	SMR_FREESTACK_HEADER					\
+	size_t		size;					\
+	ofi_atomic64_t	top;					\
 	struct name ## _entry	entry[];			\
 };								\
 								\
 static inline void name ## _init(struct name *fs, size_t size)	\
 {								\
-	ssize_t i;						\
+	size_t i;						\
 	assert(size == roundup_power_of_two(size));		\
-	assert(sizeof(fs->entry[0].buf) >= sizeof(void *));	\
 	fs->size = size;					\
-	fs->next = SMR_FREESTACK_EMPTY;				\
-	fs->base_addr = fs;					\
-	for (i = size - 1; i >= 0; i--)				\
-		smr_freestack_push(fs, &fs->entry[i].buf);	\
+	for (i = 0; i < size; i++)				\
+		fs->entry[i].next = (i == size - 1) ?		\
+				    SMR_FREESTACK_EMPTY : i + 1; \
+	ofi_atomic_initialize64(&fs->top, smr_freestack_top(	\
+				size ? 0 : SMR_FREESTACK_EMPTY, 0)); \
 }								\
 								\
 static inline struct name * name ## _create(size_t size)	\
 {								\
 	struct name *fs;					\
-	fs = calloc(1, sizeof(*fs) + sizeof(entrytype) *	\
-		    (roundup_power_of_two(size)));		\
+	fs = calloc(1, sizeof(*fs) +				\
+		       sizeof(struct name ## _entry) *		\
+		       (roundup_power_of_two(size)));		\
 	if (fs)							\
 		name ##_init(fs, roundup_power_of_two(size));	\
 	return fs;						\
@@ -231,9 +213,47 @@ static inline struct name * name ## _create(size_t size)	\
 static inline int name ## _index(struct name *fs,		\
 		entrytype *entry)				\
 {								\
-	return (int)((struct name ## _entry *)			\
-			(freestack_get_next(entry))		\
-			- (struct name ## _entry *)fs->entry);	\
+	return (int) ((struct name ## _entry *)			\
+		((char *) entry -				\
+		 offsetof(struct name ## _entry, buf)) -	\
+		fs->entry);					\
+}								\
+								\
+static inline int name ## _isempty(struct name *fs)		\
+{								\
+	return smr_freestack_index(ofi_atomic_get64(&fs->top)) == \
+	       SMR_FREESTACK_EMPTY;				\
+}								\
+								\
+static inline entrytype *name ## _pop(struct name *fs)		\
+{								\
+	int64_t top, next;					\
+	uint32_t index;						\
+								\
+	do {							\
+		top = ofi_atomic_get64(&fs->top);		\
+		index = smr_freestack_index(top);		\
+		if (index == SMR_FREESTACK_EMPTY)		\
+			return NULL;				\
+		next = smr_freestack_top(fs->entry[index].next,	\
+					 smr_freestack_gen(top) + 1); \
+	} while (!ofi_atomic_cas_bool64(&fs->top, top, next));	\
+								\
+	return &fs->entry[index].buf;				\
+}								\
+								\
+static inline void name ## _push(struct name *fs, entrytype *entry) \
+{								\
+	int64_t top, next;					\
+	uint32_t index;						\
+								\
+	index = name ## _index(fs, entry);			\
+	do {							\
+		top = ofi_atomic_get64(&fs->top);		\
+		fs->entry[index].next = smr_freestack_index(top); \
+		next = smr_freestack_top(index,			\
+					 smr_freestack_gen(top) + 1); \
+	} while (!ofi_atomic_cas_bool64(&fs->top, top, next));	\
 }								\
 								\
 static inline void name ## _free(struct name *fs)		\
@@ -111,6 +111,31 @@ static inline int ofi_sendall_socket(SOCKET sock, const void *buf, size_t len)
 	return (size_t) ret != len;
 }
 
+/*
+ * Ask the kernel to busy poll the device queue for up to usec microseconds
+ * on blocking reads of this socket, preferring busy polling over interrupt
+ * driven processing where supported.
+ */
+static inline int ofi_busy_poll_socket(SOCKET sock, int usec)
+{
+#ifdef SO_BUSY_POLL
+	int ret;
+
+	ret = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (char *) &usec,
+			 sizeof(usec));
+	if (ret)
+		return -ofi_sockerr();
+#ifdef SO_PREFER_BUSY_POLL
+	usec = 1;
+	(void) setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+			  (char *) &usec, sizeof(usec));
+#endif
+	return 0;
+#else
+	return -FI_ENOSYS;
+#endif
+}
+
 /*
  * Address utility functions
  */
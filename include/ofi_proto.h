@@ -59,6 +59,16 @@ enum {
 	ofi_ctrl_nack,
 	ofi_ctrl_discard,
 	ofi_ctrl_seg_data,
+	ofi_ctrl_close_req,
+	ofi_ctrl_close_resp,
+	ofi_ctrl_seg_credit,
+	ofi_ctrl_write_req,
+	ofi_ctrl_write_cts,
+	ofi_ctrl_write_done,
+	ofi_ctrl_bundle,
+	ofi_ctrl_credit,
+	ofi_ctrl_atomic,
+	ofi_ctrl_atomic_resp,
 };
 
 /*
@@ -99,6 +99,117 @@ static inline void name ## _free(struct name *cq)		\
 #define ofi_cirque_commit(cq)		((cq)->wcnt++)
 
 
+/*
+ * Multi-producer, single-consumer circular queue template
+ *
+ * Producers claim entries by advancing the write count with a
+ * compare-and-swap and publish them through a per-entry sequence number,
+ * so senders never block each other or the reader.  The reader owns the
+ * read count and must be serialized by the caller.  Entries are located by
+ * index, which allows the queue to be placed in shared memory.
+ */
+#define OFI_DECLARE_ATOMIC_Q(entrytype, name)			\
+struct name ## _entry {						\
+	ofi_atomic64_t	seq;					\
+	entrytype	buf;					\
+};								\
+struct name {							\
+	int64_t		size;					\
+	int64_t		size_mask;				\
+	int64_t		rcnt;					\
+	ofi_atomic64_t	wcnt;					\
+	struct name ## _entry	entry[];			\
+};								\
+								\
+static inline void name ## _init(struct name *q, size_t size)	\
+{								\
+	size_t i;						\
+	assert(size == roundup_power_of_two(size));		\
+	q->size = size;						\
+	q->size_mask = q->size - 1;				\
+	q->rcnt = 0;						\
+	ofi_atomic_initialize64(&q->wcnt, 0);			\
+	for (i = 0; i < size; i++)				\
+		ofi_atomic_initialize64(&q->entry[i].seq, i);	\
+}								\
+								\
+static inline struct name * name ## _create(size_t size)	\
+{								\
+	struct name *q;						\
+	q = calloc(1, sizeof(*q) + sizeof(struct name ## _entry) * \
+		   (roundup_power_of_two(size)));		\
+	if (q)							\
+		name ##_init(q, roundup_power_of_two(size));	\
+	return q;						\
+}								\
+								\
+static inline void name ## _free(struct name *q)		\
+{								\
+	free(q);						\
+}								\
+								\
+static inline entrytype *name ## _entry(struct name *q, int64_t pos) \
+{								\
+	return &q->entry[pos & q->size_mask].buf;		\
+}								\
+								\
+/* Reserve cnt consecutive entries, returns NULL if the queue is full */ \
+static inline entrytype *name ## _reserve(struct name *q, int cnt, \
+					  int64_t *pos)		\
+{								\
+	int64_t wcnt, diff;					\
+	int i;							\
+								\
+	assert(cnt <= q->size);					\
+retry:								\
+	wcnt = ofi_atomic_get64(&q->wcnt);			\
+	for (i = 0; i < cnt; i++) {				\
+		diff = ofi_atomic_get64(&q->entry[(wcnt + i) &	\
+					q->size_mask].seq) - (wcnt + i); \
+		if (diff < 0)					\
+			return NULL;				\
+		if (diff > 0)					\
+			goto retry;				\
+	}							\
+	if (!ofi_atomic_cas_bool64(&q->wcnt, wcnt, wcnt + cnt))	\
+		goto retry;					\
+								\
+	*pos = wcnt;						\
+	return name ## _entry(q, wcnt);				\
+}								\
+								\
+/* Publish reserved entries, last to first so the head completes a set */ \
+static inline void name ## _commit(struct name *q, int64_t pos, int cnt) \
+{								\
+	while (cnt--)						\
+		ofi_atomic_set64(&q->entry[(pos + cnt) &	\
+				 q->size_mask].seq, pos + cnt + 1); \
+}								\
+								\
+static inline entrytype *name ## _head(struct name *q)		\
+{								\
+	if (ofi_atomic_get64(&q->entry[q->rcnt & q->size_mask].seq) != \
+	    q->rcnt + 1)					\
+		return NULL;					\
+	return name ## _entry(q, q->rcnt);			\
+}								\
+								\
+/* Entries following the head which were committed in the same set */ \
+static inline entrytype *name ## _peek(struct name *q, int offset) \
+{								\
+	assert(ofi_atomic_get64(&q->entry[(q->rcnt + offset) &	\
+	       q->size_mask].seq) == q->rcnt + offset + 1);	\
+	return name ## _entry(q, q->rcnt + offset);		\
+}								\
+								\
+static inline void name ## _discard(struct name *q)		\
+{								\
+	ofi_atomic_set64(&q->entry[q->rcnt & q->size_mask].seq,	\
+			 q->rcnt + q->size);			\
+	q->rcnt++;						\
+}
+
+
 /*
  * Simple ring buffer
  */
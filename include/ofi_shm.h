@@ -42,6 +42,7 @@
 #include <ofi_proto.h>
 #include <ofi_mem.h>
 #include <ofi_rbuf.h>
+#include <ofi_indexer.h>
 
 #include <rdma/providers/fi_prov.h>
 
@@ -50,7 +51,7 @@ extern "C" {
 #endif
 
 
-#define SMR_VERSION	1
+#define SMR_VERSION	4
 
 #ifdef HAVE_ATOMICS
 #define SMR_FLAG_ATOMIC	(1 << 0)
@@ -64,14 +65,19 @@ extern "C" {
 #define SMR_FLAG_DEBUG	(0 << 1)
 #endif
 
+#define SMR_FLAG_CMA	(1 << 2)	/* process_vm_readv/writev usable */
+#define SMR_FLAG_SAR	(1 << 3)	/* region carries bounce buffers */
+
 
 #define SMR_CMD_SIZE		128	/* align with 64-byte cache line */
+#define SMR_CACHE_LINE_SIZE	64
 
 /* SMR op_src: Specifies data source location */
 enum {
 	smr_src_inline,	/* command data */
 	smr_src_inject,	/* inject buffers */
 	smr_src_iov,	/* reference iovec via CMA */
+	smr_src_sar,	/* segmented copy through bounce buffers */
 };
 
 #define SMR_REMOTE_CQ_DATA	(1 << 0)
@@ -84,6 +90,7 @@ enum {
  * 	op_src - msg src (ex. smr_src_inline, defined above)
  * 	op_flags - operation flags (ex. SMR_REMOTE_CQ_DATA, defined above)
  * 	src_data - src of additional op data (inject offset / resp offset)
+ * 	           sar messages also carry the bounce buffer offset in data.sar
  * 	data - remote CQ data
  */
 struct smr_msg_hdr {
@@ -109,6 +116,7 @@ struct smr_msg_hdr {
 #define SMR_COMP_DATA_LEN	(SMR_MSG_DATA_LEN / 2)
 union smr_cmd_data {
 	uint8_t			msg[SMR_MSG_DATA_LEN];
+	uint64_t		sar;
 	struct {
 		uint8_t		iov_count;
 		struct iovec	iov[(SMR_MSG_DATA_LEN - 8) /
@@ -146,6 +154,31 @@ struct smr_cmd {
 #define SMR_INJECT_SIZE		4096
 #define SMR_COMP_INJECT_SIZE	(SMR_INJECT_SIZE / 2)
 
+/*
+ * Bounce buffers used when CMA is not available.  Each buffer is a small
+ * ring of segments: one side fills segments while the other drains them,
+ * handing each segment over through its status.  Buffers live in the
+ * region of the cmd receiver and are held for the whole transfer.
+ */
+#define SMR_SAR_SIZE		(1 << 15)
+#define SMR_SAR_SEGS		4
+#define SMR_SAR_COUNT		16
+
+enum {
+	SMR_SAR_FREE,	/* segment may be filled */
+	SMR_SAR_READY,	/* segment holds data to drain */
+};
+
+struct smr_sar_seg {
+	ofi_atomic32_t	status;
+	uint32_t	size;
+	uint8_t		buf[SMR_SAR_SIZE];
+};
+
+struct smr_sar_buf {
+	struct smr_sar_seg	seg[SMR_SAR_SEGS];
+};
+
 #define SMR_NAME_SIZE	32
 struct smr_addr {
 	char		name[SMR_NAME_SIZE];
@@ -154,42 +187,67 @@ struct smr_addr {
 
 struct smr_region;
 
+/*
+ * Peers are recorded by name when inserted into the AV.  The peer region
+ * is only mapped on first use (see smr_map_to_region), so the cost of a
+ * map scales with the peers that are actually contacted.
+ */
 struct smr_peer {
 	struct smr_addr		peer;
 	struct smr_region	*region;
+	struct dlist_entry	entry;
+	int			id;
+	int			cma;
 };
 
-#define SMR_MAX_PEERS	256
+#define SMR_MAX_PEERS	(OFI_IDX_MAX_INDEX + 1)
 
 struct smr_map {
-	fastlock_t	lock;
-	struct smr_peer	peers[SMR_MAX_PEERS];
+	fastlock_t		lock;
+	int			max_peers;
+	struct index_map	peers;
+	struct dlist_entry	peer_list;
 };
 
+/*
+ * The cmd queue and inject pool are accessed by all peers without locking.
+ * Senders reserve and publish cmds with atomics; the owner of the region
+ * is the only consumer and must serialize its progress (rx cq lock).
+ * Commands that span two queue entries (RMA, atomics) are reserved and
+ * committed together.
+ *
+ * A region holds queue_count cmd queues, each paired with its own inject
+ * pool and kept on separate cache lines.  A sending endpoint always uses
+ * the same queue of a peer, which keeps its commands ordered, while
+ * different senders spread out over the queues instead of contending on
+ * a single one.
+ */
 struct smr_region {
 	uint8_t		version;
 	uint8_t		resv;
 	uint16_t	flags;
 	int		pid;
-	fastlock_t	lock; /* lock for shm access
-				 Must hold smr->lock before tx/rx cq locks
-				 in order to progress or post recv */
 	struct smr_map	*map;
+	void		*base_addr;	/* region address in the owner */
 
 	size_t		total_size;
-	size_t		cmd_cnt; /* Doubles as a tracker for number of cmds AND
-				    number of inject buffers available for use,
-				    to ensure 1:1 ratio of cmds to inject bufs.
-				    Might not always be paired consistently with
-				    cmd alloc/free depending on protocol
-				    (Ex. unexpected messages, RMA requests) */
 
 	/* offsets from start of smr_region */
 	size_t		cmd_queue_offset;
 	size_t		resp_queue_offset;
 	size_t		inject_pool_offset;
+	size_t		sar_pool_offset;
 	size_t		peer_addr_offset;
+	size_t		peer_hash_offset;
 	size_t		name_offset;
+
+	int		max_peers;
+	int		peer_hash_size;
+	int		peer_hash_deleted;
+
+	int		queue_count;
+	size_t		cmd_queue_size;
+	size_t		inject_pool_size;
 };
 
 struct smr_resp {
@@ -207,30 +265,56 @@ struct smr_inject_buf {
 	};
 };
 
-OFI_DECLARE_CIRQUE(struct smr_cmd, smr_cmd_queue);
+OFI_DECLARE_ATOMIC_Q(struct smr_cmd, smr_cmd_queue);
 OFI_DECLARE_CIRQUE(struct smr_resp, smr_resp_queue);
 DECLARE_SMR_FREESTACK(struct smr_inject_buf, smr_inject_pool);
+DECLARE_SMR_FREESTACK(struct smr_sar_buf, smr_sar_pool);
 
+static inline struct smr_peer *smr_map_peer(struct smr_map *map, int id)
+{
+	return ofi_idm_at(&map->peers, id);
+}
 static inline struct smr_region *smr_peer_region(struct smr_region *smr, int i)
 {
-	return smr->map->peers[i].region;
+	return smr_map_peer(smr->map, i)->region;
 }
-static inline struct smr_cmd_queue *smr_cmd_queue(struct smr_region *smr)
+static inline struct smr_cmd_queue *smr_cmd_queue(struct smr_region *smr,
+						  int qid)
 {
-	return (struct smr_cmd_queue *) ((char *) smr + smr->cmd_queue_offset);
+	return (struct smr_cmd_queue *) ((char *) smr + smr->cmd_queue_offset +
+		smr->cmd_queue_size * (qid & (smr->queue_count - 1)));
 }
 static inline struct smr_resp_queue *smr_resp_queue(struct smr_region *smr)
 {
 	return (struct smr_resp_queue *) ((char *) smr + smr->resp_queue_offset);
 }
-static inline struct smr_inject_pool *smr_inject_pool(struct smr_region *smr)
+static inline struct smr_inject_pool *smr_inject_pool(struct smr_region *smr,
+						      int qid)
 {
-	return (struct smr_inject_pool *) ((char *) smr + smr->inject_pool_offset);
+	return (struct smr_inject_pool *) ((char *) smr + smr->inject_pool_offset +
+		smr->inject_pool_size * (qid & (smr->queue_count - 1)));
+}
+/* Inject pool that a buffer was taken from */
+static inline struct smr_inject_pool *
+smr_inject_pool_buf(struct smr_region *smr, struct smr_inject_buf *buf)
+{
+	return smr_inject_pool(smr, (int) (((char *) buf - (char *) smr -
+			       smr->inject_pool_offset) / smr->inject_pool_size));
+}
+static inline struct smr_sar_pool *smr_sar_pool(struct smr_region *smr)
+{
+	if (!(smr->flags & SMR_FLAG_SAR))
+		return NULL;
+	return (struct smr_sar_pool *) ((char *) smr + smr->sar_pool_offset);
 }
 static inline struct smr_addr *smr_peer_addr(struct smr_region *smr)
 {
 	return (struct smr_addr *) ((char *) smr + smr->peer_addr_offset); 
 }
+static inline int *smr_peer_hash(struct smr_region *smr)
+{
+	return (int *) ((char *) smr + smr->peer_hash_offset);
+}
 static inline const char *smr_name(struct smr_region *smr)
 {
 	return (const char *) smr + smr->name_offset;
@@ -245,6 +329,8 @@ struct smr_attr {
 	const char	*name;
 	size_t		rx_count;
 	size_t		tx_count;
+	size_t		queue_count;
+	uint16_t	flags;
 };
 
 int	smr_map_create(const struct fi_provider *prov, int peer_count,
@@ -259,7 +345,7 @@ int	smr_map_add(const struct fi_provider *prov,
 void	smr_map_del(struct smr_map *map, int id);
 void	smr_map_free(struct smr_map *map);
 
-struct smr_region *smr_map_get(struct smr_map *map, int id);
+struct smr_peer *smr_map_get(struct smr_map *map, int id);
 
 int	smr_create(const struct fi_provider *prov, struct smr_map *map,
 		   const struct smr_attr *attr, struct smr_region **smr);
@@ -353,6 +353,21 @@ OFI_DECLARE_CIRQUE(struct fi_cq_tagged_entry, util_comp_cirq);
 
 typedef void (*ofi_cq_progress_func)(struct util_cq *cq);
 
+/*
+ * Blocking CQ reads spin on non-blocking reads for up to budget usec before
+ * arming the wait object.  The budget follows twice the average time until
+ * a completion arrived, and shrinks when arrivals are further apart than
+ * max_budget.  Spinning is disabled while max_budget is 0.
+ */
+struct util_busy_poll {
+	uint64_t		max_budget;
+	uint64_t		budget;
+	uint64_t		avg_wait;
+	/* blocking reads completed while spinning / after arming the wait */
+	uint64_t		spins;
+	uint64_t		sleeps;
+};
+
 struct util_cq {
 	struct fid_cq		cq_fid;
 	struct util_domain	*domain;
@@ -372,6 +387,7 @@ struct util_cq {
 	int			internal_wait;
 	ofi_atomic32_t		signaled;
 	ofi_cq_progress_func	progress;
+	struct util_busy_poll	busy_poll;
 };
 
 int ofi_cq_init(const struct fi_provider *prov, struct fid_domain *domain,
@@ -391,6 +407,7 @@ ssize_t ofi_cq_sread(struct fid_cq *cq_fid, void *buf, size_t count,
 ssize_t ofi_cq_sreadfrom(struct fid_cq *cq_fid, void *buf, size_t count,
 		fi_addr_t *src_addr, const void *cond, int timeout);
 int ofi_cq_signal(struct fid_cq *cq_fid);
+void ofi_cq_busy_poll_init(struct util_cq *cq, uint64_t max_budget);
 
 int ofi_cq_write_overflow(struct util_cq *cq, void *context, uint64_t flags, size_t len,
 			  void *buf, uint64_t data, uint64_t tag, fi_addr_t src);
@@ -601,6 +618,10 @@ enum util_cmap_state {
 	CMAP_CONNECTED_NOTIFY,
 	CMAP_CONNECTED,
 	CMAP_SHUTDOWN,
+	/* The provider is tearing down an idle connection in agreement
+	 * with the peer. The handle is kept and goes back to CMAP_IDLE,
+	 * so that the next transfer reconnects it. */
+	CMAP_CLOSING,
 };
 
 struct util_cmap_handle {
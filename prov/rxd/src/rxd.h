@@ -51,6 +51,7 @@
 #include <ofi_enosys.h>
 #include <ofi_rbuf.h>
 #include <ofi_list.h>
+#include <ofi_match.h>
 #include <ofi_util.h>
 #include <ofi_tree.h>
 
@@ -59,7 +60,7 @@
 
 #define RXD_MAJOR_VERSION 	(1)
 #define RXD_MINOR_VERSION 	(0)
-#define RXD_PROTOCOL_VERSION 	(1)
+#define RXD_PROTOCOL_VERSION 	(2)
 #define RXD_FI_VERSION 		FI_VERSION(1,6)
 
 #define RXD_IOV_LIMIT		4
@@ -74,6 +75,7 @@
 #define RXD_TX_POOL_CHUNK_CNT	1024
 #define RXD_RX_POOL_CHUNK_CNT	1024
 #define RXD_MAX_UNACKED		128
+#define RXD_SACK_WORDS		(RXD_MAX_UNACKED / 64)
 #define RXD_MAX_PKT_RETRY	50
 
 #define RXD_REMOTE_CQ_DATA	(1 << 0)
@@ -149,10 +151,10 @@ struct rxd_ep {
 	struct rxd_rx_fs *rx_fs;
 
 	struct dlist_entry tx_list;
-	struct dlist_entry unexp_list;
-	struct dlist_entry unexp_tag_list;
-	struct dlist_entry rx_list;
-	struct dlist_entry rx_tag_list;
+	struct ofi_mq unexp_queue;
+	struct ofi_mq unexp_tag_queue;
+	struct ofi_mq rx_queue;
+	struct ofi_mq rx_tag_queue;
 	struct dlist_entry active_rx_list;
 };
 
@@ -198,9 +200,13 @@ struct rxd_x_entry {
 	uint8_t retry_cnt;
 	uint32_t num_segs;
 	uint64_t seg_size;
+	/* Receiver: segments held beyond next_seg_no, see rxd_sack_set() */
+	uint64_t sack[RXD_SACK_WORDS];
+	/* Sender: holes below it were already retransmitted on a SACK */
+	uint32_t retx_seg_no;
 
 	uint32_t flags;
-	uint64_t ignore;
+	struct ofi_mq_entry match;
 	uint8_t iov_count;
 	struct iovec iov[RXD_IOV_LIMIT];
 
@@ -233,6 +239,8 @@ struct rxd_ctrl_hdr {
 	uint64_t size;
 	uint64_t data;
 	uint64_t tag;
+	/* RXD_ACK: bit i is set if segment pkt_hdr.seg_no + i was received */
+	uint64_t sack[RXD_SACK_WORDS];
 	uint8_t source[RXD_NAME_LENGTH];
 };
 
@@ -248,7 +256,7 @@ struct rxd_data_pkt {
 };
 
 struct rxd_pkt_entry {
-	struct dlist_entry d_entry;
+	struct ofi_mq_entry match;
 	struct slist_entry s_entry;//TODO - keep both or make separate tx/rx pkt structs
 	size_t pkt_size;
 	struct fi_context context;
@@ -272,25 +280,46 @@ static inline int rxd_is_ctrl_pkt(struct rxd_pkt_entry *pkt_entry)
 	return (rxd_get_ctrl_pkt(pkt_entry))->pkt_hdr.flags & RXD_CTRL;
 }
 
-static inline void rxd_set_pkt(struct rxd_ep *ep, struct rxd_pkt_entry *pkt_entry)
+static inline void rxd_sack_set(uint64_t *sack, uint32_t i)
 {
-	pkt_entry->pkt = (void *) ((char *) pkt_entry +
-			  sizeof(*pkt_entry) + ep->prefix_size);
+	sack[i / 64] |= 1ULL << (i % 64);
 }
 
-static inline void *rxd_pkt_start(struct rxd_pkt_entry *pkt_entry)
+static inline int rxd_sack_test(const uint64_t *sack, uint32_t i)
 {
-	return (void *) ((char *) pkt_entry + sizeof(*pkt_entry));
+	return (sack[i / 64] >> (i % 64)) & 1;
+}
+
+static inline int rxd_sack_empty(const uint64_t *sack)
+{
+	int i;
+
+	for (i = 0; i < RXD_SACK_WORDS; i++) {
+		if (sack[i])
+			return 0;
+	}
+	return 1;
 }
 
-static inline int rxd_match_addr(fi_addr_t addr, fi_addr_t match_addr)
+/* Moves the bitmap base to the next segment */
+static inline void rxd_sack_shift(uint64_t *sack)
 {
-	return (addr == FI_ADDR_UNSPEC || addr == match_addr);
+	int i;
+
+	for (i = 0; i < RXD_SACK_WORDS - 1; i++)
+		sack[i] = (sack[i] >> 1) | (sack[i + 1] << 63);
+	sack[i] >>= 1;
 }
 
-static inline int rxd_match_tag(uint64_t tag, uint64_t ignore, uint64_t match_tag)
+static inline void rxd_set_pkt(struct rxd_ep *ep, struct rxd_pkt_entry *pkt_entry)
 {
-	return ((tag | ignore ) == (match_tag | ignore));
+	pkt_entry->pkt = (void *) ((char *) pkt_entry +
+			  sizeof(*pkt_entry) + ep->prefix_size);
+}
+
+static inline void *rxd_pkt_start(struct rxd_pkt_entry *pkt_entry)
+{
+	return (void *) ((char *) pkt_entry + sizeof(*pkt_entry));
 }
 
 int rxd_info_to_core(uint32_t version, const struct fi_info *rxd_info,
@@ -336,6 +365,8 @@ void rxd_tx_entry_free(struct rxd_ep *ep, struct rxd_x_entry *tx_entry);
 void rxd_rx_entry_free(struct rxd_ep *ep, struct rxd_x_entry *rx_entry);
 void rxd_ep_free_acked_pkts(struct rxd_ep *ep, struct rxd_x_entry *x_entry,
 			    uint32_t last_acked);
+void rxd_ep_sack_pkts(struct rxd_ep *ep, struct rxd_x_entry *tx_entry,
+		      struct rxd_ctrl_pkt *ack_pkt);
 void rxd_set_timeout(struct rxd_x_entry *x_entry);
 
 /* Progress functions */
@@ -54,7 +54,7 @@ struct fi_rx_attr rxd_rx_attr = {
 struct fi_ep_attr rxd_ep_attr = {
 	.type = FI_EP_RDM,
 	.protocol = FI_PROTO_RXD,
-	.protocol_version = 1,
+	.protocol_version = RXD_PROTOCOL_VERSION,
 	.max_msg_size = SIZE_MAX,
 	.tx_ctx_cnt = 1,
 	.rx_ctx_cnt = 1
@@ -187,20 +187,30 @@ void rxd_cq_report_tx_comp(struct rxd_cq *cq, struct rxd_x_entry *tx_entry)
 	cq->write_fn(cq, &tx_entry->cq_entry);
 }
 
+static void rxd_ep_place_data(struct rxd_ep *ep, struct rxd_x_entry *rx_entry,
+			      struct rxd_data_pkt *pkt, size_t size)
+{
+	rx_entry->bytes_done += ofi_copy_to_iov(rx_entry->iov,
+				rx_entry->iov_count,
+				pkt->hdr.seg_no * rx_entry->seg_size, pkt->data,
+				size - sizeof(struct rxd_pkt_hdr) - ep->prefix_size);
+}
+
 static void rxd_ep_recv_data(struct rxd_ep *ep, struct rxd_x_entry *rx_entry,
 			     struct rxd_data_pkt *pkt, size_t size)
 {
 	struct fi_cq_err_entry err_entry;
 	struct rxd_cq *rx_cq = rxd_ep_rx_cq(ep);
 	struct util_cntr *cntr = ep->util_ep.rx_cntr;
-	uint64_t done;
 
-	done = ofi_copy_to_iov(rx_entry->iov, rx_entry->iov_count,
-			       pkt->hdr.seg_no * rx_entry->seg_size, pkt->data,
-			       size - sizeof(struct rxd_pkt_hdr) - ep->prefix_size);
+	rxd_ep_place_data(ep, rx_entry, pkt, size);
 
-	rx_entry->bytes_done += done;
-	rx_entry->next_seg_no++;
+	/* Move past the segments held out of order that this one unblocks */
+	rxd_sack_set(rx_entry->sack, 0);
+	while (rxd_sack_test(rx_entry->sack, 0)) {
+		rx_entry->next_seg_no++;
+		rxd_sack_shift(rx_entry->sack);
+	}
 
 	if (rx_entry->next_seg_no < rx_entry->num_segs) {
 		if (rx_entry->next_seg_no == rx_entry->next_start) {
@@ -286,56 +296,54 @@ void rxd_post_cts(struct rxd_ep *rxd_ep, struct rxd_x_entry *rx_entry,
 		rxd_release_tx_pkt(rxd_ep, pkt_entry);
 }
 
-static int rxd_match_msg(struct dlist_entry *item, const void *arg)
-{
-	const struct rxd_pkt_entry *pkt_entry = (struct rxd_pkt_entry *) arg;
-	struct rxd_x_entry *rx_entry;
-
-	rx_entry = container_of(item, struct rxd_x_entry, entry);
-
-	return rxd_match_addr(rx_entry->peer, pkt_entry->peer);
-}
-
-static int rxd_match_tmsg(struct dlist_entry *item, const void *arg)
-{
-	struct rxd_pkt_entry *pkt_entry = (struct rxd_pkt_entry *) arg;
-	struct rxd_x_entry *rx_entry;
-
-	rx_entry = container_of(item, struct rxd_x_entry, entry);
-
-	return rxd_match_addr(rx_entry->peer, pkt_entry->peer) &&
-	       rxd_match_tag(rx_entry->cq_entry.tag, rx_entry->ignore,
-			     rxd_get_ctrl_pkt(pkt_entry)->ctrl_hdr.tag);
-}
-
 static void rxd_handle_data(struct rxd_ep *ep, struct fi_cq_msg_entry *comp,
 			    struct rxd_data_pkt *pkt)
 {
 	struct rxd_x_entry *rx_entry, tmp_entry;
 	uint32_t pkt_seg_no = pkt->hdr.seg_no;
+	int new_hole;
 
 	rx_entry = &ep->rx_fs->entry[pkt->hdr.rx_id].buf;
 
 	if (!(rx_entry->state == RXD_CTS || rx_entry->state == RXD_ACK) ||
 	    rxd_check_pkt_ids(rx_entry, pkt->hdr)) {
-	    	if (!(pkt->hdr.flags & RXD_LAST))
+		/* The message was received in full, ack all its segments
+		 * to a sender that retransmits */
+		if (!(pkt->hdr.flags & (RXD_LAST | RXD_RETRY)))
 			return;
 
 		tmp_entry.tx_id = pkt->hdr.tx_id;
 		tmp_entry.rx_id = pkt->hdr.rx_id;
 		tmp_entry.key = pkt->hdr.key;
 		tmp_entry.peer = pkt->hdr.peer;
-		tmp_entry.next_seg_no = pkt->hdr.seg_no + 1;
+		tmp_entry.next_seg_no = UINT32_MAX;
 		tmp_entry.window = 1;
+		memset(tmp_entry.sack, 0, sizeof(tmp_entry.sack));
 		rxd_ep_post_ack(ep, &tmp_entry);
 		return;
 	}
 
-	if (pkt_seg_no == rx_entry->next_seg_no || rxd_env.ooo_rdm)
+	if (pkt_seg_no == rx_entry->next_seg_no || rxd_env.ooo_rdm) {
 		rxd_ep_recv_data(ep, rx_entry, pkt, comp->len);
-	else if (rx_entry->state != RXD_ACK ||
-		(rx_entry->next_seg_no == rx_entry->next_start &&
-		(pkt_seg_no + 1) == rx_entry->next_start))
+		return;
+	}
+
+	/* Already received, the sender may have missed the ack */
+	if (pkt_seg_no < rx_entry->next_seg_no ||
+	    pkt_seg_no - rx_entry->next_seg_no >= RXD_MAX_UNACKED ||
+	    rxd_sack_test(rx_entry->sack, pkt_seg_no - rx_entry->next_seg_no)) {
+		if (pkt->hdr.flags & RXD_RETRY)
+			rxd_ep_post_ack(ep, rx_entry);
+		return;
+	}
+
+	/* Hold the segment beyond the hole, and report the hole when it
+	 * opens and with the last segment of the window */
+	new_hole = rxd_sack_empty(rx_entry->sack);
+	rxd_ep_place_data(ep, rx_entry, pkt, comp->len);
+	rxd_sack_set(rx_entry->sack, pkt_seg_no - rx_entry->next_seg_no);
+	if (new_hole || (pkt->hdr.flags & RXD_RETRY) ||
+	    pkt_seg_no + 1 == MIN(rx_entry->next_start, rx_entry->num_segs))
 		rxd_ep_post_ack(ep, rx_entry);
 }
 
@@ -359,23 +367,34 @@ static int rxd_check_active(struct rxd_ep *ep, struct rxd_pkt_entry *rts_pkt)
 	return -FI_ENOMSG;
 }
 
-static int rxd_check_post_unexp(struct dlist_entry *list,
-				struct rxd_pkt_entry *pkt_entry)
+static int rxd_match_unexp_rts(struct ofi_mq_entry *item, const void *arg)
 {
-	struct rxd_pkt_entry *unexp;
+	struct rxd_pkt_entry *pkt_entry = (struct rxd_pkt_entry *) arg;
 	struct rxd_ctrl_pkt *pkt = rxd_get_ctrl_pkt(pkt_entry);
+	struct rxd_pkt_entry *unexp;
 	struct rxd_ctrl_pkt *unexp_pkt;
-	struct dlist_entry *item;
 
-	dlist_foreach(list, item) {
-		unexp = container_of(item, struct rxd_pkt_entry, d_entry);
-		unexp_pkt = rxd_get_ctrl_pkt(unexp);
-		if (unexp_pkt->pkt_hdr.tx_id == pkt->pkt_hdr.tx_id &&
-		    unexp_pkt->pkt_hdr.key == pkt->pkt_hdr.key &&
-		    unexp->peer == pkt_entry->peer)
-			return 0;
-	}
-	dlist_insert_tail(&pkt_entry->d_entry, list);
+	unexp = container_of(item, struct rxd_pkt_entry, match);
+	unexp_pkt = rxd_get_ctrl_pkt(unexp);
+	return unexp_pkt->pkt_hdr.tx_id == pkt->pkt_hdr.tx_id &&
+	       unexp_pkt->pkt_hdr.key == pkt->pkt_hdr.key &&
+	       unexp->peer == pkt_entry->peer;
+}
+
+static int rxd_check_post_unexp(struct ofi_mq *queue,
+				struct rxd_pkt_entry *pkt_entry)
+{
+	struct rxd_ctrl_pkt *pkt = rxd_get_ctrl_pkt(pkt_entry);
+
+	/* Only a retransmitted RTS can already be queued */
+	if ((pkt->pkt_hdr.flags & RXD_RETRY) &&
+	    ofi_mq_find(queue, rxd_match_unexp_rts, pkt_entry))
+		return 0;
+
+	pkt_entry->match.addr = pkt_entry->peer;
+	pkt_entry->match.tag = pkt->ctrl_hdr.tag;
+	pkt_entry->match.ignore = 0;
+	ofi_mq_insert(queue, &pkt_entry->match);
 	return -FI_ENOMSG;
 }
 
@@ -421,8 +440,8 @@ static int rxd_handle_rts(struct rxd_ep *ep, struct fi_cq_msg_entry *comp,
 	struct rxd_av *rxd_av;
 	struct ofi_rbnode *node;
 	struct rxd_x_entry *rx_entry;
-	struct dlist_entry *match;
-	struct dlist_entry *unexp_list;
+	struct ofi_mq_entry *match;
+	struct ofi_mq *rx_queue, *unexp_queue;
 	fi_addr_t dg_addr;
 	struct rxd_ctrl_pkt *pkt = rxd_get_ctrl_pkt(pkt_entry);
 	int ret;
@@ -447,18 +466,18 @@ static int rxd_handle_rts(struct rxd_ep *ep, struct fi_cq_msg_entry *comp,
 	}
 
 	if (pkt->ctrl_hdr.op == ofi_op_tagged) {
-		match = dlist_remove_first_match(&ep->rx_tag_list, &rxd_match_tmsg,
-					 (void *) pkt_entry);
-		unexp_list = &ep->unexp_tag_list;
+		rx_queue = &ep->rx_tag_queue;
+		unexp_queue = &ep->unexp_tag_queue;
 	} else {
-		match = dlist_remove_first_match(&ep->rx_list, &rxd_match_msg,
-					 (void *) pkt_entry);
-		unexp_list = &ep->unexp_list;
+		rx_queue = &ep->rx_queue;
+		unexp_queue = &ep->unexp_queue;
 	}
+	match = ofi_mq_find_recv(rx_queue, pkt_entry->peer, pkt->ctrl_hdr.tag);
 	if (!match)
-		return rxd_check_post_unexp(unexp_list, pkt_entry);
+		return rxd_check_post_unexp(unexp_queue, pkt_entry);
 
-	rx_entry = container_of(match, struct rxd_x_entry, entry);
+	ofi_mq_remove(match);
+	rx_entry = container_of(match, struct rxd_x_entry, match);
 
 	if (pkt->pkt_hdr.flags & RXD_INLINE) {
 		fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
@@ -524,7 +543,9 @@ static void rxd_handle_ack(struct rxd_ep *ep, struct fi_cq_msg_entry *comp,
 	    tx_entry->state != RXD_CTS)
 		return;
 
-	rxd_ep_free_acked_pkts(ep, tx_entry, pkt->pkt_hdr.seg_no - 1);
+	if (pkt->pkt_hdr.seg_no)
+		rxd_ep_free_acked_pkts(ep, tx_entry, pkt->pkt_hdr.seg_no - 1);
+	rxd_ep_sack_pkts(ep, tx_entry, pkt);
 	if (!slist_empty(&tx_entry->pkt_list))
 		return;
 
@@ -58,6 +58,8 @@ struct rxd_pkt_entry *rxd_get_tx_pkt(struct rxd_ep *ep)
 		    util_buf_alloc(ep->tx_pkt_pool);
 
 	pkt_entry->mr = (struct fid_mr *) mr;
+	/* slist_insert_tail() relies on it */
+	pkt_entry->s_entry.next = NULL;
 
 	return pkt_entry;
 }
@@ -86,11 +88,11 @@ void rxd_release_rx_pkt(struct rxd_ep *ep, struct rxd_pkt_entry *pkt)
 	util_buf_release(ep->rx_pkt_pool, pkt);
 }
 
-static int rxd_match_ctx(struct dlist_entry *item, const void *arg)
+static int rxd_match_ctx(struct ofi_mq_entry *item, const void *arg)
 {
 	struct rxd_x_entry *x_entry;
 
-	x_entry = container_of(item, struct rxd_x_entry, entry);
+	x_entry = container_of(item, struct rxd_x_entry, match);
 
 	return (x_entry->cq_entry.op_context == arg);
 }
@@ -98,19 +100,19 @@ static int rxd_match_ctx(struct dlist_entry *item, const void *arg)
 static ssize_t rxd_ep_cancel(fid_t fid, void *context)
 {
 	struct rxd_ep *ep;
-	struct dlist_entry *entry;
+	struct ofi_mq_entry *entry;
 	struct rxd_x_entry *rx_entry;
 	struct fi_cq_err_entry err_entry = {0};
 
 	ep = container_of(fid, struct rxd_ep, util_ep.ep_fid.fid);
 	fastlock_acquire(&ep->util_ep.lock);
 
-	entry = dlist_remove_first_match(&ep->rx_list,
-				&rxd_match_ctx, context);
+	entry = ofi_mq_find(&ep->rx_queue, &rxd_match_ctx, context);
 	if (!entry)
 		goto out;
 
-	rx_entry = container_of(entry, struct rxd_x_entry, entry);
+	ofi_mq_remove(entry);
+	rx_entry = container_of(entry, struct rxd_x_entry, match);
 
 	rxd_rx_entry_free(ep, rx_entry);
 	err_entry.op_context = rx_entry->cq_entry.op_context;
@@ -147,32 +149,21 @@ struct fi_ops_ep rxd_ops_ep = {
 	.tx_size_left = fi_no_tx_size_left,
 };
 
-static int rxd_match_unexp(struct dlist_entry *item, const void *arg)
-{
-	struct rxd_x_entry *rx_entry = (struct rxd_x_entry *) arg;
-	struct rxd_pkt_entry *pkt_entry;
-
-	pkt_entry = container_of(item, struct rxd_pkt_entry, d_entry);
-
-	return rxd_match_addr(rx_entry->peer, pkt_entry->peer) &&
-	       rxd_match_tag(rx_entry->cq_entry.tag, rx_entry->ignore,
-			     rxd_get_ctrl_pkt(pkt_entry)->ctrl_hdr.tag);
-}
-
-static void rxd_ep_check_unexp_msg_list(struct rxd_ep *ep, struct dlist_entry *list,
+static void rxd_ep_check_unexp_msg_list(struct rxd_ep *ep, struct ofi_mq *queue,
 					struct rxd_x_entry *rx_entry)
 {
-	struct dlist_entry *match;
+	struct ofi_mq_entry *match;
 	struct rxd_pkt_entry *pkt_entry;
 
-	match = dlist_remove_first_match(list, &rxd_match_unexp,
-					 (void *) rx_entry);
+	match = ofi_mq_find_msg(queue, rx_entry->match.addr,
+				rx_entry->match.tag, rx_entry->match.ignore);
 	if (match) {
 		FI_DBG(&rxd_prov, FI_LOG_EP_CTRL, "progressing unexp msg entry\n");
-		dlist_remove(&rx_entry->entry);
+		ofi_mq_remove(match);
+		ofi_mq_remove(&rx_entry->match);
 		dlist_insert_tail(&rx_entry->entry, &ep->active_rx_list);
 
-		pkt_entry = container_of(match, struct rxd_pkt_entry, d_entry);
+		pkt_entry = container_of(match, struct rxd_pkt_entry, match);
 
 		if (rxd_get_ctrl_pkt(pkt_entry)->pkt_hdr.flags & RXD_INLINE)
 			rxd_progress_inline(ep, pkt_entry, rx_entry);
@@ -201,11 +192,13 @@ static struct rxd_x_entry *rxd_rx_entry_init(struct rxd_ep *ep,
 	rx_entry->rx_id = rxd_rx_fs_index(ep->rx_fs, rx_entry);
 	rx_entry->state = RXD_RTS;
 	rx_entry->peer = addr;
+	rx_entry->match.addr = addr;
 	rx_entry->flags = rxd_flags(flags);
 	rx_entry->bytes_done = 0;
 	rx_entry->next_seg_no = 0;
 	rx_entry->next_start = 0;
 	rx_entry->window = 0;
+	memset(rx_entry->sack, 0, sizeof(rx_entry->sack));
 	rx_entry->iov_count = iov_count;
 
 	memcpy(rx_entry->iov, iov, sizeof(*rx_entry->iov) * iov_count);
@@ -215,17 +208,20 @@ static struct rxd_x_entry *rxd_rx_entry_init(struct rxd_ep *ep,
 	rx_entry->cq_entry.len = ofi_total_iov_len(iov, iov_count);
 	rx_entry->cq_entry.buf = iov[0].iov_base;
 	rx_entry->cq_entry.flags = (FI_RECV | FI_MSG);
+	dlist_init(&rx_entry->entry);
 	if (op == ofi_op_tagged) {
 		rx_entry->cq_entry.flags |= FI_TAGGED;
 		rx_entry->cq_entry.tag = tag;
-		rx_entry->ignore = ignore;
-		dlist_insert_tail(&rx_entry->entry, &ep->rx_tag_list);
+		rx_entry->match.tag = tag;
+		rx_entry->match.ignore = ignore;
+		ofi_mq_insert(&ep->rx_tag_queue, &rx_entry->match);
 	} else {
 		rx_entry->cq_entry.tag = 0;
-		rx_entry->ignore = ~0;
-		dlist_insert_tail(&rx_entry->entry, &ep->rx_list);
+		rx_entry->match.tag = 0;
+		rx_entry->match.ignore = ~0;
+		ofi_mq_insert(&ep->rx_queue, &rx_entry->match);
 	}
-	
+
 	slist_init(&rx_entry->pkt_list);
 
 	return rx_entry;
@@ -239,7 +235,7 @@ static ssize_t rxd_ep_generic_recvmsg(struct rxd_ep *rxd_ep, const struct iovec
 	ssize_t ret = 0;
 	struct rxd_av *rxd_av;
 	struct rxd_x_entry *rx_entry;
-	struct dlist_entry *unexp_list;
+	struct ofi_mq *unexp_queue;
 
 	assert(iov_count <= RXD_IOV_LIMIT);
 
@@ -262,10 +258,10 @@ static ssize_t rxd_ep_generic_recvmsg(struct rxd_ep *rxd_ep, const struct iovec
 		goto out;
 	}
 
-	unexp_list = (op == ofi_op_tagged) ? &rxd_ep->unexp_tag_list :
-		      &rxd_ep->unexp_list;
-	if (!dlist_empty(unexp_list))
-		rxd_ep_check_unexp_msg_list(rxd_ep, unexp_list, rx_entry);
+	unexp_queue = (op == ofi_op_tagged) ? &rxd_ep->unexp_tag_queue :
+		      &rxd_ep->unexp_queue;
+	if (!ofi_mq_empty(unexp_queue))
+		rxd_ep_check_unexp_msg_list(rxd_ep, unexp_queue, rx_entry);
 out:
 	fastlock_release(&rxd_ep->util_ep.rx_cq->cq_lock);
 	fastlock_release(&rxd_ep->util_ep.lock);
@@ -421,6 +417,7 @@ void rxd_init_ctrl_pkt(struct rxd_ep *ep, struct rxd_x_entry *x_entry,
 	ctrl_pkt->pkt_hdr.peer = x_entry->peer;
 	ctrl_pkt->ctrl_hdr.type = type;
 	ctrl_pkt->ctrl_hdr.window = x_entry->window;
+	memset(ctrl_pkt->ctrl_hdr.sack, 0, sizeof(ctrl_pkt->ctrl_hdr.sack));
 	pkt_entry->pkt_size = sizeof(struct rxd_ctrl_pkt) + ep->prefix_size;
 }
 
@@ -447,6 +444,7 @@ struct rxd_x_entry *rxd_tx_entry_init(struct rxd_ep *ep, const struct iovec *iov
 	tx_entry->bytes_done = 0;
 	tx_entry->next_seg_no = 0;
 	tx_entry->next_start = 0;
+	tx_entry->retx_seg_no = 0;
 	tx_entry->retry_cnt = 0;
 	tx_entry->seg_size = rxd_ep_domain(ep)->max_seg_sz;
 	tx_entry->iov_count = iov_count;
@@ -515,6 +513,55 @@ void rxd_ep_free_acked_pkts(struct rxd_ep *ep, struct rxd_x_entry *x_entry,
 	}
 }
 
+/*
+ * Releases the segments that the receiver holds out of order, as reported
+ * by the SACK bitmap of an ack, and retransmits right away the missing ones
+ * below the highest of them. Each hole is retransmitted this way once, a
+ * lost retransmission is recovered by the timeout.
+ */
+void rxd_ep_sack_pkts(struct rxd_ep *ep, struct rxd_x_entry *tx_entry,
+		      struct rxd_ctrl_pkt *ack_pkt)
+{
+	struct slist_entry *item, *prev = NULL;
+	struct rxd_pkt_entry *pkt_entry;
+	uint32_t base = ack_pkt->pkt_hdr.seg_no;
+	uint32_t seg_no, end = 0;
+
+	if (rxd_sack_empty(ack_pkt->ctrl_hdr.sack))
+		return;
+
+	for (item = tx_entry->pkt_list.head; item; ) {
+		pkt_entry = container_of(item, struct rxd_pkt_entry, s_entry);
+		item = item->next;
+		seg_no = rxd_get_data_pkt(pkt_entry)->hdr.seg_no;
+		if (seg_no - base >= RXD_MAX_UNACKED ||
+		    !rxd_sack_test(ack_pkt->ctrl_hdr.sack, seg_no - base)) {
+			prev = &pkt_entry->s_entry;
+			continue;
+		}
+		slist_remove(&tx_entry->pkt_list, &pkt_entry->s_entry, prev);
+		rxd_release_tx_pkt(ep, pkt_entry);
+		end = seg_no + 1;
+	}
+
+	for (item = tx_entry->pkt_list.head; item; item = item->next) {
+		pkt_entry = container_of(item, struct rxd_pkt_entry, s_entry);
+		seg_no = rxd_get_data_pkt(pkt_entry)->hdr.seg_no;
+		if (seg_no >= end)
+			break;
+		if (seg_no < tx_entry->retx_seg_no)
+			continue;
+		if (rxd_ep_retry_pkt(ep, pkt_entry, tx_entry)) {
+			end = seg_no;
+			break;
+		}
+	}
+	tx_entry->retx_seg_no = MAX(tx_entry->retx_seg_no, end);
+
+	tx_entry->retry_cnt = 0;
+	rxd_set_timeout(tx_entry);
+}
+
 int rxd_ep_retry_pkt(struct rxd_ep *ep, struct rxd_pkt_entry *pkt_entry,
 		     struct rxd_x_entry *x_entry)
 {
@@ -602,6 +649,8 @@ ssize_t rxd_ep_post_ack(struct rxd_ep *rxd_ep, struct rxd_x_entry *rx_entry)
 	ack_pkt->pkt_hdr.seg_no = rx_entry->next_seg_no;
 
 	ack_pkt->ctrl_hdr.window = rx_entry->window;
+	memcpy(ack_pkt->ctrl_hdr.sack, rx_entry->sack,
+	       sizeof(ack_pkt->ctrl_hdr.sack));
 
 	ret = rxd_ep_retry_pkt(rxd_ep, pkt_entry, rx_entry);
 
@@ -931,6 +980,10 @@ static struct fi_ops_tagged rxd_ops_tagged = {
 
 static void rxd_ep_free_res(struct rxd_ep *ep)
 {
+	ofi_mq_close(&ep->rx_queue);
+	ofi_mq_close(&ep->rx_tag_queue);
+	ofi_mq_close(&ep->unexp_queue);
+	ofi_mq_close(&ep->unexp_tag_queue);
 
 	if (ep->tx_fs)
 		rxd_tx_fs_free(ep->tx_fs);
@@ -947,6 +1000,7 @@ static int rxd_ep_close(struct fid *fid)
 	int ret;
 	struct rxd_ep *ep;
 	struct rxd_pkt_entry *pkt_entry;
+	struct ofi_mq_entry *match;
 	struct slist_entry *entry;
 
 	ep = container_of(fid, struct rxd_ep, util_ep.ep_fid.fid);
@@ -968,15 +1022,15 @@ static int rxd_ep_close(struct fid *fid)
 		rxd_release_rx_pkt(ep, pkt_entry);
 	}
 
-	while (!dlist_empty(&ep->unexp_list)) {
-		dlist_pop_front(&ep->unexp_list, struct rxd_pkt_entry,
-				pkt_entry, d_entry);
+	while ((match = ofi_mq_first(&ep->unexp_queue))) {
+		ofi_mq_remove(match);
+		pkt_entry = container_of(match, struct rxd_pkt_entry, match);
 		rxd_release_rx_pkt(ep, pkt_entry);
 	}
 
-	while (!dlist_empty(&ep->unexp_tag_list)) {
-		dlist_pop_front(&ep->unexp_tag_list, struct rxd_pkt_entry,
-				pkt_entry, d_entry);
+	while ((match = ofi_mq_first(&ep->unexp_tag_queue))) {
+		ofi_mq_remove(match);
+		pkt_entry = container_of(match, struct rxd_pkt_entry, match);
 		rxd_release_rx_pkt(ep, pkt_entry);
 	}
 
@@ -1186,11 +1240,17 @@ static void rxd_ep_progress(struct util_ep *util_ep)
 		     pkt_item = pkt_item->next) {
 			pkt_entry = container_of(pkt_item, struct rxd_pkt_entry,
 						 s_entry);
-			rxd_get_ctrl_pkt(pkt_entry)->pkt_hdr.flags |= RXD_RETRY;
+			/* Only the first packet asks the receiver for an ack,
+			 * the others fill the holes */
+			if (pkt_item == tx_entry->pkt_list.head)
+				rxd_get_ctrl_pkt(pkt_entry)->pkt_hdr.flags |= RXD_RETRY;
+			else
+				rxd_get_ctrl_pkt(pkt_entry)->pkt_hdr.flags &= ~RXD_RETRY;
 			ret = rxd_ep_retry_pkt(ep, pkt_entry, tx_entry);
 			if (ret || rxd_is_ctrl_pkt(pkt_entry))
 				break;
 		}
+		tx_entry->retx_seg_no = tx_entry->next_seg_no;
 		rxd_set_timeout(tx_entry);
 	}
 
@@ -1221,6 +1281,7 @@ static void rxd_buf_region_free_hndlr(void *pool_ctx, void *context)
 
 int rxd_ep_init_res(struct rxd_ep *ep, struct fi_info *fi_info)
 {
+	uint64_t flags;
 	int ret = util_buf_pool_create_ex(
 		&ep->tx_pkt_pool,
 		rxd_ep_domain(ep)->max_mtu_sz + sizeof(struct rxd_pkt_entry),
@@ -1248,16 +1309,25 @@ int rxd_ep_init_res(struct rxd_ep *ep, struct fi_info *fi_info)
 	if (!ep->rx_fs)
 		goto err;
 
+	flags = (fi_info->caps & FI_DIRECTED_RECV) ? OFI_MQ_DIRECTED : 0;
+	if (ofi_mq_init(&ep->rx_queue, ep->rx_size, flags) ||
+	    ofi_mq_init(&ep->unexp_queue, ep->rx_size, flags) ||
+	    ofi_mq_init(&ep->rx_tag_queue, ep->rx_size, flags | OFI_MQ_TAGGED) ||
+	    ofi_mq_init(&ep->unexp_tag_queue, ep->rx_size,
+			flags | OFI_MQ_TAGGED))
+		goto err;
+
 	dlist_init(&ep->tx_list);
-	dlist_init(&ep->rx_list);
-	dlist_init(&ep->rx_tag_list);
 	dlist_init(&ep->active_rx_list);
-	dlist_init(&ep->unexp_list);
-	dlist_init(&ep->unexp_tag_list);
 	slist_init(&ep->rx_pkt_list);
 
 	return 0;
 err:
+	ofi_mq_close(&ep->rx_queue);
+	ofi_mq_close(&ep->unexp_queue);
+	ofi_mq_close(&ep->rx_tag_queue);
+	ofi_mq_close(&ep->unexp_tag_queue);
+
 	if (ep->tx_pkt_pool)
 		util_buf_pool_destroy(ep->tx_pkt_pool);
 
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _FI_EXT_RXM_H_
+#define _FI_EXT_RXM_H_
+
+/*
+ * See the fi_rxm.7 man page for information about the rxm provider
+ * extensions provided in this header.
+ */
+
+#include <stdint.h>
+#include <rdma/fi_endpoint.h>
+
+/*
+ * Endpoint statistics, counted since the endpoint was opened
+ */
+struct fi_rxm_ep_stats {
+	uint64_t conn_evictions;
+	uint64_t conn_reconnects;
+};
+
+/*
+ * Endpoint extensions
+ */
+#define FI_RXM_EP_OPS_1 "ep_ops 1"
+struct fi_rxm_ops_ep {
+	size_t size;
+	int (*get_stats)(struct fid_ep *ep, struct fi_rxm_ep_stats *stats);
+};
+
+#endif /* _FI_EXT_RXM_H_ */
@@ -49,9 +49,12 @@
 #include <ofi_enosys.h>
 #include <ofi_util.h>
 #include <ofi_list.h>
+#include <ofi_match.h>
 #include <ofi_proto.h>
 #include <ofi_iov.h>
 
+#include "fi_ext_rxm.h"
+
 #ifndef _RXM_H_
 #define _RXM_H_
 
@@ -61,15 +64,44 @@
 #define RXM_MINOR_VERSION 0
 
 #define RXM_OP_VERSION		3
-#define RXM_CTRL_VERSION	3
+#define RXM_CTRL_VERSION	9
 
-#define RXM_BUF_SIZE	16384
+/* Default size of the eager buffers that are preposted to MSG EPs. Larger
+ * messages go through SAR / rendezvous, so this bounds the memory used by
+ * each connection */
+#define RXM_BUF_SIZE	2048
+/* Size class for the eager transmit buffers of small messages */
+#define RXM_BUF_SMALL_SIZE	256
 
 #define RXM_SAR_LIMIT	262144
-#define RXM_SAR_DIVIDER	1024
+/* Number of SAR segments a sender may have outstanding per message before
+ * the receiver returns credits. Credits are returned in batches of half
+ * the window, once the segments have been placed in the user buffer */
+#define RXM_SAR_WINDOW		64
+#define RXM_SAR_CREDIT_BATCH	(RXM_SAR_WINDOW / 2)
+
+/* Messages up to this size use the write-based rendezvous: the receiver
+ * answers the request with a CTS describing its buffer and the sender
+ * pushes the data with RMA writes of RXM_RNDV_WRITE_CHUNK bytes, keeping
+ * at most RXM_RNDV_WRITE_WINDOW of them in flight */
+#define RXM_RNDV_WRITE_LIMIT	(16 * 1024 * 1024)
+#define RXM_RNDV_WRITE_CHUNK	(256 * 1024)
+#define RXM_RNDV_WRITE_WINDOW	4
+
+/* Default time (us) an open bundle may wait for more messages */
+#define RXM_BUNDLE_TIMEOUT	10
+
+/* Number of MSG CQ completions read and handled at once by the progress */
+#define RXM_MSG_CQ_BATCH	16
 
 #define RXM_IOV_LIMIT 4
 
+#if defined(__GNUC__)
+#define rxm_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define rxm_prefetch(addr)
+#endif
+
 #define RXM_MR_MODES	(OFI_MR_BASIC_MAP | FI_MR_LOCAL)
 #define RXM_MR_VIRT_ADDR(info) ((info->domain_attr->mr_mode == FI_MR_BASIC) ||\
 				info->domain_attr->mr_mode & FI_MR_VIRT_ADDR)
@@ -109,6 +141,7 @@ do {									\
 extern struct fi_provider rxm_prov;
 extern struct util_prov rxm_util_prov;
 extern struct fi_ops_rma rxm_ops_rma;
+extern struct fi_ops_atomic rxm_ops_atomic;
 
 struct rxm_fabric {
 	struct util_fabric util_fabric;
@@ -118,19 +151,42 @@ struct rxm_fabric {
 struct rxm_domain {
 	struct util_domain util_domain;
 	struct fid_domain *msg_domain;
+	/* Memory regions by MSG MR key, to check and translate the targets of
+	 * atomic operations. Protected by `util_domain::lock` */
+	struct ofi_mr_map mr_map;
 	uint8_t mr_local;
+	/* Registrations of user buffers with the MSG provider for large
+	 * messages and RMA, see rxm_mr_cache_reg(). Protected by
+	 * mr_cache_lock */
+	uint8_t mr_cache_enable;
+	struct ofi_mr_cache mr_cache;
+	struct ofi_mem_monitor monitor;
+	fastlock_t mr_cache_lock;
+};
+
+/* Stored in ofi_mr_entry::data: the MR handed out for a cached MSG
+ * registration, closing it releases the cache entry */
+struct rxm_mr_cache_desc {
+	struct fid_mr mr_fid;
+	struct fid_mr *msg_mr;
+	struct rxm_domain *domain;
+	struct ofi_mr_entry *entry;
 };
 
 struct rxm_mr {
 	struct fid_mr mr_fid;
 	struct fid_mr *msg_mr;
+	struct rxm_domain *domain;
 };
 
 struct rxm_ep_wire_proto {
 	uint8_t	ctrl_version;
 	uint8_t	op_version;
 	uint8_t endianness;
-	uint8_t padding[6];
+	uint8_t padding;
+	/* Eager messages the sender may have buffered at this end, 0 if
+	 * unlimited */
+	uint32_t eager_credits;
 	uint64_t eager_size;
 };
 
@@ -175,7 +231,15 @@ struct rxm_rma_iov {
 	FUNC(RXM_LMT_READ),	\
 	FUNC(RXM_LMT_ACK_SENT), \
 	FUNC(RXM_LMT_ACK_RECVD),\
-	FUNC(RXM_LMT_FINISH),
+	FUNC(RXM_LMT_FINISH),	\
+	FUNC(RXM_RNDV_CTS_WAIT),\
+	FUNC(RXM_RNDV_WRITE),	\
+	FUNC(RXM_RNDV_CTS),	\
+	FUNC(RXM_RNDV_DONE_WAIT),\
+	FUNC(RXM_BUNDLE_TX),	\
+	FUNC(RXM_ATOMIC_TX),	\
+	FUNC(RXM_ATOMIC_RESP_WAIT),\
+	FUNC(RXM_ATOMIC_RESP_TX),
 
 enum rxm_proto_state {
 	RXM_PROTO_STATES(OFI_ENUM_VAL)
@@ -189,6 +253,21 @@ struct rxm_pkt {
 	char data[];
 };
 
+/* Atomic operations travel as ofi_ctrl_atomic messages that fit in an
+ * eager buffer: hdr.op is ofi_op_atomic, ofi_op_atomic_fetch or
+ * ofi_op_atomic_compare, hdr.atomic describes the operation and the data
+ * holds the target iocs (struct fi_rma_ioc), the operands and the compare
+ * values. The target executes them from its progress. The results of
+ * fetching operations, identified by the msg_id of the request, are
+ * batched per connection into ofi_ctrl_atomic_resp messages, whose data
+ * is a series of rxm_atomic_resp, each one followed by its results padded
+ * to 8 bytes */
+struct rxm_atomic_resp {
+	uint64_t msg_id;
+	int32_t status;
+	uint32_t result_len;
+};
+
 union rxm_sar_ctrl_data {
 	struct {
 		enum rxm_sar_seg_type {
@@ -231,12 +310,6 @@ struct rxm_recv_match_attr {
 	uint64_t ignore;
 };
 
-struct rxm_unexp_msg {
-	struct dlist_entry entry;
-	fi_addr_t addr;
-	uint64_t tag;
-};
-
 struct rxm_iov {
 	struct iovec iov[RXM_IOV_LIMIT];
 	void *desc[RXM_IOV_LIMIT];
@@ -253,11 +326,15 @@ enum rxm_buf_pool_type {
 	RXM_BUF_POOL_START	= RXM_BUF_POOL_RX,
 	RXM_BUF_POOL_TX,
 	RXM_BUF_POOL_TX_START	= RXM_BUF_POOL_TX,
+	RXM_BUF_POOL_TX_SMALL,
 	RXM_BUF_POOL_TX_INJECT,
 	RXM_BUF_POOL_TX_ACK,
 	RXM_BUF_POOL_TX_LMT,
+	RXM_BUF_POOL_TX_CTS,
 	RXM_BUF_POOL_TX_SAR,
-	RXM_BUF_POOL_TX_END	= RXM_BUF_POOL_TX_SAR,
+	RXM_BUF_POOL_TX_BUNDLE,
+	RXM_BUF_POOL_TX_ATOMIC,
+	RXM_BUF_POOL_TX_END	= RXM_BUF_POOL_TX_ATOMIC,
 	RXM_BUF_POOL_RMA,
 	RXM_BUF_POOL_MAX,
 };
@@ -270,7 +347,9 @@ struct rxm_buf {
 
 	struct dlist_entry entry;
 	void *desc;
-	/* MSG EP / shared context to which bufs would be posted to */
+	/* MSG EP / shared context to which bufs would be posted to. NULL for
+	 * RX buffers holding a message unpacked from a bundle, which were
+	 * never posted and are released instead of reposted */
 	struct fid_ep *msg_ep;
 };
 
@@ -281,13 +360,26 @@ struct rxm_rx_buf {
 	struct rxm_ep *ep;
 	struct dlist_entry repost_entry;
 	struct rxm_conn *conn;
+	/* Entry in rxm_conn::posted_rx_list while posted to the MSG EP */
+	struct dlist_entry posted_entry;
+	/* SAR segments of an unexpected message: the first segment is
+	 * queued on rxm_conn::sar_rx_unexp_list and holds the following ones
+	 * in sar_seg_list, until a receive is matched */
+	struct dlist_entry sar_entry;
+	struct dlist_entry sar_seg_list;
+	/* Entry in rxm_conn::rndv_rx_list while waiting for the data of a
+	 * write-based rendezvous */
+	struct dlist_entry rndv_entry;
 	struct rxm_recv_entry *recv_entry;
-	struct rxm_unexp_msg unexp_msg;
+	struct ofi_mq_entry unexp_msg;
 	uint64_t comp_flags;
 	struct fi_recv_context recv_context;
 	// TODO remove this and modify unexp msg handling path to not repost
 	// rx_buf
 	uint8_t repost;
+	/* Charged against the sender's eager credits, returned when the
+	 * buffer is released or reposted */
+	uint8_t eager_credit;
 
 	/* Used for large messages */
 	struct rxm_rma_iov *rma_iov;
@@ -304,8 +396,10 @@ struct rxm_tx_buf {
 
 	enum rxm_buf_pool_type type;
 
-	/* Used for SAR protocol */
+	/* Used for SAR protocol and fetching atomics */
 	struct rxm_tx_entry *tx_entry;
+	/* TX entries of the messages packed into a bundle */
+	struct dlist_entry bundle_list;
 
 	/* Must stay at bottom */
 	struct rxm_pkt pkt;
@@ -325,6 +419,8 @@ struct rxm_rma_buf {
 
 struct rxm_tx_entry {
 	/* Must stay at top */
+	/* deferred_entry also links the entry into rxm_tx_buf::bundle_list
+	 * while its message sits in a bundle */
 	union {
 		struct fi_context fi_context;
 		struct dlist_entry deferred_entry;
@@ -342,49 +438,76 @@ struct rxm_tx_entry {
 		struct rxm_tx_buf *tx_buf;
 		struct rxm_rma_buf *rma_buf;
 	};
+	/* Used for SAR, write-based rendezvous and fetching atomics */
+	uint64_t msg_id;
+	/* Entry in rxm_ep::tx_stall_list */
+	struct dlist_entry stall_entry;
 
 	union {
 		/* Used for large messages and RMA */
 		struct {
 			struct fid_mr *mr[RXM_IOV_LIMIT];
 			struct rxm_rx_buf *rx_buf;
+			/* Used for write-based rendezvous. rx_buf holds
+			 * the CTS and rndv_len the length accepted by the
+			 * receiver */
+			struct rxm_iov rndv_iov;
+			size_t rndv_len;
+			size_t rndv_offset;
+			size_t rndv_writes;
+			size_t rndv_iov_index;
+			size_t rndv_iov_offset;
+			size_t rndv_rma_index;
+			size_t rndv_rma_offset;
 		};
 		/* Used for SAR protocol */
 		struct {
-			size_t segs_left;
-			uint64_t msg_id;
+			/* Segments posted to the MSG EP, not completed yet */
+			size_t segs_inflight;
 			/* The list for the TX buffers that have been 
 			 * queued until it would be possbile to send it  */
 			struct dlist_entry deferred_tx_buf_list;
 			struct rxm_iov rxm_iov;
 			uint64_t iov_offset;
+			size_t total_len;
+			/* Segments that may be sent before the receiver
+			 * returns more credits */
+			size_t credits;
+			uint32_t seg_no;
+			uint8_t op;
+			uint64_t data;
+			uint64_t tag;
 		};
+		/* Used for fetching atomics: where the results go */
+		struct rxm_iov atomic_result;
 	};
 };
 DECLARE_FREESTACK(struct rxm_tx_entry, rxm_txe_fs);
 
 struct rxm_recv_entry {
-	struct dlist_entry entry;
+	struct ofi_mq_entry match;
 	struct rxm_iov rxm_iov;
-	fi_addr_t addr;
 	void *context;
 	uint64_t flags;
-	uint64_t tag;
-	uint64_t ignore;
 	uint64_t comp_flags;
 	size_t total_len;
 	struct rxm_recv_queue *recv_queue;
 	void *multi_recv_buf;
 	/* Used for SAR protocol */
 	struct {
+		/* Entry in rxm_conn::sar_rx_msg_list */
 		struct dlist_entry sar_entry;
+		struct rxm_conn *sar_conn;
+		/* Bytes placed in the user buffer */
 		size_t total_recv_len;
-		size_t segs_rcvd;
+		/* Bytes of the message consumed, including truncated ones */
+		size_t sar_recv_len;
 		uint64_t msg_id;
-		/* This is used when a message with the `RXM_SAR_SEG_LAST`
-		 * flag is receved, but not all messages has been received
-		 * yet */
-		size_t last_seg_no;
+		size_t segs_total;
+		/* Segments the sender may send in total so far */
+		size_t segs_credited;
+		/* Consumed segments not returned to the sender yet */
+		size_t credits_pending;
 	};
 };
 DECLARE_FREESTACK(struct rxm_recv_entry, rxm_recv_fs);
@@ -406,10 +529,8 @@ struct rxm_recv_queue {
 	struct rxm_ep *rxm_ep;
 	enum rxm_recv_queue_type type;
 	struct rxm_recv_fs *fs;
-	struct dlist_entry recv_list;
-	struct dlist_entry unexp_msg_list;
-	dlist_func_t *match_recv;
-	dlist_func_t *match_unexp;
+	struct ofi_mq recv_mq;
+	struct ofi_mq unexp_mq;
 	fastlock_t lock;
 };
 
@@ -437,18 +558,65 @@ struct rxm_ep {
 	size_t			min_multi_recv_size;
 
 	size_t			sar_limit;
-	/* This defines maximum index of a segment for
-	 * which segment length mast be calculated. */
-	uint32_t		sar_max_calc_seg_no;
+	/* Payload size of all SAR segments but the last one */
+	size_t			sar_seg_size;
+	size_t			rndv_write_limit;
+	/* Small messages are packed into bundles of up to bundle_size
+	 * bytes, each message taking at most bundle_msg_size bytes of
+	 * payload. A bundle is flushed when full, before any other
+	 * transfer on its connection, and by the progress engine once it is
+	 * older than bundle_timeout us */
+	size_t			bundle_size;
+	size_t			bundle_msg_size;
+	uint64_t		bundle_timeout;
+	/* Connections with an open bundle, protected by `util_ep::lock` */
+	struct dlist_entry	bundle_conn_list;
+	/* Eager flow control: number of eager messages (inject, bundled
+	 * and eager sends) each peer may have buffered here before it has
+	 * to wait for credits. 0 disables it. Credits are returned in
+	 * batches of eager_credit_batch, piggybacked on data and acks or
+	 * through an explicit credit message for the connections queued on
+	 * credit_update_list. Everything below, except eager_credits and
+	 * eager_credit_batch, is protected by `util_ep::lock` */
+	size_t			eager_credits;
+	size_t			eager_credit_batch;
+	struct dlist_entry	credit_update_list;
+	uint64_t		eager_stalls;
+	uint64_t		credit_updates;
 
 	struct rxm_buf_pool	buf_pools[RXM_BUF_POOL_MAX];
 
 	struct dlist_entry	repost_ready_list;
 	struct dlist_entry	conn_deferred_list;
+	/* Connections deleted by the cmap thread, freed from CQ progress
+	 * (see rxm_conn_progress_free) until the endpoint closes.
+	 * Protected by `util_ep::lock` */
+	struct dlist_entry	conn_free_list;
+	int			closing;
 
 	struct rxm_recv_queue	recv_queue;
 	struct rxm_recv_queue	trecv_queue;
 
+	/* Connection eviction. Everything below, except max_conn and
+	 * conn_evict, is protected by `cmap::lock` */
+	size_t			max_conn;
+	int			conn_evict;
+	size_t			conn_lru_cnt;
+	size_t			conn_closing_cnt;
+	struct dlist_entry	conn_lru_list;
+	struct dlist_entry	conn_close_list;
+	uint64_t		conn_evictions;
+	uint64_t		conn_reconnects;
+
+	/* SAR and rendezvous write transfers that can't make progress from
+	 * their own completions, and control messages that couldn't be
+	 * injected. Protected by `util_ep::lock` */
+	struct dlist_entry	tx_stall_list;
+	struct dlist_entry	ctrl_retry_list;
+	/* Connections with atomic responses to send, protected by
+	 * `util_ep::lock` */
+	struct dlist_entry	atomic_resp_conn_list;
+
 	ofi_fastlock_acquire_t	res_fastlock_acquire;
 	ofi_fastlock_release_t	res_fastlock_release;
 };
@@ -465,11 +633,86 @@ struct rxm_conn {
 	struct dlist_entry deferred_op_list;
 
 	struct rxm_send_queue send_queue;
+	/* SAR messages being received, protected by `util_ep::lock` */
 	struct dlist_entry sar_rx_msg_list;
+	struct dlist_entry sar_rx_unexp_list;
+	/* Receives waiting for the end of a write-based rendezvous,
+	 * protected by `util_ep::lock` */
+	struct dlist_entry rndv_rx_list;
+	/* Makes SAR and rendezvous msg_ids unique across re-use of TX
+	 * entries */
+	uint32_t msg_seq;
+	/* Open bundle and its creation time (us), protected by
+	 * `send_queue::lock` */
+	struct rxm_tx_buf *bundle;
+	uint64_t bundle_start;
+	/* Entry in rxm_ep::bundle_conn_list */
+	struct dlist_entry bundle_entry;
+	/* Eager flow control, protected by `util_ep::lock`. As a sender:
+	 * the budget advertised by the peer (0 if it doesn't limit us) and
+	 * the credits left of it. As a receiver: eager messages of the peer
+	 * still buffered here, and consumed ones whose credits have not been
+	 * returned yet */
+	uint32_t eager_credit_limit;
+	uint32_t eager_credits;
+	uint32_t eager_rx_held;
+	uint32_t eager_rx_pending;
+	/* Entry in rxm_ep::credit_update_list */
+	struct dlist_entry credit_entry;
+	/* Batches of atomic responses to send, the last one being filled,
+	 * protected by `util_ep::lock` */
+	struct dlist_entry atomic_resp_list;
+	/* Entry in rxm_ep::atomic_resp_conn_list */
+	struct dlist_entry atomic_resp_entry;
 	struct util_cmap_handle handle;
 	/* This is saved MSG EP fid, that hasn't been closed during
 	 * handling of CONN_RECV in CMAP_CONNREQ_SENT for passive side */
 	struct fid_ep *saved_msg_ep;
+
+	/* Connection eviction (see rxm_conn_progress_evict). Connected
+	 * handles sit on rxm_ep::conn_lru_list and are scanned in CLOCK
+	 * order: any transfer sets `referenced` and buys the connection
+	 * another pass. Idle victims are closed via a close_req/close_resp
+	 * exchange and go back to CMAP_IDLE, so that the next transfer
+	 * reconnects them with deferred ops parked on deferred_op_list */
+	struct dlist_entry lru_entry;
+	struct dlist_entry close_entry;
+	/* Posted RX buffers (no SRX) that must be reclaimed on close */
+	struct dlist_entry posted_rx_list;
+	struct dlist_entry free_entry;
+	size_t rx_busy;
+	uint8_t referenced;
+	uint8_t close_flags;
+	uint8_t evicted;
+};
+
+/* rxm_conn::close_flags */
+enum {
+	/* Counted in rxm_ep::conn_closing_cnt */
+	RXM_CONN_CLOSE_ACTIVE		= (1 << 0),
+	/* We have sent the close_req */
+	RXM_CONN_CLOSE_INITIATOR	= (1 << 1),
+	/* close_resp that still has to be sent to the peer */
+	RXM_CONN_CLOSE_ACCEPT		= (1 << 2),
+	RXM_CONN_CLOSE_REFUSE		= (1 << 3),
+	RXM_CONN_CLOSE_NOSYS		= (1 << 4),
+	/* The peer has closed its MSG EP */
+	RXM_CONN_CLOSE_DONE		= (1 << 5),
+	/* The peer doesn't evict connections, never try again */
+	RXM_CONN_CLOSE_PINNED		= (1 << 6),
+};
+
+#define RXM_CONN_CLOSE_RESP (RXM_CONN_CLOSE_ACCEPT | RXM_CONN_CLOSE_REFUSE | \
+			     RXM_CONN_CLOSE_NOSYS)
+
+/* Control message (SAR credits, end of a rendezvous write) that couldn't
+ * be injected right away */
+struct rxm_ctrl_retry {
+	struct dlist_entry entry;
+	struct rxm_conn *conn;
+	uint8_t type;
+	uint64_t msg_id;
+	uint64_t data;
 };
 
 struct rxm_ep_wait_ref {
@@ -498,17 +741,47 @@ int rxm_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 int rxm_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 			 struct fid_cq **cq_fid, void *context);
 ssize_t rxm_cq_handle_rx_buf(struct rxm_rx_buf *rx_buf);
+void rxm_cq_sar_discard(struct rxm_rx_buf *rx_buf);
+void rxm_cq_rndv_discard(struct rxm_rx_buf *rx_buf);
 
 int rxm_endpoint(struct fid_domain *domain, struct fi_info *info,
 			  struct fid_ep **ep, void *context);
 
 struct util_cmap *rxm_conn_cmap_alloc(struct rxm_ep *rxm_ep);
+void rxm_conn_progress_evict(struct rxm_ep *rxm_ep);
+void rxm_conn_progress_free(struct rxm_ep *rxm_ep);
+void rxm_ep_drain_msg_cq(struct rxm_ep *rxm_ep);
+ssize_t rxm_conn_handle_close_req(struct rxm_rx_buf *rx_buf);
+ssize_t rxm_conn_handle_close_resp(struct rxm_rx_buf *rx_buf);
 void rxm_cq_write_error(struct util_cq *cq, struct util_cntr *cntr,
 			void *op_context, int err);
 void rxm_ep_progress_one(struct util_ep *util_ep);
 void rxm_ep_progress_multi(struct util_ep *util_ep);
+void rxm_ep_cq_progress_one(struct util_ep *util_ep);
+void rxm_ep_cq_progress_multi(struct util_ep *util_ep);
 
 int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep);
+void rxm_ep_sar_tx_progress(struct rxm_ep *rxm_ep,
+			    struct rxm_tx_entry *tx_entry);
+void rxm_ep_rndv_write_progress(struct rxm_ep *rxm_ep,
+				struct rxm_tx_entry *tx_entry);
+ssize_t rxm_conn_bundle_flush(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn);
+void rxm_ep_progress_bundles(struct rxm_ep *rxm_ep);
+void rxm_ep_progress_credits(struct rxm_ep *rxm_ep);
+void rxm_conn_init_credits(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			   uint32_t limit);
+
+int rxm_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
+		     enum fi_op op, struct fi_atomic_attr *attr, uint64_t flags);
+ssize_t rxm_atomic_handle_req(struct rxm_rx_buf *rx_buf);
+ssize_t rxm_atomic_handle_resp(struct rxm_rx_buf *rx_buf);
+void rxm_atomic_tx_error(struct rxm_ep *rxm_ep, struct rxm_tx_buf *tx_buf,
+			 int err);
+void rxm_ep_progress_atomic_resps(struct rxm_ep *rxm_ep);
+void rxm_conn_purge_atomics(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn);
+
+int rxm_mr_cache_reg(struct rxm_domain *rxm_domain, const struct iovec *iov,
+		     struct fid_mr **mr);
 
 static inline
 void rxm_ep_msg_mr_closev(struct fid_mr **mr, size_t count)
@@ -537,14 +810,18 @@ int rxm_ep_msg_mr_regv(struct rxm_ep *rxm_ep, const struct iovec *iov,
 
 	// TODO do fi_mr_regv if provider supports it
 	for (i = 0; i < count; i++) {
-		ret = fi_mr_reg(rxm_domain->msg_domain, iov[i].iov_base,
-				iov[i].iov_len, access, 0, 0, 0, &mr[i], NULL);
+		if (rxm_domain->mr_cache_enable && iov[i].iov_len)
+			ret = rxm_mr_cache_reg(rxm_domain, &iov[i], &mr[i]);
+		else
+			ret = fi_mr_reg(rxm_domain->msg_domain,
+					iov[i].iov_base, iov[i].iov_len,
+					access, 0, 0, 0, &mr[i], NULL);
 		if (ret)
 			goto err;
 	}
 	return 0;
 err:
-	rxm_ep_msg_mr_closev(mr, count);
+	rxm_ep_msg_mr_closev(mr, i);
 	return ret;
 }
 
@@ -577,25 +854,44 @@ static inline struct rxm_rx_buf *
 rxm_check_unexp_msg_list(struct rxm_recv_queue *recv_queue, fi_addr_t addr,
 			 uint64_t tag, uint64_t ignore)
 {
-	struct rxm_recv_match_attr match_attr;
-	struct dlist_entry *entry;
+	struct ofi_mq_entry *entry;
 
-	if (dlist_empty(&recv_queue->unexp_msg_list))
+	if (ofi_mq_empty(&recv_queue->unexp_mq))
 		return NULL;
 
-	match_attr.addr 	= addr;
-	match_attr.tag 		= tag;
-	match_attr.ignore 	= ignore;
-
-	entry = dlist_find_first_match(&recv_queue->unexp_msg_list,
-				       recv_queue->match_unexp, &match_attr);
+	entry = ofi_mq_find_msg(&recv_queue->unexp_mq, addr, tag, ignore);
 	if (!entry)
 		return NULL;
 
 	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Match for posted recv found in unexp"
-			 " msg list\n", match_attr.addr, match_attr.tag);
+			 " msg list\n", addr, tag);
 
-	return container_of(entry, struct rxm_rx_buf, unexp_msg.entry);
+	return container_of(entry, struct rxm_rx_buf, unexp_msg);
+}
+
+/* Starts the reassembly of the SAR message whose first segment is in
+ * `rx_buf`, once it has been matched with `recv_entry`: the following
+ * segments are placed straight into the receive buffer. If the message was
+ * unexpected, the segments received so far stay in rxm_rx_buf::sar_seg_list */
+static inline void
+rxm_sar_rx_start(struct rxm_rx_buf *rx_buf, struct rxm_recv_entry *recv_entry)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&rx_buf->sar_entry);
+
+	recv_entry->sar_conn = rx_buf->conn;
+	recv_entry->msg_id = rx_buf->pkt.ctrl_hdr.msg_id;
+	recv_entry->total_recv_len = 0;
+	recv_entry->sar_recv_len = 0;
+	recv_entry->segs_total = ofi_div_ceil(rx_buf->pkt.hdr.size,
+					      rx_buf->pkt.ctrl_hdr.seg_size);
+	recv_entry->segs_credited = RXM_SAR_WINDOW;
+	recv_entry->credits_pending = 0;
+	dlist_insert_tail(&recv_entry->sar_entry,
+			  &rx_buf->conn->sar_rx_msg_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
 }
 
 static inline int
@@ -605,53 +901,53 @@ rxm_process_recv_entry(struct rxm_recv_queue *recv_queue,
 	struct rxm_rx_buf *rx_buf;
 
 	recv_queue->rxm_ep->res_fastlock_acquire(&recv_queue->lock);
-	rx_buf = rxm_check_unexp_msg_list(recv_queue, recv_entry->addr,
-					  recv_entry->tag, recv_entry->ignore);
+	rx_buf = rxm_check_unexp_msg_list(recv_queue, recv_entry->match.addr,
+					  recv_entry->match.tag,
+					  recv_entry->match.ignore);
 	if (rx_buf) {
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		ofi_mq_remove(&rx_buf->unexp_msg);
 		rx_buf->recv_entry = recv_entry;
+		/* Segments that arrive from now on go to the user buffer */
+		if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data)
+			rxm_sar_rx_start(rx_buf, recv_entry);
 		recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
-		if (rx_buf->pkt.ctrl_hdr.type != ofi_ctrl_seg_data) {
-			return rxm_cq_handle_rx_buf(rx_buf);
-		} else {
-			enum rxm_sar_seg_type last =
-				(rxm_sar_get_seg_type(&rx_buf->pkt.ctrl_hdr)
-								== RXM_SAR_SEG_LAST);
-			ssize_t ret = rxm_cq_handle_rx_buf(rx_buf);
-			recv_queue->rxm_ep->res_fastlock_acquire(&recv_queue->lock);
-			while (!ret && rx_buf && !last) {
-				rx_buf = rxm_check_unexp_msg_list(recv_queue, recv_entry->addr,
-								  recv_entry->tag, recv_entry->ignore);
-				if (rx_buf) {
-					assert(rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data);
-					rx_buf->recv_entry = recv_entry;
-					dlist_remove(&rx_buf->unexp_msg.entry);
-					last = (rxm_sar_get_seg_type(&rx_buf->pkt.ctrl_hdr)
-									== RXM_SAR_SEG_LAST);
-					recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
-					ret = rxm_cq_handle_rx_buf(rx_buf);
-					recv_queue->rxm_ep->res_fastlock_acquire(&recv_queue->lock);
-				}
-			}
-			recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
-			return ret;
-		}
+		return rxm_cq_handle_rx_buf(rx_buf);
 	}
 
-	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Enqueuing recv", recv_entry->addr,
-			 recv_entry->tag);
-	dlist_insert_tail(&recv_entry->entry, &recv_queue->recv_list);
+	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Enqueuing recv",
+			 recv_entry->match.addr, recv_entry->match.tag);
+	ofi_mq_insert(&recv_queue->recv_mq, &recv_entry->match);
 	recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
 
 	return FI_SUCCESS;
 }
 
+static inline struct rxm_conn *rxm_key2conn(struct rxm_ep *rxm_ep, uint64_t key)
+{
+	struct util_cmap_handle *handle;
+	handle = ofi_cmap_key2handle(rxm_ep->util_ep.cmap, key);
+	if (!handle)
+		return NULL;
+	return container_of(handle, struct rxm_conn, handle);
+}
+
+/* Caller must hold `cmap::lock` */
 static inline struct rxm_conn *
 rxm_acquire_conn(struct rxm_ep *rxm_ep, fi_addr_t fi_addr)
 {
-	return container_of(ofi_cmap_acquire_handle(rxm_ep->util_ep.cmap,
-						    fi_addr),
-			    struct rxm_conn, handle);
+	struct util_cmap_handle *handle;
+	struct rxm_conn *rxm_conn;
+
+	handle = ofi_cmap_acquire_handle(rxm_ep->util_ep.cmap, fi_addr);
+	if (OFI_UNLIKELY(!handle)) {
+		/* The handle was deleted on remote shutdown, start over */
+		if (util_cmap_alloc_handle(rxm_ep->util_ep.cmap, fi_addr,
+					   CMAP_IDLE, &handle))
+			return NULL;
+	}
+	rxm_conn = container_of(handle, struct rxm_conn, handle);
+	rxm_conn->referenced = 1;
+	return rxm_conn;
 }
 
 void rxm_ep_progress_conn_deferred_list(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn);
@@ -685,16 +981,73 @@ rxm_ep_handle_unconnected(struct rxm_ep *rxm_ep, struct util_cmap_handle *handle
 	return -FI_EAGAIN;
 }
 
+/* Eager flow control (see rxm_ep::eager_credits). Credits returned to
+ * the peer travel in the seg_no field of data, bundle and ack messages,
+ * which is otherwise only used by SAR segments */
+static inline int rxm_conn_has_credit(struct rxm_conn *rxm_conn)
+{
+	return !rxm_conn->eager_credit_limit || rxm_conn->eager_credits;
+}
+
+/* Takes the eager credit for a message (if `eager` is set) and, unless
+ * `returned` is NULL, the credits to piggyback on it */
+static inline int
+rxm_conn_credit_tx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		   int eager, uint32_t *returned)
+{
+	if (returned)
+		*returned = 0;
+	if (!rxm_conn->eager_credit_limit && !rxm_ep->eager_credits)
+		return 0;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	if (eager && rxm_conn->eager_credit_limit) {
+		if (OFI_UNLIKELY(!rxm_conn->eager_credits)) {
+			rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+			return -FI_EAGAIN;
+		}
+		rxm_conn->eager_credits--;
+	}
+	if (returned) {
+		*returned = rxm_conn->eager_rx_pending;
+		rxm_conn->eager_rx_pending = 0;
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	return 0;
+}
+
+/* Gives back what rxm_conn_credit_tx took for a message that wasn't sent */
+static inline void
+rxm_conn_credit_tx_undo(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			int eager, uint32_t returned)
+{
+	if (!rxm_conn->eager_credit_limit && !rxm_ep->eager_credits)
+		return;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	if (eager && rxm_conn->eager_credit_limit)
+		rxm_conn->eager_credits++;
+	rxm_conn->eager_rx_pending += returned;
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
 static inline ssize_t
 rxm_ep_inject_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 		   struct rxm_tx_buf *tx_buf, size_t pkt_size)
 {
+	uint32_t returned;
+
+	if (OFI_UNLIKELY(rxm_conn_credit_tx(rxm_ep, rxm_conn, 1, &returned)))
+		return -FI_EAGAIN;
+	tx_buf->pkt.ctrl_hdr.seg_no = returned;
+
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting inject with length: %" PRIu64
 	       " tag: 0x%" PRIx64 "\n", tx_buf->pkt.hdr.size, tx_buf->pkt.hdr.tag);
 	ssize_t ret = fi_inject(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size, 0);
 	if (OFI_UNLIKELY(ret)) {
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
 		       "fi_inject for MSG provider failed\n");
+		rxm_conn_credit_tx_undo(rxm_ep, rxm_conn, 1, returned);
 		rxm_cntr_incerr(rxm_ep->util_ep.tx_cntr);
 	} else {
 		rxm_cntr_inc(rxm_ep->util_ep.tx_cntr);
@@ -706,12 +1059,24 @@ static inline ssize_t
 rxm_ep_normal_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 		   struct rxm_tx_entry *tx_entry, size_t pkt_size)
 {
+	int eager = (tx_entry->tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_data);
+	uint32_t returned = 0;
+
+	if (eager) {
+		if (OFI_UNLIKELY(rxm_conn_credit_tx(rxm_ep, rxm_conn, 1,
+						    &returned)))
+			return -FI_EAGAIN;
+		tx_entry->tx_buf->pkt.ctrl_hdr.seg_no = returned;
+	}
+
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting send with length: %" PRIu64
 	       " tag: 0x%" PRIx64 "\n", tx_entry->tx_buf->pkt.hdr.size,
 	       tx_entry->tx_buf->pkt.hdr.tag);
 	ssize_t ret = fi_send(rxm_conn->msg_ep, &tx_entry->tx_buf->pkt, pkt_size,
 			      tx_entry->tx_buf->hdr.desc, 0, tx_entry);
 	if (OFI_UNLIKELY(ret)) {
+		if (eager)
+			rxm_conn_credit_tx_undo(rxm_ep, rxm_conn, 1, returned);
 		if (ret == -FI_EAGAIN)
 			rxm_ep_progress_multi(&rxm_ep->util_ep);
 		else
@@ -763,10 +1128,14 @@ static inline struct rxm_tx_buf *
 rxm_tx_buf_get(struct rxm_ep *rxm_ep, enum rxm_buf_pool_type type)
 {
 	assert((type == RXM_BUF_POOL_TX) ||
+	       (type == RXM_BUF_POOL_TX_SMALL) ||
 	       (type == RXM_BUF_POOL_TX_INJECT) ||
 	       (type == RXM_BUF_POOL_TX_ACK) ||
 	       (type == RXM_BUF_POOL_TX_LMT) ||
-	       (type == RXM_BUF_POOL_TX_SAR));
+	       (type == RXM_BUF_POOL_TX_CTS) ||
+	       (type == RXM_BUF_POOL_TX_SAR) ||
+	       (type == RXM_BUF_POOL_TX_BUNDLE) ||
+	       (type == RXM_BUF_POOL_TX_ATOMIC));
 	return (struct rxm_tx_buf *)rxm_buf_get(&rxm_ep->buf_pools[type]);
 }
 
@@ -774,19 +1143,35 @@ static inline void
 rxm_tx_buf_release(struct rxm_ep *rxm_ep, struct rxm_tx_buf *tx_buf)
 {
 	assert((tx_buf->type == RXM_BUF_POOL_TX) ||
+	       (tx_buf->type == RXM_BUF_POOL_TX_SMALL) ||
 	       (tx_buf->type == RXM_BUF_POOL_TX_INJECT) ||
 	       (tx_buf->type == RXM_BUF_POOL_TX_ACK) ||
 	       (tx_buf->type == RXM_BUF_POOL_TX_LMT) ||
-	       (tx_buf->type == RXM_BUF_POOL_TX_SAR));
+	       (tx_buf->type == RXM_BUF_POOL_TX_CTS) ||
+	       (tx_buf->type == RXM_BUF_POOL_TX_SAR) ||
+	       (tx_buf->type == RXM_BUF_POOL_TX_BUNDLE) ||
+	       (tx_buf->type == RXM_BUF_POOL_TX_ATOMIC));
 	assert((tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_data) ||
 	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_large_data) ||
+	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_write_cts) ||
 	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data) ||
-	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_ack));
+	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_bundle) ||
+	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_ack) ||
+	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_atomic) ||
+	       (tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_atomic_resp));
 	tx_buf->pkt.hdr.flags = 0;
 	rxm_buf_release(&rxm_ep->buf_pools[tx_buf->type],
 			(struct rxm_buf *)tx_buf);
 }
 
+/* Returns the smallest eager TX buffer pool that fits `data_len` */
+static inline struct rxm_buf_pool *
+rxm_ep_tx_pool(struct rxm_ep *rxm_ep, size_t data_len)
+{
+	return &rxm_ep->buf_pools[(data_len <= RXM_BUF_SMALL_SIZE) ?
+				  RXM_BUF_POOL_TX_SMALL : RXM_BUF_POOL_TX];
+}
+
 static inline struct rxm_rx_buf *rxm_rx_buf_get(struct rxm_ep *rxm_ep)
 {
 	return (struct rxm_rx_buf *)rxm_buf_get_ts(
@@ -917,10 +1302,88 @@ static inline void rxm_enqueue_rx_buf_for_repost(struct rxm_rx_buf *rx_buf)
 	rx_buf->ep->res_fastlock_release(&rx_buf->ep->util_ep.lock);
 }
 
+/* Without SRX the RX buffers posted to a MSG EP are tracked per connection
+ * when eviction is enabled, so that they can be reclaimed when the MSG EP
+ * is closed. rxm_conn::rx_busy counts the buffers that completed and are
+ * still held by RxM */
+static inline int rxm_ep_track_rx_bufs(struct rxm_ep *rxm_ep)
+{
+	return rxm_ep->conn_evict && !rxm_ep->srx_ctx;
+}
+
+static inline void rxm_rx_buf_unpost(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+
+	if (OFI_LIKELY(!rxm_ep->conn_evict))
+		return;
+	if (rx_buf->conn)
+		rx_buf->conn->referenced = 1;
+	if (rxm_ep->srx_ctx)
+		return;
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&rx_buf->posted_entry);
+	rx_buf->conn->rx_busy++;
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Returns the eager credit charged for the RX buffer to its sender, right
+ * away once a batch is ready or the sender is about to run out. Caller
+ * holds `util_ep::lock` */
+static inline void
+rxm_rx_buf_return_credit(struct rxm_ep *rxm_ep, struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_conn *rxm_conn = rx_buf->conn;
+
+	rx_buf->eager_credit = 0;
+	/* Credits of a previous connection are gone */
+	if (!rxm_conn->eager_rx_held)
+		return;
+	rxm_conn->eager_rx_held--;
+	rxm_conn->eager_rx_pending++;
+	if (dlist_empty(&rxm_conn->credit_entry) &&
+	    (rxm_conn->eager_rx_pending >= rxm_ep->eager_credit_batch ||
+	     rxm_conn->eager_rx_held + rxm_conn->eager_rx_pending +
+	     rxm_ep->eager_credit_batch >= rxm_ep->eager_credits))
+		dlist_insert_tail(&rxm_conn->credit_entry,
+				  &rxm_ep->credit_update_list);
+}
+
 static inline void rxm_enqueue_rx_buf_for_repost_check(struct rxm_rx_buf *rx_buf)
 {
-	if (rx_buf->repost)
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+
+	if (rx_buf->repost) {
 		rxm_enqueue_rx_buf_for_repost(rx_buf);
-	else
-		rxm_rx_buf_release(rx_buf->ep, rx_buf);
+		return;
+	}
+	if (rxm_ep_track_rx_bufs(rxm_ep) || rx_buf->eager_credit) {
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		if (rxm_ep_track_rx_bufs(rxm_ep))
+			rx_buf->conn->rx_busy--;
+		if (rx_buf->eager_credit)
+			rxm_rx_buf_return_credit(rxm_ep, rx_buf);
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	}
+	rxm_rx_buf_release(rxm_ep, rx_buf);
+}
+
+/* Sends a header-only control message over the connection. The MSG
+ * provider must be able to inject a struct rxm_pkt */
+static inline ssize_t
+rxm_conn_inject_ctrl(struct rxm_conn *rxm_conn, uint8_t type,
+		     uint64_t msg_id, uint64_t data)
+{
+	struct rxm_pkt pkt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.hdr.op		= ofi_op_msg;
+	pkt.hdr.version		= OFI_OP_VERSION;
+	pkt.ctrl_hdr.version	= RXM_CTRL_VERSION;
+	pkt.ctrl_hdr.type	= type;
+	pkt.ctrl_hdr.conn_id	= rxm_conn->handle.remote_key;
+	pkt.ctrl_hdr.msg_id	= msg_id;
+	pkt.ctrl_hdr.ctrl_data	= data;
+
+	return fi_inject(rxm_conn->msg_ep, &pkt, sizeof(pkt), 0);
 }
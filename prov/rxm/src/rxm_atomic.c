@@ -0,0 +1,975 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <ofi_atomic.h>
+#include <ofi_iov.h>
+
+#include "rxm.h"
+
+static uint64_t rxm_atomic_query_flags(uint8_t op)
+{
+	switch (op) {
+	case ofi_op_atomic_fetch:
+		return FI_FETCH_ATOMIC;
+	case ofi_op_atomic_compare:
+		return FI_COMPARE_ATOMIC;
+	default:
+		return 0;
+	}
+}
+
+static size_t rxm_atomic_copy_ioc(char *buf, const struct fi_ioc *ioc,
+				  size_t ioc_count, size_t dtsize)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < ioc_count; i++) {
+		memcpy(&buf[len], ioc[i].addr, ioc[i].count * dtsize);
+		len += ioc[i].count * dtsize;
+	}
+	return len;
+}
+
+/* Takes a fetching atomic out of the wait for its response, unless it has
+ * been completed already */
+static int rxm_atomic_claim(struct rxm_ep *rxm_ep,
+			    struct rxm_tx_entry *tx_entry, uint64_t msg_id)
+{
+	struct rxm_send_queue *send_queue = &tx_entry->conn->send_queue;
+	int claimed;
+
+	rxm_ep->res_fastlock_acquire(&send_queue->lock);
+	claimed = (tx_entry->state == RXM_ATOMIC_RESP_WAIT) &&
+		  (tx_entry->msg_id == msg_id);
+	if (claimed) {
+		tx_entry->state = RXM_TX_NOBUF;
+		tx_entry->msg_id = UINT64_MAX;
+	}
+	rxm_ep->res_fastlock_release(&send_queue->lock);
+	return claimed;
+}
+
+static ssize_t
+rxm_ep_atomic_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		   struct rxm_tx_buf *tx_buf, size_t pkt_size,
+		   const struct fi_msg_atomic *msg, uint64_t flags)
+{
+	struct rxm_tx_entry *tx_entry;
+	ssize_t ret;
+
+	if (!(flags & FI_COMPLETION) &&
+	    (pkt_size <= rxm_ep->msg_info->tx_attr->inject_size)) {
+		ret = fi_inject(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size, 0);
+		if (OFI_LIKELY(!ret))
+			rxm_cntr_inc(rxm_ep->util_ep.wr_cntr);
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return ret;
+	}
+
+	tx_entry = rxm_tx_entry_get(&rxm_conn->send_queue);
+	if (OFI_UNLIKELY(!tx_entry)) {
+		ret = -FI_EAGAIN;
+		goto err;
+	}
+	rxm_fill_tx_entry(msg->context, (uint8_t)msg->iov_count, flags, 0,
+			  tx_buf, tx_entry);
+	tx_entry->comp_flags = FI_ATOMIC | FI_WRITE;
+	tx_entry->state = RXM_TX;
+
+	ret = fi_send(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size,
+		      tx_buf->hdr.desc, 0, tx_entry);
+	if (OFI_LIKELY(!ret))
+		return 0;
+
+	rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+err:
+	rxm_tx_buf_release(rxm_ep, tx_buf);
+	return ret;
+}
+
+/* The request goes out on its own, the fetching atomic completes when the
+ * target sends its results back */
+static ssize_t
+rxm_ep_atomic_fetch_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			 struct rxm_tx_buf *tx_buf, size_t pkt_size,
+			 const struct fi_msg_atomic *msg,
+			 const struct fi_ioc *resultv, size_t result_count,
+			 size_t dtsize, uint64_t flags)
+{
+	struct rxm_tx_entry *tx_entry;
+	size_t i;
+	ssize_t ret;
+
+	tx_entry = rxm_tx_entry_get(&rxm_conn->send_queue);
+	if (OFI_UNLIKELY(!tx_entry)) {
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return -FI_EAGAIN;
+	}
+	rxm_fill_tx_entry(msg->context, (uint8_t)result_count, flags, 0,
+			  NULL, tx_entry);
+	tx_entry->comp_flags = FI_ATOMIC | FI_READ;
+	for (i = 0; i < result_count; i++) {
+		tx_entry->atomic_result.iov[i].iov_base = resultv[i].addr;
+		tx_entry->atomic_result.iov[i].iov_len =
+			resultv[i].count * dtsize;
+	}
+	tx_entry->atomic_result.count = (uint8_t)result_count;
+	tx_entry->msg_id = ((uint64_t)rxm_conn->msg_seq++ << 32) |
+			   rxm_txe_fs_index(rxm_conn->send_queue.fs, tx_entry);
+	tx_entry->state = RXM_ATOMIC_RESP_WAIT;
+	tx_buf->pkt.ctrl_hdr.msg_id = tx_entry->msg_id;
+
+	if (pkt_size <= rxm_ep->msg_info->tx_attr->inject_size) {
+		ret = fi_inject(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size, 0);
+		if (OFI_UNLIKELY(ret))
+			goto err;
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return 0;
+	}
+
+	tx_buf->hdr.state = RXM_ATOMIC_TX;
+	tx_buf->tx_entry = tx_entry;
+	ret = fi_send(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size,
+		      tx_buf->hdr.desc, 0, tx_buf);
+	if (OFI_LIKELY(!ret))
+		return 0;
+err:
+	tx_entry->state = RXM_TX_NOBUF;
+	tx_entry->msg_id = UINT64_MAX;
+	rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+	rxm_tx_buf_release(rxm_ep, tx_buf);
+	return ret;
+}
+
+static ssize_t
+rxm_ep_atomic_common(struct rxm_ep *rxm_ep, const struct fi_msg_atomic *msg,
+		     const struct fi_ioc *comparev, size_t compare_count,
+		     const struct fi_ioc *resultv, size_t result_count,
+		     uint8_t op, uint64_t flags)
+{
+	struct rxm_tx_buf *tx_buf;
+	struct rxm_conn *rxm_conn;
+	size_t dtsize, ioc_len, data_len;
+	ssize_t ret;
+
+	assert(msg->iov_count <= rxm_ep->rxm_info->tx_attr->iov_limit);
+	assert(msg->rma_iov_count <= rxm_ep->rxm_info->tx_attr->rma_iov_limit);
+
+	if (OFI_UNLIKELY((result_count > RXM_IOV_LIMIT) ||
+			 ofi_atomic_valid(&rxm_prov, msg->datatype, msg->op,
+					  rxm_atomic_query_flags(op))))
+		return -FI_EINVAL;
+
+	/* Operands and results must fit in an eager buffer */
+	dtsize = ofi_datatype_size(msg->datatype);
+	ioc_len = msg->rma_iov_count * sizeof(*msg->rma_iov);
+	data_len = ioc_len;
+	if (msg->op != FI_ATOMIC_READ)
+		data_len += ofi_total_ioc_cnt(msg->msg_iov,
+					      msg->iov_count) * dtsize;
+	if (op == ofi_op_atomic_compare)
+		data_len += ofi_total_ioc_cnt(comparev, compare_count) * dtsize;
+	if (OFI_UNLIKELY(data_len > rxm_ep->rxm_info->tx_attr->inject_size) ||
+	    ((op != ofi_op_atomic) &&
+	     (sizeof(struct rxm_atomic_resp) +
+	      fi_get_aligned_sz(ofi_total_ioc_cnt(resultv, result_count) *
+				dtsize, 8) >
+	      rxm_ep->rxm_info->tx_attr->inject_size)))
+		return -FI_EINVAL;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	rxm_conn = rxm_acquire_conn(rxm_ep, msg->addr);
+	if (OFI_UNLIKELY(!rxm_conn)) {
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+		return -FI_ENOMEM;
+	}
+	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
+		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle,
+						msg->addr);
+		if (!ret)
+			goto atomic_continue;
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+		return ret;
+	}
+atomic_continue:
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+
+	if (OFI_UNLIKELY(rxm_conn->bundle != NULL) &&
+	    rxm_conn_bundle_flush(rxm_ep, rxm_conn))
+		return -FI_EAGAIN;
+
+	tx_buf = rxm_tx_buf_get(rxm_ep, RXM_BUF_POOL_TX_ATOMIC);
+	if (OFI_UNLIKELY(!tx_buf)) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_DATA, "TX queue full!\n");
+		rxm_ep_progress_multi(&rxm_ep->util_ep);
+		return -FI_EAGAIN;
+	}
+
+	tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_atomic;
+	tx_buf->pkt.ctrl_hdr.conn_id = rxm_conn->handle.remote_key;
+	tx_buf->pkt.ctrl_hdr.seg_no = 0;
+	tx_buf->pkt.ctrl_hdr.msg_id = 0;
+	tx_buf->pkt.hdr.op = op;
+	tx_buf->pkt.hdr.size = data_len;
+	tx_buf->pkt.hdr.atomic.datatype = msg->datatype;
+	tx_buf->pkt.hdr.atomic.op = msg->op;
+	tx_buf->pkt.hdr.atomic.ioc_count = (uint8_t)msg->rma_iov_count;
+	if (flags & FI_REMOTE_CQ_DATA) {
+		tx_buf->pkt.hdr.flags |= FI_REMOTE_CQ_DATA;
+		tx_buf->pkt.hdr.data = msg->data;
+	}
+
+	memcpy(tx_buf->pkt.data, msg->rma_iov, ioc_len);
+	data_len = ioc_len;
+	if (msg->op != FI_ATOMIC_READ)
+		data_len += rxm_atomic_copy_ioc(tx_buf->pkt.data + data_len,
+						msg->msg_iov, msg->iov_count,
+						dtsize);
+	if (op == ofi_op_atomic_compare)
+		rxm_atomic_copy_ioc(tx_buf->pkt.data + data_len, comparev,
+				    compare_count, dtsize);
+
+	if (op == ofi_op_atomic)
+		ret = rxm_ep_atomic_send(rxm_ep, rxm_conn, tx_buf,
+					 sizeof(struct rxm_pkt) +
+					 tx_buf->pkt.hdr.size, msg, flags);
+	else
+		ret = rxm_ep_atomic_fetch_send(rxm_ep, rxm_conn, tx_buf,
+					       sizeof(struct rxm_pkt) +
+					       tx_buf->pkt.hdr.size, msg,
+					       resultv, result_count, dtsize,
+					       flags);
+	if (OFI_UNLIKELY(ret == -FI_EAGAIN))
+		rxm_ep_progress_multi(&rxm_ep->util_ep);
+	return ret;
+}
+
+static ssize_t rxm_ep_atomic_writemsg(struct fid_ep *ep_fid,
+				      const struct fi_msg_atomic *msg,
+				      uint64_t flags)
+{
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_common(rxm_ep, msg, NULL, 0, NULL, 0,
+				    ofi_op_atomic, flags);
+}
+
+static ssize_t rxm_ep_atomic_writev(struct fid_ep *ep_fid,
+				    const struct fi_ioc *iov, void **desc,
+				    size_t count, fi_addr_t dest_addr,
+				    uint64_t addr, uint64_t key,
+				    enum fi_datatype datatype, enum fi_op op,
+				    void *context)
+{
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = ofi_total_ioc_cnt(iov, count),
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = context,
+		.data = 0,
+	};
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_writemsg(ep_fid, &msg, rxm_ep_tx_flags(rxm_ep));
+}
+
+static ssize_t rxm_ep_atomic_write(struct fid_ep *ep_fid, const void *buf,
+				   size_t count, void *desc,
+				   fi_addr_t dest_addr, uint64_t addr,
+				   uint64_t key, enum fi_datatype datatype,
+				   enum fi_op op, void *context)
+{
+	struct fi_ioc iov = {
+		.addr = (void *)buf,
+		.count = count,
+	};
+
+	return rxm_ep_atomic_writev(ep_fid, &iov, &desc, 1, dest_addr, addr,
+				    key, datatype, op, context);
+}
+
+static ssize_t rxm_ep_atomic_inject(struct fid_ep *ep_fid, const void *buf,
+				    size_t count, fi_addr_t dest_addr,
+				    uint64_t addr, uint64_t key,
+				    enum fi_datatype datatype, enum fi_op op)
+{
+	struct fi_ioc iov = {
+		.addr = (void *)buf,
+		.count = count,
+	};
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = count,
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = &iov,
+		.desc = NULL,
+		.iov_count = 1,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = NULL,
+		.data = 0,
+	};
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_writemsg(ep_fid, &msg,
+				      (rxm_ep_tx_flags(rxm_ep) &
+				       ~FI_COMPLETION) | FI_INJECT);
+}
+
+static ssize_t rxm_ep_atomic_readwritemsg(struct fid_ep *ep_fid,
+					  const struct fi_msg_atomic *msg,
+					  struct fi_ioc *resultv,
+					  void **result_desc,
+					  size_t result_count, uint64_t flags)
+{
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_common(rxm_ep, msg, NULL, 0, resultv,
+				    result_count, ofi_op_atomic_fetch, flags);
+}
+
+static ssize_t rxm_ep_atomic_readwritev(struct fid_ep *ep_fid,
+					const struct fi_ioc *iov, void **desc,
+					size_t count, struct fi_ioc *resultv,
+					void **result_desc,
+					size_t result_count,
+					fi_addr_t dest_addr, uint64_t addr,
+					uint64_t key, enum fi_datatype datatype,
+					enum fi_op op, void *context)
+{
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = ofi_total_ioc_cnt(resultv, result_count),
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = context,
+		.data = 0,
+	};
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_readwritemsg(ep_fid, &msg, resultv, result_desc,
+					  result_count,
+					  rxm_ep_tx_flags(rxm_ep));
+}
+
+static ssize_t rxm_ep_atomic_readwrite(struct fid_ep *ep_fid,
+				       const void *buf, size_t count,
+				       void *desc, void *result,
+				       void *result_desc, fi_addr_t dest_addr,
+				       uint64_t addr, uint64_t key,
+				       enum fi_datatype datatype,
+				       enum fi_op op, void *context)
+{
+	struct fi_ioc iov = {
+		.addr = (void *)buf,
+		.count = count,
+	};
+	struct fi_ioc resultv = {
+		.addr = result,
+		.count = count,
+	};
+
+	return rxm_ep_atomic_readwritev(ep_fid, &iov, &desc, 1, &resultv,
+					&result_desc, 1, dest_addr, addr, key,
+					datatype, op, context);
+}
+
+static ssize_t rxm_ep_atomic_compwritemsg(struct fid_ep *ep_fid,
+					  const struct fi_msg_atomic *msg,
+					  const struct fi_ioc *comparev,
+					  void **compare_desc,
+					  size_t compare_count,
+					  struct fi_ioc *resultv,
+					  void **result_desc,
+					  size_t result_count, uint64_t flags)
+{
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_common(rxm_ep, msg, comparev, compare_count,
+				    resultv, result_count,
+				    ofi_op_atomic_compare, flags);
+}
+
+static ssize_t rxm_ep_atomic_compwritev(struct fid_ep *ep_fid,
+					const struct fi_ioc *iov, void **desc,
+					size_t count,
+					const struct fi_ioc *comparev,
+					void **compare_desc,
+					size_t compare_count,
+					struct fi_ioc *resultv,
+					void **result_desc,
+					size_t result_count,
+					fi_addr_t dest_addr, uint64_t addr,
+					uint64_t key, enum fi_datatype datatype,
+					enum fi_op op, void *context)
+{
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = ofi_total_ioc_cnt(iov, count),
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = context,
+		.data = 0,
+	};
+	struct rxm_ep *rxm_ep = container_of(ep_fid, struct rxm_ep,
+					     util_ep.ep_fid.fid);
+
+	return rxm_ep_atomic_compwritemsg(ep_fid, &msg, comparev, compare_desc,
+					  compare_count, resultv, result_desc,
+					  result_count,
+					  rxm_ep_tx_flags(rxm_ep));
+}
+
+static ssize_t rxm_ep_atomic_compwrite(struct fid_ep *ep_fid,
+				       const void *buf, size_t count,
+				       void *desc, const void *compare,
+				       void *compare_desc, void *result,
+				       void *result_desc, fi_addr_t dest_addr,
+				       uint64_t addr, uint64_t key,
+				       enum fi_datatype datatype,
+				       enum fi_op op, void *context)
+{
+	struct fi_ioc iov = {
+		.addr = (void *)buf,
+		.count = count,
+	};
+	struct fi_ioc resultv = {
+		.addr = result,
+		.count = count,
+	};
+	struct fi_ioc comparev = {
+		.addr = (void *)compare,
+		.count = count,
+	};
+
+	return rxm_ep_atomic_compwritev(ep_fid, &iov, &desc, 1, &comparev,
+					&compare_desc, 1, &resultv,
+					&result_desc, 1, dest_addr, addr, key,
+					datatype, op, context);
+}
+
+int rxm_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
+		     enum fi_op op, struct fi_atomic_attr *attr, uint64_t flags)
+{
+	size_t max_size;
+	int ret;
+
+	if (flags & FI_TAGGED) {
+		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+			"tagged atomic op not supported\n");
+		return -FI_EINVAL;
+	}
+
+	ret = ofi_atomic_valid(&rxm_prov, datatype, op, flags);
+	if (ret || !attr)
+		return ret;
+
+	/* A single target ioc, its operands and compare values go in an
+	 * eager buffer */
+	max_size = rxm_info.tx_attr->inject_size - sizeof(struct fi_rma_ioc);
+	if (flags & FI_COMPARE_ATOMIC)
+		max_size /= 2;
+
+	attr->size = ofi_datatype_size(datatype);
+	attr->count = max_size / attr->size;
+	return 0;
+}
+
+static int rxm_ep_atomic_valid(struct fid_ep *ep_fid,
+			       enum fi_datatype datatype, enum fi_op op,
+			       size_t *count)
+{
+	struct fi_atomic_attr attr;
+	int ret;
+
+	ret = rxm_query_atomic(NULL, datatype, op, &attr, 0);
+	if (!ret)
+		*count = attr.count;
+	return ret;
+}
+
+static int rxm_ep_atomic_readwritevalid(struct fid_ep *ep_fid,
+					enum fi_datatype datatype,
+					enum fi_op op, size_t *count)
+{
+	struct fi_atomic_attr attr;
+	int ret;
+
+	ret = rxm_query_atomic(NULL, datatype, op, &attr, FI_FETCH_ATOMIC);
+	if (!ret)
+		*count = attr.count;
+	return ret;
+}
+
+static int rxm_ep_atomic_compwritevalid(struct fid_ep *ep_fid,
+					enum fi_datatype datatype,
+					enum fi_op op, size_t *count)
+{
+	struct fi_atomic_attr attr;
+	int ret;
+
+	ret = rxm_query_atomic(NULL, datatype, op, &attr, FI_COMPARE_ATOMIC);
+	if (!ret)
+		*count = attr.count;
+	return ret;
+}
+
+struct fi_ops_atomic rxm_ops_atomic = {
+	.size = sizeof(struct fi_ops_atomic),
+	.write = rxm_ep_atomic_write,
+	.writev = rxm_ep_atomic_writev,
+	.writemsg = rxm_ep_atomic_writemsg,
+	.inject = rxm_ep_atomic_inject,
+	.readwrite = rxm_ep_atomic_readwrite,
+	.readwritev = rxm_ep_atomic_readwritev,
+	.readwritemsg = rxm_ep_atomic_readwritemsg,
+	.compwrite = rxm_ep_atomic_compwrite,
+	.compwritev = rxm_ep_atomic_compwritev,
+	.compwritemsg = rxm_ep_atomic_compwritemsg,
+	.writevalid = rxm_ep_atomic_valid,
+	.readwritevalid = rxm_ep_atomic_readwritevalid,
+	.compwritevalid = rxm_ep_atomic_compwritevalid,
+};
+
+/* Checks an atomic request against the registered memory and translates
+ * the addresses of its target iocs. Caller holds `util_domain::lock` */
+static int rxm_atomic_verify(struct rxm_ep *rxm_ep, struct rxm_pkt *pkt,
+			     struct fi_rma_ioc *ioc, size_t *len)
+{
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+	size_t i, dtsize, ioc_len, data_len;
+	uint64_t access;
+	int ret;
+
+	if ((pkt->hdr.op != ofi_op_atomic &&
+	     pkt->hdr.op != ofi_op_atomic_fetch &&
+	     pkt->hdr.op != ofi_op_atomic_compare) ||
+	    (pkt->hdr.atomic.ioc_count > RXM_IOV_LIMIT) ||
+	    ofi_atomic_valid(&rxm_prov, pkt->hdr.atomic.datatype,
+			     pkt->hdr.atomic.op,
+			     rxm_atomic_query_flags(pkt->hdr.op)))
+		return -FI_EINVAL;
+
+	ioc_len = pkt->hdr.atomic.ioc_count * sizeof(*ioc);
+	if (pkt->hdr.size < ioc_len)
+		return -FI_EINVAL;
+	memcpy(ioc, pkt->data, ioc_len);
+
+	if (pkt->hdr.atomic.op == FI_ATOMIC_READ)
+		access = FI_REMOTE_READ;
+	else if (pkt->hdr.op == ofi_op_atomic)
+		access = FI_REMOTE_WRITE;
+	else
+		access = FI_REMOTE_READ | FI_REMOTE_WRITE;
+
+	dtsize = ofi_datatype_size(pkt->hdr.atomic.datatype);
+	for (i = 0, *len = 0; i < pkt->hdr.atomic.ioc_count; i++) {
+		ret = ofi_mr_map_verify(&rxm_domain->mr_map,
+					(uintptr_t *)&ioc[i].addr,
+					ioc[i].count * dtsize, ioc[i].key,
+					access, NULL);
+		if (ret)
+			return ret;
+		*len += ioc[i].count * dtsize;
+	}
+
+	if (pkt->hdr.atomic.op == FI_ATOMIC_READ)
+		data_len = 0;
+	else if (pkt->hdr.op == ofi_op_atomic_compare)
+		data_len = 2 * *len;
+	else
+		data_len = *len;
+
+	if ((pkt->hdr.size != ioc_len + data_len) ||
+	    ((pkt->hdr.op != ofi_op_atomic) &&
+	     (sizeof(struct rxm_atomic_resp) + fi_get_aligned_sz(*len, 8) >
+	      rxm_ep->rxm_info->tx_attr->inject_size)))
+		return -FI_EINVAL;
+
+	return 0;
+}
+
+/* Applies a verified atomic request, storing the initial values of the
+ * targets at `res` for fetching ones */
+static void rxm_atomic_apply(struct rxm_pkt *pkt, struct fi_rma_ioc *ioc,
+			     char *res)
+{
+	enum fi_datatype datatype = pkt->hdr.atomic.datatype;
+	enum fi_op op = pkt->hdr.atomic.op;
+	size_t i, len, dtsize = ofi_datatype_size(datatype);
+	char *src, *cmp;
+	void *dst;
+
+	src = pkt->data + pkt->hdr.atomic.ioc_count * sizeof(*ioc);
+	for (i = 0, len = 0; i < pkt->hdr.atomic.ioc_count; i++)
+		len += ioc[i].count * dtsize;
+	cmp = src + len;
+
+	for (i = 0; i < pkt->hdr.atomic.ioc_count; i++) {
+		dst = (void *)(uintptr_t)ioc[i].addr;
+		len = ioc[i].count * dtsize;
+		switch (pkt->hdr.op) {
+		case ofi_op_atomic:
+			ofi_atomic_write_handlers[op][datatype](dst, src,
+								ioc[i].count);
+			break;
+		case ofi_op_atomic_fetch:
+			ofi_atomic_readwrite_handlers[op][datatype](dst, src,
+						res, ioc[i].count);
+			res += len;
+			break;
+		default:
+			ofi_atomic_swap_handlers[op - OFI_SWAP_OP_START]
+				[datatype](dst, src, cmp, res, ioc[i].count);
+			cmp += len;
+			res += len;
+			break;
+		}
+		src += len;
+	}
+}
+
+/* Reserves room for a response in the batch of the connection, which is
+ * sent by the progress. Caller holds `util_ep::lock` */
+static struct rxm_atomic_resp *
+rxm_atomic_resp_get(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		    size_t result_len)
+{
+	struct rxm_atomic_resp *resp;
+	struct rxm_tx_buf *tx_buf = NULL;
+	size_t size = sizeof(*resp) + fi_get_aligned_sz(result_len, 8);
+
+	if (!dlist_empty(&rxm_conn->atomic_resp_list))
+		tx_buf = container_of(rxm_conn->atomic_resp_list.prev,
+				      struct rxm_tx_buf, hdr.entry);
+	if (!tx_buf || (tx_buf->pkt.hdr.size + size >
+			rxm_ep->rxm_info->tx_attr->inject_size)) {
+		tx_buf = rxm_tx_buf_get(rxm_ep, RXM_BUF_POOL_TX_ATOMIC);
+		if (OFI_UNLIKELY(!tx_buf))
+			return NULL;
+		tx_buf->hdr.state = RXM_ATOMIC_RESP_TX;
+		tx_buf->tx_entry = NULL;
+		tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_atomic_resp;
+		tx_buf->pkt.ctrl_hdr.conn_id = rxm_conn->handle.remote_key;
+		tx_buf->pkt.ctrl_hdr.seg_no = 0;
+		tx_buf->pkt.ctrl_hdr.msg_id = 0;
+		tx_buf->pkt.hdr.op = ofi_op_msg;
+		tx_buf->pkt.hdr.size = 0;
+		dlist_insert_tail(&tx_buf->hdr.entry,
+				  &rxm_conn->atomic_resp_list);
+		if (dlist_empty(&rxm_conn->atomic_resp_entry))
+			dlist_insert_tail(&rxm_conn->atomic_resp_entry,
+					  &rxm_ep->atomic_resp_conn_list);
+	}
+
+	resp = (struct rxm_atomic_resp *)(tx_buf->pkt.data +
+					  tx_buf->pkt.hdr.size);
+	tx_buf->pkt.hdr.size += size;
+	resp->result_len = (uint32_t)result_len;
+	return resp;
+}
+
+ssize_t rxm_atomic_handle_req(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_domain *rxm_domain = container_of(rxm_ep->util_ep.domain,
+						     struct rxm_domain,
+						     util_domain);
+	struct rxm_pkt *pkt = &rx_buf->pkt;
+	struct fi_rma_ioc ioc[RXM_IOV_LIMIT];
+	struct rxm_atomic_resp *resp;
+	struct rxm_conn *rxm_conn;
+	size_t len = 0;
+	uint64_t comp_flags;
+	int ret;
+
+	rxm_conn = rx_buf->conn ? rx_buf->conn :
+		   rxm_key2conn(rxm_ep, pkt->ctrl_hdr.conn_id);
+	if (OFI_UNLIKELY(!rxm_conn)) {
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "Atomic request from an unknown "
+			"connection\n");
+		goto out;
+	}
+
+	if (pkt->hdr.op == ofi_op_atomic) {
+		fastlock_acquire(&rxm_domain->util_domain.lock);
+		ret = rxm_atomic_verify(rxm_ep, pkt, ioc, &len);
+		if (!ret)
+			rxm_atomic_apply(pkt, ioc, NULL);
+		fastlock_release(&rxm_domain->util_domain.lock);
+		if (OFI_UNLIKELY(ret)) {
+			FI_WARN(&rxm_prov, FI_LOG_CQ, "Dropping invalid atomic "
+				"request: %s\n", fi_strerror(-ret));
+			goto out;
+		}
+	} else {
+		/* The result goes straight into the response */
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		fastlock_acquire(&rxm_domain->util_domain.lock);
+		ret = rxm_atomic_verify(rxm_ep, pkt, ioc, &len);
+		resp = rxm_atomic_resp_get(rxm_ep, rxm_conn, ret ? 0 : len);
+		if (OFI_LIKELY(resp != NULL)) {
+			resp->msg_id = pkt->ctrl_hdr.msg_id;
+			resp->status = -ret;
+			if (!ret)
+				rxm_atomic_apply(pkt, ioc, (char *)(resp + 1));
+		}
+		fastlock_release(&rxm_domain->util_domain.lock);
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		if (OFI_UNLIKELY(!resp)) {
+			FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to allocate atomic "
+				"response for msg_id: 0x%" PRIx64 "\n",
+				pkt->ctrl_hdr.msg_id);
+			goto out;
+		}
+		if (OFI_UNLIKELY(ret))
+			goto out;
+	}
+
+	if (pkt->hdr.atomic.op == FI_ATOMIC_READ) {
+		comp_flags = FI_ATOMIC | FI_REMOTE_READ;
+		rxm_cntr_inc(rxm_ep->util_ep.rem_rd_cntr);
+	} else {
+		comp_flags = FI_ATOMIC | FI_REMOTE_WRITE;
+		rxm_cntr_inc(rxm_ep->util_ep.rem_wr_cntr);
+	}
+	if ((pkt->hdr.flags & FI_REMOTE_CQ_DATA) && rxm_ep->util_ep.rx_cq) {
+		ret = ofi_cq_write(rxm_ep->util_ep.rx_cq, NULL,
+				   comp_flags | FI_REMOTE_CQ_DATA, 0, NULL,
+				   pkt->hdr.data, 0);
+		if (ret)
+			FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to write remote "
+				"atomic completion\n");
+	}
+out:
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return 0;
+}
+
+ssize_t rxm_atomic_handle_resp(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_send_queue *send_queue;
+	struct rxm_atomic_resp *resp;
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_conn *rxm_conn;
+	size_t index, offset = 0;
+	ssize_t ret = 0;
+
+	rxm_conn = rx_buf->conn ? rx_buf->conn :
+		   rxm_key2conn(rxm_ep, rx_buf->pkt.ctrl_hdr.conn_id);
+	if (OFI_UNLIKELY(!rxm_conn))
+		goto out;
+	send_queue = &rxm_conn->send_queue;
+
+	while (offset + sizeof(*resp) <= rx_buf->pkt.hdr.size) {
+		resp = (struct rxm_atomic_resp *)(rx_buf->pkt.data + offset);
+		offset += sizeof(*resp) + fi_get_aligned_sz(resp->result_len, 8);
+		index = resp->msg_id & UINT32_MAX;
+		if (OFI_UNLIKELY((offset > rx_buf->pkt.hdr.size) ||
+				 (index >= send_queue->fs->size)))
+			break;
+
+		tx_entry = &send_queue->fs->entry[index].buf;
+		if (!rxm_atomic_claim(rxm_ep, tx_entry, resp->msg_id))
+			continue;
+
+		if (OFI_UNLIKELY(resp->status)) {
+			rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+					   rxm_ep->util_ep.rd_cntr,
+					   tx_entry->context, resp->status);
+			rxm_tx_entry_release(send_queue, tx_entry);
+			continue;
+		}
+
+		ofi_copy_to_iov(tx_entry->atomic_result.iov,
+				tx_entry->atomic_result.count, 0, resp + 1,
+				resp->result_len);
+		if (OFI_UNLIKELY(rxm_finish_send_nobuf(tx_entry))) {
+			rxm_tx_entry_release(send_queue, tx_entry);
+			ret = -FI_EOTHER;
+		}
+	}
+out:
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return ret;
+}
+
+/* Fails the fetching atomic whose request couldn't be sent, or drops the
+ * responses that couldn't */
+void rxm_atomic_tx_error(struct rxm_ep *rxm_ep, struct rxm_tx_buf *tx_buf,
+			 int err)
+{
+	struct rxm_tx_entry *tx_entry = tx_buf->tx_entry;
+
+	if (tx_buf->hdr.state == RXM_ATOMIC_TX) {
+		if (rxm_atomic_claim(rxm_ep, tx_entry,
+				     tx_buf->pkt.ctrl_hdr.msg_id)) {
+			rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+					   rxm_ep->util_ep.rd_cntr,
+					   tx_entry->context, err);
+			rxm_tx_entry_release(&tx_entry->conn->send_queue,
+					     tx_entry);
+		}
+	} else {
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to send atomic "
+			"responses: %s\n", fi_strerror(err));
+	}
+	rxm_tx_buf_release(rxm_ep, tx_buf);
+}
+
+/* Caller holds `util_ep::lock` */
+static ssize_t rxm_atomic_resp_send(struct rxm_ep *rxm_ep,
+				    struct rxm_conn *rxm_conn,
+				    struct rxm_tx_buf *tx_buf)
+{
+	size_t pkt_size = sizeof(struct rxm_pkt) + tx_buf->pkt.hdr.size;
+	ssize_t ret;
+
+	if (pkt_size <= rxm_ep->msg_info->tx_attr->inject_size) {
+		ret = fi_inject(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size, 0);
+		if (ret)
+			return ret;
+		dlist_remove(&tx_buf->hdr.entry);
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return 0;
+	}
+
+	ret = fi_send(rxm_conn->msg_ep, &tx_buf->pkt, pkt_size,
+		      tx_buf->hdr.desc, 0, tx_buf);
+	if (ret)
+		return ret;
+	dlist_remove(&tx_buf->hdr.entry);
+	return 0;
+}
+
+/* Sends the atomic responses batched by the last progress */
+void rxm_ep_progress_atomic_resps(struct rxm_ep *rxm_ep)
+{
+	struct rxm_conn *rxm_conn;
+	struct rxm_tx_buf *tx_buf;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	while (!dlist_empty(&rxm_ep->atomic_resp_conn_list)) {
+		rxm_conn = container_of(rxm_ep->atomic_resp_conn_list.next,
+					struct rxm_conn, atomic_resp_entry);
+		if ((rxm_conn->handle.state == CMAP_CONNECTED) ||
+		    (rxm_conn->handle.state == CMAP_CONNECTED_NOTIFY)) {
+			while (!dlist_empty(&rxm_conn->atomic_resp_list)) {
+				tx_buf = container_of(
+						rxm_conn->atomic_resp_list.next,
+						struct rxm_tx_buf, hdr.entry);
+				/* Retried on the next progress */
+				if (rxm_atomic_resp_send(rxm_ep, rxm_conn,
+							 tx_buf))
+					goto unlock;
+			}
+		}
+		dlist_remove_init(&rxm_conn->atomic_resp_entry);
+	}
+unlock:
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Drops the responses that haven't been sent over the connection and fails
+ * the fetching atomics that wait for one */
+void rxm_conn_purge_atomics(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	struct rxm_send_queue *send_queue = &rxm_conn->send_queue;
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_tx_buf *tx_buf;
+	struct dlist_entry resp_list;
+	size_t i;
+
+	dlist_init(&resp_list);
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&rxm_conn->atomic_resp_entry);
+	dlist_splice_tail(&resp_list, &rxm_conn->atomic_resp_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	while (!dlist_empty(&resp_list)) {
+		dlist_pop_front(&resp_list, struct rxm_tx_buf, tx_buf,
+				hdr.entry);
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+	}
+
+	for (i = 0; i < send_queue->fs->size; i++) {
+		tx_entry = &send_queue->fs->entry[i].buf;
+		if (!rxm_atomic_claim(rxm_ep, tx_entry, tx_entry->msg_id))
+			continue;
+		rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+				   rxm_ep->util_ep.rd_cntr,
+				   tx_entry->context, -FI_ECONNABORTED);
+		rxm_tx_entry_release(send_queue, tx_entry);
+	}
+}
@@ -32,7 +32,8 @@
 
 #include "rxm.h"
 
-#define RXM_EP_CAPS (FI_MSG | FI_RMA | FI_TAGGED | FI_DIRECTED_RECV |	\
+#define RXM_EP_CAPS (FI_MSG | FI_RMA | FI_TAGGED | FI_ATOMIC |		\
+		     FI_DIRECTED_RECV |					\
 		     FI_READ | FI_WRITE | FI_RECV | FI_SEND |		\
 		     FI_REMOTE_READ | FI_REMOTE_WRITE | FI_SOURCE)
 
@@ -37,6 +37,30 @@
 #include <ofi_util.h>
 #include "rxm.h"
 
+/* Releases the RX buffers that were still posted to a closed MSG EP, or to
+ * any MSG EP of the connection if `msg_ep` is NULL */
+static void rxm_conn_release_rx_bufs(struct rxm_ep *rxm_ep,
+				     struct rxm_conn *rxm_conn,
+				     struct fid_ep *msg_ep)
+{
+	struct rxm_rx_buf *rx_buf;
+	struct dlist_entry *tmp;
+
+	if (!rxm_ep_track_rx_bufs(rxm_ep))
+		return;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_foreach_container_safe(&rxm_conn->posted_rx_list,
+				     struct rxm_rx_buf, rx_buf,
+				     posted_entry, tmp) {
+		if (msg_ep && rx_buf->hdr.msg_ep != msg_ep)
+			continue;
+		dlist_remove_init(&rx_buf->posted_entry);
+		rxm_rx_buf_release(rxm_ep, rx_buf);
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
 static int rxm_msg_ep_open(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 			   struct rxm_conn *rxm_conn, void *context)
 {
@@ -81,16 +105,18 @@ static int rxm_msg_ep_open(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 		goto err;
 	}
 
+	/* Reposted buffers are checked against the current MSG EP */
+	rxm_conn->msg_ep = msg_ep;
 	if (!rxm_ep->srx_ctx) {
 		ret = rxm_ep_prepost_buf(rxm_ep, msg_ep);
 		if (ret)
 			goto err;
 	}
-
-	rxm_conn->msg_ep = msg_ep;
 	return 0;
 err:
+	rxm_conn->msg_ep = NULL;
 	fi_close(&msg_ep->fid);
+	rxm_conn_release_rx_bufs(rxm_ep, rxm_conn, msg_ep);
 	return ret;
 }
 
@@ -115,6 +141,20 @@ rxm_send_queue_init(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 	return 0;
 }
 
+static int rxm_send_queue_idle(struct rxm_send_queue *send_queue)
+{
+	size_t free_cnt = 0;
+	void *next;
+
+	send_queue->rxm_ep->res_fastlock_acquire(&send_queue->lock);
+	for (next = send_queue->fs->next; next != FREESTACK_EMPTY;
+	     next = *(void **)next)
+		free_cnt++;
+	send_queue->rxm_ep->res_fastlock_release(&send_queue->lock);
+
+	return free_cnt == send_queue->fs->size;
+}
+
 static void rxm_send_queue_close(struct rxm_send_queue *send_queue)
 {
 	if (send_queue->fs) {
@@ -133,9 +173,55 @@ static void rxm_send_queue_close(struct rxm_send_queue *send_queue)
 	fastlock_destroy(&send_queue->lock);
 }
 
+/* Caller must hold `cmap::lock` */
+static void rxm_conn_lru_add(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	if (!dlist_empty(&rxm_conn->lru_entry))
+		return;
+	dlist_insert_tail(&rxm_conn->lru_entry, &rxm_ep->conn_lru_list);
+	rxm_ep->conn_lru_cnt++;
+}
+
+/* Caller must hold `cmap::lock` */
+static void rxm_conn_lru_del(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	if (dlist_empty(&rxm_conn->lru_entry))
+		return;
+	dlist_remove_init(&rxm_conn->lru_entry);
+	rxm_ep->conn_lru_cnt--;
+}
+
+/* Caller must hold `cmap::lock` */
+static void rxm_conn_close_start(struct rxm_ep *rxm_ep,
+				 struct rxm_conn *rxm_conn, uint8_t flags)
+{
+	rxm_conn_lru_del(rxm_ep, rxm_conn);
+	rxm_conn->handle.state = CMAP_CLOSING;
+	rxm_conn->close_flags |= RXM_CONN_CLOSE_ACTIVE | flags;
+	rxm_ep->conn_closing_cnt++;
+}
+
+/* Caller must hold `cmap::lock`. Pending close responses are dropped unless
+ * they are part of `keep` */
+static void rxm_conn_close_stop(struct rxm_ep *rxm_ep,
+				struct rxm_conn *rxm_conn, uint8_t keep)
+{
+	if (rxm_conn->close_flags & RXM_CONN_CLOSE_ACTIVE)
+		rxm_ep->conn_closing_cnt--;
+	rxm_conn->close_flags &= (keep | RXM_CONN_CLOSE_PINNED);
+	if (!(rxm_conn->close_flags & RXM_CONN_CLOSE_RESP))
+		dlist_remove_init(&rxm_conn->close_entry);
+}
+
 static void rxm_conn_close(struct util_cmap_handle *handle)
 {
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+	struct rxm_ep *rxm_ep = container_of(handle->cmap->ep, struct rxm_ep,
+					     util_ep);
+
+	/* The peer reconnects to a handle that we were closing */
+	if (handle->state == CMAP_CLOSING)
+		rxm_conn_close_stop(rxm_ep, rxm_conn, 0);
 
 	if (!rxm_conn->msg_ep)
 		return;
@@ -145,33 +231,192 @@ static void rxm_conn_close(struct util_cmap_handle *handle)
 	rxm_conn->msg_ep = NULL;
 }
 
+/* Drops the pending SAR, rendezvous, bundling and atomic work of the
+ * connection before its MSG EP goes away. Receives that wait for the data
+ * of a write-based rendezvous, messages of a bundle that was never sent and
+ * fetching atomics that wait for their results are completed in error */
+static void rxm_conn_purge(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_tx_buf *bundle;
+	struct rxm_ctrl_retry *ctrl;
+	struct rxm_rx_buf *rx_buf;
+	struct dlist_entry rndv_list;
+	struct dlist_entry *tmp;
+
+	dlist_init(&rndv_list);
+	rxm_ep->res_fastlock_acquire(&rxm_conn->send_queue.lock);
+	bundle = rxm_conn->bundle;
+	rxm_conn->bundle = NULL;
+	rxm_ep->res_fastlock_release(&rxm_conn->send_queue.lock);
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&rxm_conn->bundle_entry);
+	dlist_remove_init(&rxm_conn->credit_entry);
+	dlist_foreach_container_safe(&rxm_ep->tx_stall_list,
+				     struct rxm_tx_entry, tx_entry,
+				     stall_entry, tmp) {
+		if (tx_entry->conn == rxm_conn)
+			dlist_remove_init(&tx_entry->stall_entry);
+	}
+	dlist_foreach_container_safe(&rxm_ep->ctrl_retry_list,
+				     struct rxm_ctrl_retry, ctrl,
+				     entry, tmp) {
+		if (ctrl->conn == rxm_conn) {
+			dlist_remove(&ctrl->entry);
+			free(ctrl);
+		}
+	}
+	dlist_splice_tail(&rndv_list, &rxm_conn->rndv_rx_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	while (!dlist_empty(&rndv_list)) {
+		dlist_pop_front(&rndv_list, struct rxm_rx_buf, rx_buf,
+				rndv_entry);
+		if (!rxm_ep->rxm_mr_local)
+			rxm_ep_msg_mr_closev(rx_buf->mr,
+					     rx_buf->recv_entry->rxm_iov.count);
+		rxm_cq_write_error(rxm_ep->util_ep.rx_cq,
+				   rxm_ep->util_ep.rx_cntr,
+				   rx_buf->recv_entry->context,
+				   -FI_ECONNABORTED);
+		rxm_recv_entry_release(rx_buf->recv_entry->recv_queue,
+				       rx_buf->recv_entry);
+		rxm_rx_buf_release(rxm_ep, rx_buf);
+	}
+
+	rxm_conn_purge_atomics(rxm_ep, rxm_conn);
+
+	if (!bundle)
+		return;
+	while (!dlist_empty(&bundle->bundle_list)) {
+		dlist_pop_front(&bundle->bundle_list, struct rxm_tx_entry,
+				tx_entry, deferred_entry);
+		rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+				   rxm_ep->util_ep.tx_cntr,
+				   tx_entry->context, -FI_ECONNABORTED);
+		rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+	}
+	rxm_tx_buf_release(rxm_ep, bundle);
+}
+
+/* Fails the transfers that were deferred until the connection came up and
+ * takes the connection off rxm_ep::conn_deferred_list */
+static void rxm_conn_purge_deferred(struct rxm_ep *rxm_ep,
+				    struct rxm_conn *rxm_conn)
+{
+	struct rxm_tx_entry *tx_entry;
+	struct dlist_entry deferred_list;
+
+	dlist_init(&deferred_list);
+	rxm_ep->util_ep.tx_cq->cq_fastlock_acquire(&rxm_ep->util_ep.tx_cq->cq_lock);
+	if (!dlist_empty(&rxm_conn->deferred_op_list))
+		dlist_remove(&rxm_conn->conn_deferred_entry);
+	dlist_splice_tail(&deferred_list, &rxm_conn->deferred_op_list);
+	rxm_ep->util_ep.tx_cq->cq_fastlock_release(&rxm_ep->util_ep.tx_cq->cq_lock);
+
+	while (!dlist_empty(&deferred_list)) {
+		dlist_pop_front(&deferred_list, struct rxm_tx_entry, tx_entry,
+				deferred_entry);
+		if (!(tx_entry->flags & FI_INJECT) ||
+		    (tx_entry->flags & FI_COMPLETION))
+			rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+					   rxm_ep->util_ep.tx_cntr,
+					   tx_entry->context, -FI_ECONNABORTED);
+		rxm_tx_buf_release(rxm_ep, tx_entry->tx_buf);
+		free(tx_entry);
+	}
+}
+
 static void rxm_conn_free(struct util_cmap_handle *handle)
 {
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+	struct rxm_ep *rxm_ep = container_of(handle->cmap->ep, struct rxm_ep,
+					     util_ep);
+
+	if (rxm_ep->conn_evict) {
+		fastlock_acquire(&handle->cmap->lock);
+		rxm_conn_lru_del(rxm_ep, rxm_conn);
+		rxm_conn_close_stop(rxm_ep, rxm_conn, 0);
+		dlist_remove_init(&rxm_conn->close_entry);
+		fastlock_release(&handle->cmap->lock);
+	}
+	rxm_conn_purge(rxm_ep, rxm_conn);
+	rxm_conn_purge_deferred(rxm_ep, rxm_conn);
 
 	/* This handles case when saved_msg_ep wasn't closed */
 	if (rxm_conn->saved_msg_ep) {
 		if (fi_close(&rxm_conn->saved_msg_ep->fid))
 			FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
 				"Unable to close saved msg_ep\n");
+		rxm_conn_release_rx_bufs(rxm_ep, rxm_conn,
+					 rxm_conn->saved_msg_ep);
 	}
 
-	if (!rxm_conn->msg_ep)
-		return;
-	/* Assuming fi_close also shuts down the connection gracefully if the
-	 * endpoint is in connected state */
-	if (fi_close(&rxm_conn->msg_ep->fid))
-		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to close msg_ep\n");
-	FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Closed msg_ep\n");
-	rxm_conn->msg_ep = NULL;
+	/* An evicted connection has no msg_ep, but still has to be freed */
+	if (rxm_conn->msg_ep) {
+		/* Assuming fi_close also shuts down the connection gracefully
+		 * if the endpoint is in connected state */
+		if (fi_close(&rxm_conn->msg_ep->fid))
+			FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+				"Unable to close msg_ep\n");
+		FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Closed msg_ep\n");
+		rxm_conn_release_rx_bufs(rxm_ep, rxm_conn, rxm_conn->msg_ep);
+		rxm_conn->msg_ep = NULL;
+	}
 	rxm_send_queue_close(&rxm_conn->send_queue);
 
 	free(container_of(handle, struct rxm_conn, handle));
 }
 
+/* Frees the connections deleted by the cmap thread. This runs from progress,
+ * which is serialized with the other MSG CQ reads: completions of a deleted
+ * connection point into its send queue and RX buffers, so the MSG CQ is read
+ * before its MSG EPs are closed, and again after, as the MSG provider may
+ * report more completions until the close */
+void rxm_conn_progress_free(struct rxm_ep *rxm_ep)
+{
+	struct rxm_conn *rxm_conn;
+	struct dlist_entry free_list;
+
+	dlist_init(&free_list);
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_splice_tail(&free_list, &rxm_ep->conn_free_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	if (dlist_empty(&free_list))
+		return;
+
+	rxm_ep_drain_msg_cq(rxm_ep);
+	dlist_foreach_container(&free_list, struct rxm_conn, rxm_conn,
+				free_entry) {
+		if (rxm_conn->saved_msg_ep) {
+			if (fi_close(&rxm_conn->saved_msg_ep->fid))
+				FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+					"Unable to close saved msg_ep\n");
+			rxm_conn->saved_msg_ep = NULL;
+		}
+		if (rxm_conn->msg_ep) {
+			if (fi_close(&rxm_conn->msg_ep->fid))
+				FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+					"Unable to close msg_ep\n");
+			rxm_conn->msg_ep = NULL;
+		}
+	}
+	rxm_ep_drain_msg_cq(rxm_ep);
+
+	while (!dlist_empty(&free_list)) {
+		dlist_pop_front(&free_list, struct rxm_conn, rxm_conn,
+				free_entry);
+		rxm_conn_release_rx_bufs(rxm_ep, rxm_conn, NULL);
+		rxm_conn_free(&rxm_conn->handle);
+	}
+}
+
 static void rxm_conn_connected_handler(struct util_cmap_handle *handle)
 {
 	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+	struct rxm_ep *rxm_ep = container_of(handle->cmap->ep, struct rxm_ep,
+					     util_ep);
 
 	if (!rxm_conn->saved_msg_ep)
 		return;
@@ -180,14 +425,236 @@ static void rxm_conn_connected_handler(struct util_cmap_handle *handle)
 	if (fi_close(&rxm_conn->saved_msg_ep->fid))
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to close saved msg_ep\n");
 	FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Closed saved msg_ep\n");
+	rxm_conn_release_rx_bufs(rxm_ep, rxm_conn, rxm_conn->saved_msg_ep);
 	rxm_conn->saved_msg_ep = NULL;
 }
 
+/* Caller must hold `cmap::lock` */
+static int rxm_conn_idle(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			 size_t rx_held)
+{
+	int idle;
+
+	if (!dlist_empty(&rxm_conn->deferred_op_list) || rxm_conn->bundle)
+		return 0;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	idle = (rxm_conn->rx_busy <= rx_held) &&
+	       dlist_empty(&rxm_conn->sar_rx_msg_list) &&
+	       dlist_empty(&rxm_conn->sar_rx_unexp_list) &&
+	       dlist_empty(&rxm_conn->rndv_rx_list) &&
+	       dlist_empty(&rxm_conn->atomic_resp_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	return idle && rxm_send_queue_idle(&rxm_conn->send_queue);
+}
+
+/* Caller must hold `cmap::lock` */
+static ssize_t rxm_conn_send_close_resp(struct rxm_conn *rxm_conn)
+{
+	uint64_t data;
+	ssize_t ret;
+
+	if (rxm_conn->close_flags & RXM_CONN_CLOSE_ACCEPT)
+		data = FI_SUCCESS;
+	else if (rxm_conn->close_flags & RXM_CONN_CLOSE_NOSYS)
+		data = FI_ENOSYS;
+	else
+		data = FI_EBUSY;
+
+	ret = rxm_conn_inject_ctrl(rxm_conn, ofi_ctrl_close_resp, 0, data);
+	if (!ret)
+		rxm_conn->close_flags &= ~RXM_CONN_CLOSE_RESP;
+	return ret;
+}
+
+/* Caller must hold `cmap::lock`. Both sides have agreed to close the idle
+ * connection: release the MSG EP with its RX buffers and keep the handle, so
+ * that the next transfer reconnects it */
+static void rxm_conn_close_finish(struct rxm_ep *rxm_ep,
+				  struct rxm_conn *rxm_conn)
+{
+	int ret;
+
+	rxm_conn_close_stop(rxm_ep, rxm_conn, 0);
+	rxm_conn_purge(rxm_ep, rxm_conn);
+
+	if (rxm_conn->saved_msg_ep) {
+		if (fi_close(&rxm_conn->saved_msg_ep->fid))
+			FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+				"Unable to close saved msg_ep\n");
+		rxm_conn_release_rx_bufs(rxm_ep, rxm_conn,
+					 rxm_conn->saved_msg_ep);
+		rxm_conn->saved_msg_ep = NULL;
+	}
+	if (rxm_conn->msg_ep) {
+		if (fi_close(&rxm_conn->msg_ep->fid))
+			FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+				"Unable to close msg_ep\n");
+		rxm_conn_release_rx_bufs(rxm_ep, rxm_conn, rxm_conn->msg_ep);
+		rxm_conn->msg_ep = NULL;
+	}
+
+	rxm_conn->handle.state = CMAP_IDLE;
+	rxm_conn->evicted = 1;
+	rxm_ep->conn_evictions++;
+	FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Evicted connection handle: %p "
+	       "(active: %zu)\n", &rxm_conn->handle, rxm_ep->conn_lru_cnt);
+
+	/* Ops were posted while closing, reconnect right away */
+	if (!dlist_empty(&rxm_conn->deferred_op_list) &&
+	    (rxm_conn->handle.fi_addr != FI_ADDR_NOTAVAIL)) {
+		ret = ofi_cmap_handle_connect(rxm_ep->util_ep.cmap,
+					      rxm_conn->handle.fi_addr,
+					      &rxm_conn->handle);
+		if (ret != -FI_EAGAIN)
+			FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
+				"Unable to reconnect evicted connection\n");
+	}
+}
+
+static struct rxm_conn *rxm_conn_from_rx_buf(struct rxm_rx_buf *rx_buf)
+{
+	if (rx_buf->conn)
+		return rx_buf->conn;
+	return rxm_key2conn(rx_buf->ep, rx_buf->pkt.ctrl_hdr.conn_id);
+}
+
+ssize_t rxm_conn_handle_close_req(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn = rxm_conn_from_rx_buf(rx_buf);
+
+	if (OFI_UNLIKELY(!rxm_conn))
+		return -FI_EOTHER;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	if (rxm_conn->handle.state == CMAP_CONNECTED_NOTIFY)
+		ofi_cmap_process_conn_notify(rxm_ep->util_ep.cmap,
+					     &rxm_conn->handle);
+
+	if (!rxm_ep->conn_evict) {
+		rxm_conn->close_flags |= RXM_CONN_CLOSE_NOSYS;
+	} else if (rxm_conn->handle.state == CMAP_CLOSING) {
+		/* Both sides picked the same connection. Refuse, so that
+		 * neither side closes it */
+		if (rxm_conn->close_flags & RXM_CONN_CLOSE_INITIATOR)
+			rxm_conn->close_flags |= RXM_CONN_CLOSE_REFUSE;
+	} else if ((rxm_conn->handle.state == CMAP_CONNECTED) &&
+		   rxm_conn_idle(rxm_ep, rxm_conn, 1)) {
+		rxm_conn_close_start(rxm_ep, rxm_conn, RXM_CONN_CLOSE_ACCEPT);
+	} else {
+		rxm_conn->close_flags |= RXM_CONN_CLOSE_REFUSE;
+	}
+
+	if ((rxm_conn->close_flags & RXM_CONN_CLOSE_RESP) &&
+	    rxm_conn_send_close_resp(rxm_conn) &&
+	    dlist_empty(&rxm_conn->close_entry))
+		dlist_insert_tail(&rxm_conn->close_entry,
+				  &rxm_ep->conn_close_list);
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return 0;
+}
+
+ssize_t rxm_conn_handle_close_resp(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn = rxm_conn_from_rx_buf(rx_buf);
+
+	if (OFI_UNLIKELY(!rxm_conn))
+		return -FI_EOTHER;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	if ((rxm_conn->handle.state != CMAP_CLOSING) ||
+	    !(rxm_conn->close_flags & RXM_CONN_CLOSE_INITIATOR)) {
+		FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Ignoring stale close "
+		       "response for handle: %p\n", &rxm_conn->handle);
+	} else if (rx_buf->pkt.ctrl_hdr.ctrl_data == FI_SUCCESS) {
+		rxm_conn_close_finish(rxm_ep, rxm_conn);
+	} else {
+		FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Peer refused to close "
+		       "handle: %p\n", &rxm_conn->handle);
+		rxm_conn_close_stop(rxm_ep, rxm_conn, RXM_CONN_CLOSE_RESP);
+		if (rx_buf->pkt.ctrl_hdr.ctrl_data == FI_ENOSYS)
+			rxm_conn->close_flags |= RXM_CONN_CLOSE_PINNED;
+		rxm_conn->handle.state = CMAP_CONNECTED;
+		rxm_conn->referenced = 1;
+		rxm_conn_lru_add(rxm_ep, rxm_conn);
+	}
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return 0;
+}
+
+/* Caller must hold `cmap::lock` */
+static void rxm_conn_evict_lru(struct rxm_ep *rxm_ep)
+{
+	struct rxm_conn *rxm_conn;
+	size_t scan = 2 * rxm_ep->conn_lru_cnt;
+
+	while ((rxm_ep->conn_lru_cnt > rxm_ep->max_conn) && scan--) {
+		rxm_conn = container_of(rxm_ep->conn_lru_list.next,
+					struct rxm_conn, lru_entry);
+		dlist_remove(&rxm_conn->lru_entry);
+		dlist_insert_tail(&rxm_conn->lru_entry, &rxm_ep->conn_lru_list);
+
+		if (rxm_conn->referenced) {
+			rxm_conn->referenced = 0;
+			continue;
+		}
+		if (rxm_conn->close_flags || !rxm_conn_idle(rxm_ep, rxm_conn, 0))
+			continue;
+
+		if (rxm_conn->handle.state == CMAP_CONNECTED_NOTIFY)
+			ofi_cmap_process_conn_notify(rxm_ep->util_ep.cmap,
+						     &rxm_conn->handle);
+		if (rxm_conn->handle.state != CMAP_CONNECTED)
+			continue;
+
+		if (rxm_conn_inject_ctrl(rxm_conn, ofi_ctrl_close_req, 0, 0))
+			break;
+		FI_DBG(&rxm_prov, FI_LOG_EP_CTRL, "Closing idle connection "
+		       "handle: %p\n", &rxm_conn->handle);
+		rxm_conn_close_start(rxm_ep, rxm_conn,
+				     RXM_CONN_CLOSE_INITIATOR);
+	}
+}
+
+void rxm_conn_progress_evict(struct rxm_ep *rxm_ep)
+{
+	struct rxm_conn *rxm_conn;
+	struct dlist_entry *tmp;
+
+	if (dlist_empty(&rxm_ep->conn_close_list) &&
+	    (rxm_ep->conn_lru_cnt <= rxm_ep->max_conn))
+		return;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	dlist_foreach_container_safe(&rxm_ep->conn_close_list,
+				     struct rxm_conn, rxm_conn,
+				     close_entry, tmp) {
+		if ((rxm_conn->close_flags & RXM_CONN_CLOSE_RESP) &&
+		    rxm_conn_send_close_resp(rxm_conn))
+			continue;
+
+		if ((rxm_conn->handle.state == CMAP_CLOSING) &&
+		    (rxm_conn->close_flags & RXM_CONN_CLOSE_DONE))
+			rxm_conn_close_finish(rxm_ep, rxm_conn);
+		else
+			dlist_remove_init(&rxm_conn->close_entry);
+	}
+	rxm_conn_evict_lru(rxm_ep);
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+}
+
 static int rxm_conn_reprocess_directed_recvs(struct rxm_recv_queue *recv_queue)
 {
 	struct rxm_rx_buf *rx_buf;
-	struct dlist_entry *entry, *tmp_entry;
-	struct rxm_recv_match_attr match_attr;
+	struct ofi_mq_entry *entry;
+	struct dlist_entry *tmp_entry;
 	struct dlist_entry rx_buf_list;
 	struct fi_cq_err_entry err_entry = {0};
 	int ret, count = 0;
@@ -196,27 +663,32 @@ static int rxm_conn_reprocess_directed_recvs(struct rxm_recv_queue *recv_queue)
 
 	recv_queue->rxm_ep->res_fastlock_acquire(&recv_queue->lock);
 
-	dlist_foreach_container_safe(&recv_queue->unexp_msg_list,
+	dlist_foreach_container_safe(&recv_queue->unexp_mq.list,
 				     struct rxm_rx_buf, rx_buf,
-				     unexp_msg.entry, tmp_entry) {
+				     unexp_msg.list_entry, tmp_entry) {
 		if (rx_buf->unexp_msg.addr == rx_buf->conn->handle.fi_addr)
 			continue;
 
 		assert(rx_buf->unexp_msg.addr == FI_ADDR_NOTAVAIL);
 
-		match_attr.addr = rx_buf->unexp_msg.addr =
-			rx_buf->conn->handle.fi_addr;
-		match_attr.tag = rx_buf->unexp_msg.tag;
+		ofi_mq_remove(&rx_buf->unexp_msg);
+		rx_buf->unexp_msg.addr = rx_buf->conn->handle.fi_addr;
 
-		entry = dlist_remove_first_match(&recv_queue->recv_list,
-						 recv_queue->match_recv,
-						 &match_attr);
-		if (!entry)
+		entry = ofi_mq_find_recv(&recv_queue->recv_mq,
+					 rx_buf->unexp_msg.addr,
+					 rx_buf->unexp_msg.tag);
+		if (!entry) {
+			/* Keeps its place, but moves to the sender's bucket */
+			ofi_mq_reinsert(&recv_queue->unexp_mq,
+					&rx_buf->unexp_msg);
 			continue;
+		}
 
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		ofi_mq_remove(entry);
 		rx_buf->recv_entry = container_of(entry, struct rxm_recv_entry,
-						  entry);
+						  match);
+		if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data)
+			rxm_sar_rx_start(rx_buf, rx_buf->recv_entry);
 		dlist_insert_tail(&rx_buf->unexp_msg.entry, &rx_buf_list);
 	}
 	recv_queue->rxm_ep->res_fastlock_release(&recv_queue->lock);
@@ -286,10 +758,34 @@ static struct util_cmap_handle *rxm_conn_alloc(struct util_cmap *cmap)
 		return NULL;
 	}
 	dlist_init(&rxm_conn->sar_rx_msg_list);
+	dlist_init(&rxm_conn->sar_rx_unexp_list);
+	dlist_init(&rxm_conn->rndv_rx_list);
 	dlist_init(&rxm_conn->deferred_op_list);
+	dlist_init(&rxm_conn->lru_entry);
+	dlist_init(&rxm_conn->close_entry);
+	dlist_init(&rxm_conn->posted_rx_list);
+	dlist_init(&rxm_conn->free_entry);
+	dlist_init(&rxm_conn->bundle_entry);
+	dlist_init(&rxm_conn->credit_entry);
+	dlist_init(&rxm_conn->atomic_resp_list);
+	dlist_init(&rxm_conn->atomic_resp_entry);
 	return &rxm_conn->handle;
 }
 
+/* Starts the eager flow control of a new connection, `limit` being the
+ * budget advertised by the peer */
+void rxm_conn_init_credits(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			   uint32_t limit)
+{
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	rxm_conn->eager_credit_limit = limit;
+	rxm_conn->eager_credits = limit;
+	rxm_conn->eager_rx_held = 0;
+	rxm_conn->eager_rx_pending = 0;
+	dlist_remove_init(&rxm_conn->credit_entry);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
 static inline int
 rxm_conn_verify_cm_data(struct rxm_cm_data *remote_cm_data,
 			struct rxm_cm_data *local_cm_data)
@@ -343,6 +839,7 @@ rxm_msg_process_connreq(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 			.op_version = RXM_OP_VERSION,
 			.endianness = ofi_detect_endianness(),
 			.eager_size = rxm_ep->rxm_info->tx_attr->inject_size,
+			.eager_credits = rxm_ep->eager_credits,
 		},
 	};
 	struct util_cmap_handle *handle;
@@ -365,6 +862,8 @@ rxm_msg_process_connreq(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 	rxm_conn = container_of(handle, struct rxm_conn, handle);
 
 	rxm_conn->handle.remote_key = remote_cm_data->conn_id;
+	rxm_conn_init_credits(rxm_ep, rxm_conn,
+			      ntohl(remote_cm_data->proto.eager_credits));
 
 	ret = rxm_msg_ep_open(rxm_ep, msg_info, rxm_conn, handle);
 	if (ret)
@@ -372,6 +871,7 @@ rxm_msg_process_connreq(struct rxm_ep *rxm_ep, struct fi_info *msg_info,
 
 	cm_data.conn_id = rxm_conn->handle.key;
 	cm_data.proto.eager_size = htonll(cm_data.proto.eager_size);
+	cm_data.proto.eager_credits = htonl(cm_data.proto.eager_credits);
 
 	ret = fi_accept(rxm_conn->msg_ep, &cm_data, sizeof(cm_data));
 	if (ret) {
@@ -391,12 +891,34 @@ err1:
 	return ret;
 }
 
+/* The MSG CQ may still hold completions of the connection, which are read
+ * from progress, so the handle is freed there. Once the endpoint is closing,
+ * nothing reads the MSG CQ any more and the handle is freed right away */
+static void rxm_conn_free_defer(struct util_cmap_handle *handle)
+{
+	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn, handle);
+	struct rxm_ep *rxm_ep = container_of(handle->cmap->ep, struct rxm_ep,
+					     util_ep);
+	int closing;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	closing = rxm_ep->closing;
+	if (!closing)
+		dlist_insert_tail(&rxm_conn->free_entry,
+				  &rxm_ep->conn_free_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	if (closing)
+		rxm_conn_free(handle);
+}
+
 static int rxm_conn_handle_notify(struct fi_eq_entry *eq_entry)
 {
 	switch((enum ofi_cmap_signal)eq_entry->data) {
 	case OFI_CMAP_FREE:
 		FI_DBG(&rxm_prov, FI_LOG_FABRIC, "Freeing handle\n");
-		rxm_conn_free((struct util_cmap_handle *)eq_entry->context);
+		rxm_conn_free_defer((struct util_cmap_handle *)
+				    eq_entry->context);
 		return 0;
 	case OFI_CMAP_EXIT:
 		FI_TRACE(&rxm_prov, FI_LOG_FABRIC, "Closing event handler\n");
@@ -431,6 +953,47 @@ static void rxm_conn_wake_up_wait_obj(struct rxm_ep *rxm_ep)
 		util_cntr_signal(rxm_ep->util_ep.tx_cntr);
 }
 
+/* Caller must hold `cmap::lock` */
+static void rxm_conn_handle_connected(struct rxm_ep *rxm_ep,
+				      struct util_cmap_handle *handle)
+{
+	struct rxm_conn *rxm_conn = container_of(handle, struct rxm_conn,
+						 handle);
+
+	if (rxm_conn->evicted) {
+		rxm_conn->evicted = 0;
+		rxm_ep->conn_reconnects++;
+	}
+	rxm_conn->referenced = 1;
+	rxm_conn_lru_add(rxm_ep, rxm_conn);
+}
+
+/* Returns 1 if the shutdown event was consumed by connection eviction */
+static int rxm_conn_handle_evict_shutdown(struct rxm_ep *rxm_ep,
+					  struct fid *msg_ep_fid)
+{
+	struct rxm_conn *rxm_conn = container_of(msg_ep_fid->context,
+						 struct rxm_conn, handle);
+	int ret = 1;
+
+	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+	if (!rxm_conn->msg_ep || (&rxm_conn->msg_ep->fid != msg_ep_fid)) {
+		/* The handle has been re-used for a new connection */
+		FI_DBG(&rxm_prov, FI_LOG_FABRIC,
+		       "Ignoring shutdown of a replaced msg_ep\n");
+	} else if (rxm_conn->handle.state == CMAP_CLOSING) {
+		/* Finish from the progress path, which owns the RX bufs */
+		rxm_conn->close_flags |= RXM_CONN_CLOSE_DONE;
+		if (dlist_empty(&rxm_conn->close_entry))
+			dlist_insert_tail(&rxm_conn->close_entry,
+					  &rxm_ep->conn_close_list);
+	} else {
+		ret = 0;
+	}
+	fastlock_release(&rxm_ep->util_ep.cmap->lock);
+	return ret;
+}
+
 static void *rxm_conn_event_handler(void *arg)
 {
 	struct fi_eq_cm_entry *entry;
@@ -477,16 +1040,29 @@ static void *rxm_conn_event_handler(void *arg)
 			       "Connection successful\n");
 			fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 			cm_data = (void *)entry->data;
+			/* The accepting side got the budget of the peer with
+			 * its connection request */
+			if (rd - sizeof(*entry))
+				rxm_conn_init_credits(rxm_ep,
+					container_of(entry->fid->context,
+						     struct rxm_conn, handle),
+					ntohl(cm_data->proto.eager_credits));
 			ofi_cmap_process_connect(rxm_ep->util_ep.cmap,
 						 entry->fid->context,
 						 ((rd - sizeof(*entry)) ?
 						  &cm_data->conn_id : NULL));
+			if (rxm_ep->conn_evict)
+				rxm_conn_handle_connected(rxm_ep,
+							  entry->fid->context);
 			rxm_conn_wake_up_wait_obj(rxm_ep);
 			fastlock_release(&rxm_ep->util_ep.cmap->lock);
 			break;
 		case FI_SHUTDOWN:
 			FI_DBG(&rxm_prov, FI_LOG_FABRIC,
 			       "Received connection shutdown\n");
+			if (rxm_ep->conn_evict &&
+			    rxm_conn_handle_evict_shutdown(rxm_ep, entry->fid))
+				break;
 			ofi_cmap_process_shutdown(rxm_ep->util_ep.cmap,
 						  entry->fid->context);
 			break;
@@ -547,6 +1123,7 @@ rxm_conn_connect(struct util_ep *util_ep, struct util_cmap_handle *handle,
 			.op_version = RXM_OP_VERSION,
 			.endianness = ofi_detect_endianness(),
 			.eager_size = rxm_ep->rxm_info->tx_attr->inject_size,
+			.eager_credits = rxm_ep->eager_credits,
 		},
 	};
 
@@ -574,6 +1151,7 @@ rxm_conn_connect(struct util_ep *util_ep, struct util_cmap_handle *handle,
 		goto err2;
 
 	cm_data.proto.eager_size = htonll(cm_data.proto.eager_size);
+	cm_data.proto.eager_credits = htonl(cm_data.proto.eager_credits);
 
 	ret = fi_connect(rxm_conn->msg_ep, msg_info->dest_addr, &cm_data, sizeof(cm_data));
 	if (ret) {
@@ -584,6 +1162,7 @@ rxm_conn_connect(struct util_ep *util_ep, struct util_cmap_handle *handle,
 	return 0;
 err2:
 	fi_close(&rxm_conn->msg_ep->fid);
+	rxm_conn_release_rx_bufs(rxm_ep, rxm_conn, rxm_conn->msg_ep);
 	rxm_conn->msg_ep = NULL;
 err1:
 	fi_freeinfo(msg_info);
@@ -616,8 +1195,9 @@ struct util_cmap *rxm_conn_cmap_alloc(struct rxm_ep *rxm_ep)
 	size_t len;
 	int ret;
 
+	/* ofi_cmap_alloc copies av->addrlen bytes of the name */
 	len = rxm_ep->msg_info->src_addrlen;
-	name = calloc(1, len);
+	name = calloc(1, MAX(len, rxm_ep->util_ep.av->addrlen));
 	if (!name) {
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL,
 			"Unable to allocate memory for EP name\n");
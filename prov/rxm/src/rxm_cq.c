@@ -39,15 +39,6 @@
 
 #include "rxm.h"
 
-static struct rxm_conn *rxm_key2conn(struct rxm_ep *rxm_ep, uint64_t key)
-{
-	struct util_cmap_handle *handle;
-	handle = ofi_cmap_key2handle(rxm_ep->util_ep.cmap, key);
-	if (!handle)
-		return NULL;
-	return container_of(handle, struct rxm_conn, handle);
-}
-
 static const char *rxm_cq_strerror(struct fid_cq *cq_fid, int prov_errno,
 		const void *err_data, char *buf, size_t len)
 {
@@ -225,33 +216,52 @@ static inline int rxm_finish_send(struct rxm_tx_entry *tx_entry)
 static inline int rxm_finish_sar_segment_send(struct rxm_tx_buf *tx_buf)
 {
 	struct rxm_tx_entry *tx_entry = tx_buf->tx_entry;
+	struct rxm_ep *rxm_ep = tx_entry->ep;
+	struct rxm_send_queue *send_queue = &tx_entry->conn->send_queue;
 
-	rxm_tx_buf_release(tx_entry->ep, tx_buf);
-	/* If `segs_left` == 0, all segments of the message have been fully sent */
-	if (!--tx_entry->segs_left) {
-		return rxm_finish_send_nobuf(tx_entry);
-	} else if (!dlist_empty(&tx_entry->deferred_tx_buf_list)) {
-		ssize_t ret = 0;
-
-		while (!dlist_empty(&tx_entry->deferred_tx_buf_list) && !ret) {
-			tx_buf = container_of(tx_entry->deferred_tx_buf_list.next,
-					      struct rxm_tx_buf, hdr.entry);
-			ret = fi_send(tx_entry->conn->msg_ep, &tx_buf->pkt,
-				      sizeof(tx_buf->pkt) + tx_buf->pkt.ctrl_hdr.seg_size,
-				      tx_buf->hdr.desc, 0, tx_buf);
-			if (!ret)
-				dlist_remove(&tx_buf->hdr.entry);
-		}
+	rxm_tx_buf_release(rxm_ep, tx_buf);
+
+	rxm_ep->res_fastlock_acquire(&send_queue->lock);
+	tx_entry->segs_inflight--;
+	if ((tx_entry->iov_offset < tx_entry->total_len) ||
+	    !dlist_empty(&tx_entry->deferred_tx_buf_list)) {
+		rxm_ep_sar_tx_progress(rxm_ep, tx_entry);
+		rxm_ep->res_fastlock_release(&send_queue->lock);
+		return FI_SUCCESS;
+	} else if (tx_entry->segs_inflight) {
+		rxm_ep->res_fastlock_release(&send_queue->lock);
+		return FI_SUCCESS;
 	}
-	/* This branch takes true, when it's impossible to allocate TX buffer */
-	if (OFI_UNLIKELY((tx_entry->msg_id == UINT64_MAX) &&
-			 dlist_empty(&tx_entry->deferred_tx_buf_list))) {
-		rxm_cq_write_error(tx_entry->ep->util_ep.tx_cq,
-				   tx_entry->ep->util_ep.tx_cntr,
-				   tx_entry->context, -FI_ENOMEM);
-		rxm_tx_entry_release(&tx_entry->conn->send_queue, tx_entry);
+	/* All segments of the message have been fully sent */
+	tx_entry->msg_id = UINT64_MAX;
+	rxm_ep->res_fastlock_release(&send_queue->lock);
+
+	/* The transfer may have been resumed by credits while parked */
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&tx_entry->stall_entry);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	return rxm_finish_send_nobuf(tx_entry);
+}
+
+/* Completes the messages packed into a bundle that has been sent */
+static int rxm_finish_bundle_send(struct rxm_ep *rxm_ep,
+				  struct rxm_tx_buf *tx_buf)
+{
+	struct rxm_tx_entry *tx_entry;
+	int ret = 0;
+
+	while (!dlist_empty(&tx_buf->bundle_list)) {
+		dlist_pop_front(&tx_buf->bundle_list, struct rxm_tx_entry,
+				tx_entry, deferred_entry);
+		if (OFI_UNLIKELY(rxm_finish_send_nobuf(tx_entry))) {
+			rxm_tx_entry_release(&tx_entry->conn->send_queue,
+					     tx_entry);
+			ret = -FI_EOTHER;
+		}
 	}
-	return FI_SUCCESS;
+	rxm_tx_buf_release(rxm_ep, tx_buf);
+	return ret;
 }
 
 static inline int rxm_finish_send_lmt_ack(struct rxm_rx_buf *rx_buf)
@@ -307,50 +317,131 @@ static int rxm_lmt_handle_ack(struct rxm_rx_buf *rx_buf)
 	}
 }
 
+/* Sends a header-only control message (SAR credits, end of a rendezvous
+ * write). Messages that can't be injected right away are retried from the
+ * progress */
+static void rxm_cq_send_ctrl(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+			     uint8_t type, uint64_t msg_id, uint64_t data)
+{
+	struct rxm_ctrl_retry *ctrl;
+
+	if (OFI_LIKELY(!rxm_conn_inject_ctrl(rxm_conn, type, msg_id, data)))
+		return;
+
+	ctrl = malloc(sizeof(*ctrl));
+	if (OFI_UNLIKELY(!ctrl)) {
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to send control message "
+			"for msg_id: 0x%" PRIx64 "\n", msg_id);
+		return;
+	}
+	ctrl->conn = rxm_conn;
+	ctrl->type = type;
+	ctrl->msg_id = msg_id;
+	ctrl->data = data;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_insert_tail(&ctrl->entry, &rxm_ep->ctrl_retry_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Returns the credits of a segment that isn't placed in a receive entry
+ * (buffered receives or dropped messages). The sender's window only
+ * depends on the segment numbers, so every batch is returned once */
+static void rxm_sar_credit_segment(struct rxm_rx_buf *rx_buf)
+{
+	if ((rxm_sar_get_seg_type(&rx_buf->pkt.ctrl_hdr) == RXM_SAR_SEG_LAST) ||
+	    ((rx_buf->pkt.ctrl_hdr.seg_no + 1) % RXM_SAR_CREDIT_BATCH))
+		return;
+
+	rxm_cq_send_ctrl(rx_buf->ep, rx_buf->conn, ofi_ctrl_seg_credit,
+			 rx_buf->pkt.ctrl_hdr.msg_id, RXM_SAR_CREDIT_BATCH);
+}
+
+static void rxm_sar_drop_segment(struct rxm_rx_buf *rx_buf)
+{
+	rxm_sar_credit_segment(rx_buf);
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+}
+
 static inline
 ssize_t rxm_cq_handle_seg_data(struct rxm_rx_buf *rx_buf)
 {
-	uint64_t done_len = ofi_copy_to_iov(rx_buf->recv_entry->rxm_iov.iov,
-					    rx_buf->recv_entry->rxm_iov.count,
-					    rxm_sar_get_offset(&rx_buf->pkt.ctrl_hdr),
-					    rx_buf->pkt.data,
-					    rx_buf->pkt.ctrl_hdr.seg_size);
-	rx_buf->recv_entry->total_recv_len += done_len;
-	rx_buf->recv_entry->segs_rcvd++;
-	/* Check that this isn't last segment */
-	if (((rxm_sar_get_seg_type(&rx_buf->pkt.ctrl_hdr) != RXM_SAR_SEG_LAST) &&
-	     (!rx_buf->recv_entry->last_seg_no ||
-	      (rx_buf->recv_entry->last_seg_no != rx_buf->pkt.ctrl_hdr.seg_no))) &&
-	/* and message isn't truncated */
-	    (done_len == rx_buf->pkt.ctrl_hdr.seg_size)) {
-		if (rx_buf->recv_entry->msg_id == UINT64_MAX) {
-			rx_buf->conn = rxm_key2conn(rx_buf->ep,
-						    rx_buf->pkt.ctrl_hdr.conn_id);
-			rx_buf->recv_entry->msg_id = rx_buf->pkt.ctrl_hdr.msg_id;
-			dlist_insert_tail(&rx_buf->recv_entry->sar_entry,
-					  &rx_buf->conn->sar_rx_msg_list);
-		}
+	struct rxm_recv_entry *recv_entry = rx_buf->recv_entry;
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn = NULL;
+	uint64_t msg_id = 0, credits = 0;
+	uint64_t done_len;
+	int done;
+
+	done_len = ofi_copy_to_iov(recv_entry->rxm_iov.iov,
+				   recv_entry->rxm_iov.count,
+				   rxm_sar_get_offset(&rx_buf->pkt.ctrl_hdr),
+				   rx_buf->pkt.data,
+				   rx_buf->pkt.ctrl_hdr.seg_size);
+
+	/* Segments of an unexpected message may be placed by the thread that
+	 * posted the receive while the progress places the new ones */
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	recv_entry->total_recv_len += done_len;
+	recv_entry->sar_recv_len += rx_buf->pkt.ctrl_hdr.seg_size;
+	done = (recv_entry->sar_recv_len == rx_buf->pkt.hdr.size);
+	if (done) {
+		dlist_remove(&recv_entry->sar_entry);
+	} else if ((++recv_entry->credits_pending >= RXM_SAR_CREDIT_BATCH) &&
+		   (recv_entry->segs_credited < recv_entry->segs_total)) {
+		credits = MIN(recv_entry->credits_pending,
+			      recv_entry->segs_total - recv_entry->segs_credited);
+		recv_entry->segs_credited += credits;
+		recv_entry->credits_pending = 0;
+		rxm_conn = recv_entry->sar_conn;
+		msg_id = recv_entry->msg_id;
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	if (credits)
+		rxm_cq_send_ctrl(rxm_ep, rxm_conn, ofi_ctrl_seg_credit,
+				 msg_id, credits);
+
+	if (!done) {
 		/* The RX buffer can be reposted for further re-use */
 		rx_buf->recv_entry = NULL;
 		rxm_enqueue_rx_buf_for_repost_check(rx_buf);
 		return FI_SUCCESS;
-	} else if ((rxm_sar_get_seg_type(&rx_buf->pkt.ctrl_hdr) == RXM_SAR_SEG_LAST) &&
-		   (rx_buf->recv_entry->segs_rcvd != (rx_buf->pkt.ctrl_hdr.seg_no + 1))) {
-		/* Handle case when the segment with the `RXM_SAR_SEG_LAST` flag
-		 * is received, but not all segments were received yet. We should
-		 * wait untill all segments will be received. */
-		rx_buf->recv_entry->last_seg_no = rx_buf->pkt.ctrl_hdr.seg_no;
-	}
-	dlist_remove(&rx_buf->recv_entry->sar_entry);
+	}
+
 	/* Mark rxm_recv_entry::msg_id as unknown for futher re-use */
-	rx_buf->recv_entry->msg_id = UINT64_MAX;
-	done_len = rx_buf->recv_entry->total_recv_len;
-	rx_buf->recv_entry->total_recv_len = 0;
-	rx_buf->recv_entry->segs_rcvd = 0;
-	rx_buf->recv_entry->last_seg_no = 0;
+	recv_entry->msg_id = UINT64_MAX;
+	done_len = recv_entry->total_recv_len;
+	recv_entry->total_recv_len = 0;
+	recv_entry->sar_recv_len = 0;
 	return rxm_finish_recv(rx_buf, done_len);
 }
 
+/* Places the first segment of a SAR message and the ones that were received
+ * before the message was matched */
+static ssize_t rxm_cq_handle_sar_msg(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_recv_entry *recv_entry = rx_buf->recv_entry;
+	struct dlist_entry seg_list;
+	ssize_t ret;
+
+	/* The first segment may be reposted before the others are placed */
+	dlist_init(&seg_list);
+	dlist_splice_tail(&seg_list, &rx_buf->sar_seg_list);
+
+	ret = rxm_cq_handle_seg_data(rx_buf);
+	while (!dlist_empty(&seg_list)) {
+		dlist_pop_front(&seg_list, struct rxm_rx_buf, rx_buf, sar_entry);
+		if (OFI_UNLIKELY(ret)) {
+			rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+			continue;
+		}
+		rx_buf->recv_entry = recv_entry;
+		ret = rxm_cq_handle_seg_data(rx_buf);
+	}
+	return ret;
+}
+
 static inline
 ssize_t rxm_cq_handle_large_data(struct rxm_rx_buf *rx_buf)
 {
@@ -423,6 +514,109 @@ ssize_t rxm_cq_handle_large_data(struct rxm_rx_buf *rx_buf)
 	return ret;
 }
 
+/* Sends the CTS of a write-based rendezvous, which describes the first
+ * `len` bytes of the receive buffer */
+static ssize_t rxm_rndv_send_cts(struct rxm_rx_buf *rx_buf,
+				 struct rxm_conn *rxm_conn, size_t len,
+				 struct fid_mr **mr)
+{
+	struct rxm_tx_buf *tx_buf;
+	struct rxm_rma_iov *rma_iov;
+	struct iovec *iov;
+	size_t i;
+	uint8_t count = 0;
+	ssize_t ret;
+
+	tx_buf = rxm_tx_buf_get(rx_buf->ep, RXM_BUF_POOL_TX_CTS);
+	if (OFI_UNLIKELY(!tx_buf)) {
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "TX queue full!\n");
+		return -FI_EAGAIN;
+	}
+	assert(tx_buf->pkt.ctrl_hdr.type == ofi_ctrl_write_cts);
+
+	tx_buf->pkt.ctrl_hdr.conn_id = rxm_conn->handle.remote_key;
+	tx_buf->pkt.ctrl_hdr.msg_id = rx_buf->pkt.ctrl_hdr.msg_id;
+	tx_buf->pkt.hdr.size = len;
+
+	rma_iov = (struct rxm_rma_iov *)tx_buf->pkt.data;
+	for (i = 0; len; i++) {
+		iov = &rx_buf->recv_entry->rxm_iov.iov[i];
+		if (!iov->iov_len)
+			continue;
+		rma_iov->iov[count].addr =
+			RXM_MR_VIRT_ADDR(rx_buf->ep->msg_info) ?
+			(uintptr_t)iov->iov_base : 0;
+		rma_iov->iov[count].len = MIN(iov->iov_len, len);
+		rma_iov->iov[count].key = fi_mr_key(mr[i]);
+		len -= rma_iov->iov[count++].len;
+	}
+	rma_iov->count = count;
+
+	ret = fi_send(rxm_conn->msg_ep, &tx_buf->pkt, sizeof(tx_buf->pkt) +
+		      sizeof(*rma_iov) + sizeof(*rma_iov->iov) * count,
+		      tx_buf->hdr.desc, 0, tx_buf);
+	if (OFI_UNLIKELY(ret)) {
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to send CTS\n");
+		rxm_tx_buf_release(rx_buf->ep, tx_buf);
+	}
+	return ret;
+}
+
+/* Answers the request of a write-based rendezvous with the receive buffer.
+ * The RX buffer is kept on rxm_conn::rndv_rx_list until the sender reports
+ * the end of the transfer */
+static ssize_t rxm_cq_handle_write_req(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_recv_entry *recv_entry = rx_buf->recv_entry;
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct fid_mr **mr;
+	ssize_t ret;
+
+	if (!rx_buf->conn) {
+		assert(rxm_ep->srx_ctx);
+		rx_buf->conn = rxm_key2conn(rxm_ep,
+					    rx_buf->pkt.ctrl_hdr.conn_id);
+		if (OFI_UNLIKELY(!rx_buf->conn))
+			return -FI_EOTHER;
+	}
+
+	FI_DBG(&rxm_prov, FI_LOG_CQ,
+	       "Got rendezvous write request with msg_id: 0x%" PRIx64 "\n",
+	       rx_buf->pkt.ctrl_hdr.msg_id);
+
+	if (!rxm_ep->rxm_mr_local) {
+		ret = rxm_ep_msg_mr_regv(rxm_ep, recv_entry->rxm_iov.iov,
+					 recv_entry->rxm_iov.count,
+					 FI_REMOTE_WRITE, rx_buf->mr);
+		if (OFI_UNLIKELY(ret))
+			return ret;
+		mr = rx_buf->mr;
+	} else {
+		/* desc is msg fid_mr * array */
+		mr = (struct fid_mr **)recv_entry->rxm_iov.desc;
+	}
+
+	RXM_LOG_STATE_RX(FI_LOG_CQ, rx_buf, RXM_RNDV_DONE_WAIT);
+	rx_buf->hdr.state = RXM_RNDV_DONE_WAIT;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_insert_tail(&rx_buf->rndv_entry, &rx_buf->conn->rndv_rx_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	ret = rxm_rndv_send_cts(rx_buf, rx_buf->conn,
+				MIN(rx_buf->pkt.hdr.size, recv_entry->total_len),
+				mr);
+	if (OFI_UNLIKELY(ret)) {
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		dlist_remove_init(&rx_buf->rndv_entry);
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		if (!rxm_ep->rxm_mr_local)
+			rxm_ep_msg_mr_closev(rx_buf->mr,
+					     recv_entry->rxm_iov.count);
+	}
+	return ret;
+}
+
 static inline
 ssize_t rxm_cq_handle_data(struct rxm_rx_buf *rx_buf)
 {
@@ -441,7 +635,9 @@ ssize_t rxm_cq_handle_rx_buf(struct rxm_rx_buf *rx_buf)
 	case ofi_ctrl_large_data:
 		return rxm_cq_handle_large_data(rx_buf);
 	case ofi_ctrl_seg_data:
-		return rxm_cq_handle_seg_data(rx_buf);
+		return rxm_cq_handle_sar_msg(rx_buf);
+	case ofi_ctrl_write_req:
+		return rxm_cq_handle_write_req(rx_buf);
 	default:
 		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unknown message type\n");
 		assert(0);
@@ -449,18 +645,45 @@ ssize_t rxm_cq_handle_rx_buf(struct rxm_rx_buf *rx_buf)
 	}
 }
 
+/* An RX buffer is held by RxM, post a new one to the MSG EP in its place */
+static ssize_t rxm_cq_replace_rx_buf(struct rxm_ep *rxm_ep,
+				     struct rxm_conn *rxm_conn,
+				     struct fid_ep *msg_ep)
+{
+	struct rxm_rx_buf *rx_buf;
+
+	rx_buf = rxm_rx_buf_get(rxm_ep);
+	if (!rx_buf)
+		return -FI_ENOMEM;
+
+	rx_buf->hdr.state = RXM_RX;
+	rx_buf->hdr.msg_ep = msg_ep;
+	rx_buf->conn = rxm_conn;
+	rx_buf->repost = 1;
+
+	if (rxm_ep_track_rx_bufs(rxm_ep)) {
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		rxm_conn->rx_busy++;
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	}
+
+	rxm_enqueue_rx_buf_for_repost(rx_buf);
+	return 0;
+}
+
 static inline ssize_t
 rxm_cq_match_rx_buf(struct rxm_rx_buf *rx_buf,
 		    struct rxm_recv_queue *recv_queue,
 		    struct rxm_recv_match_attr *match_attr)
 {
-	struct dlist_entry *entry;
+	struct ofi_mq_entry *entry;
 	struct rxm_ep *rxm_ep;
+	struct rxm_conn *rxm_conn;
 	struct fid_ep *msg_ep;
 
 	rx_buf->ep->res_fastlock_acquire(&recv_queue->lock);
-	entry = dlist_remove_first_match(&recv_queue->recv_list,
-					 recv_queue->match_recv, match_attr);
+	entry = ofi_mq_find_recv(&recv_queue->recv_mq, match_attr->addr,
+				 match_attr->tag);
 	if (!entry) {
 		RXM_DBG_ADDR_TAG(FI_LOG_CQ, "No matching recv found for "
 				 "incoming msg", match_attr->addr,
@@ -469,29 +692,35 @@ rxm_cq_match_rx_buf(struct rxm_rx_buf *rx_buf,
 		       "queue\n");
 		rx_buf->unexp_msg.addr = match_attr->addr;
 		rx_buf->unexp_msg.tag = match_attr->tag;
+		rx_buf->unexp_msg.ignore = 0;
 		rx_buf->repost = 0;
 
 		msg_ep = rx_buf->hdr.msg_ep;
+		rxm_conn = rx_buf->conn;
 		rxm_ep = rx_buf->ep;
 
-		dlist_insert_tail(&rx_buf->unexp_msg.entry,
-				  &recv_queue->unexp_msg_list);
+		/* The following segments of the message are kept with the
+		 * first one until a receive is matched */
+		if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data) {
+			rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+			dlist_insert_tail(&rx_buf->sar_entry,
+					  &rxm_conn->sar_rx_unexp_list);
+			rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		}
+		ofi_mq_insert(&recv_queue->unexp_mq, &rx_buf->unexp_msg);
 		rx_buf->ep->res_fastlock_release(&recv_queue->lock);
 
-		rx_buf = rxm_rx_buf_get(rxm_ep);
-		if (!rx_buf)
-			return -FI_ENOMEM;
-
-		rx_buf->hdr.state = RXM_RX;
-		rx_buf->hdr.msg_ep = msg_ep;
-		rx_buf->repost = 1;
-
-		rxm_enqueue_rx_buf_for_repost(rx_buf);
-		return 0;
+		/* Messages unpacked from a bundle don't hold a posted buffer */
+		if (!msg_ep)
+			return 0;
+		return rxm_cq_replace_rx_buf(rxm_ep, rxm_conn, msg_ep);
 	}
+	ofi_mq_remove(entry);
+	rx_buf->recv_entry = container_of(entry, struct rxm_recv_entry, match);
+	if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data)
+		rxm_sar_rx_start(rx_buf, rx_buf->recv_entry);
 	rx_buf->ep->res_fastlock_release(&recv_queue->lock);
 
-	rx_buf->recv_entry = container_of(entry, struct rxm_recv_entry, entry);
 	return rxm_cq_handle_rx_buf(rx_buf);
 }
 
@@ -530,6 +759,112 @@ static inline ssize_t rxm_handle_recv_comp(struct rxm_rx_buf *rx_buf)
 	}
 }
 
+/* Eager flow control: adds the credits that the peer returned with the
+ * message and charges an eager message against the peer's budget */
+static void rxm_cq_handle_eager_credits(struct rxm_ep *rxm_ep,
+					struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_conn *rxm_conn;
+	uint64_t credits;
+	int charge = 0;
+
+	rx_buf->eager_credit = 0;
+	switch (rx_buf->pkt.ctrl_hdr.type) {
+	case ofi_ctrl_data:
+		charge = (rxm_ep->eager_credits != 0);
+		/* fall through */
+	case ofi_ctrl_bundle:
+	case ofi_ctrl_ack:
+		credits = rx_buf->pkt.ctrl_hdr.seg_no;
+		break;
+	case ofi_ctrl_credit:
+		credits = rx_buf->pkt.ctrl_hdr.ctrl_data;
+		break;
+	default:
+		return;
+	}
+	if (!credits && !charge)
+		return;
+
+	rxm_conn = rx_buf->conn ? rx_buf->conn :
+		   rxm_key2conn(rxm_ep, rx_buf->pkt.ctrl_hdr.conn_id);
+	if (OFI_UNLIKELY(!rxm_conn))
+		return;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	if (credits && rxm_conn->eager_credit_limit)
+		rxm_conn->eager_credits =
+			MIN(rxm_conn->eager_credits + credits,
+			    rxm_conn->eager_credit_limit);
+	if (charge) {
+		rx_buf->conn = rxm_conn;
+		rx_buf->eager_credit = 1;
+		rxm_conn->eager_rx_held++;
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Unpacks the messages of a bundle into RX buffers of their own, which are
+ * then matched and completed as if they had been received separately */
+static ssize_t rxm_cq_handle_bundle(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_rx_buf *msg_buf;
+	struct ofi_op_hdr *hdr;
+	size_t offset = 0;
+	ssize_t ret = 0;
+
+	if (rxm_ep->eager_credits && !rx_buf->conn) {
+		rx_buf->conn = rxm_key2conn(rxm_ep,
+					    rx_buf->pkt.ctrl_hdr.conn_id);
+		if (OFI_UNLIKELY(!rx_buf->conn)) {
+			rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+			return -FI_EOTHER;
+		}
+	}
+
+	while (offset < rx_buf->pkt.hdr.size) {
+		hdr = (struct ofi_op_hdr *)(rx_buf->pkt.data + offset);
+		if (OFI_UNLIKELY(offset + sizeof(*hdr) + hdr->size >
+				 rx_buf->pkt.hdr.size)) {
+			FI_WARN(&rxm_prov, FI_LOG_CQ, "Malformed bundle\n");
+			ret = -FI_EIO;
+			break;
+		}
+
+		msg_buf = rxm_rx_buf_get(rxm_ep);
+		if (OFI_UNLIKELY(!msg_buf)) {
+			ret = -FI_ENOMEM;
+			break;
+		}
+		msg_buf->hdr.state = RXM_RX;
+		msg_buf->hdr.msg_ep = NULL;
+		msg_buf->conn = rx_buf->conn;
+		msg_buf->repost = 0;
+		msg_buf->pkt.ctrl_hdr = rx_buf->pkt.ctrl_hdr;
+		msg_buf->pkt.ctrl_hdr.type = ofi_ctrl_data;
+		msg_buf->pkt.hdr = *hdr;
+		memcpy(msg_buf->pkt.data, hdr + 1, hdr->size);
+
+		msg_buf->eager_credit = (rxm_ep->eager_credits != 0);
+		if (rxm_ep_track_rx_bufs(rxm_ep) || msg_buf->eager_credit) {
+			rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+			if (rxm_ep_track_rx_bufs(rxm_ep))
+				rx_buf->conn->rx_busy++;
+			if (msg_buf->eager_credit)
+				rx_buf->conn->eager_rx_held++;
+			rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		}
+
+		ret = rxm_handle_recv_comp(msg_buf);
+		if (OFI_UNLIKELY(ret))
+			break;
+		offset += sizeof(*hdr) + fi_get_aligned_sz(hdr->size, 8);
+	}
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return ret;
+}
+
 static int rxm_sar_match_msg_id(struct dlist_entry *item, const void *arg)
 {
 	uint64_t msg_id = *((uint64_t *)arg);
@@ -538,10 +873,22 @@ static int rxm_sar_match_msg_id(struct dlist_entry *item, const void *arg)
 	return (msg_id == recv_entry->msg_id);
 }
 
+static int rxm_sar_match_unexp_msg_id(struct dlist_entry *item, const void *arg)
+{
+	uint64_t msg_id = *((uint64_t *)arg);
+	struct rxm_rx_buf *rx_buf =
+		container_of(item, struct rxm_rx_buf, sar_entry);
+	return (msg_id == rx_buf->pkt.ctrl_hdr.msg_id);
+}
+
 static inline
 ssize_t rxm_sar_handle_segment(struct rxm_rx_buf *rx_buf)
 {
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn;
+	struct fid_ep *msg_ep;
 	struct dlist_entry *sar_entry;
+	struct rxm_rx_buf *first_buf;
 
 	rx_buf->conn = rxm_key2conn(rx_buf->ep,
 				    rx_buf->pkt.ctrl_hdr.conn_id);
@@ -550,20 +897,230 @@ ssize_t rxm_sar_handle_segment(struct rxm_rx_buf *rx_buf)
 	FI_DBG(&rxm_prov, FI_LOG_CQ,
 	       "Got incoming recv with msg_id: 0x%" PRIx64 "for conn - %p\n",
 	       rx_buf->pkt.ctrl_hdr.msg_id, rx_buf->conn);
+
+	if (rxm_ep->rxm_info->mode & FI_BUFFERED_RECV) {
+		rxm_sar_credit_segment(rx_buf);
+		return rxm_handle_recv_comp(rx_buf);
+	}
+	if (rxm_sar_get_seg_type(&rx_buf->pkt.ctrl_hdr) == RXM_SAR_SEG_FIRST)
+		return rxm_handle_recv_comp(rx_buf);
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
 	sar_entry = dlist_find_first_match(&rx_buf->conn->sar_rx_msg_list,
 					   rxm_sar_match_msg_id,
 					   &rx_buf->pkt.ctrl_hdr.msg_id);
-	if (!sar_entry)
-		return rxm_handle_recv_comp(rx_buf);
-	rx_buf->recv_entry =
-		container_of(sar_entry, struct rxm_recv_entry, sar_entry);
-	return rxm_cq_handle_seg_data(rx_buf);
+	if (sar_entry) {
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		rx_buf->recv_entry =
+			container_of(sar_entry, struct rxm_recv_entry, sar_entry);
+		return rxm_cq_handle_seg_data(rx_buf);
+	}
+
+	sar_entry = dlist_find_first_match(&rx_buf->conn->sar_rx_unexp_list,
+					   rxm_sar_match_unexp_msg_id,
+					   &rx_buf->pkt.ctrl_hdr.msg_id);
+	if (sar_entry) {
+		first_buf = container_of(sar_entry, struct rxm_rx_buf, sar_entry);
+		rx_buf->repost = 0;
+		dlist_insert_tail(&rx_buf->sar_entry, &first_buf->sar_seg_list);
+		rxm_conn = rx_buf->conn;
+		msg_ep = rx_buf->hdr.msg_ep;
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		return rxm_cq_replace_rx_buf(rxm_ep, rxm_conn, msg_ep);
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	/* The message was discarded */
+	FI_DBG(&rxm_prov, FI_LOG_CQ, "Dropping segment of msg_id: 0x%"
+	       PRIx64 "\n", rx_buf->pkt.ctrl_hdr.msg_id);
+	rxm_sar_drop_segment(rx_buf);
+	return 0;
+}
+
+/* Drops the segments of an unexpected SAR message that is discarded */
+void rxm_cq_sar_discard(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct dlist_entry seg_list;
+
+	dlist_init(&seg_list);
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&rx_buf->sar_entry);
+	dlist_splice_tail(&seg_list, &rx_buf->sar_seg_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	rxm_sar_credit_segment(rx_buf);
+	while (!dlist_empty(&seg_list)) {
+		dlist_pop_front(&seg_list, struct rxm_rx_buf, rx_buf, sar_entry);
+		rxm_sar_drop_segment(rx_buf);
+	}
+}
+
+/* Lets the sender of a discarded rendezvous message complete it without
+ * transferring any data */
+void rxm_cq_rndv_discard(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_conn *rxm_conn = rxm_key2conn(rx_buf->ep,
+						 rx_buf->pkt.ctrl_hdr.conn_id);
+
+	if (OFI_UNLIKELY(!rxm_conn ||
+			 rxm_rndv_send_cts(rx_buf, rxm_conn, 0, NULL)))
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to discard rendezvous "
+			"msg_id: 0x%" PRIx64 "\n", rx_buf->pkt.ctrl_hdr.msg_id);
+}
+
+static ssize_t rxm_sar_handle_credit(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn = rxm_key2conn(rxm_ep,
+						 rx_buf->pkt.ctrl_hdr.conn_id);
+	uint64_t msg_id = rx_buf->pkt.ctrl_hdr.msg_id;
+	struct rxm_send_queue *send_queue;
+	struct rxm_tx_entry *tx_entry;
+	size_t index = msg_id & UINT32_MAX;
+
+	FI_DBG(&rxm_prov, FI_LOG_CQ, "Got %" PRIu64 " SAR credits for msg_id: "
+	       "0x%" PRIx64 "\n", rx_buf->pkt.ctrl_hdr.ctrl_data, msg_id);
+
+	if (OFI_UNLIKELY(!rxm_conn))
+		goto out;
+	send_queue = &rxm_conn->send_queue;
+	if (OFI_UNLIKELY(index >= send_queue->fs->size))
+		goto out;
+	tx_entry = &send_queue->fs->entry[index].buf;
+
+	/* Credits of a message that was completed are ignored */
+	rxm_ep->res_fastlock_acquire(&send_queue->lock);
+	if ((tx_entry->state == RXM_SAR_TX) && (tx_entry->msg_id == msg_id)) {
+		tx_entry->credits += rx_buf->pkt.ctrl_hdr.ctrl_data;
+		rxm_ep_sar_tx_progress(rxm_ep, tx_entry);
+	}
+	rxm_ep->res_fastlock_release(&send_queue->lock);
+out:
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return 0;
+}
+
+static int rxm_rndv_write_finish(struct rxm_tx_entry *tx_entry)
+{
+	struct rxm_ep *rxm_ep = tx_entry->ep;
+
+	rxm_cq_send_ctrl(rxm_ep, tx_entry->conn, ofi_ctrl_write_done,
+			 tx_entry->msg_id, tx_entry->rndv_len);
+
+	/* The transfer may have been resumed while parked */
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&tx_entry->stall_entry);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	if (!rxm_ep->rxm_mr_local)
+		rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
+	rxm_enqueue_rx_buf_for_repost_check(tx_entry->rx_buf);
+	return rxm_finish_send_nobuf(tx_entry);
+}
+
+static ssize_t rxm_rndv_handle_cts(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn = rxm_key2conn(rxm_ep,
+						 rx_buf->pkt.ctrl_hdr.conn_id);
+	uint64_t msg_id = rx_buf->pkt.ctrl_hdr.msg_id;
+	struct rxm_send_queue *send_queue;
+	struct rxm_tx_entry *tx_entry;
+	size_t index = msg_id & UINT32_MAX;
+	int done;
+
+	FI_DBG(&rxm_prov, FI_LOG_CQ, "Got CTS of %" PRIu64 " bytes for "
+	       "msg_id: 0x%" PRIx64 "\n", rx_buf->pkt.hdr.size, msg_id);
+
+	if (OFI_UNLIKELY(!rxm_conn))
+		goto out;
+	send_queue = &rxm_conn->send_queue;
+	if (OFI_UNLIKELY(index >= send_queue->fs->size))
+		goto out;
+	tx_entry = &send_queue->fs->entry[index].buf;
+
+	rxm_ep->res_fastlock_acquire(&send_queue->lock);
+	if (OFI_UNLIKELY((tx_entry->state != RXM_RNDV_CTS_WAIT) ||
+			 (tx_entry->msg_id != msg_id))) {
+		rxm_ep->res_fastlock_release(&send_queue->lock);
+		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unexpected CTS for msg_id: "
+			"0x%" PRIx64 "\n", msg_id);
+		goto out;
+	}
+	tx_entry->rx_buf = rx_buf;
+	tx_entry->rndv_len = rx_buf->pkt.hdr.size;
+	tx_entry->state = RXM_RNDV_WRITE;
+	rxm_ep_rndv_write_progress(rxm_ep, tx_entry);
+	done = !tx_entry->rndv_writes &&
+	       (tx_entry->rndv_offset == tx_entry->rndv_len);
+	rxm_ep->res_fastlock_release(&send_queue->lock);
+
+	return done ? rxm_rndv_write_finish(tx_entry) : 0;
+out:
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	return 0;
+}
+
+static int rxm_rndv_write_comp(struct rxm_tx_entry *tx_entry)
+{
+	struct rxm_send_queue *send_queue = &tx_entry->conn->send_queue;
+	struct rxm_ep *rxm_ep = tx_entry->ep;
+
+	rxm_ep->res_fastlock_acquire(&send_queue->lock);
+	tx_entry->rndv_writes--;
+	if (tx_entry->rndv_offset < tx_entry->rndv_len) {
+		rxm_ep_rndv_write_progress(rxm_ep, tx_entry);
+		rxm_ep->res_fastlock_release(&send_queue->lock);
+		return 0;
+	} else if (tx_entry->rndv_writes) {
+		rxm_ep->res_fastlock_release(&send_queue->lock);
+		return 0;
+	}
+	rxm_ep->res_fastlock_release(&send_queue->lock);
+
+	return rxm_rndv_write_finish(tx_entry);
+}
+
+static ssize_t rxm_rndv_handle_write_done(struct rxm_rx_buf *rx_buf)
+{
+	struct rxm_ep *rxm_ep = rx_buf->ep;
+	struct rxm_conn *rxm_conn = rxm_key2conn(rxm_ep,
+						 rx_buf->pkt.ctrl_hdr.conn_id);
+	uint64_t msg_id = rx_buf->pkt.ctrl_hdr.msg_id;
+	struct rxm_rx_buf *rndv_buf = NULL;
+	struct dlist_entry *entry;
+
+	rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+	if (OFI_UNLIKELY(!rxm_conn))
+		return 0;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_foreach(&rxm_conn->rndv_rx_list, entry) {
+		rndv_buf = container_of(entry, struct rxm_rx_buf, rndv_entry);
+		if (rndv_buf->pkt.ctrl_hdr.msg_id == msg_id) {
+			dlist_remove_init(&rndv_buf->rndv_entry);
+			break;
+		}
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+	/* Discarded messages have no receive to complete */
+	if (entry == &rxm_conn->rndv_rx_list)
+		return 0;
+
+	if (!rxm_ep->rxm_mr_local)
+		rxm_ep_msg_mr_closev(rndv_buf->mr,
+				     rndv_buf->recv_entry->rxm_iov.count);
+	return rxm_finish_recv(rndv_buf, MIN(rndv_buf->pkt.hdr.size,
+					     rndv_buf->recv_entry->total_len));
 }
 
 static ssize_t rxm_lmt_send_ack(struct rxm_rx_buf *rx_buf)
 {
 	struct rxm_tx_entry *tx_entry;
 	struct rxm_tx_buf *tx_buf;
+	uint32_t returned;
 	ssize_t ret;
 
 	assert(rx_buf->conn);
@@ -590,11 +1147,14 @@ static ssize_t rxm_lmt_send_ack(struct rxm_rx_buf *rx_buf)
 
 	tx_buf->pkt.ctrl_hdr.conn_id 	= rx_buf->conn->handle.remote_key;
 	tx_buf->pkt.ctrl_hdr.msg_id 	= rx_buf->pkt.ctrl_hdr.msg_id;
+	(void) rxm_conn_credit_tx(rx_buf->ep, rx_buf->conn, 0, &returned);
+	tx_buf->pkt.ctrl_hdr.seg_no	= returned;
 
 	ret = fi_send(rx_buf->conn->msg_ep, &tx_buf->pkt, sizeof(tx_buf->pkt),
 		      tx_buf->hdr.desc, 0, tx_entry);
 	if (OFI_UNLIKELY(ret)) {
 		FI_WARN(&rxm_prov, FI_LOG_CQ, "Unable to send ACK\n");
+		rxm_conn_credit_tx_undo(rx_buf->ep, rx_buf->conn, 0, returned);
 		goto err2;
 	}
 	return 0;
@@ -608,16 +1168,19 @@ err1:
 static ssize_t rxm_lmt_send_ack_fast(struct rxm_rx_buf *rx_buf)
 {
 	struct rxm_pkt pkt;
+	uint32_t returned;
 	ssize_t ret;
 
 	assert(rx_buf->conn);
 
 	RXM_LOG_STATE(FI_LOG_CQ, rx_buf->pkt, RXM_LMT_READ, RXM_LMT_ACK_SENT);
 
+	(void) rxm_conn_credit_tx(rx_buf->ep, rx_buf->conn, 0, &returned);
 	pkt.hdr.op		= ofi_op_msg;
 	pkt.hdr.version		= OFI_OP_VERSION;
 	pkt.ctrl_hdr.version	= RXM_CTRL_VERSION;
 	pkt.ctrl_hdr.type	= ofi_ctrl_ack;
+	pkt.ctrl_hdr.seg_no	= returned;
 	pkt.ctrl_hdr.conn_id 	= rx_buf->conn->handle.remote_key;
 	pkt.ctrl_hdr.msg_id 	= rx_buf->pkt.ctrl_hdr.msg_id;
 
@@ -625,6 +1188,7 @@ static ssize_t rxm_lmt_send_ack_fast(struct rxm_rx_buf *rx_buf)
 	if (OFI_UNLIKELY(ret)) {
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
 		       "fi_inject(ack pkt) for MSG provider failed\n");
+		rxm_conn_credit_tx_undo(rx_buf->ep, rx_buf->conn, 0, returned);
 		return ret;
 	}
 
@@ -645,8 +1209,10 @@ static int rxm_handle_remote_write(struct rxm_ep *rxm_ep,
 		return ret;
 	}
 	rxm_cntr_inc(rxm_ep->util_ep.rem_wr_cntr);
-	if (comp->op_context)
+	if (comp->op_context) {
+		rxm_rx_buf_unpost(comp->op_context);
 		rxm_enqueue_rx_buf_for_repost_check(comp->op_context);
+	}
 	return 0;
 }
 
@@ -674,6 +1240,14 @@ static ssize_t rxm_cq_handle_comp(struct rxm_ep *rxm_ep,
 	case RXM_SAR_TX:
 		assert(comp->flags & FI_SEND);
 		return rxm_finish_sar_segment_send(tx_buf);
+	case RXM_BUNDLE_TX:
+		assert(comp->flags & FI_SEND);
+		return rxm_finish_bundle_send(rxm_ep, tx_buf);
+	case RXM_ATOMIC_TX:
+	case RXM_ATOMIC_RESP_TX:
+		assert(comp->flags & FI_SEND);
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return 0;
 	case RXM_TX_RMA:
 		assert(comp->flags & (FI_WRITE | FI_READ));
 		if (tx_entry->ep->msg_mr_local && !tx_entry->ep->rxm_mr_local)
@@ -684,15 +1258,37 @@ static ssize_t rxm_cq_handle_comp(struct rxm_ep *rxm_ep,
 		assert(!(comp->flags & FI_REMOTE_READ));
 		assert((rx_buf->pkt.hdr.version == OFI_OP_VERSION) &&
 		       (rx_buf->pkt.ctrl_hdr.version == RXM_CTRL_VERSION));
+		rxm_rx_buf_unpost(rx_buf);
+		rxm_cq_handle_eager_credits(rxm_ep, rx_buf);
 
 		switch (rx_buf->pkt.ctrl_hdr.type) {
 		case ofi_ctrl_data:
 		case ofi_ctrl_large_data:
+		case ofi_ctrl_write_req:
 			return rxm_handle_recv_comp(rx_buf);
 		case ofi_ctrl_ack:
 			return rxm_lmt_handle_ack(rx_buf);
 		case ofi_ctrl_seg_data:
 			return rxm_sar_handle_segment(rx_buf);
+		case ofi_ctrl_seg_credit:
+			return rxm_sar_handle_credit(rx_buf);
+		case ofi_ctrl_write_cts:
+			return rxm_rndv_handle_cts(rx_buf);
+		case ofi_ctrl_write_done:
+			return rxm_rndv_handle_write_done(rx_buf);
+		case ofi_ctrl_bundle:
+			return rxm_cq_handle_bundle(rx_buf);
+		case ofi_ctrl_atomic:
+			return rxm_atomic_handle_req(rx_buf);
+		case ofi_ctrl_atomic_resp:
+			return rxm_atomic_handle_resp(rx_buf);
+		case ofi_ctrl_credit:
+			rxm_enqueue_rx_buf_for_repost_check(rx_buf);
+			return 0;
+		case ofi_ctrl_close_req:
+			return rxm_conn_handle_close_req(rx_buf);
+		case ofi_ctrl_close_resp:
+			return rxm_conn_handle_close_resp(rx_buf);
 		default:
 			FI_WARN(&rxm_prov, FI_LOG_CQ, "Unknown message type\n");
 			assert(0);
@@ -714,6 +1310,13 @@ static ssize_t rxm_cq_handle_comp(struct rxm_ep *rxm_ep,
 			return rxm_lmt_send_ack(rx_buf);
 		else
 			return rxm_lmt_send_ack_fast(rx_buf);
+	case RXM_RNDV_WRITE:
+		assert(comp->flags & FI_WRITE);
+		return rxm_rndv_write_comp(tx_entry);
+	case RXM_RNDV_CTS:
+		assert(comp->flags & FI_SEND);
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return 0;
 	case RXM_LMT_ACK_SENT:
 		assert(comp->flags & FI_SEND);
 		rx_buf = tx_entry->context;
@@ -808,6 +1411,7 @@ static void rxm_cq_read_write_error(struct rxm_ep *rxm_ep)
 		/* fall through */
 	case RXM_TX:
 	case RXM_LMT_TX:
+	case RXM_RNDV_WRITE:
 		util_cq = tx_entry->ep->util_ep.tx_cq;
 		if (tx_entry->ep->util_ep.flags & OFI_CNTR_ENABLED) {
 			if (tx_entry->comp_flags & FI_SEND)
@@ -822,6 +1426,28 @@ static void rxm_cq_read_write_error(struct rxm_ep *rxm_ep)
 		util_cq = tx_entry->ep->util_ep.rx_cq;
 		util_cntr = tx_entry->ep->util_ep.rx_cntr;
 		break;
+	case RXM_RNDV_CTS:
+		util_cq = rxm_ep->util_ep.rx_cq;
+		util_cntr = rxm_ep->util_ep.rx_cntr;
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		break;
+	case RXM_BUNDLE_TX:
+		while (!dlist_empty(&tx_buf->bundle_list)) {
+			dlist_pop_front(&tx_buf->bundle_list,
+					struct rxm_tx_entry, tx_entry,
+					deferred_entry);
+			rxm_cq_write_error(rxm_ep->util_ep.tx_cq,
+					   rxm_ep->util_ep.tx_cntr,
+					   tx_entry->context, err_entry.err);
+			rxm_tx_entry_release(&tx_entry->conn->send_queue,
+					     tx_entry);
+		}
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		return;
+	case RXM_ATOMIC_TX:
+	case RXM_ATOMIC_RESP_TX:
+		rxm_atomic_tx_error(rxm_ep, tx_buf, err_entry.err);
+		return;
 	case RXM_RX:
 	case RXM_LMT_READ:
 		util_cq = rx_buf->ep->util_ep.rx_cq;
@@ -844,20 +1470,79 @@ static void rxm_cq_read_write_error(struct rxm_ep *rxm_ep)
 	}
 }
 
-static inline int rxm_ep_repost_buf(struct rxm_rx_buf *rx_buf)
+/* Returns whether the RX buffer is to be posted back to its MSG EP, or
+ * releases it. With RX buffer tracking, caller must hold
+ * `rxm_ep::util_ep::lock` */
+static inline int rxm_ep_repost_buf_prepare(struct rxm_rx_buf *rx_buf)
 {
+	/* Unpacked from a bundle, it was never posted to a MSG EP */
+	if (OFI_UNLIKELY(!rx_buf->hdr.msg_ep)) {
+		rxm_rx_buf_release(rx_buf->ep, rx_buf);
+		return 0;
+	}
+
 	if (rx_buf->ep->srx_ctx)
 		rx_buf->conn = NULL;
 	rx_buf->hdr.state = RXM_RX;
 
-	if (fi_recv(rx_buf->hdr.msg_ep, &rx_buf->pkt, rx_buf->ep->eager_pkt_size,
-		    rx_buf->hdr.desc, FI_ADDR_UNSPEC, rx_buf)) {
+	if (rxm_ep_track_rx_bufs(rx_buf->ep)) {
+		/* The MSG EP was closed (or replaced) by eviction */
+		if (OFI_UNLIKELY(rx_buf->hdr.msg_ep != rx_buf->conn->msg_ep)) {
+			rxm_rx_buf_release(rx_buf->ep, rx_buf);
+			return 0;
+		}
+		dlist_insert_tail(&rx_buf->posted_entry,
+				  &rx_buf->conn->posted_rx_list);
+	}
+	return 1;
+}
+
+/* FI_MORE tells the MSG provider that more receives follow for the same
+ * MSG EP, so that it may post them as one batch. With RX buffer tracking,
+ * caller must hold `rxm_ep::util_ep::lock` */
+static inline int rxm_ep_post_buf(struct rxm_rx_buf *rx_buf, uint64_t flags)
+{
+	struct iovec iov = {
+		.iov_base = &rx_buf->pkt,
+		.iov_len = rx_buf->ep->eager_pkt_size,
+	};
+	struct fi_msg msg = {
+		.msg_iov = &iov,
+		.desc = &rx_buf->hdr.desc,
+		.iov_count = 1,
+		.addr = FI_ADDR_UNSPEC,
+		.context = rx_buf,
+		.data = 0,
+	};
+
+	if (fi_recvmsg(rx_buf->hdr.msg_ep, &msg, flags)) {
 		FI_WARN(&rxm_prov, FI_LOG_EP_CTRL, "Unable to repost buf\n");
+		if (rxm_ep_track_rx_bufs(rx_buf->ep))
+			dlist_remove_init(&rx_buf->posted_entry);
 		return -FI_EAVAIL;
 	}
 	return FI_SUCCESS;
 }
 
+/* Posts the RX buffers of the list, in batches of consecutive buffers of
+ * the same MSG EP. With RX buffer tracking, caller must hold
+ * `rxm_ep::util_ep::lock` */
+static void rxm_ep_post_buf_list(struct dlist_entry *post_list)
+{
+	struct rxm_rx_buf *rx_buf, *next;
+
+	while (!dlist_empty(post_list)) {
+		dlist_pop_front(post_list, struct rxm_rx_buf, rx_buf,
+				repost_entry);
+		next = dlist_empty(post_list) ? NULL :
+		       container_of(post_list->next, struct rxm_rx_buf,
+				    repost_entry);
+		(void) rxm_ep_post_buf(rx_buf, (next && next->hdr.msg_ep ==
+						rx_buf->hdr.msg_ep) ?
+				       FI_MORE : 0);
+	}
+}
+
 int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep)
 {
 	struct rxm_rx_buf *rx_buf;
@@ -877,7 +1562,12 @@ int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep)
 			rx_buf->conn = container_of(msg_ep->fid.context,
 						    struct rxm_conn,
 						    handle);
-		ret = rxm_ep_repost_buf(rx_buf);
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		ret = rxm_ep_repost_buf_prepare(rx_buf) ?
+		      rxm_ep_post_buf(rx_buf, (i + 1 <
+					       rxm_ep->msg_info->rx_attr->size) ?
+				      FI_MORE : 0) : 0;
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
 		if (ret) {
 			rxm_rx_buf_release(rxm_ep, rx_buf);
 			return ret;
@@ -886,33 +1576,57 @@ int rxm_ep_prepost_buf(struct rxm_ep *rxm_ep, struct fid_ep *msg_ep)
 	return 0;
 }
 
+/* Posts back the RX buffers released since the last progress, all at once */
 static inline void rxm_cq_repost_rx_buffers(struct rxm_ep *rxm_ep)
 {
 	struct rxm_rx_buf *buf;
+	struct dlist_entry post_list;
+
 	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	if (dlist_empty(&rxm_ep->repost_ready_list)) {
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		return;
+	}
+
+	dlist_init(&post_list);
 	while (!dlist_empty(&rxm_ep->repost_ready_list)) {
 		dlist_pop_front(&rxm_ep->repost_ready_list, struct rxm_rx_buf,
 				buf, repost_entry);
-		(void) rxm_ep_repost_buf(buf);
+		if (rxm_ep_track_rx_bufs(rxm_ep))
+			buf->conn->rx_busy--;
+		if (buf->eager_credit)
+			rxm_rx_buf_return_credit(rxm_ep, buf);
+		if (rxm_ep_repost_buf_prepare(buf))
+			dlist_insert_tail(&buf->repost_entry, &post_list);
 	}
+	rxm_ep_post_buf_list(&post_list);
 	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
 }
 
-static inline ssize_t rxm_ep_read_msg_cq(struct rxm_ep *rxm_ep)
-{	
-	struct fi_cq_data_entry comp;
-	ssize_t ret;
+/* Reads up to `count` MSG CQ completions with a single call and handles
+ * them. The contexts of the whole batch are prefetched first */
+static inline ssize_t rxm_ep_read_msg_cq(struct rxm_ep *rxm_ep, size_t count)
+{
+	struct fi_cq_data_entry comp[RXM_MSG_CQ_BATCH];
+	ssize_t ret, err, i;
 
-	ret = fi_cq_read(rxm_ep->msg_cq, &comp, 1);
+	ret = fi_cq_read(rxm_ep->msg_cq, comp, MIN(count, RXM_MSG_CQ_BATCH));
 	if (ret > 0) {
-		// TODO handle errors internally and make this function return void.
-		// We don't have enough info to write a good error entry to the CQ at
-		// this point
-		ret = rxm_cq_handle_comp(rxm_ep, &comp);
-		if (OFI_UNLIKELY(ret)) {
-			rxm_cq_write_error_all(rxm_ep, ret);
-		} else {
-			return 1;
+		for (i = 0; i < ret; i++) {
+			if (comp[i].flags & FI_REMOTE_WRITE)
+				continue;
+			rxm_prefetch(comp[i].op_context);
+			if (comp[i].flags & FI_RECV)
+				rxm_prefetch(&((struct rxm_rx_buf *)
+					       comp[i].op_context)->pkt);
+		}
+		for (i = 0; i < ret; i++) {
+			// TODO handle errors internally and make this function
+			// return void. We don't have enough info to write a
+			// good error entry to the CQ at this point
+			err = rxm_cq_handle_comp(rxm_ep, &comp[i]);
+			if (OFI_UNLIKELY(err))
+				rxm_cq_write_error_all(rxm_ep, (int)err);
 		}
 	} else if (ret < 0) {
 		if (ret != -FI_EAGAIN) {
@@ -925,17 +1639,85 @@ static inline ssize_t rxm_ep_read_msg_cq(struct rxm_ep *rxm_ep)
 	return ret;
 }
 
+/* Retries the control messages that couldn't be injected and resumes the
+ * SAR and rendezvous write transfers that ran out of resources */
+static void rxm_ep_progress_stalled(struct rxm_ep *rxm_ep)
+{
+	struct rxm_send_queue *send_queue;
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_ctrl_retry *ctrl;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	while (!dlist_empty(&rxm_ep->ctrl_retry_list)) {
+		ctrl = container_of(rxm_ep->ctrl_retry_list.next,
+				    struct rxm_ctrl_retry, entry);
+		if (rxm_conn_inject_ctrl(ctrl->conn, ctrl->type,
+					 ctrl->msg_id, ctrl->data))
+			break;
+		dlist_remove(&ctrl->entry);
+		free(ctrl);
+	}
+
+	while (!dlist_empty(&rxm_ep->tx_stall_list)) {
+		tx_entry = container_of(rxm_ep->tx_stall_list.next,
+					struct rxm_tx_entry, stall_entry);
+		dlist_remove_init(&tx_entry->stall_entry);
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+		send_queue = &tx_entry->conn->send_queue;
+		rxm_ep->res_fastlock_acquire(&send_queue->lock);
+		if (tx_entry->state == RXM_SAR_TX)
+			rxm_ep_sar_tx_progress(rxm_ep, tx_entry);
+		else
+			rxm_ep_rndv_write_progress(rxm_ep, tx_entry);
+		rxm_ep->res_fastlock_release(&send_queue->lock);
+
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		/* Still out of resources, retry on the next progress */
+		if (!dlist_empty(&tx_entry->stall_entry))
+			break;
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
 void rxm_ep_progress_one(struct util_ep *util_ep)
 {
 	struct rxm_ep *rxm_ep =
 		container_of(util_ep, struct rxm_ep, util_ep);
 
-	rxm_cq_repost_rx_buffers(rxm_ep);
-
-	(void) rxm_ep_read_msg_cq(rxm_ep);
+	(void) rxm_ep_read_msg_cq(rxm_ep, rxm_ep->comp_per_progress);
 
 	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_deferred_list)))
 		rxm_ep_progress_deferred_list(rxm_ep);
+
+	rxm_cq_repost_rx_buffers(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->bundle_conn_list)))
+		rxm_ep_progress_bundles(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->credit_update_list)))
+		rxm_ep_progress_credits(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->atomic_resp_conn_list)))
+		rxm_ep_progress_atomic_resps(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->tx_stall_list) ||
+			 !dlist_empty(&rxm_ep->ctrl_retry_list)))
+		rxm_ep_progress_stalled(rxm_ep);
+
+	if (OFI_UNLIKELY(rxm_ep->conn_evict ||
+			 !dlist_empty(&rxm_ep->conn_close_list)))
+		rxm_conn_progress_evict(rxm_ep);
+}
+
+/* Reads the MSG CQ until it is empty */
+void rxm_ep_drain_msg_cq(struct rxm_ep *rxm_ep)
+{
+	ssize_t ret;
+
+	do {
+		ret = rxm_ep_read_msg_cq(rxm_ep, RXM_MSG_CQ_BATCH);
+	} while (ret > 0 || ret == -FI_EAVAIL);
 }
 
 void rxm_ep_progress_multi(struct util_ep *util_ep)
@@ -945,14 +1727,59 @@ void rxm_ep_progress_multi(struct util_ep *util_ep)
 	ssize_t ret;
 	size_t comp_read = 0;
 
-	rxm_cq_repost_rx_buffers(rxm_ep);
-
 	do {
-		ret = rxm_ep_read_msg_cq(rxm_ep);
+		ret = rxm_ep_read_msg_cq(rxm_ep, rxm_ep->comp_per_progress -
+					 comp_read);
 
 		if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_deferred_list)))
 			rxm_ep_progress_deferred_list(rxm_ep);
-	} while ((++comp_read < rxm_ep->comp_per_progress) && (ret > 0));
+	} while ((ret > 0) &&
+		 ((comp_read += ret) < rxm_ep->comp_per_progress));
+
+	/* The RX buffers released by this pass go back in one go */
+	rxm_cq_repost_rx_buffers(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->bundle_conn_list)))
+		rxm_ep_progress_bundles(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->credit_update_list)))
+		rxm_ep_progress_credits(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->atomic_resp_conn_list)))
+		rxm_ep_progress_atomic_resps(rxm_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->tx_stall_list) ||
+			 !dlist_empty(&rxm_ep->ctrl_retry_list)))
+		rxm_ep_progress_stalled(rxm_ep);
+
+	if (OFI_UNLIKELY(rxm_ep->conn_evict ||
+			 !dlist_empty(&rxm_ep->conn_close_list)))
+		rxm_conn_progress_evict(rxm_ep);
+}
+
+/* CQ-driven progress. Connections deleted by the cmap thread are only
+ * freed here, never from the inline progress of a data transfer call
+ * that may still hold a pointer to the connection. */
+void rxm_ep_cq_progress_one(struct util_ep *util_ep)
+{
+	struct rxm_ep *rxm_ep =
+		container_of(util_ep, struct rxm_ep, util_ep);
+
+	rxm_ep_progress_one(util_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_free_list)))
+		rxm_conn_progress_free(rxm_ep);
+}
+
+void rxm_ep_cq_progress_multi(struct util_ep *util_ep)
+{
+	struct rxm_ep *rxm_ep =
+		container_of(util_ep, struct rxm_ep, util_ep);
+
+	rxm_ep_progress_multi(util_ep);
+
+	if (OFI_UNLIKELY(!dlist_empty(&rxm_ep->conn_free_list)))
+		rxm_conn_progress_free(rxm_ep);
 }
 
 static int rxm_cq_close(struct fid *fid)
@@ -34,6 +34,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <pthread.h>
+#include <uthash.h>
+
 #include <ofi_util.h>
 #include "rxm.h"
 
@@ -76,9 +79,402 @@ static struct fi_ops_domain rxm_domain_ops = {
 	.poll_open = fi_poll_create,
 	.stx_ctx = fi_no_stx_context,
 	.srx_ctx = fi_no_srx_context,
-	.query_atomic = fi_no_query_atomic,
+	.query_atomic = rxm_query_atomic,
+};
+
+/* Memory monitor of the MR cache: the free and realloc hooks report the
+ * buffers that go away, so that their registrations are dropped. Buffers
+ * are tracked by start address, each one with the subscriptions of all
+ * the registrations that begin there */
+struct rxm_mem_ptr_entry {
+	void			*addr;
+	struct dlist_entry	sub_list;
+	UT_hash_handle		hh;
+};
+
+struct rxm_mem_sub {
+	struct dlist_entry	entry;
+	/* Entry in rxm_mem_notifier::event_list once the buffer is gone */
+	struct dlist_entry	event_entry;
+	struct ofi_subscription	*subscription;
+};
+
+struct rxm_mem_notifier {
+	struct rxm_mem_ptr_entry	*mem_ptrs_hash;
+	struct dlist_entry		event_list;
+	ofi_mem_free_hook		prev_free_hook;
+	ofi_mem_realloc_hook		prev_realloc_hook;
+	int				ref_cnt;
+	pthread_mutex_t			lock;
 };
 
+/* One for the whole provider, as the hooks are process wide */
+static struct rxm_mem_notifier *rxm_mem_notifier = NULL;
+
+#ifdef HAVE_GLIBC_MALLOC_HOOKS
+
+static void rxm_mem_notifier_free_hook(void *ptr, const void *caller);
+static void *rxm_mem_notifier_realloc_hook(void *ptr, size_t size,
+					   const void *caller);
+
+#define RXM_MEMORY_HOOK_BEGIN(notifier)				\
+{								\
+	pthread_mutex_lock(&notifier->lock);			\
+	ofi_set_mem_free_hook(notifier->prev_free_hook);	\
+	ofi_set_mem_realloc_hook(notifier->prev_realloc_hook);	\
+
+#define RXM_MEMORY_HOOK_END(notifier)				\
+	ofi_set_mem_realloc_hook(rxm_mem_notifier_realloc_hook);\
+	ofi_set_mem_free_hook(rxm_mem_notifier_free_hook);	\
+	pthread_mutex_unlock(&notifier->lock);			\
+}
+
+/* Caller holds rxm_mem_notifier::lock */
+static void rxm_mem_notifier_report(void *ptr)
+{
+	struct rxm_mem_ptr_entry *entry;
+	struct rxm_mem_sub *sub;
+
+	HASH_FIND(hh, rxm_mem_notifier->mem_ptrs_hash, &ptr, sizeof(void *),
+		  entry);
+	if (!entry)
+		return;
+	FI_DBG(&rxm_prov, FI_LOG_MR, "Catch free of %p\n", ptr);
+
+	dlist_foreach_container(&entry->sub_list, struct rxm_mem_sub, sub,
+				entry) {
+		if (dlist_empty(&sub->event_entry))
+			dlist_insert_tail(&sub->event_entry,
+					  &rxm_mem_notifier->event_list);
+	}
+}
+
+static void rxm_mem_notifier_free_hook(void *ptr, const void *caller)
+{
+	OFI_UNUSED(caller);
+
+	RXM_MEMORY_HOOK_BEGIN(rxm_mem_notifier)
+	free(ptr);
+	if (ptr)
+		rxm_mem_notifier_report(ptr);
+	RXM_MEMORY_HOOK_END(rxm_mem_notifier)
+}
+
+static void *rxm_mem_notifier_realloc_hook(void *ptr, size_t size,
+					   const void *caller)
+{
+	void *ret_ptr;
+	OFI_UNUSED(caller);
+
+	RXM_MEMORY_HOOK_BEGIN(rxm_mem_notifier)
+	ret_ptr = realloc(ptr, size);
+	if (ptr)
+		rxm_mem_notifier_report(ptr);
+	RXM_MEMORY_HOOK_END(rxm_mem_notifier)
+	return ret_ptr;
+}
+
+#else /* !HAVE_GLIBC_MALLOC_HOOKS */
+
+#define RXM_MEMORY_HOOK_BEGIN(notifier)				\
+{								\
+	pthread_mutex_lock(&notifier->lock);			\
+
+#define RXM_MEMORY_HOOK_END(notifier)				\
+	pthread_mutex_unlock(&notifier->lock);			\
+}
+
+#endif /* HAVE_GLIBC_MALLOC_HOOKS */
+
+static void rxm_mem_notifier_finalize(void)
+{
+	assert(rxm_mem_notifier);
+	pthread_mutex_lock(&rxm_mem_notifier->lock);
+	if (--rxm_mem_notifier->ref_cnt) {
+		pthread_mutex_unlock(&rxm_mem_notifier->lock);
+		return;
+	}
+	ofi_set_mem_free_hook(rxm_mem_notifier->prev_free_hook);
+	ofi_set_mem_realloc_hook(rxm_mem_notifier->prev_realloc_hook);
+	assert(!rxm_mem_notifier->mem_ptrs_hash);
+	pthread_mutex_unlock(&rxm_mem_notifier->lock);
+	pthread_mutex_destroy(&rxm_mem_notifier->lock);
+	free(rxm_mem_notifier);
+	rxm_mem_notifier = NULL;
+}
+
+/* Without malloc hooks nothing is reported: the application must not
+ * release buffers that are still cached */
+static int rxm_mem_notifier_init(void)
+{
+	pthread_mutexattr_t mutex_attr;
+
+	if (rxm_mem_notifier) {
+		pthread_mutex_lock(&rxm_mem_notifier->lock);
+		rxm_mem_notifier->ref_cnt++;
+		pthread_mutex_unlock(&rxm_mem_notifier->lock);
+		return 0;
+	}
+
+	rxm_mem_notifier = calloc(1, sizeof(*rxm_mem_notifier));
+	if (!rxm_mem_notifier)
+		return -FI_ENOMEM;
+
+	pthread_mutexattr_init(&mutex_attr);
+	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(&rxm_mem_notifier->lock, &mutex_attr)) {
+		pthread_mutexattr_destroy(&mutex_attr);
+		free(rxm_mem_notifier);
+		rxm_mem_notifier = NULL;
+		return -FI_ENOMEM;
+	}
+	pthread_mutexattr_destroy(&mutex_attr);
+
+	dlist_init(&rxm_mem_notifier->event_list);
+
+	pthread_mutex_lock(&rxm_mem_notifier->lock);
+	rxm_mem_notifier->prev_free_hook = ofi_get_mem_free_hook();
+	rxm_mem_notifier->prev_realloc_hook = ofi_get_mem_realloc_hook();
+#ifdef HAVE_GLIBC_MALLOC_HOOKS
+	ofi_set_mem_free_hook(rxm_mem_notifier_free_hook);
+	ofi_set_mem_realloc_hook(rxm_mem_notifier_realloc_hook);
+#else
+	FI_WARN(&rxm_prov, FI_LOG_MR, "No memory monitor available, "
+		"buffers must stay allocated while they are cached\n");
+#endif
+	rxm_mem_notifier->ref_cnt++;
+	pthread_mutex_unlock(&rxm_mem_notifier->lock);
+	return 0;
+}
+
+static int rxm_monitor_subscribe(struct ofi_mem_monitor *notifier,
+				 void *addr, size_t len,
+				 struct ofi_subscription *subscription)
+{
+	struct rxm_mem_ptr_entry *entry;
+	struct rxm_mem_sub *sub;
+	int ret = 0;
+
+	RXM_MEMORY_HOOK_BEGIN(rxm_mem_notifier)
+	sub = calloc(1, sizeof(*sub));
+	if (!sub) {
+		ret = -FI_ENOMEM;
+		goto out;
+	}
+	sub->subscription = subscription;
+	dlist_init(&sub->event_entry);
+
+	HASH_FIND(hh, rxm_mem_notifier->mem_ptrs_hash, &addr,
+		  sizeof(void *), entry);
+	if (!entry) {
+		entry = calloc(1, sizeof(*entry));
+		if (!entry) {
+			free(sub);
+			ret = -FI_ENOMEM;
+			goto out;
+		}
+		entry->addr = addr;
+		dlist_init(&entry->sub_list);
+		HASH_ADD(hh, rxm_mem_notifier->mem_ptrs_hash, addr,
+			 sizeof(void *), entry);
+	}
+	dlist_insert_tail(&sub->entry, &entry->sub_list);
+out:
+	RXM_MEMORY_HOOK_END(rxm_mem_notifier)
+	return ret;
+}
+
+static void rxm_monitor_unsubscribe(struct ofi_mem_monitor *notifier,
+				    void *addr, size_t len,
+				    struct ofi_subscription *subscription)
+{
+	struct rxm_mem_ptr_entry *entry;
+	struct rxm_mem_sub *sub;
+
+	RXM_MEMORY_HOOK_BEGIN(rxm_mem_notifier)
+	HASH_FIND(hh, rxm_mem_notifier->mem_ptrs_hash, &addr,
+		  sizeof(void *), entry);
+	assert(entry);
+
+	dlist_foreach_container(&entry->sub_list, struct rxm_mem_sub, sub,
+				entry) {
+		if (sub->subscription != subscription)
+			continue;
+		dlist_remove(&sub->entry);
+		if (!dlist_empty(&sub->event_entry))
+			dlist_remove(&sub->event_entry);
+		free(sub);
+		break;
+	}
+
+	if (dlist_empty(&entry->sub_list)) {
+		HASH_DEL(rxm_mem_notifier->mem_ptrs_hash, entry);
+		free(entry);
+	}
+	RXM_MEMORY_HOOK_END(rxm_mem_notifier)
+}
+
+static struct ofi_subscription *
+rxm_monitor_get_event(struct ofi_mem_monitor *notifier)
+{
+	struct ofi_subscription *subscription = NULL;
+	struct rxm_mem_sub *sub;
+
+	pthread_mutex_lock(&rxm_mem_notifier->lock);
+	if (!dlist_empty(&rxm_mem_notifier->event_list)) {
+		dlist_pop_front(&rxm_mem_notifier->event_list,
+				struct rxm_mem_sub, sub, event_entry);
+		/* needed to protect against double insertions */
+		dlist_init(&sub->event_entry);
+		subscription = sub->subscription;
+	}
+	pthread_mutex_unlock(&rxm_mem_notifier->lock);
+	return subscription;
+}
+
+static int rxm_mr_cache_close(fid_t fid)
+{
+	struct rxm_mr_cache_desc *desc =
+		container_of(fid, struct rxm_mr_cache_desc, mr_fid.fid);
+	struct rxm_domain *rxm_domain = desc->domain;
+
+	fastlock_acquire(&rxm_domain->mr_cache_lock);
+	ofi_mr_cache_delete(&rxm_domain->mr_cache, desc->entry);
+	fastlock_release(&rxm_domain->mr_cache_lock);
+	return 0;
+}
+
+static struct fi_ops rxm_mr_cache_ops = {
+	.size = sizeof(struct fi_ops),
+	.close = rxm_mr_cache_close,
+	.bind = fi_no_bind,
+	.control = fi_no_control,
+	.ops_open = fi_no_ops_open,
+};
+
+/* Cached registrations serve any transfer, so they get all the access
+ * rights that RxM needs */
+static int rxm_mr_cache_entry_reg(struct ofi_mr_cache *cache,
+				  struct ofi_mr_entry *entry)
+{
+	struct rxm_mr_cache_desc *desc = (struct rxm_mr_cache_desc *)entry->data;
+	struct rxm_domain *rxm_domain = container_of(cache, struct rxm_domain,
+						     mr_cache);
+	int ret;
+
+	ret = fi_mr_reg(rxm_domain->msg_domain, entry->iov.iov_base,
+			entry->iov.iov_len, FI_SEND | FI_RECV | FI_READ |
+			FI_WRITE | FI_REMOTE_READ | FI_REMOTE_WRITE, 0, 0, 0,
+			&desc->msg_mr, NULL);
+	if (ret)
+		return ret;
+
+	desc->mr_fid.fid.fclass = FI_CLASS_MR;
+	desc->mr_fid.fid.context = NULL;
+	desc->mr_fid.fid.ops = &rxm_mr_cache_ops;
+	desc->mr_fid.mem_desc = fi_mr_desc(desc->msg_mr);
+	desc->mr_fid.key = fi_mr_key(desc->msg_mr);
+	desc->domain = rxm_domain;
+	desc->entry = entry;
+	return 0;
+}
+
+static void rxm_mr_cache_entry_dereg(struct ofi_mr_cache *cache,
+				     struct ofi_mr_entry *entry)
+{
+	struct rxm_mr_cache_desc *desc = (struct rxm_mr_cache_desc *)entry->data;
+
+	if (fi_close(&desc->msg_mr->fid))
+		FI_WARN(&rxm_prov, FI_LOG_MR, "Unable to close MSG MR\n");
+}
+
+/* Returns a registration of the buffer with the MSG provider, from the
+ * cache when a previous one covers it. The MR is released with fi_close()
+ * as an uncached one */
+int rxm_mr_cache_reg(struct rxm_domain *rxm_domain, const struct iovec *iov,
+		     struct fid_mr **mr)
+{
+	struct fi_mr_attr attr = {
+		.mr_iov = iov,
+		.iov_count = 1,
+		.access = FI_SEND | FI_RECV | FI_READ | FI_WRITE |
+			  FI_REMOTE_READ | FI_REMOTE_WRITE,
+	};
+	struct ofi_mr_entry *entry;
+	int ret;
+
+	fastlock_acquire(&rxm_domain->mr_cache_lock);
+	ret = ofi_mr_cache_search(&rxm_domain->mr_cache, &attr, &entry);
+	fastlock_release(&rxm_domain->mr_cache_lock);
+	if (OFI_UNLIKELY(ret))
+		return ret;
+
+	*mr = &((struct rxm_mr_cache_desc *)entry->data)->mr_fid;
+	return 0;
+}
+
+static int rxm_mr_cache_open(struct rxm_domain *rxm_domain)
+{
+	size_t max_cached_size = ULONG_MAX;
+	int max_cached_cnt = 4096;
+	int ret;
+
+	if (fi_param_get_bool(&rxm_prov, "mr_cache_enable", &ret) || !ret)
+		return 0;
+
+	fi_param_get_int(&rxm_prov, "mr_max_cached_cnt", &max_cached_cnt);
+	fi_param_get_size_t(&rxm_prov, "mr_max_cached_size",
+			    &max_cached_size);
+	if (max_cached_cnt <= 0) {
+		FI_WARN(&rxm_prov, FI_LOG_MR,
+			"Invalid value of mr_max_cached_cnt, MR cache "
+			"disabled\n");
+		return 0;
+	}
+
+	ret = rxm_mem_notifier_init();
+	if (ret)
+		return ret;
+
+	rxm_domain->monitor.subscribe = rxm_monitor_subscribe;
+	rxm_domain->monitor.unsubscribe = rxm_monitor_unsubscribe;
+	rxm_domain->monitor.get_event = rxm_monitor_get_event;
+	ofi_monitor_init(&rxm_domain->monitor);
+
+	rxm_domain->mr_cache.max_cached_cnt = max_cached_cnt;
+	rxm_domain->mr_cache.max_cached_size = max_cached_size;
+	rxm_domain->mr_cache.merge_regions = 0;
+	rxm_domain->mr_cache.entry_data_size = sizeof(struct rxm_mr_cache_desc);
+	rxm_domain->mr_cache.add_region = rxm_mr_cache_entry_reg;
+	rxm_domain->mr_cache.delete_region = rxm_mr_cache_entry_dereg;
+	ret = ofi_mr_cache_init(&rxm_domain->util_domain, &rxm_domain->monitor,
+				&rxm_domain->mr_cache);
+	if (ret) {
+		ofi_monitor_cleanup(&rxm_domain->monitor);
+		rxm_mem_notifier_finalize();
+		return ret;
+	}
+
+	fastlock_init(&rxm_domain->mr_cache_lock);
+	rxm_domain->mr_cache_enable = 1;
+	return 0;
+}
+
+static void rxm_mr_cache_close_all(struct rxm_domain *rxm_domain)
+{
+	if (!rxm_domain->mr_cache_enable)
+		return;
+
+	FI_INFO(&rxm_prov, FI_LOG_MR, "MR cache: hits %zu, misses %zu\n",
+		rxm_domain->mr_cache.hit_cnt, rxm_domain->mr_cache.search_cnt -
+		rxm_domain->mr_cache.hit_cnt);
+	ofi_mr_cache_cleanup(&rxm_domain->mr_cache);
+	ofi_monitor_cleanup(&rxm_domain->monitor);
+	rxm_mem_notifier_finalize();
+	fastlock_destroy(&rxm_domain->mr_cache_lock);
+	rxm_domain->mr_cache_enable = 0;
+}
+
 static int rxm_domain_close(fid_t fid)
 {
 	struct rxm_domain *rxm_domain;
@@ -86,6 +482,9 @@ static int rxm_domain_close(fid_t fid)
 
 	rxm_domain = container_of(fid, struct rxm_domain, util_domain.domain_fid.fid);
 
+	/* Drops the domain reference held by the cache */
+	rxm_mr_cache_close_all(rxm_domain);
+
 	ret = fi_close(&rxm_domain->msg_domain->fid);
 	if (ret)
 		return ret;
@@ -94,6 +493,7 @@ static int rxm_domain_close(fid_t fid)
 	if (ret)
 		return ret;
 
+	ofi_mr_map_close(&rxm_domain->mr_map);
 	free(rxm_domain);
 	return 0;
 }
@@ -112,6 +512,14 @@ static int rxm_mr_close(fid_t fid)
 	int ret;
 
 	rxm_mr = container_of(fid, struct rxm_mr, mr_fid.fid);
+
+	fastlock_acquire(&rxm_mr->domain->util_domain.lock);
+	ret = ofi_mr_map_remove(&rxm_mr->domain->mr_map, rxm_mr->mr_fid.key);
+	fastlock_release(&rxm_mr->domain->util_domain.lock);
+	if (ret)
+		FI_WARN(&rxm_prov, FI_LOG_DOMAIN, "Unable to remove MR from "
+			"the key map\n");
+
 	ret = fi_close(&rxm_mr->msg_mr->fid);
 	if (ret)
 		FI_WARN(&rxm_prov, FI_LOG_DOMAIN, "Unable to close MSG MR\n");
@@ -133,6 +541,17 @@ static int rxm_mr_reg(struct fid *domain_fid, const void *buf, size_t len,
 {
 	struct rxm_domain *rxm_domain;
 	struct rxm_mr *rxm_mr;
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+	struct fi_mr_attr attr = {
+		.mr_iov = &iov,
+		.iov_count = 1,
+		.access = access,
+		.offset = 0,
+	};
+	uint64_t key;
 	int ret;
 
 	rxm_domain = container_of(domain_fid, struct rxm_domain,
@@ -142,8 +561,9 @@ static int rxm_mr_reg(struct fid *domain_fid, const void *buf, size_t len,
 	if (!rxm_mr)
 		return -FI_ENOMEM;
 
-	/* Additional flags to use RMA read for large message transfers */
-	access |= FI_READ | FI_REMOTE_READ;
+	/* Additional flags to use RMA read or write for large message
+	 * transfers */
+	access |= FI_READ | FI_REMOTE_READ | FI_REMOTE_WRITE;
 
 	if (rxm_domain->mr_local)
 		access |= FI_WRITE;
@@ -163,6 +583,20 @@ static int rxm_mr_reg(struct fid *domain_fid, const void *buf, size_t len,
 	 * The key would be used in large message transfer protocol and RMA. */
 	rxm_mr->mr_fid.mem_desc = rxm_mr->msg_mr;
 	rxm_mr->mr_fid.key = fi_mr_key(rxm_mr->msg_mr);
+	rxm_mr->domain = rxm_domain;
+
+	/* Atomics are executed by RxM at the target, with the access that
+	 * the application asked for */
+	attr.requested_key = rxm_mr->mr_fid.key;
+	fastlock_acquire(&rxm_domain->util_domain.lock);
+	ret = ofi_mr_map_insert(&rxm_domain->mr_map, &attr, &key, NULL);
+	fastlock_release(&rxm_domain->util_domain.lock);
+	if (ret) {
+		FI_WARN(&rxm_prov, FI_LOG_DOMAIN, "Unable to add MR to the "
+			"key map\n");
+		fi_close(&rxm_mr->msg_mr->fid);
+		goto err;
+	}
 	*mr = &rxm_mr->mr_fid;
 
 	return 0;
@@ -209,9 +643,16 @@ int rxm_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 	if (ret)
 		goto err2;
 
+	/* Atomic targets are addressed the way the MSG provider addresses
+	 * RMA ones */
+	ret = ofi_mr_map_init(&rxm_prov, RXM_MR_VIRT_ADDR(msg_info) ?
+			      FI_MR_VIRT_ADDR : 0, &rxm_domain->mr_map);
+	if (ret)
+		goto err3;
+
 	ret = ofi_domain_init(fabric, info, &rxm_domain->util_domain, context);
 	if (ret) {
-		goto err3;
+		goto err4;
 	}
 
 	*domain = &rxm_domain->util_domain.domain_fid;
@@ -222,8 +663,16 @@ int rxm_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 
 	rxm_domain->mr_local = ofi_mr_local(msg_info) && !ofi_mr_local(info);
 
+	ret = rxm_mr_cache_open(rxm_domain);
+	if (ret)
+		goto err5;
+
 	fi_freeinfo(msg_info);
 	return 0;
+err5:
+	ofi_domain_close(&rxm_domain->util_domain);
+err4:
+	ofi_mr_map_close(&rxm_domain->mr_map);
 err3:
 	fi_close(&rxm_domain->msg_domain->fid);
 err2:
@@ -38,70 +38,14 @@
 
 #include "rxm.h"
 
-static int rxm_match_noop(struct dlist_entry *item, const void *arg)
+static int rxm_match_recv_entry_context(struct ofi_mq_entry *item,
+					const void *context)
 {
-	OFI_UNUSED(item);
-	OFI_UNUSED(arg);
-	return 1;
-}
-
-static int rxm_match_recv_entry(struct dlist_entry *item, const void *arg)
-{
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *) arg;
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return ofi_match_addr(recv_entry->addr, attr->addr);
-}
-
-static int rxm_match_recv_entry_tag(struct dlist_entry *item, const void *arg)
-{
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
 	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return ofi_match_tag(recv_entry->tag, recv_entry->ignore, attr->tag);
-}
-
-static int rxm_match_recv_entry_tag_addr(struct dlist_entry *item, const void *arg)
-{
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
-	return ofi_match_addr(recv_entry->addr, attr->addr) &&
-		ofi_match_tag(recv_entry->tag, recv_entry->ignore, attr->tag);
-}
-
-static int rxm_match_recv_entry_context(struct dlist_entry *item, const void *context)
-{
-	struct rxm_recv_entry *recv_entry =
-		container_of(item, struct rxm_recv_entry, entry);
+		container_of(item, struct rxm_recv_entry, match);
 	return recv_entry->context == context;
 }
 
-static int rxm_match_unexp_msg(struct dlist_entry *item, const void *arg)
-{
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_unexp_msg *unexp_msg =
-		container_of(item, struct rxm_unexp_msg, entry);
-	return ofi_match_addr(attr->addr, unexp_msg->addr);
-}
-
-static int rxm_match_unexp_msg_tag(struct dlist_entry *item, const void *arg)
-{
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_unexp_msg *unexp_msg =
-		container_of(item, struct rxm_unexp_msg, entry);
-	return ofi_match_tag(attr->tag, attr->ignore, unexp_msg->tag);
-}
-
-static int rxm_match_unexp_msg_tag_addr(struct dlist_entry *item, const void *arg)
-{
-	struct rxm_recv_match_attr *attr = (struct rxm_recv_match_attr *)arg;
-	struct rxm_unexp_msg *unexp_msg =
-		container_of(item, struct rxm_unexp_msg, entry);
-	return ofi_match_addr(attr->addr, unexp_msg->addr) &&
-		ofi_match_tag(attr->tag, attr->ignore, unexp_msg->tag);
-}
-
 static inline int
 rxm_mr_buf_reg(struct rxm_ep *rxm_ep, void *addr, size_t len, void **context)
 {
@@ -148,6 +92,10 @@ static int rxm_buf_reg(void *pool_ctx, void *addr, size_t len, void **context)
 			rx_buf = (struct rxm_rx_buf *)((char *)addr + i * entry_sz);
 			rx_buf->ep = pool->rxm_ep;
 			rx_buf->hdr.desc = mr_desc;
+			dlist_init(&rx_buf->sar_entry);
+			dlist_init(&rx_buf->sar_seg_list);
+			dlist_init(&rx_buf->rndv_entry);
+			rx_buf->eager_credit = 0;
 		} else {
 			tx_buf = (struct rxm_tx_buf *)((char *)addr + i * entry_sz);
 			tx_buf->type = pool->type;
@@ -160,6 +108,7 @@ static int rxm_buf_reg(void *pool_ctx, void *addr, size_t len, void **context)
 				tx_buf->pkt.hdr.op = ofi_op_msg;
 				/* fall through */
 			case RXM_BUF_POOL_TX:
+			case RXM_BUF_POOL_TX_SMALL:
 			case RXM_BUF_POOL_TX_INJECT:
 				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_data;
 				break;
@@ -170,10 +119,24 @@ static int rxm_buf_reg(void *pool_ctx, void *addr, size_t len, void **context)
 			case RXM_BUF_POOL_TX_LMT:
 				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_large_data;
 				break;
+			case RXM_BUF_POOL_TX_CTS:
+				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_write_cts;
+				tx_buf->pkt.hdr.op = ofi_op_msg;
+				tx_buf->hdr.state = RXM_RNDV_CTS;
+				break;
 			case RXM_BUF_POOL_TX_SAR:
 				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_seg_data;
 				tx_buf->hdr.state = RXM_SAR_TX;
 				break;
+			case RXM_BUF_POOL_TX_BUNDLE:
+				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_bundle;
+				tx_buf->pkt.hdr.op = ofi_op_msg;
+				tx_buf->hdr.state = RXM_BUNDLE_TX;
+				dlist_init(&tx_buf->bundle_list);
+				break;
+			case RXM_BUF_POOL_TX_ATOMIC:
+				tx_buf->pkt.ctrl_hdr.type = ofi_ctrl_atomic;
+				break;
 			default:
 				assert(0);
 				break;
@@ -250,39 +213,43 @@ static void rxm_recv_entry_init(struct rxm_recv_entry *entry, void *arg)
 static int rxm_recv_queue_init(struct rxm_ep *rxm_ep,  struct rxm_recv_queue *recv_queue,
 			       size_t size, enum rxm_recv_queue_type type)
 {
+	uint64_t flags = 0;
+	int ret;
+
 	recv_queue->rxm_ep = rxm_ep;
 	recv_queue->type = type;
 	recv_queue->fs = rxm_recv_fs_create(size, rxm_recv_entry_init, recv_queue);
 	if (!recv_queue->fs)
 		return -FI_ENOMEM;
 
-	dlist_init(&recv_queue->recv_list);
-	dlist_init(&recv_queue->unexp_msg_list);
-	if (type == RXM_RECV_QUEUE_MSG) {
-		if (rxm_ep->rxm_info->caps & FI_DIRECTED_RECV) {
-			recv_queue->match_recv = rxm_match_recv_entry;
-			recv_queue->match_unexp = rxm_match_unexp_msg;
-		} else {
-			recv_queue->match_recv = rxm_match_noop;
-			recv_queue->match_unexp = rxm_match_noop;
-		}
-	} else {
-		if (rxm_ep->rxm_info->caps & FI_DIRECTED_RECV) {
-			recv_queue->match_recv = rxm_match_recv_entry_tag_addr;
-			recv_queue->match_unexp = rxm_match_unexp_msg_tag_addr;
-		} else {
-			recv_queue->match_recv = rxm_match_recv_entry_tag;
-			recv_queue->match_unexp = rxm_match_unexp_msg_tag;
-		}
-	}
+	if (rxm_ep->rxm_info->caps & FI_DIRECTED_RECV)
+		flags |= OFI_MQ_DIRECTED;
+	if (type == RXM_RECV_QUEUE_TAGGED)
+		flags |= OFI_MQ_TAGGED;
+
+	ret = ofi_mq_init(&recv_queue->recv_mq, size, flags);
+	if (ret)
+		goto err1;
+	ret = ofi_mq_init(&recv_queue->unexp_mq, size, flags);
+	if (ret)
+		goto err2;
+
 	fastlock_init(&recv_queue->lock);
 	return 0;
+err2:
+	ofi_mq_close(&recv_queue->recv_mq);
+err1:
+	rxm_recv_fs_free(recv_queue->fs);
+	recv_queue->fs = NULL;
+	return ret;
 }
 
 static void rxm_recv_queue_close(struct rxm_recv_queue *recv_queue)
 {
 	if (recv_queue->fs)
 		rxm_recv_fs_free(recv_queue->fs);
+	ofi_mq_close(&recv_queue->recv_mq);
+	ofi_mq_close(&recv_queue->unexp_mq);
 	fastlock_destroy(&recv_queue->lock);
 	// TODO cleanup recv_list and unexp msg list
 }
@@ -293,10 +260,14 @@ static int rxm_ep_txrx_pool_create(struct rxm_ep *rxm_ep)
 	size_t queue_sizes[RXM_BUF_POOL_MAX] = {
 		rxm_ep->msg_info->rx_attr->size,	/* RX */
 		rxm_ep->msg_info->tx_attr->size,	/* TX */
+		rxm_ep->msg_info->tx_attr->size,	/* TX SMALL */
 		rxm_ep->msg_info->tx_attr->size,	/* TX INJECT */
 		rxm_ep->msg_info->tx_attr->size,	/* TX ACK */
 		rxm_ep->msg_info->tx_attr->size,	/* TX LMT */
+		rxm_ep->msg_info->tx_attr->size,	/* TX CTS */
 		rxm_ep->msg_info->tx_attr->size,	/* TX SAR */
+		rxm_ep->msg_info->tx_attr->size,	/* TX BUNDLE */
+		rxm_ep->msg_info->tx_attr->size,	/* TX ATOMIC */
 		rxm_ep->msg_info->tx_attr->size,	/* RMA */
 	};
 	size_t entry_sizes[RXM_BUF_POOL_MAX] = {
@@ -304,6 +275,9 @@ static int rxm_ep_txrx_pool_create(struct rxm_ep *rxm_ep)
 		sizeof(struct rxm_rx_buf),			/* RX */
 		rxm_ep->rxm_info->tx_attr->inject_size +
 		sizeof(struct rxm_tx_buf),			/* TX */
+		MIN(RXM_BUF_SMALL_SIZE,
+		    rxm_ep->rxm_info->tx_attr->inject_size) +
+		sizeof(struct rxm_tx_buf),			/* TX SMALL */
 		rxm_ep->msg_info->tx_attr->inject_size +
 		sizeof(struct rxm_tx_buf),			/* TX INJECT */
 		sizeof(struct rxm_tx_buf),			/* TX ACK */
@@ -311,14 +285,30 @@ static int rxm_ep_txrx_pool_create(struct rxm_ep *rxm_ep)
 		rxm_ep->rxm_info->tx_attr->iov_limit *
 		sizeof(struct ofi_rma_iov) +
 		sizeof(struct rxm_tx_buf),			/* TX LMT */
+		sizeof(struct rxm_rma_iov) +
+		rxm_ep->rxm_info->rx_attr->iov_limit *
+		sizeof(struct ofi_rma_iov) +
+		sizeof(struct rxm_tx_buf),			/* TX CTS */
 		rxm_ep->rxm_info->tx_attr->inject_size +
 		sizeof(struct rxm_tx_buf),			/* TX SAR */
 		rxm_ep->rxm_info->tx_attr->inject_size +
+		sizeof(struct rxm_tx_buf),			/* TX BUNDLE */
+		rxm_ep->rxm_info->tx_attr->inject_size +
+		sizeof(struct rxm_tx_buf),			/* TX ATOMIC */
+		rxm_ep->rxm_info->tx_attr->inject_size +
 		sizeof(struct rxm_rma_buf),			/* RMA */
 	};
 
 	dlist_init(&rxm_ep->repost_ready_list);
 	dlist_init(&rxm_ep->conn_deferred_list);
+	dlist_init(&rxm_ep->conn_free_list);
+	dlist_init(&rxm_ep->conn_lru_list);
+	dlist_init(&rxm_ep->conn_close_list);
+	dlist_init(&rxm_ep->tx_stall_list);
+	dlist_init(&rxm_ep->ctrl_retry_list);
+	dlist_init(&rxm_ep->bundle_conn_list);
+	dlist_init(&rxm_ep->credit_update_list);
+	dlist_init(&rxm_ep->atomic_resp_conn_list);
 
 	for (i = 0; i < RXM_BUF_POOL_MAX; i++) {
 		ret = rxm_buf_pool_create(rxm_ep, queue_sizes[i], entry_sizes[i],
@@ -373,7 +363,7 @@ static void rxm_ep_txrx_queue_close(struct rxm_ep *rxm_ep)
 static int rxm_ep_txrx_res_open(struct rxm_ep *rxm_ep,
 				struct util_domain *domain)
 {
-	int ret;
+	int ret, timeout;
 	size_t param;
 
 	FI_DBG(&rxm_prov, FI_LOG_EP_CTRL,
@@ -408,9 +398,76 @@ static int rxm_ep_txrx_res_open(struct rxm_ep *rxm_ep,
 	} else {
 		rxm_ep->sar_limit = RXM_SAR_LIMIT;
 	}
-	while ((RXM_SAR_DIVIDER << (rxm_ep->sar_max_calc_seg_no + 1)) <
-	       rxm_ep->rxm_info->tx_attr->inject_size)
-		rxm_ep->sar_max_calc_seg_no++;
+	rxm_ep->max_conn = SIZE_MAX;
+	if (!fi_param_get_size_t(&rxm_prov, "max_conn", &param) && param) {
+		if (rxm_ep->srx_ctx || sizeof(struct rxm_pkt) >
+		    rxm_ep->msg_info->tx_attr->inject_size) {
+			FI_WARN(&rxm_prov, FI_LOG_CORE,
+				"Connection limit (%zu) is not supported with "
+				"shared receive context or when the MSG provider "
+				"inject size is less than %zu. Connections won't "
+				"be evicted.\n", param, sizeof(struct rxm_pkt));
+		} else {
+			rxm_ep->max_conn = param;
+			rxm_ep->conn_evict = 1;
+		}
+	}
+	/* The receiver returns SAR credits with header-only injects */
+	if (rxm_ep->sar_limit && sizeof(struct rxm_pkt) >
+	    rxm_ep->msg_info->tx_attr->inject_size) {
+		FI_WARN(&rxm_prov, FI_LOG_CORE,
+			"MSG provider inject size is less than %zu. SAR "
+			"protocol won't be used.\n", sizeof(struct rxm_pkt));
+		rxm_ep->sar_limit = 0;
+	}
+	rxm_ep->sar_seg_size = MIN(rxm_ep->rxm_info->tx_attr->inject_size,
+				   UINT16_MAX);
+
+	if (fi_param_get_size_t(&rxm_prov, "rndv_write_limit",
+				&rxm_ep->rndv_write_limit))
+		rxm_ep->rndv_write_limit = RXM_RNDV_WRITE_LIMIT;
+	/* Buffered receives hand the request itself to the user */
+	if (rxm_ep->rxm_info->mode & FI_BUFFERED_RECV)
+		rxm_ep->rndv_write_limit = 0;
+	/* The request and the end of the transfer are header-only injects */
+	if (rxm_ep->rndv_write_limit && sizeof(struct rxm_pkt) >
+	    rxm_ep->msg_info->tx_attr->inject_size) {
+		FI_WARN(&rxm_prov, FI_LOG_CORE,
+			"MSG provider inject size is less than %zu. Write-based "
+			"rendezvous won't be used.\n", sizeof(struct rxm_pkt));
+		rxm_ep->rndv_write_limit = 0;
+	}
+
+	if (!fi_param_get_size_t(&rxm_prov, "bundle_size", &param) && param) {
+		param = MIN(param, rxm_ep->rxm_info->tx_attr->inject_size);
+		if (param < 2 * (sizeof(struct ofi_op_hdr) + sizeof(uint64_t))) {
+			FI_WARN(&rxm_prov, FI_LOG_CORE,
+				"Bundle size (%zu) can't hold two messages. "
+				"Messages won't be bundled.\n", param);
+		} else {
+			rxm_ep->bundle_size = param;
+			rxm_ep->bundle_msg_size = param / 2 -
+						  sizeof(struct ofi_op_hdr);
+		}
+	}
+	if (fi_param_get_int(&rxm_prov, "bundle_timeout", &timeout))
+		timeout = RXM_BUNDLE_TIMEOUT;
+	rxm_ep->bundle_timeout = MAX(timeout, 0);
+
+	if (!fi_param_get_size_t(&rxm_prov, "eager_credits", &param) && param) {
+		/* Credits are returned with header-only injects */
+		if (sizeof(struct rxm_pkt) >
+		    rxm_ep->msg_info->tx_attr->inject_size) {
+			FI_WARN(&rxm_prov, FI_LOG_CORE,
+				"MSG provider inject size is less than %zu. "
+				"Eager messages won't be flow controlled.\n",
+				sizeof(struct rxm_pkt));
+		} else {
+			rxm_ep->eager_credits = MIN(param, UINT32_MAX);
+			rxm_ep->eager_credit_batch =
+				MAX(rxm_ep->eager_credits / 4, 1);
+		}
+	}
 
 	return FI_SUCCESS;
 err:
@@ -420,6 +477,13 @@ err:
 
 static void rxm_ep_txrx_res_close(struct rxm_ep *rxm_ep)
 {
+	struct rxm_ctrl_retry *ctrl;
+
+	while (!dlist_empty(&rxm_ep->ctrl_retry_list)) {
+		dlist_pop_front(&rxm_ep->ctrl_retry_list, struct rxm_ctrl_retry,
+				ctrl, entry);
+		free(ctrl);
+	}
 	rxm_ep_txrx_queue_close(rxm_ep);
 
 	rxm_ep_txrx_pool_destroy(rxm_ep);
@@ -459,19 +523,20 @@ static int rxm_ep_cancel_recv(struct rxm_ep *rxm_ep,
 {
 	struct fi_cq_err_entry err_entry;
 	struct rxm_recv_entry *recv_entry;
-	struct dlist_entry *entry;
+	struct ofi_mq_entry *entry;
 
 	rxm_ep->res_fastlock_acquire(&recv_queue->lock);
-	entry = dlist_remove_first_match(&recv_queue->recv_list,
-					 rxm_match_recv_entry_context,
-					 context);
+	entry = ofi_mq_find(&recv_queue->recv_mq, rxm_match_recv_entry_context,
+			    context);
+	if (entry)
+		ofi_mq_remove(entry);
 	rxm_ep->res_fastlock_release(&recv_queue->lock);
 	if (entry) {
-		recv_entry = container_of(entry, struct rxm_recv_entry, entry);
+		recv_entry = container_of(entry, struct rxm_recv_entry, match);
 		memset(&err_entry, 0, sizeof(err_entry));
 		err_entry.op_context = recv_entry->context;
 		err_entry.flags |= recv_entry->comp_flags;
-		err_entry.tag = recv_entry->tag;
+		err_entry.tag = recv_entry->match.tag;
 		err_entry.err = FI_ECANCELED;
 		err_entry.prov_errno = -FI_ECANCELED;
 		rxm_recv_entry_release(recv_queue, recv_entry);
@@ -543,6 +608,11 @@ static int rxm_ep_discard_recv(struct rxm_ep *rxm_ep, struct rxm_rx_buf *rx_buf,
 	RXM_DBG_ADDR_TAG(FI_LOG_EP_DATA, "Discarding message",
 			 rx_buf->unexp_msg.addr, rx_buf->unexp_msg.tag);
 
+	if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data)
+		rxm_cq_sar_discard(rx_buf);
+	else if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_write_req)
+		rxm_cq_rndv_discard(rx_buf);
+
 	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
 	dlist_insert_tail(&rx_buf->repost_entry,
 			  &rx_buf->ep->repost_ready_list);
@@ -575,7 +645,7 @@ static int rxm_ep_peek_recv(struct rxm_ep *rxm_ep, fi_addr_t addr, uint64_t tag,
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Message found\n");
 
 	if (flags & FI_DISCARD) {
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		ofi_mq_remove(&rx_buf->unexp_msg);
 		rxm_ep->res_fastlock_release(&recv_queue->lock);
 		return rxm_ep_discard_recv(rxm_ep, rx_buf, context);
 	}
@@ -583,7 +653,7 @@ static int rxm_ep_peek_recv(struct rxm_ep *rxm_ep, fi_addr_t addr, uint64_t tag,
 	if (flags & FI_CLAIM) {
 		FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Marking message for Claim\n");
 		((struct fi_context *)context)->internal[0] = rx_buf;
-		dlist_remove(&rx_buf->unexp_msg.entry);
+		ofi_mq_remove(&rx_buf->unexp_msg);
 	}
 	rxm_ep->res_fastlock_release(&recv_queue->lock);
 
@@ -606,11 +676,11 @@ rxm_ep_format_rx_res(struct rxm_ep *rxm_ep, const struct iovec *iov,
 		return -FI_EAGAIN;
 
 	(*recv_entry)->rxm_iov.count 	= (uint8_t)count;
-	(*recv_entry)->addr 		= src_addr;
+	(*recv_entry)->match.addr	= src_addr;
 	(*recv_entry)->context 		= context;
 	(*recv_entry)->flags 		= flags;
-	(*recv_entry)->ignore 		= ignore;
-	(*recv_entry)->tag		= tag;
+	(*recv_entry)->match.ignore	= ignore;
+	(*recv_entry)->match.tag	= tag;
 	(*recv_entry)->multi_recv_buf	= iov[0].iov_base;
 
 	for (i = 0; i < count; i++) {
@@ -642,7 +712,8 @@ rxm_ep_recv_common(struct rxm_ep *rxm_ep, const struct iovec *iov,
 		return ret;
 	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting recv with length: %zu "
 	       "tag: 0x%" PRIx64 " ignore: 0x%" PRIx64 "\n",
-	       recv_entry->total_len, recv_entry->tag, recv_entry->ignore);
+	       recv_entry->total_len, recv_entry->match.tag,
+	       recv_entry->match.ignore);
 	return rxm_process_recv_entry(recv_queue, recv_entry);
 }
 
@@ -707,6 +778,8 @@ claim:
 
 	if (rxm_ep->rxm_info->mode & FI_BUFFERED_RECV)
 		recv_entry->comp_flags |= FI_CLAIM;
+	else if (rx_buf->pkt.ctrl_hdr.type == ofi_ctrl_seg_data)
+		rxm_sar_rx_start(rx_buf, recv_entry);
 
 	rx_buf->recv_entry = recv_entry;
 	return rxm_cq_handle_rx_buf(rx_buf);
@@ -904,49 +977,254 @@ err:
 	return ret;
 }
 
-static inline size_t
-rxm_ep_sar_estimate_segments_num(struct rxm_ep *rxm_ep, size_t data_len)
+/* Caller must hold `send_queue::lock`. Writes the data accepted by the
+ * receiver of a rendezvous in chunks, keeping up to RXM_RNDV_WRITE_WINDOW
+ * of them in flight. When none is in flight and the MSG EP is out of
+ * resources, the transfer is parked on rxm_ep::tx_stall_list and retried
+ * from the progress */
+void rxm_ep_rndv_write_progress(struct rxm_ep *rxm_ep,
+				struct rxm_tx_entry *tx_entry)
+{
+	struct rxm_rma_iov *rma_iov =
+		(struct rxm_rma_iov *)tx_entry->rx_buf->pkt.data;
+	struct ofi_rma_iov *rma;
+	struct iovec iov[RXM_IOV_LIMIT];
+	void *desc[RXM_IOV_LIMIT];
+	size_t count, index, offset, len;
+	ssize_t ret = 0;
+
+	while ((tx_entry->rndv_offset < tx_entry->rndv_len) &&
+	       (tx_entry->rndv_writes < RXM_RNDV_WRITE_WINDOW)) {
+		assert(tx_entry->rndv_rma_index < rma_iov->count);
+		rma = &rma_iov->iov[tx_entry->rndv_rma_index];
+		len = MIN(RXM_RNDV_WRITE_CHUNK,
+			  rma->len - tx_entry->rndv_rma_offset);
+
+		index = tx_entry->rndv_iov_index;
+		offset = tx_entry->rndv_iov_offset;
+		ret = ofi_copy_iov_desc(iov, desc, &count,
+					tx_entry->rndv_iov.iov,
+					tx_entry->rndv_iov.desc,
+					tx_entry->rndv_iov.count,
+					&index, &offset, len);
+		if (OFI_UNLIKELY(ret))
+			goto stall;
+
+		ret = fi_writev(tx_entry->conn->msg_ep, iov, desc, count, 0,
+				rma->addr + tx_entry->rndv_rma_offset,
+				rma->key, tx_entry);
+		if (OFI_UNLIKELY(ret))
+			goto stall;
+
+		tx_entry->rndv_writes++;
+		tx_entry->rndv_offset += len;
+		tx_entry->rndv_iov_index = index;
+		tx_entry->rndv_iov_offset = offset;
+		tx_entry->rndv_rma_offset += len;
+		if (tx_entry->rndv_rma_offset == rma->len) {
+			tx_entry->rndv_rma_index++;
+			tx_entry->rndv_rma_offset = 0;
+		}
+	}
+	return;
+stall:
+	if (ret != -FI_EAGAIN)
+		FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
+			"Unable to write rendezvous data: %zd\n", ret);
+	if (tx_entry->rndv_writes)
+		return;
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	if (dlist_empty(&tx_entry->stall_entry))
+		dlist_insert_tail(&tx_entry->stall_entry,
+				  &rxm_ep->tx_stall_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Sends the request of a write-based rendezvous. The receiver answers with
+ * a CTS that describes its buffer, see rxm_ep_rndv_write_progress() */
+static ssize_t
+rxm_ep_rndv_write_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		       void *context, uint8_t count, const struct iovec *iov,
+		       void **desc, size_t data_len, uint64_t data,
+		       uint64_t flags, uint64_t comp_flags, uint64_t tag,
+		       uint8_t op)
 {
-	/* This is rough estimation of the number of the segments to be sent */
-	return (data_len / rxm_ep->rxm_info->tx_attr->inject_size);
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_pkt pkt;
+	size_t i;
+	ssize_t ret;
+
+	ret = rxm_ep_format_tx_entry(rxm_conn, context, count, flags,
+				     comp_flags, NULL, &tx_entry);
+	if (OFI_UNLIKELY(ret))
+		return ret;
+
+	if (!rxm_ep->rxm_mr_local) {
+		ret = rxm_ep_msg_mr_regv(rxm_ep, iov, count, FI_WRITE,
+					 tx_entry->mr);
+		if (ret)
+			goto err;
+		for (i = 0; i < count; i++)
+			tx_entry->rndv_iov.desc[i] = fi_mr_desc(tx_entry->mr[i]);
+	} else {
+		/* desc is msg fid_mr * array */
+		for (i = 0; i < count; i++)
+			tx_entry->rndv_iov.desc[i] =
+				fi_mr_desc((struct fid_mr *)desc[i]);
+	}
+	for (i = 0; i < count; i++)
+		tx_entry->rndv_iov.iov[i] = iov[i];
+	tx_entry->rndv_iov.count = count;
+	tx_entry->rndv_len = 0;
+	tx_entry->rndv_offset = 0;
+	tx_entry->rndv_writes = 0;
+	tx_entry->rndv_iov_index = 0;
+	tx_entry->rndv_iov_offset = 0;
+	tx_entry->rndv_rma_index = 0;
+	tx_entry->rndv_rma_offset = 0;
+	tx_entry->rx_buf = NULL;
+	dlist_init(&tx_entry->stall_entry);
+	tx_entry->msg_id = ((uint64_t)rxm_conn->msg_seq++ << 32) |
+			   rxm_txe_fs_index(rxm_conn->send_queue.fs, tx_entry);
+	/* The CTS may be handled before fi_inject returns */
+	tx_entry->state = RXM_RNDV_CTS_WAIT;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.ctrl_hdr.version	= RXM_CTRL_VERSION;
+	pkt.ctrl_hdr.type	= ofi_ctrl_write_req;
+	pkt.ctrl_hdr.conn_id	= rxm_conn->handle.remote_key;
+	pkt.ctrl_hdr.msg_id	= tx_entry->msg_id;
+	pkt.hdr.version		= OFI_OP_VERSION;
+	pkt.hdr.op		= op;
+	pkt.hdr.size		= data_len;
+	pkt.hdr.tag		= tag;
+	pkt.hdr.flags		= comp_flags;
+	if (flags & FI_REMOTE_CQ_DATA) {
+		pkt.hdr.flags |= FI_REMOTE_CQ_DATA;
+		pkt.hdr.data = data;
+	}
+
+	ret = fi_inject(rxm_conn->msg_ep, &pkt, sizeof(pkt), 0);
+	if (OFI_LIKELY(!ret))
+		return 0;
+
+	FI_DBG(&rxm_prov, FI_LOG_EP_DATA,
+	       "Transmit for MSG provider failed\n");
+	if (!rxm_ep->rxm_mr_local)
+		rxm_ep_msg_mr_closev(tx_entry->mr, tx_entry->count);
+err:
+	tx_entry->msg_id = UINT64_MAX;
+	rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+	return ret;
 }
 
 static inline struct rxm_tx_buf *
-rxm_ep_sar_tx_prepare_segment(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
-			      size_t total_len, size_t seg_len, size_t seg_no,
-			      size_t offset, uint64_t data, uint64_t flags,
-			      uint64_t tag, uint64_t comp_flags, uint8_t op,
-			      enum rxm_sar_seg_type seg_type,
+rxm_ep_sar_tx_prepare_segment(struct rxm_ep *rxm_ep,
 			      struct rxm_tx_entry *tx_entry)
 {
 	struct rxm_tx_buf *tx_buf;
+	size_t seg_len;
 	ssize_t ret;
 
-	ret = rxm_ep_format_tx_res_lightweight(rxm_ep, rxm_conn, total_len,
-					       data, flags, tag, &tx_buf,
+	ret = rxm_ep_format_tx_res_lightweight(rxm_ep, tx_entry->conn,
+					       tx_entry->total_len,
+					       tx_entry->data, tx_entry->flags,
+					       tx_entry->tag, &tx_buf,
 					       &rxm_ep->buf_pools[RXM_BUF_POOL_TX_SAR]);
 	if (OFI_UNLIKELY(ret))
 		return NULL;
 
-	tx_buf->pkt.hdr.op = op;
+	seg_len = MIN(rxm_ep->sar_seg_size,
+		      tx_entry->total_len - tx_entry->iov_offset);
+
+	tx_buf->pkt.hdr.op = tx_entry->op;
 	tx_buf->pkt.ctrl_hdr.msg_id = tx_entry->msg_id;
 	tx_buf->pkt.ctrl_hdr.seg_size = seg_len;
-	tx_buf->pkt.ctrl_hdr.seg_no = seg_no;
-	rxm_sar_set_seg_type(&tx_buf->pkt.ctrl_hdr, seg_type);
-	assert(offset <= (uint32_t)-1);
-	rxm_sar_set_offset(&tx_buf->pkt.ctrl_hdr, offset);
+	tx_buf->pkt.ctrl_hdr.seg_no = tx_entry->seg_no;
+	if (!tx_entry->seg_no)
+		rxm_sar_set_seg_type(&tx_buf->pkt.ctrl_hdr, RXM_SAR_SEG_FIRST);
+	else if (tx_entry->iov_offset + seg_len == tx_entry->total_len)
+		rxm_sar_set_seg_type(&tx_buf->pkt.ctrl_hdr, RXM_SAR_SEG_LAST);
+	else
+		rxm_sar_set_seg_type(&tx_buf->pkt.ctrl_hdr, RXM_SAR_SEG_MIDDLE);
+	assert(tx_entry->iov_offset <= (uint32_t)-1);
+	rxm_sar_set_offset(&tx_buf->pkt.ctrl_hdr, tx_entry->iov_offset);
 
-	tx_buf->pkt.hdr.flags |= comp_flags;
+	tx_buf->pkt.hdr.flags |= tx_entry->comp_flags;
 
 	tx_buf->tx_entry = tx_entry;
 
 	ofi_copy_from_iov(tx_buf->pkt.data, seg_len, tx_entry->rxm_iov.iov,
 			  tx_entry->rxm_iov.count, tx_entry->iov_offset);
 	tx_entry->iov_offset += seg_len;
+	tx_entry->seg_no++;
+	tx_entry->credits--;
 
 	return tx_buf;
 }
 
+static inline ssize_t
+rxm_ep_sar_tx_post_segment(struct rxm_tx_entry *tx_entry,
+			   struct rxm_tx_buf *tx_buf)
+{
+	ssize_t ret;
+
+	ret = fi_send(tx_entry->conn->msg_ep, &tx_buf->pkt,
+		      sizeof(struct rxm_pkt) + tx_buf->pkt.ctrl_hdr.seg_size,
+		      tx_buf->hdr.desc, 0, tx_buf);
+	if (OFI_LIKELY(!ret))
+		tx_entry->segs_inflight++;
+	return ret;
+}
+
+/* Caller must hold `send_queue::lock`. Sends the segments that the credit
+ * window allows. The transfer is driven by the completions of its own
+ * segments and by the credits returned by the receiver. When neither is
+ * outstanding and the MSG EP or the TX pool is out of resources, it is
+ * parked on rxm_ep::tx_stall_list and retried from the progress */
+void rxm_ep_sar_tx_progress(struct rxm_ep *rxm_ep,
+			    struct rxm_tx_entry *tx_entry)
+{
+	struct rxm_tx_buf *tx_buf;
+	ssize_t ret = 0;
+
+	while (!dlist_empty(&tx_entry->deferred_tx_buf_list)) {
+		tx_buf = container_of(tx_entry->deferred_tx_buf_list.next,
+				      struct rxm_tx_buf, hdr.entry);
+		ret = rxm_ep_sar_tx_post_segment(tx_entry, tx_buf);
+		if (OFI_UNLIKELY(ret))
+			goto stall;
+		dlist_remove(&tx_buf->hdr.entry);
+	}
+
+	while (tx_entry->credits &&
+	       (tx_entry->iov_offset < tx_entry->total_len)) {
+		tx_buf = rxm_ep_sar_tx_prepare_segment(rxm_ep, tx_entry);
+		if (OFI_UNLIKELY(!tx_buf)) {
+			ret = -FI_EAGAIN;
+			goto stall;
+		}
+		ret = rxm_ep_sar_tx_post_segment(tx_entry, tx_buf);
+		if (OFI_UNLIKELY(ret)) {
+			dlist_insert_tail(&tx_buf->hdr.entry,
+					  &tx_entry->deferred_tx_buf_list);
+			goto stall;
+		}
+	}
+	return;
+stall:
+	if (ret != -FI_EAGAIN)
+		FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
+			"Unable to send SAR segment: %zd\n", ret);
+	if (tx_entry->segs_inflight)
+		return;
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	if (dlist_empty(&tx_entry->stall_entry))
+		dlist_insert_tail(&tx_entry->stall_entry,
+				  &rxm_ep->tx_stall_list);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
 static inline ssize_t
 rxm_ep_sar_tx_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn, void *context,
 		   uint8_t count, const struct iovec *iov, size_t data_len,
@@ -954,85 +1232,53 @@ rxm_ep_sar_tx_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn, void *conte
 		   uint64_t tag, uint8_t op)
 {
 	struct rxm_tx_entry *tx_entry;
-	size_t i, total_len = data_len, seg_len;
+	struct rxm_tx_buf *tx_buf;
+	size_t i;
 	ssize_t ret;
-	int send_failed = 0;
-	enum rxm_sar_seg_type seg_type = RXM_SAR_SEG_FIRST;
 
 	ret = rxm_ep_format_tx_entry(rxm_conn, context, count, flags,
 				     comp_flags, NULL, &tx_entry);
 	if (OFI_UNLIKELY(ret))
 		return ret;
 
+	tx_entry->state = RXM_SAR_TX;
 	dlist_init(&tx_entry->deferred_tx_buf_list);
-	tx_entry->iov_offset = 0;
+	dlist_init(&tx_entry->stall_entry);
 	for (i = 0; i < count; i++)
 		tx_entry->rxm_iov.iov[i] = iov[i];
-
 	tx_entry->rxm_iov.count = count;
-	tx_entry->msg_id = rxm_txe_fs_index(rxm_conn->send_queue.fs, tx_entry);
-	tx_entry->segs_left = 0;
-
-	while (total_len) {
-		struct rxm_tx_buf *tx_buf;
-
-		seg_len = (tx_entry->segs_left <= rxm_ep->sar_max_calc_seg_no) ?
-			   RXM_SAR_DIVIDER << tx_entry->segs_left :
-			   rxm_ep->rxm_info->tx_attr->inject_size;
-
-		if (seg_len >= total_len) {
-			seg_len = total_len;
-			seg_type = RXM_SAR_SEG_LAST;
-		}
-
-		tx_buf = rxm_ep_sar_tx_prepare_segment(rxm_ep, rxm_conn, data_len,
-						       seg_len, tx_entry->segs_left,
-						       data_len - total_len, /* offset */
-						       data, flags, tag, comp_flags,
-						       op, seg_type, tx_entry);
-		if (OFI_UNLIKELY(!tx_buf)) {
-			tx_entry->msg_id = UINT64_MAX;
-			if (seg_type == RXM_SAR_SEG_FIRST) {
-				/* if TX buffer allocation for the first segment fails,
-				 * release TX entry and report to user */
-				rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
-			}
-			while (!dlist_empty(&tx_entry->deferred_tx_buf_list)) {
-				dlist_pop_front(&tx_entry->deferred_tx_buf_list,
-						struct rxm_tx_buf, tx_buf, hdr.entry);
-				rxm_tx_buf_release(tx_entry->ep, tx_buf);
-			}
-			return -FI_EAGAIN;
-		}
-
-		if (!send_failed) {
-			ret = fi_send(rxm_conn->msg_ep, &tx_buf->pkt,
-				      sizeof(struct rxm_pkt) +
-				      tx_buf->pkt.ctrl_hdr.seg_size,
-				      tx_buf->hdr.desc, 0, tx_buf);
-			if (OFI_UNLIKELY(ret)) {
-				if (seg_type == RXM_SAR_SEG_FIRST) {
-					/* if the sending for the first segment fails,
-					 * release resources and report this to user */
-					rxm_tx_buf_release(tx_entry->ep, tx_buf);
-					rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
-					return -FI_EAGAIN;
-				}
-				send_failed = 1;
-				dlist_insert_tail(&tx_buf->hdr.entry,
-						  &tx_entry->deferred_tx_buf_list);	
-			}
-		} else {
-			dlist_insert_tail(&tx_buf->hdr.entry,
-					  &tx_entry->deferred_tx_buf_list);
-		}
-
-		tx_entry->segs_left++;
-		total_len -= seg_len;
-		seg_type = RXM_SAR_SEG_MIDDLE;
+	tx_entry->iov_offset = 0;
+	tx_entry->total_len = data_len;
+	tx_entry->segs_inflight = 0;
+	tx_entry->seg_no = 0;
+	tx_entry->credits = RXM_SAR_WINDOW;
+	tx_entry->op = op;
+	tx_entry->data = data;
+	tx_entry->tag = tag;
+	tx_entry->msg_id = ((uint64_t)rxm_conn->msg_seq++ << 32) |
+			   rxm_txe_fs_index(rxm_conn->send_queue.fs, tx_entry);
+
+	/* Failures to send the first segment are reported to the user, the
+	 * rest of the message is the responsibility of the progress */
+	rxm_ep->res_fastlock_acquire(&rxm_conn->send_queue.lock);
+	tx_buf = rxm_ep_sar_tx_prepare_segment(rxm_ep, tx_entry);
+	if (OFI_UNLIKELY(!tx_buf)) {
+		ret = -FI_EAGAIN;
+		goto err;
 	}
-
+	ret = rxm_ep_sar_tx_post_segment(tx_entry, tx_buf);
+	if (OFI_UNLIKELY(ret)) {
+		rxm_tx_buf_release(rxm_ep, tx_buf);
+		goto err;
+	}
+	rxm_ep_sar_tx_progress(rxm_ep, tx_entry);
+	rxm_ep->res_fastlock_release(&rxm_conn->send_queue.lock);
 	return 0;
+err:
+	tx_entry->msg_id = UINT64_MAX;
+	rxm_ep->res_fastlock_release(&rxm_conn->send_queue.lock);
+	rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+	return ret;
 }
 
 static inline ssize_t
@@ -1183,7 +1429,7 @@ rxm_ep_prepare_deferred_tx(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn, siz
 		   (len + sizeof(struct rxm_pkt) <=
 			rxm_ep->msg_info->tx_attr->inject_size)) ?
 		  &rxm_ep->buf_pools[RXM_BUF_POOL_TX_INJECT] :
-		  &rxm_ep->buf_pools[RXM_BUF_POOL_TX];
+		  rxm_ep_tx_pool(rxm_ep, len);
 
 	ret = rxm_ep_format_tx_inject_iov(
 			rxm_ep, rxm_conn, len, iov, count, data, flags,
@@ -1216,6 +1462,215 @@ rxm_ep_defer_tx_inject(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
 	return 0;
 }
 
+/* Caller holds the send_queue lock */
+static ssize_t
+rxm_conn_bundle_flush_locked(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	struct rxm_tx_buf *tx_buf = rxm_conn->bundle;
+	uint32_t returned;
+	ssize_t ret;
+
+	(void) rxm_conn_credit_tx(rxm_ep, rxm_conn, 0, &returned);
+	tx_buf->pkt.ctrl_hdr.seg_no = returned;
+
+	FI_DBG(&rxm_prov, FI_LOG_EP_DATA, "Posting bundle with length: %"
+	       PRIu64 "\n", tx_buf->pkt.hdr.size);
+	ret = fi_send(rxm_conn->msg_ep, &tx_buf->pkt,
+		      sizeof(struct rxm_pkt) + tx_buf->pkt.hdr.size,
+		      tx_buf->hdr.desc, 0, tx_buf);
+	if (OFI_UNLIKELY(ret)) {
+		rxm_conn_credit_tx_undo(rxm_ep, rxm_conn, 0, returned);
+		if (ret != -FI_EAGAIN)
+			FI_WARN(&rxm_prov, FI_LOG_EP_DATA,
+				"fi_send for MSG provider failed\n");
+		return ret;
+	}
+	rxm_conn->bundle = NULL;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_remove_init(&rxm_conn->bundle_entry);
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	return 0;
+}
+
+/* Sends the open bundle of the connection so that the messages packed into
+ * it go out before any other transfer */
+ssize_t rxm_conn_bundle_flush(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	ssize_t ret = 0;
+
+	rxm_ep->res_fastlock_acquire(&rxm_conn->send_queue.lock);
+	if (rxm_conn->bundle)
+		ret = rxm_conn_bundle_flush_locked(rxm_ep, rxm_conn);
+	rxm_ep->res_fastlock_release(&rxm_conn->send_queue.lock);
+	return ret;
+}
+
+/* Flushes the bundles that are older than the bundle timeout, all of them
+ * if there's none */
+void rxm_ep_progress_bundles(struct rxm_ep *rxm_ep)
+{
+	struct rxm_conn *rxm_conn;
+	struct dlist_entry flush_list;
+	uint64_t now = rxm_ep->bundle_timeout ? fi_gettime_us() : 0;
+
+	dlist_init(&flush_list);
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	dlist_splice_tail(&flush_list, &rxm_ep->bundle_conn_list);
+	while (!dlist_empty(&flush_list)) {
+		rxm_conn = container_of(flush_list.next, struct rxm_conn,
+					bundle_entry);
+		dlist_remove_init(&rxm_conn->bundle_entry);
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
+		rxm_ep->res_fastlock_acquire(&rxm_conn->send_queue.lock);
+		if (rxm_conn->bundle &&
+		    (now - rxm_conn->bundle_start < rxm_ep->bundle_timeout ||
+		     rxm_conn_bundle_flush_locked(rxm_ep, rxm_conn))) {
+			/* Not expired or out of resources, check it again on
+			 * the next progress */
+			rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+			if (dlist_empty(&rxm_conn->bundle_entry))
+				dlist_insert_tail(&rxm_conn->bundle_entry,
+						  &rxm_ep->bundle_conn_list);
+			rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+		}
+		rxm_ep->res_fastlock_release(&rxm_conn->send_queue.lock);
+
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Returns the credits of consumed eager messages to the peers that didn't
+ * get them back with other traffic */
+void rxm_ep_progress_credits(struct rxm_ep *rxm_ep)
+{
+	struct rxm_conn *rxm_conn;
+	uint32_t credits;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	while (!dlist_empty(&rxm_ep->credit_update_list)) {
+		rxm_conn = container_of(rxm_ep->credit_update_list.next,
+					struct rxm_conn, credit_entry);
+		credits = rxm_conn->eager_rx_pending;
+		if (credits &&
+		    ((rxm_conn->handle.state == CMAP_CONNECTED) ||
+		     (rxm_conn->handle.state == CMAP_CONNECTED_NOTIFY))) {
+			/* Retried on the next progress */
+			if (rxm_conn_inject_ctrl(rxm_conn, ofi_ctrl_credit, 0,
+						 credits))
+				break;
+			rxm_conn->eager_rx_pending = 0;
+			rxm_ep->credit_updates++;
+		}
+		dlist_remove_init(&rxm_conn->credit_entry);
+	}
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+}
+
+/* Packs a small message into the open bundle of the connection, opening a
+ * new one if needed. The message completes once the whole bundle has been
+ * sent by the MSG provider. Only messages that report a completion are
+ * bundled: waiting for it drives the progress that flushes the bundle */
+static ssize_t
+rxm_ep_bundle_send(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn,
+		   const struct iovec *iov, size_t count, size_t data_len,
+		   void *context, uint64_t data, uint64_t flags, uint64_t tag,
+		   uint8_t op, uint64_t comp_flags)
+{
+	struct rxm_tx_entry *tx_entry;
+	struct rxm_tx_buf *tx_buf;
+	struct ofi_op_hdr *hdr;
+	size_t msg_size = sizeof(*hdr) + fi_get_aligned_sz(data_len, 8);
+	ssize_t ret;
+
+	ret = rxm_ep_format_tx_entry(rxm_conn, context, (uint8_t)count, flags,
+				     comp_flags, NULL, &tx_entry);
+	if (OFI_UNLIKELY(ret))
+		return ret;
+	tx_entry->state = RXM_BUNDLE_TX;
+
+	/* Each bundled message takes an RX buffer of its own at the peer,
+	 * returned credits go with the whole bundle when it's flushed */
+	if (OFI_UNLIKELY(rxm_conn_credit_tx(rxm_ep, rxm_conn, 1, NULL))) {
+		rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+		return -FI_EAGAIN;
+	}
+
+	rxm_ep->res_fastlock_acquire(&rxm_conn->send_queue.lock);
+	tx_buf = rxm_conn->bundle;
+	if (tx_buf && (tx_buf->pkt.hdr.size + msg_size > rxm_ep->bundle_size)) {
+		ret = rxm_conn_bundle_flush_locked(rxm_ep, rxm_conn);
+		if (OFI_UNLIKELY(ret))
+			goto unlock;
+		tx_buf = NULL;
+	}
+	if (!tx_buf) {
+		tx_buf = rxm_tx_buf_get(rxm_ep, RXM_BUF_POOL_TX_BUNDLE);
+		if (OFI_UNLIKELY(!tx_buf)) {
+			ret = -FI_EAGAIN;
+			goto unlock;
+		}
+		tx_buf->pkt.ctrl_hdr.conn_id = rxm_conn->handle.remote_key;
+		tx_buf->pkt.hdr.size = 0;
+		rxm_conn->bundle = tx_buf;
+		rxm_conn->bundle_start = rxm_ep->bundle_timeout ?
+					 fi_gettime_us() : 0;
+
+		rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+		dlist_insert_tail(&rxm_conn->bundle_entry,
+				  &rxm_ep->bundle_conn_list);
+		rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	}
+
+	hdr = (struct ofi_op_hdr *)(tx_buf->pkt.data + tx_buf->pkt.hdr.size);
+	hdr->version = OFI_OP_VERSION;
+	hdr->rx_index = 0;
+	hdr->op = op;
+	hdr->op_data = 0;
+	hdr->flags = comp_flags | (flags & FI_REMOTE_CQ_DATA);
+	hdr->size = data_len;
+	hdr->data = (flags & FI_REMOTE_CQ_DATA) ? data : 0;
+	hdr->tag = tag;
+	ofi_copy_from_iov(hdr + 1, data_len, iov, count, 0);
+	tx_buf->pkt.hdr.size += msg_size;
+
+	tx_entry->tx_buf = tx_buf;
+	dlist_insert_tail(&tx_entry->deferred_entry, &tx_buf->bundle_list);
+
+	/* Send a full bundle right away, or leave it to the progress if the
+	 * MSG provider is out of resources */
+	if (tx_buf->pkt.hdr.size + sizeof(*hdr) + sizeof(uint64_t) >
+	    rxm_ep->bundle_size)
+		(void) rxm_conn_bundle_flush_locked(rxm_ep, rxm_conn);
+unlock:
+	rxm_ep->res_fastlock_release(&rxm_conn->send_queue.lock);
+	if (OFI_UNLIKELY(ret)) {
+		rxm_conn_credit_tx_undo(rxm_ep, rxm_conn, 1, 0);
+		rxm_tx_entry_release(&rxm_conn->send_queue, tx_entry);
+	}
+	return ret;
+}
+
+/* Eager messages stall, rather than queue up, once the peer's budget is
+ * used up. Progress once in case credits are waiting in the CQ */
+static inline int
+rxm_conn_wait_credit(struct rxm_ep *rxm_ep, struct rxm_conn *rxm_conn)
+{
+	if (OFI_LIKELY(rxm_conn_has_credit(rxm_conn)))
+		return 0;
+
+	rxm_ep_progress_multi(&rxm_ep->util_ep);
+	if (rxm_conn_has_credit(rxm_conn))
+		return 0;
+
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	rxm_ep->eager_stalls++;
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+	return -FI_EAGAIN;
+}
+
 static inline ssize_t
 rxm_ep_inject_common(struct rxm_ep *rxm_ep, const void *buf, size_t len,
 		     fi_addr_t dest_addr, uint64_t data, uint64_t flags,
@@ -1231,6 +1686,10 @@ rxm_ep_inject_common(struct rxm_ep *rxm_ep, const void *buf, size_t len,
 
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, dest_addr);
+	if (OFI_UNLIKELY(!rxm_conn)) {
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+		return -FI_ENOMEM;
+	}
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, dest_addr);
 		fastlock_release(&rxm_ep->util_ep.cmap->lock);
@@ -1244,6 +1703,9 @@ rxm_ep_inject_common(struct rxm_ep *rxm_ep, const void *buf, size_t len,
 	fastlock_release(&rxm_ep->util_ep.cmap->lock);
 
 inject_continue:
+	if (OFI_UNLIKELY(rxm_conn_wait_credit(rxm_ep, rxm_conn)))
+		return -FI_EAGAIN;
+
 	if (OFI_UNLIKELY(!dlist_empty(&rxm_conn->deferred_op_list))) {
 		rxm_ep_progress_multi(&rxm_ep->util_ep);
 		if (!dlist_empty(&rxm_conn->deferred_op_list)) {
@@ -1252,6 +1714,10 @@ inject_continue:
 		}
 	}
 
+	if (OFI_UNLIKELY(rxm_conn->bundle != NULL) &&
+	    rxm_conn_bundle_flush(rxm_ep, rxm_conn))
+		return -FI_EAGAIN;
+
 	if (pkt_size <= rxm_ep->msg_info->tx_attr->inject_size) {
 		ret = rxm_ep_format_tx_inject_buf(
 				rxm_ep, rxm_conn, buf, len,
@@ -1275,7 +1741,7 @@ inject_continue:
 		ret = rxm_ep_format_tx_res(rxm_ep, rxm_conn, NULL, 1,
 					   len, data, flags, comp_flags,
 					   tag, &tx_buf, &tx_entry,
-					   &rxm_ep->buf_pools[RXM_BUF_POOL_TX]);
+					   rxm_ep_tx_pool(rxm_ep, len));
 		if (OFI_UNLIKELY(ret))
 			goto defer;
 		rxm_ep_fill_tx_inject_buf(rxm_ep, buf, len, op, comp_flags, tx_buf);
@@ -1319,6 +1785,10 @@ rxm_ep_send_common(struct rxm_ep *rxm_ep, const struct iovec *iov, void **desc,
 
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, dest_addr);
+	if (OFI_UNLIKELY(!rxm_conn)) {
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+		return -FI_ENOMEM;
+	}
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, dest_addr);
 		fastlock_release(&rxm_ep->util_ep.cmap->lock);
@@ -1336,6 +1806,10 @@ rxm_ep_send_common(struct rxm_ep *rxm_ep, const struct iovec *iov, void **desc,
 	fastlock_release(&rxm_ep->util_ep.cmap->lock);
 
 send_continue:
+	if ((data_len <= rxm_ep->rxm_info->tx_attr->inject_size) &&
+	    OFI_UNLIKELY(rxm_conn_wait_credit(rxm_ep, rxm_conn)))
+		return -FI_EAGAIN;
+
 	if (OFI_UNLIKELY(!dlist_empty(&rxm_conn->deferred_op_list))) {
 		rxm_ep_progress_multi(&rxm_ep->util_ep);
 		if (!dlist_empty(&rxm_conn->deferred_op_list)) {
@@ -1347,6 +1821,15 @@ send_continue:
 		}
 	}
 
+	if (rxm_ep->bundle_size && (data_len <= rxm_ep->bundle_msg_size) &&
+	    (flags & FI_COMPLETION))
+		return rxm_ep_bundle_send(rxm_ep, rxm_conn, iov, count,
+					  data_len, context, data, flags, tag,
+					  op, comp_flags);
+	if (OFI_UNLIKELY(rxm_conn->bundle != NULL) &&
+	    rxm_conn_bundle_flush(rxm_ep, rxm_conn))
+		return -FI_EAGAIN;
+
 	if (data_len <= rxm_ep->rxm_info->tx_attr->inject_size) {
 		size_t total_len = sizeof(struct rxm_pkt) + data_len;
 
@@ -1369,7 +1852,7 @@ send_continue:
 		ret = rxm_ep_format_tx_res(rxm_ep, rxm_conn, context,
 					   (uint8_t)count, data_len, data, flags,
 					   comp_flags, tag, &tx_buf, &tx_entry,
-					   &rxm_ep->buf_pools[RXM_BUF_POOL_TX]);
+					   rxm_ep_tx_pool(rxm_ep, data_len));
 		if (OFI_UNLIKELY(ret))
 			return ret;
 		rxm_ep_fill_tx_inject_iov(rxm_ep, iov, count, op, comp_flags, tx_buf);
@@ -1382,13 +1865,14 @@ send_continue:
 		return ret;
 	} else {
 		assert(!(flags & FI_INJECT));
-		if ((data_len <= rxm_ep->sar_limit) &&
-		    /* Roughly estimate whether all SAR segments can be sent w/o
-		     * retransmission due to lack of space in the TX queue */
-		    (rxm_ep_sar_estimate_segments_num(rxm_ep, data_len) <=
-						rxm_ep->rxm_info->tx_attr->size)) {
+		if (data_len <= rxm_ep->sar_limit) {
 			return rxm_ep_sar_tx_send(rxm_ep, rxm_conn, context, count, iov,
 						  data_len, data, flags, comp_flags, tag, op);
+		} else if (data_len <= rxm_ep->rndv_write_limit) {
+			return rxm_ep_rndv_write_send(rxm_ep, rxm_conn, context,
+						      (uint8_t)count, iov, desc,
+						      data_len, data, flags,
+						      comp_flags, tag, op);
 		} else {
 			ret = rxm_ep_alloc_lmt_tx_res(rxm_ep, rxm_conn, context,
 						      (uint8_t)count, iov, desc,
@@ -1692,6 +2176,16 @@ static int rxm_ep_close(struct fid *fid)
 	}
 	OFI_UNUSED(tmp_list_entry); /* to avoid "set, but not used" warning*/
 
+	if (rxm_ep->eager_stalls || rxm_ep->credit_updates)
+		FI_INFO(&rxm_prov, FI_LOG_EP_CTRL, "Sends stalled for eager "
+			"credits: %" PRIu64 ", credit updates sent: %" PRIu64
+			"\n", rxm_ep->eager_stalls, rxm_ep->credit_updates);
+
+	rxm_conn_progress_free(rxm_ep);
+	rxm_ep->res_fastlock_acquire(&rxm_ep->util_ep.lock);
+	rxm_ep->closing = 1;
+	rxm_ep->res_fastlock_release(&rxm_ep->util_ep.lock);
+
 	if (rxm_ep->util_ep.cmap)
 		ofi_cmap_free(rxm_ep->util_ep.cmap);
 
@@ -1889,6 +2383,24 @@ err1:
 	return ret;
 }
 
+static int rxm_ep_has_wait(struct rxm_ep *rxm_ep)
+{
+	struct util_ep *util_ep = &rxm_ep->util_ep;
+	struct util_cntr *cntrs[] = {
+		util_ep->tx_cntr, util_ep->rx_cntr, util_ep->rd_cntr,
+		util_ep->wr_cntr, util_ep->rem_rd_cntr, util_ep->rem_wr_cntr,
+	};
+	size_t i;
+
+	if (util_ep->tx_cq->wait || util_ep->rx_cq->wait)
+		return 1;
+	for (i = 0; i < sizeof(cntrs) / sizeof(cntrs[0]); i++) {
+		if (cntrs[i] && cntrs[i]->wait)
+			return 1;
+	}
+	return 0;
+}
+
 static int rxm_ep_ctrl(struct fid *fid, int command, void *arg)
 {
 	struct rxm_ep *rxm_ep;
@@ -1903,6 +2415,15 @@ static int rxm_ep_ctrl(struct fid *fid, int command, void *arg)
 		if (!rxm_ep->util_ep.av || !rxm_ep->util_ep.cmap)
 			return -FI_EOPBADSTATE;
 
+		/* A blocking read progresses once before sleeping, so a
+		 * bundle can't be left open until its timeout expires */
+		if (rxm_ep->bundle_timeout && rxm_ep_has_wait(rxm_ep)) {
+			FI_INFO(&rxm_prov, FI_LOG_EP_CTRL, "CQ or counter with "
+				"a wait object bound, bundles are flushed on "
+				"every progress\n");
+			rxm_ep->bundle_timeout = 0;
+		}
+
 		if (rxm_ep->srx_ctx) {
 			ret = rxm_ep_prepost_buf(rxm_ep, rxm_ep->srx_ctx);
 			if (ret) {
@@ -1919,12 +2440,44 @@ static int rxm_ep_ctrl(struct fid *fid, int command, void *arg)
 	return 0;
 }
 
+static int rxm_ep_get_stats(struct fid_ep *ep_fid,
+			    struct fi_rxm_ep_stats *stats)
+{
+	struct rxm_ep *rxm_ep =
+		container_of(ep_fid, struct rxm_ep, util_ep.ep_fid);
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (rxm_ep->util_ep.cmap) {
+		fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
+		stats->conn_evictions = rxm_ep->conn_evictions;
+		stats->conn_reconnects = rxm_ep->conn_reconnects;
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+	}
+	return 0;
+}
+
+static struct fi_rxm_ops_ep rxm_ops_ep_ext = {
+	.size = sizeof(struct fi_rxm_ops_ep),
+	.get_stats = rxm_ep_get_stats,
+};
+
+static int rxm_ep_ops_open(struct fid *fid, const char *ops_name,
+			   uint64_t flags, void **ops, void *context)
+{
+	if (strcmp(ops_name, FI_RXM_EP_OPS_1))
+		return -FI_EINVAL;
+
+	*ops = &rxm_ops_ep_ext;
+	return 0;
+}
+
 static struct fi_ops rxm_ep_fi_ops = {
 	.size = sizeof(struct fi_ops),
 	.close = rxm_ep_close,
 	.bind = rxm_ep_bind,
 	.control = rxm_ep_ctrl,
-	.ops_open = fi_no_ops_open,
+	.ops_open = rxm_ep_ops_open,
 };
 
 static int rxm_listener_open(struct rxm_ep *rxm_ep)
@@ -2007,8 +2560,8 @@ static int rxm_ep_msg_res_open(struct util_domain *util_domain,
 	if (ret)
 		return ret;
 
-	max_prog_val = MIN(rxm_ep->msg_info->tx_attr->size,
-			   rxm_ep->msg_info->rx_attr->size) / 2;
+	max_prog_val = MAX(MIN(rxm_ep->msg_info->tx_attr->size,
+			       rxm_ep->msg_info->rx_attr->size) / 2, 1);
 	rxm_ep->comp_per_progress = (rxm_ep->comp_per_progress > max_prog_val) ?
 				    max_prog_val : rxm_ep->comp_per_progress;
 	rxm_ep->eager_pkt_size =
@@ -2070,12 +2623,12 @@ int rxm_endpoint(struct fid_domain *domain, struct fi_info *info,
 			     (int *)&rxm_ep->comp_per_progress)) {
 		ret = ofi_endpoint_init(domain, &rxm_util_prov,
 					info, &rxm_ep->util_ep,
-					context, &rxm_ep_progress_multi);
+					context, &rxm_ep_cq_progress_multi);
 	} else {
-		rxm_ep->comp_per_progress = 1;
+		rxm_ep->comp_per_progress = RXM_MSG_CQ_BATCH;
 		ret = ofi_endpoint_init(domain, &rxm_util_prov,
 					info, &rxm_ep->util_ep,
-					context, &rxm_ep_progress_one);
+					context, &rxm_ep_cq_progress_one);
 		if (ret)
 			goto err1;
 	}
@@ -2105,6 +2658,7 @@ int rxm_endpoint(struct fid_domain *domain, struct fi_info *info,
 	(*ep_fid)->msg = &rxm_ops_msg;
 	(*ep_fid)->tagged = &rxm_ops_tagged;
 	(*ep_fid)->rma = &rxm_ops_rma;
+	(*ep_fid)->atomic = &rxm_ops_atomic;
 
 	return 0;
 err3:
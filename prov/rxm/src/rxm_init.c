@@ -81,7 +81,8 @@ int rxm_info_to_core(uint32_t version, const struct fi_info *hints,
 	core_info->mode |= FI_RX_CQ_DATA | FI_CONTEXT;
 
 	if (hints) {
-		if (hints->caps & FI_TAGGED)
+		/* Tagged messages and atomics are carried over FI_MSG */
+		if (hints->caps & (FI_TAGGED | FI_ATOMIC))
 			core_info->caps |= FI_MSG;
 
 		/* FI_RMA cap is needed for large message transfer protocol */
@@ -271,12 +272,13 @@ RXM_INI
 			"eager protocol and those above would be transmitted "
 			"via a rendezvous or SAR (Segmentation And Reassembly) "
 			"protocol. Transmit data would be copied up to this size "
-			"(default: ~16k).");
+			"(default: ~2k). Receive buffers of this size are "
+			"preposted for every connection.");
 
 	fi_param_define(&rxm_prov, "comp_per_progress", FI_PARAM_INT,
 			"Defines the maximum number of MSG provider CQ entries "
-			"(default: 1) that would be read per progress "
-			"(RxM CQ read).");
+			"that would be read per progress (RxM CQ read). By "
+			"default a single batch of up to 16 entries is read.");
 
 	fi_param_define(&rxm_prov, "sar_limit", FI_PARAM_SIZE_T,
 			"Set this environment variable to control the RxM SAR "
@@ -284,6 +286,45 @@ RXM_INI
 			"Messages of size greater than this (default: 256 Kb) "
 			"would be transmitted via rendezvous protocol.");
 
+	fi_param_define(&rxm_prov, "rndv_write_limit", FI_PARAM_SIZE_T,
+			"Messages of size greater than sar_limit and up to this "
+			"(default: 16 Mb) are transmitted via a write-based "
+			"rendezvous: the receiver returns the address of its "
+			"buffer and the sender writes the data with RMA writes. "
+			"Larger messages are read by the receiver. Set to 0 to "
+			"always use the read-based rendezvous.");
+
+	fi_param_define(&rxm_prov, "bundle_size", FI_PARAM_SIZE_T,
+			"Packs small messages sent to the same peer into bundles "
+			"of up to this size (default: 0, disabled), capped by "
+			"the eager buffer size. Messages that report a "
+			"completion and take at most half of a bundle are "
+			"eligible. Trades some latency for a higher message "
+			"rate.");
+
+	fi_param_define(&rxm_prov, "bundle_timeout", FI_PARAM_INT,
+			"Time in microseconds that a bundle may wait for more "
+			"messages before the progress engine sends it "
+			"(default: 10). Set to 0 to send them on every progress. "
+			"Ignored if a CQ or counter with a wait object is "
+			"bound to the endpoint.");
+
+	fi_param_define(&rxm_prov, "eager_credits", FI_PARAM_SIZE_T,
+			"Number of eager messages that each peer may have "
+			"buffered at this endpoint, matched or not, before it "
+			"has to wait for credits (default: 0, unlimited). A "
+			"sender that is out of credits gets -FI_EAGAIN for "
+			"messages up to the eager size. Bounds the memory used "
+			"for unexpected messages.");
+
+	fi_param_define(&rxm_prov, "max_conn", FI_PARAM_SIZE_T,
+			"Defines the maximum number of active MSG provider "
+			"connections per RxM endpoint (default: 0, unlimited). "
+			"When the limit is reached, the least recently used idle "
+			"connection is closed and re-established transparently "
+			"on the next transfer to that peer. Ignored if use_srx "
+			"is enabled.");
+
 	fi_param_define(&rxm_prov, "use_srx", FI_PARAM_BOOL,
 			"Set this enivronment variable to control the RxM "
 			"receive path. If this variable set to 1 (default: 0), "
@@ -291,6 +332,20 @@ RXM_INI
 			"memory consumption, but it may increase small message "
 			"latency as a side-effect.");
 
+	fi_param_define(&rxm_prov, "mr_cache_enable", FI_PARAM_BOOL,
+			"Keeps the MSG provider registrations of the user "
+			"buffers of rendezvous transfers and RMA operations "
+			"in a cache for reuse (default: no). Without a memory "
+			"monitor, buffers must not be freed while cached.");
+
+	fi_param_define(&rxm_prov, "mr_max_cached_cnt", FI_PARAM_INT,
+			"Maximum number of registrations kept in the MR cache "
+			"(default: 4096).");
+
+	fi_param_define(&rxm_prov, "mr_max_cached_size", FI_PARAM_SIZE_T,
+			"Maximum total size of the memory kept registered by "
+			"the MR cache (default: unlimited).");
+
 	if (rxm_init_info()) {
 		FI_WARN(&rxm_prov, FI_LOG_CORE, "Unable to initialize rxm_info\n");
 		return NULL;
@@ -237,6 +237,10 @@ rxm_ep_rma_common(struct rxm_ep *rxm_ep, const struct fi_msg_rma *msg, uint64_t
 
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, msg->addr);
+	if (OFI_UNLIKELY(!rxm_conn)) {
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+		return -FI_ENOMEM;
+	}
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, msg->addr);
 		if (!ret)
@@ -247,6 +251,10 @@ rxm_ep_rma_common(struct rxm_ep *rxm_ep, const struct fi_msg_rma *msg, uint64_t
 rma_continue:
 	fastlock_release(&rxm_ep->util_ep.cmap->lock);
 
+	if (OFI_UNLIKELY(rxm_conn->bundle != NULL) &&
+	    rxm_conn_bundle_flush(rxm_ep, rxm_conn))
+		return -FI_EAGAIN;
+
 	ret = rxm_ep_format_rma_res_lightweight(rxm_ep, rxm_conn, flags,
 						comp_flags, msg, &tx_entry);
 	if (OFI_UNLIKELY(ret))
@@ -348,6 +356,10 @@ rxm_ep_rma_inject(struct rxm_ep *rxm_ep, const struct fi_msg_rma *msg, uint64_t
 
 	fastlock_acquire(&rxm_ep->util_ep.cmap->lock);
 	rxm_conn = rxm_acquire_conn(rxm_ep, msg->addr);
+	if (OFI_UNLIKELY(!rxm_conn)) {
+		fastlock_release(&rxm_ep->util_ep.cmap->lock);
+		return -FI_ENOMEM;
+	}
 	if (OFI_UNLIKELY(rxm_conn->handle.state != CMAP_CONNECTED)) {
 		ret = rxm_ep_handle_unconnected(rxm_ep, &rxm_conn->handle, msg->addr);
 		if (!ret)
@@ -358,6 +370,10 @@ rxm_ep_rma_inject(struct rxm_ep *rxm_ep, const struct fi_msg_rma *msg, uint64_t
 rma_inject_continue:
 	fastlock_release(&rxm_ep->util_ep.cmap->lock);
 
+	if (OFI_UNLIKELY(rxm_conn->bundle != NULL) &&
+	    rxm_conn_bundle_flush(rxm_ep, rxm_conn))
+		return -FI_EAGAIN;
+
 	if (OFI_UNLIKELY(total_size > rxm_ep->rxm_info->tx_attr->inject_size))
 		return -FI_EMSGSIZE;
 
@@ -56,6 +56,7 @@
 #include <ofi_shm.h>
 #include <ofi_rbuf.h>
 #include <ofi_list.h>
+#include <ofi_match.h>
 #include <ofi_signal.h>
 #include <ofi_util.h>
 #include <ofi_atomic.h>
@@ -70,6 +71,9 @@
 extern struct fi_provider smr_prov;
 extern struct fi_info smr_info;
 extern struct util_prov smr_util_prov;
+extern int smr_cma_enabled;
+extern int smr_sar_enabled;
+extern size_t smr_cmd_queue_count;
 
 int smr_fabric(struct fi_fabric_attr *attr, struct fid_fabric **fabric,
 		void *context);
@@ -94,11 +98,8 @@ int smr_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
 #define SMR_IOV_LIMIT		4
 
 struct smr_ep_entry {
-	struct dlist_entry	entry;
+	struct ofi_mq_entry	match;
 	void			*context;
-	fi_addr_t		addr;
-	uint64_t		tag;
-	uint64_t		ignore;
 	struct iovec		iov[SMR_IOV_LIMIT];
 	uint32_t		iov_count;
 	uint32_t		flags;
@@ -112,37 +113,32 @@ typedef int (*smr_rx_comp_func)(struct smr_ep *ep, void *context,
 typedef int (*smr_tx_comp_func)(struct smr_ep *ep, void *context,
 		uint64_t flags, uint64_t err);
 
-
-struct smr_match_attr {
-	fi_addr_t	addr;
-	uint64_t	tag;
-	uint64_t	ignore;
-};
-
-static inline int smr_match_addr(fi_addr_t addr, fi_addr_t match_addr)
-{
-	return (addr == FI_ADDR_UNSPEC) || (match_addr == FI_ADDR_UNSPEC) ||
-		(addr == match_addr);
-}
-
-static inline int smr_match_tag(uint64_t tag, uint64_t ignore, uint64_t match_tag)
-{
-	return ((tag | ignore) == (match_tag | ignore));
-}
-
 struct smr_unexp_msg {
-	struct dlist_entry entry;
+	struct ofi_mq_entry match;
 	struct smr_cmd cmd;
 };
 
+/*
+ * Tracks a transfer through a bounce buffer.  The sender keeps one for
+ * its side of the copy; the receiver keeps a copy of the cmd and, for
+ * messages, the matched receive.
+ */
+struct smr_sar_entry {
+	struct dlist_entry	entry;
+	struct smr_cmd		cmd;
+	struct smr_ep_entry	rx_entry;
+	struct iovec		iov[SMR_IOV_LIMIT];
+	size_t			iov_count;
+	size_t			bytes_done;
+	int			next;
+	int			err;
+	struct smr_sar_buf	*sar;
+};
+
 DECLARE_FREESTACK(struct smr_ep_entry, smr_recv_fs);
 DECLARE_FREESTACK(struct smr_unexp_msg, smr_unexp_fs);
 DECLARE_FREESTACK(struct smr_cmd, smr_pend_fs);
-
-struct smr_queue {
-	struct dlist_entry list;
-	dlist_func_t *match_func;
-};
+DECLARE_FREESTACK(struct smr_sar_entry, smr_sar_fs);
 
 struct smr_fabric {
 	struct util_fabric	util_fabric;
@@ -181,12 +177,17 @@ struct smr_ep {
 	size_t			min_multi_recv_size;
 	const char		*name;
 	struct smr_region	*region;
+	int			qid; /* cmd queue used at peers */
 	struct smr_recv_fs	*recv_fs; /* protected by rx_cq lock */
-	struct smr_queue	recv_queue;
-	struct smr_queue	trecv_queue;
+	struct ofi_mq		recv_queue;
+	struct ofi_mq		trecv_queue;
 	struct smr_unexp_fs	*unexp_fs;
 	struct smr_pend_fs	*pend_fs;
-	struct smr_queue	unexp_queue;
+	struct ofi_mq		unexp_queue;
+	struct smr_sar_fs	*tx_sar_fs; /* protected by tx_cq lock */
+	struct dlist_entry	tx_sar_list;
+	struct smr_sar_fs	*rx_sar_fs; /* protected by rx_cq lock */
+	struct dlist_entry	rx_sar_list;
 };
 
 #define smr_ep_rx_flags(smr_ep) ((smr_ep)->util_ep.rx_op_flags)
@@ -200,6 +201,11 @@ int smr_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 
 int smr_verify_peer(struct smr_ep *ep, int peer_id);
 
+static inline int smr_cma_capable(struct smr_region *smr, int peer_id)
+{
+	return smr_map_peer(smr->map, peer_id)->cma;
+}
+
 void smr_post_pend_resp(struct smr_cmd *cmd, struct smr_cmd *pend,
 			struct smr_resp *resp);
 void smr_generic_format(struct smr_cmd *cmd, fi_addr_t peer_id,
@@ -217,6 +223,12 @@ void smr_format_iov(struct smr_cmd *cmd, fi_addr_t peer_id,
 		uint32_t op, uint64_t tag, uint64_t data, uint64_t op_flags,
 		void *context, struct smr_region *smr, struct smr_resp *resp,
 		struct smr_cmd *pend);
+void smr_format_sar(struct smr_cmd *cmd, fi_addr_t peer_id,
+		const struct iovec *iov, size_t count, size_t total_len,
+		uint32_t op, uint64_t tag, uint64_t data, uint64_t op_flags,
+		void *context, struct smr_region *smr, struct smr_resp *resp,
+		struct smr_cmd *pend, struct smr_region *peer_smr,
+		struct smr_sar_buf *sar, struct smr_sar_entry *sar_entry);
 
 int smr_tx_comp(struct smr_ep *ep, void *context, uint64_t flags, uint64_t err);
 int smr_tx_comp_signal(struct smr_ep *ep, void *context, uint64_t flags,
@@ -240,5 +252,6 @@ uint64_t smr_mr_reg_flags(uint32_t op, uint16_t atomic_op);
 
 void smr_ep_progress(struct util_ep *util_ep);
 int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry);
+void smr_progress_sar_tx(struct smr_ep *ep, struct smr_sar_entry *sar_entry);
 
 #endif
@@ -192,11 +192,14 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 	struct smr_ep *ep;
 	struct smr_domain *domain;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_cmd_queue *cmd_queue;
+	struct smr_inject_pool *inject_pool;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
 	struct iovec iov[SMR_IOV_LIMIT];
 	struct iovec compare_iov[SMR_IOV_LIMIT];
 	struct iovec result_iov[SMR_IOV_LIMIT];
+	int64_t pos;
 	int peer_id, err = 0;
 	uint16_t flags = 0;
 	ssize_t ret = 0;
@@ -216,11 +219,8 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < 2) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
+	cmd_queue = smr_cmd_queue(peer_smr, ep->qid);
+	inject_pool = smr_inject_pool(peer_smr, ep->qid);
 
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	if (ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -228,7 +228,6 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		goto unlock_cq;
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
 	msg_len = total_len = ofi_datatype_size(datatype) *
 			      ofi_total_ioc_cnt(ioc, count);
 	
@@ -258,56 +257,72 @@ static ssize_t smr_generic_atomic(struct fid_ep *ep_fid,
 		break;
 	}
 
-	if (total_len <= SMR_MSG_DATA_LEN && !(flags & SMR_RMA_REQ)) {
+	if (total_len > SMR_INJECT_SIZE) {
+		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+			"message too large\n");
+		ret = -FI_EINVAL;
+		goto unlock_cq;
+	}
+
+	if (total_len > SMR_MSG_DATA_LEN || flags & SMR_RMA_REQ) {
+		tx_buf = smr_inject_pool_pop(inject_pool);
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	}
+
+	cmd = smr_cmd_queue_reserve(cmd_queue, 2, &pos);
+	if (!cmd) {
+		if (tx_buf)
+			smr_inject_pool_push(inject_pool, tx_buf);
+		ret = -FI_EAGAIN;
+		goto unlock_cq;
+	}
+
+	if (!tx_buf) {
 		smr_format_inline_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 iov, count, compare_iov, compare_count,
 					 op, datatype, atomic_op);
-	} else if (total_len <= SMR_INJECT_SIZE) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+	} else {
 		smr_format_inject_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 iov, count, result_iov, result_count,
 					 compare_iov, compare_count, op, datatype,
 					 atomic_op, peer_smr, tx_buf);
-	} else {
-		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
-			"message too large\n");
-		ret = -FI_EINVAL;
-		goto unlock_cq;
 	}
 	cmd->msg.hdr.op_flags |= flags;
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-
+	/* The fetch must complete before the target can apply the op */
 	if (op != ofi_op_atomic) {
 		if (flags & SMR_RMA_REQ) {
 			smr_post_fetch_resp(ep, cmd,
 				(const struct iovec *) result_iov,
 				result_count);
-			goto format_rma;
+		} else {
+			err = smr_fetch_result(ep, peer_smr, result_iov,
+					       result_count, rma_ioc, rma_count,
+					       datatype, msg_len);
+			if (err)
+				FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+					"unable to fetch results");
 		}
-		err = smr_fetch_result(ep, peer_smr, result_iov, result_count,
-				       rma_ioc, rma_count, datatype, msg_len);
-		if (err)
-			FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
-				"unable to fetch results");
 	}
 
+	cmd = smr_cmd_queue_entry(cmd_queue, pos + 1);
+	smr_format_rma_ioc(cmd, rma_ioc, rma_count);
+	smr_cmd_queue_commit(cmd_queue, pos, 2);
+
+	if (flags & SMR_RMA_REQ)
+		goto unlock_cq;
+
 	ret = ep->tx_comp(ep, context, smr_tx_comp_flags(op), err);
 	if (ret) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process tx completion\n");
 	}
 
-format_rma:
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-	smr_format_rma_ioc(cmd, rma_ioc, rma_count);
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
 unlock_cq:
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-unlock_region:
-	fastlock_release(&peer_smr->lock);
 	return ret;
 }
 
@@ -363,10 +378,13 @@ static ssize_t smr_atomic_inject(struct fid_ep *ep_fid, const void *buf,
 {
 	struct smr_ep *ep;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_cmd_queue *cmd_queue;
+	struct smr_inject_pool *inject_pool;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
 	struct iovec iov;
 	struct fi_rma_ioc rma_ioc;
+	int64_t pos;
 	int peer_id;
 	ssize_t ret = 0;
 	size_t total_len;
@@ -381,15 +399,23 @@ static ssize_t smr_atomic_inject(struct fid_ep *ep_fid, const void *buf,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < 2) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
+	cmd_queue = smr_cmd_queue(peer_smr, ep->qid);
+	inject_pool = smr_inject_pool(peer_smr, ep->qid);
+	total_len = count * ofi_datatype_size(datatype);
+
+	if (total_len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_inject_pool_pop(inject_pool);
+		if (!tx_buf)
+			return -FI_EAGAIN;
+	}
+
+	cmd = smr_cmd_queue_reserve(cmd_queue, 2, &pos);
+	if (!cmd) {
+		if (tx_buf)
+			smr_inject_pool_push(inject_pool, tx_buf);
+		return -FI_EAGAIN;
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-	total_len = count * ofi_datatype_size(datatype);
-	
 	iov.iov_base = (void *) buf;
 	iov.iov_len = total_len;
 
@@ -401,22 +427,16 @@ static ssize_t smr_atomic_inject(struct fid_ep *ep_fid, const void *buf,
 		smr_format_inline_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 &iov, 1, NULL, 0, ofi_op_atomic,
 					 datatype, op);
-	} else if (total_len <= SMR_INJECT_SIZE) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
+	} else {
 		smr_format_inject_atomic(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 					 &iov, 1, NULL, 0, NULL, 0, ofi_op_atomic,
 					 datatype, op, peer_smr, tx_buf);
 	}
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	cmd = smr_cmd_queue_entry(cmd_queue, pos + 1);
 	smr_format_rma_ioc(cmd, &rma_ioc, 1);
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+	smr_cmd_queue_commit(cmd_queue, pos, 2);
 
-unlock_region:
-	fastlock_release(&peer_smr->lock);
 	return ret;
 }
 
@@ -102,7 +102,8 @@ int smr_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 	fastlock_acquire(&smr_fabric->util_fabric.lock);
 	smr_domain->dom_idx = smr_fabric->dom_idx++;
 	smr_domain->fast_rma = smr_fast_rma_enabled(info->domain_attr->mr_mode,
-						    info->tx_attr->msg_order);
+						    info->tx_attr->msg_order) &&
+			       smr_cma_enabled;
 	fastlock_release(&smr_fabric->util_fabric.lock);
 
 	*domain = &smr_domain->util_domain.domain_fid;
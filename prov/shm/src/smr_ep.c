@@ -30,11 +30,13 @@
  * SOFTWARE.
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/uio.h>
 
 #include "ofi_iov.h"
+#include "fasthash.h"
 #include "smr.h"
 
 extern struct fi_ops_msg smr_msg_ops;
@@ -116,30 +118,30 @@ int smr_setopt(fid_t fid, int level, int optname,
 }
 
 
-static int smr_match_recv_ctx(struct dlist_entry *item, const void *args)
+static int smr_match_recv_ctx(struct ofi_mq_entry *item, const void *args)
 {
 	struct smr_ep_entry *pending_recv;
 
-	pending_recv = container_of(item, struct smr_ep_entry, entry);
+	pending_recv = container_of(item, struct smr_ep_entry, match);
 	return pending_recv->context == args;
 }
 
-static int smr_ep_cancel_recv(struct smr_ep *ep, struct smr_queue *queue,
+static int smr_ep_cancel_recv(struct smr_ep *ep, struct ofi_mq *queue,
 			      void *context)
 {
 	struct smr_ep_entry *recv_entry;
-	struct dlist_entry *entry;
+	struct ofi_mq_entry *entry;
 	int ret = 0;
 
 	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
-	entry = dlist_remove_first_match(&queue->list, smr_match_recv_ctx,
-					 context);
+	entry = ofi_mq_find(queue, smr_match_recv_ctx, context);
 	if (entry) {
-		recv_entry = container_of(entry, struct smr_ep_entry, entry);
+		ofi_mq_remove(entry);
+		recv_entry = container_of(entry, struct smr_ep_entry, match);
 		ret = ep->rx_comp(ep, (void *) recv_entry->context,
 				  recv_entry->flags | FI_RECV, 0,
-				  NULL, (void *) recv_entry->addr,
-				  recv_entry->tag, 0, FI_ECANCELED);
+				  NULL, (void *) recv_entry->match.addr,
+				  recv_entry->match.tag, 0, FI_ECANCELED);
 		freestack_push(ep->recv_fs, recv_entry);
 		ret = ret ? ret : 1;
 	}
@@ -174,53 +176,68 @@ static struct fi_ops_ep smr_ep_ops = {
 	.tx_size_left = fi_no_tx_size_left,
 };
 
-int smr_verify_peer(struct smr_ep *ep, int peer_id)
+/*
+ * CMA is probed against each peer when it is first mapped, by reading
+ * the peer's pid from its own address space.  Access is assumed to be
+ * symmetric; the peer performs the copies for transfers sent to it.
+ */
+static int smr_cma_probe(struct smr_region *smr, struct smr_region *peer_smr)
 {
-	int ret;
+	struct iovec local, remote;
+	int pid = 0;
 
-	if (ep->region->map->peers[peer_id].peer.addr != FI_ADDR_UNSPEC)
+	if (!(smr->flags & peer_smr->flags & SMR_FLAG_CMA))
 		return 0;
 
-	ret = smr_map_to_region(&smr_prov, &ep->region->map->peers[peer_id]);
-
-	return (ret == -ENOENT) ? -FI_EAGAIN : ret;
+	local.iov_base = &pid;
+	local.iov_len = sizeof(pid);
+	remote.iov_base = (char *) peer_smr->base_addr +
+			  offsetof(struct smr_region, pid);
+	remote.iov_len = sizeof(pid);
+	if (process_vm_readv(peer_smr->pid, &local, 1, &remote, 1, 0) ==
+	    sizeof(pid) && pid == peer_smr->pid)
+		return 1;
+
+	if (peer_smr->flags & SMR_FLAG_SAR) {
+		FI_INFO(&smr_prov, FI_LOG_EP_CTRL,
+			"peer %s refused CMA, using bounce buffers\n",
+			smr_name(peer_smr));
+	} else {
+		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+			"peer %s refused CMA and has no bounce buffers, "
+			"large transfers to it will fail (see "
+			"FI_SHM_DISABLE_CMA)\n", smr_name(peer_smr));
+	}
+	return 0;
 }
 
-static int smr_match_msg(struct dlist_entry *item, const void *args)
+int smr_verify_peer(struct smr_ep *ep, int peer_id)
 {
-	struct smr_match_attr *attr = (struct smr_match_attr *)args;
-	struct smr_ep_entry *recv_entry;
-
-	recv_entry = container_of(item, struct smr_ep_entry, entry);
-	return smr_match_addr(recv_entry->addr, attr->addr);
-}
+	struct smr_map *map = ep->region->map;
+	struct smr_peer *peer;
+	int ret = 0;
 
-static int smr_match_tagged(struct dlist_entry *item, const void *args)
-{
-	struct smr_match_attr *attr = (struct smr_match_attr *)args;
-	struct smr_ep_entry *recv_entry;
+	peer = smr_map_get(map, peer_id);
+	if (!peer)
+		return -FI_EINVAL;
 
-	recv_entry = container_of(item, struct smr_ep_entry, entry);
-	return smr_match_addr(recv_entry->addr, attr->addr) &&
-	       smr_match_tag(recv_entry->tag, recv_entry->ignore, attr->tag); 
-} 
+	if (peer->peer.addr != FI_ADDR_UNSPEC)
+		return 0;
 
-static int smr_match_unexp(struct dlist_entry *item, const void *args)
-{
-	struct smr_match_attr *attr = (struct smr_match_attr *)args;
-	struct smr_unexp_msg *unexp_msg;
+	fastlock_acquire(&map->lock);
+	if (peer->peer.addr != FI_ADDR_UNSPEC)
+		goto out;
 
-	unexp_msg = container_of(item, struct smr_unexp_msg, entry);
-	return smr_match_addr(unexp_msg->cmd.msg.hdr.addr, attr->addr) &&
-	       smr_match_tag(unexp_msg->cmd.msg.hdr.tag, attr->ignore,
-			     attr->tag);
-}
+	ret = smr_map_to_region(&smr_prov, peer);
+	if (ret)
+		goto out;
 
-static void smr_init_queue(struct smr_queue *queue,
-			   dlist_func_t *match_func)
-{
-	dlist_init(&queue->list);
-	queue->match_func = match_func;
+	peer->cma = smr_cma_probe(ep->region, peer->region);
+	peer->peer.addr = peer_id;
+	smr_map_to_endpoint(ep->region, peer_id);
+out:
+	fastlock_release(&map->lock);
+	return (ret == -ENOENT) ? -FI_EAGAIN : ret;
 }
 
 void smr_post_pend_resp(struct smr_cmd *cmd, struct smr_cmd *pend,
@@ -292,6 +309,36 @@ void smr_format_iov(struct smr_cmd *cmd, fi_addr_t peer_id,
 	smr_post_pend_resp(cmd, pend_cmd, resp);
 }
 
+void smr_format_sar(struct smr_cmd *cmd, fi_addr_t peer_id,
+		    const struct iovec *iov, size_t count, size_t total_len,
+		    uint32_t op, uint64_t tag, uint64_t data, uint64_t op_flags,
+		    void *context, struct smr_region *smr, struct smr_resp *resp,
+		    struct smr_cmd *pend_cmd, struct smr_region *peer_smr,
+		    struct smr_sar_buf *sar, struct smr_sar_entry *sar_entry)
+{
+	int i;
+
+	smr_generic_format(cmd, peer_id, op, tag, 0, 0, data, op_flags);
+	cmd->msg.hdr.op_src = smr_src_sar;
+	cmd->msg.hdr.src_data = (uint64_t) ((char **) resp - (char **) smr);
+	cmd->msg.hdr.size = total_len;
+	cmd->msg.hdr.msg_id = (uint64_t) (uintptr_t) context;
+	cmd->msg.data.sar = (uint64_t) ((char **) sar - (char **) peer_smr);
+
+	for (i = 0; i < SMR_SAR_SEGS; i++)
+		ofi_atomic_initialize32(&sar->seg[i].status, SMR_SAR_FREE);
+
+	sar_entry->cmd = *cmd;
+	sar_entry->iov_count = count;
+	memcpy(sar_entry->iov, iov, sizeof(*iov) * count);
+	sar_entry->bytes_done = 0;
+	sar_entry->next = 0;
+	sar_entry->err = 0;
+	sar_entry->sar = sar;
+
+	smr_post_pend_resp(cmd, pend_cmd, resp);
+}
+
 static int smr_ep_close(struct fid *fid)
 {
 	struct smr_ep *ep;
@@ -303,9 +350,14 @@ static int smr_ep_close(struct fid *fid)
 	if (ep->region)
 		smr_free(ep->region);
 
+	ofi_mq_close(&ep->recv_queue);
+	ofi_mq_close(&ep->trecv_queue);
+	ofi_mq_close(&ep->unexp_queue);
 	smr_recv_fs_free(ep->recv_fs);
 	smr_unexp_fs_free(ep->unexp_fs);
 	smr_pend_fs_free(ep->pend_fs);
+	smr_sar_fs_free(ep->tx_sar_fs);
+	smr_sar_fs_free(ep->rx_sar_fs);
 	free(ep);
 	return 0;
 }
@@ -406,10 +458,15 @@ static int smr_ep_ctrl(struct fid *fid, int command, void *arg)
 		attr.name = ep->name;
 		attr.rx_count = ep->rx_size;
 		attr.tx_count = ep->tx_size;
+		attr.queue_count = smr_cmd_queue_count;
+		attr.flags = (smr_cma_enabled ? SMR_FLAG_CMA : 0) |
+			     (smr_sar_enabled ? SMR_FLAG_SAR : 0);
 		ret = smr_create(&smr_prov, av->smr_map, &attr, &ep->region);
 		if (ret)
 			return ret;
 		smr_exchange_all_peers(ep->region);
+		ep->qid = (int) (fasthash32(ep->name, strlen(ep->name), 0) &
+				 INT_MAX);
 		break;
 	default:
 		return -FI_ENOSYS;
@@ -463,25 +520,43 @@ int smr_endpoint(struct fid_domain *domain, struct fi_info *info,
 	ret = smr_endpoint_name(name, info->src_addr, info->src_addrlen,
 			        smr_domain->dom_idx, ep_idx);
 	if (ret)
-		goto err2;
+		goto err4;
 
 	ret = smr_setname(&ep->util_ep.ep_fid.fid, name, SMR_NAME_SIZE);
 	if (ret)
-		goto err2;
+		goto err4;
 
 	ep->rx_size = info->rx_attr->size;
 	ep->tx_size = info->tx_attr->size;
 	ret = ofi_endpoint_init(domain, &smr_util_prov, info, &ep->util_ep, context,
 				smr_ep_progress);
 	if (ret)
-		goto err1;
+		goto err3;
 
 	ep->recv_fs = smr_recv_fs_create(info->rx_attr->size, NULL, NULL);
 	ep->unexp_fs = smr_unexp_fs_create(info->rx_attr->size, NULL, NULL);
 	ep->pend_fs = smr_pend_fs_create(info->tx_attr->size, NULL, NULL);
-	smr_init_queue(&ep->recv_queue, smr_match_msg);
-	smr_init_queue(&ep->trecv_queue, smr_match_tagged);
-	smr_init_queue(&ep->unexp_queue, smr_match_unexp);
+	ep->tx_sar_fs = smr_sar_fs_create(info->tx_attr->size, NULL, NULL);
+	ep->rx_sar_fs = smr_sar_fs_create(SMR_SAR_COUNT, NULL, NULL);
+	if (!ep->recv_fs || !ep->unexp_fs || !ep->pend_fs ||
+	    !ep->tx_sar_fs || !ep->rx_sar_fs) {
+		ret = -FI_ENOMEM;
+		goto err2;
+	}
+	dlist_init(&ep->tx_sar_list);
+	dlist_init(&ep->rx_sar_list);
+	ret = ofi_mq_init(&ep->recv_queue, info->rx_attr->size,
+			  OFI_MQ_DIRECTED);
+	if (ret)
+		goto err2;
+	ret = ofi_mq_init(&ep->trecv_queue, info->rx_attr->size,
+			  OFI_MQ_DIRECTED | OFI_MQ_TAGGED);
+	if (ret)
+		goto err1;
+	ret = ofi_mq_init(&ep->unexp_queue, info->rx_attr->size,
+			  OFI_MQ_DIRECTED | OFI_MQ_TAGGED);
+	if (ret)
+		goto err0;
 
 	ep->min_multi_recv_size = SMR_INJECT_SIZE;
 
@@ -496,9 +571,20 @@ int smr_endpoint(struct fid_domain *domain, struct fi_info *info,
 	*ep_fid = &ep->util_ep.ep_fid;
 	return 0;
 
+err0:
+	ofi_mq_close(&ep->trecv_queue);
 err1:
-	free((void *)ep->name);
+	ofi_mq_close(&ep->recv_queue);
 err2:
+	smr_recv_fs_free(ep->recv_fs);
+	smr_unexp_fs_free(ep->unexp_fs);
+	smr_pend_fs_free(ep->pend_fs);
+	smr_sar_fs_free(ep->tx_sar_fs);
+	smr_sar_fs_free(ep->rx_sar_fs);
+	ofi_endpoint_close(&ep->util_ep);
+err3:
+	free((void *)ep->name);
+err4:
 	free(ep);
 	return ret;
 }
@@ -30,11 +30,18 @@
  * SOFTWARE.
  */
 
+#include <stdio.h>
+#include <sys/uio.h>
+
 #include <rdma/fi_errno.h>
 
 #include <ofi_prov.h>
 #include "smr.h"
 
+int smr_cma_enabled;
+int smr_sar_enabled;
+size_t smr_cmd_queue_count = 4;
+
 
 static void smr_resolve_addr(const char *node, const char *service,
 			     char **addr, size_t *addrlen)
@@ -104,6 +111,54 @@ static int smr_getinfo(uint32_t version, const char *node, const char *service,
 	return 0;
 }
 
+/*
+ * Large transfers copy directly between processes with CMA.  It may be
+ * blocked by seccomp filters in containers, in which case bounce buffers
+ * are used instead.  Whether a particular peer may be accessed is only
+ * known by probing it (see smr_verify_peer).  A restricted yama ptrace
+ * scope admits some peers but not others, so regions then also carry
+ * bounce buffers to fall back on.
+ */
+static void smr_check_cma(void)
+{
+	struct iovec local, remote;
+	int src = 1, dst = 0;
+	int disable = 0, scope, ret;
+	FILE *file;
+
+	smr_cma_enabled = 0;
+	smr_sar_enabled = 1;
+
+	fi_param_get_bool(&smr_prov, "disable_cma", &disable);
+	if (disable)
+		return;
+
+	local.iov_base = &dst;
+	local.iov_len = sizeof(dst);
+	remote.iov_base = &src;
+	remote.iov_len = sizeof(src);
+	if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) != sizeof(dst) ||
+	    dst != src) {
+		FI_INFO(&smr_prov, FI_LOG_CORE,
+			"process_vm_readv failed, CMA disabled\n");
+		return;
+	}
+	smr_cma_enabled = 1;
+
+	file = fopen("/proc/sys/kernel/yama/ptrace_scope", "r");
+	if (file) {
+		ret = fscanf(file, "%d", &scope);
+		fclose(file);
+		if (ret == 1 && scope > 0) {
+			FI_INFO(&smr_prov, FI_LOG_CORE,
+				"ptrace scope restricted, keeping bounce "
+				"buffers for peers that refuse CMA\n");
+			return;
+		}
+	}
+	smr_sar_enabled = 0;
+}
+
 static void smr_fini(void)
 {
 	/* yawn */
@@ -126,5 +181,21 @@ struct util_prov smr_util_prov = {
 
 SHM_INI
 {
+	fi_param_define(&smr_prov, "disable_cma", FI_PARAM_BOOL,
+			"Disable use of CMA (Cross Memory Attach) for large "
+			"transfers. Data is copied through shared bounce "
+			"buffers instead (default: no). CMA is also disabled "
+			"when it cannot be used by the process, and for peers "
+			"that refuse it.");
+
+	fi_param_define(&smr_prov, "cmd_queues", FI_PARAM_SIZE_T,
+			"Number of command queues per endpoint (default: 4). "
+			"Each sending endpoint uses one of a peer's queues, so "
+			"several senders to the same peer do not contend on "
+			"one queue. Rounded up to a power of two.");
+
+	smr_check_cma();
+	fi_param_get_size_t(&smr_prov, "cmd_queues", &smr_cmd_queue_count);
+
 	return &smr_prov;
 }
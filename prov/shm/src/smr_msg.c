@@ -47,8 +47,8 @@ static inline struct smr_ep_entry *smr_get_recv_entry(struct smr_ep *ep)
 
 	entry = freestack_pop(ep->recv_fs);
 
-	entry->tag = 0; /* does this need to be set? */
-	entry->ignore = 0; /* does this need to be set? */
+	entry->match.tag = 0;
+	entry->match.ignore = 0;
 	entry->err = 0;
 	return entry;
 }
@@ -76,9 +76,9 @@ ssize_t smr_recvmsg(struct fid_ep *ep_fid, const struct fi_msg *msg,
 
 	entry->context = msg->context;
 	entry->flags = flags;
-	entry->addr = msg->addr;
+	entry->match.addr = msg->addr;
 
-	dlist_insert_tail(&entry->entry, &ep->recv_queue.list);
+	ofi_mq_insert(&ep->recv_queue, &entry->match);
 out:
 	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
 	return ret;
@@ -107,9 +107,9 @@ ssize_t smr_recvv(struct fid_ep *ep_fid, const struct iovec *iov, void **desc,
 
 	entry->context = context;
 	entry->flags = smr_ep_rx_flags(ep);
-	entry->addr = src_addr;
+	entry->match.addr = src_addr;
 
-	dlist_insert_tail(&entry->entry, &ep->recv_queue.list);
+	ofi_mq_insert(&ep->recv_queue, &entry->match);
 out:
 	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
 	return ret;
@@ -136,9 +136,9 @@ ssize_t smr_recv(struct fid_ep *ep_fid, void *buf, size_t len, void *desc,
 
 	entry->context = context;
 	entry->flags = smr_ep_rx_flags(ep);
-	entry->addr = src_addr;
+	entry->match.addr = src_addr;
 
-	dlist_insert_tail(&entry->entry, &ep->recv_queue.list);
+	ofi_mq_insert(&ep->recv_queue, &entry->match);
 out:
 	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
 	return ret;
@@ -150,9 +150,14 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 				   uint64_t op_flags)
 {
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_cmd_queue *cmd_queue;
+	struct smr_inject_pool *inject_pool;
+	struct smr_inject_buf *tx_buf = NULL;
+	struct smr_sar_buf *sar = NULL;
+	struct smr_sar_entry *sar_entry;
 	struct smr_resp *resp;
 	struct smr_cmd *cmd, *pend;
+	int64_t pos;
 	int peer_id;
 	ssize_t ret = 0;
 	size_t total_len;
@@ -166,11 +171,8 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (!peer_smr->cmd_cnt) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
+	cmd_queue = smr_cmd_queue(peer_smr, ep->qid);
+	inject_pool = smr_inject_pool(peer_smr, ep->qid);
 
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	if (ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -180,16 +182,55 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 
 	total_len = ofi_total_iov_len(iov, iov_count);
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	if (total_len > SMR_MSG_DATA_LEN && total_len <= SMR_INJECT_SIZE) {
+		tx_buf = smr_inject_pool_pop(inject_pool);
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	} else if (total_len > SMR_INJECT_SIZE &&
+		   !smr_cma_capable(ep->region, peer_id)) {
+		if (!smr_sar_pool(peer_smr)) {
+			ret = -FI_EOPNOTSUPP;
+			goto unlock_cq;
+		}
+		if (freestack_isempty(ep->tx_sar_fs) ||
+		    !(sar = smr_sar_pool_pop(smr_sar_pool(peer_smr)))) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	}
+
+	cmd = smr_cmd_queue_reserve(cmd_queue, 1, &pos);
+	if (!cmd) {
+		if (tx_buf)
+			smr_inject_pool_push(inject_pool, tx_buf);
+		if (sar)
+			smr_sar_pool_push(smr_sar_pool(peer_smr), sar);
+		ret = -FI_EAGAIN;
+		goto unlock_cq;
+	}
 
 	if (total_len <= SMR_MSG_DATA_LEN) {
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr, iov,
 				  iov_count, op, tag, data, op_flags);
 	} else if (total_len <= SMR_INJECT_SIZE) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  iov, iov_count, op, tag, data, op_flags,
 				  peer_smr, tx_buf);
+	} else if (sar) {
+		assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
+		resp = ofi_cirque_tail(smr_resp_queue(ep->region));
+		pend = freestack_pop(ep->pend_fs);
+		sar_entry = freestack_pop(ep->tx_sar_fs);
+		smr_format_sar(cmd, smr_peer_addr(ep->region)[peer_id].addr, iov,
+			       iov_count, total_len, op, tag, data, op_flags,
+			       context, ep->region, resp, pend, peer_smr, sar,
+			       sar_entry);
+		ofi_cirque_commit(smr_resp_queue(ep->region));
+		smr_progress_sar_tx(ep, sar_entry);
+		smr_cmd_queue_commit(cmd_queue, pos, 1);
+		goto unlock_cq;
 	} else {
 		assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
 		resp = ofi_cirque_tail(smr_resp_queue(ep->region));
@@ -198,22 +239,19 @@ static ssize_t smr_generic_sendmsg(struct smr_ep *ep, const struct iovec *iov,
 			       iov_count, total_len, op, tag, data, op_flags,
 			       context, ep->region, resp, pend);
 		ofi_cirque_commit(smr_resp_queue(ep->region));
-		goto commit;
+		smr_cmd_queue_commit(cmd_queue, pos, 1);
+		goto unlock_cq;
 	}
+	smr_cmd_queue_commit(cmd_queue, pos, 1);
+
 	ret = ep->tx_comp(ep, context, smr_tx_comp_flags(op), 0);
 	if (ret) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process tx completion\n");
-		goto unlock_cq;
 	}
 
-commit:
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
 unlock_cq:
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-unlock_region:
-	fastlock_release(&peer_smr->lock);
 	return ret;
 }
 
@@ -262,8 +300,11 @@ static ssize_t smr_generic_inject(struct fid_ep *ep_fid, const void *buf,
 {
 	struct smr_ep *ep;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_cmd_queue *cmd_queue;
+	struct smr_inject_pool *inject_pool;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
+	int64_t pos;
 	int peer_id;
 	ssize_t ret = 0;
 	struct iovec msg_iov;
@@ -281,29 +322,32 @@ static ssize_t smr_generic_inject(struct fid_ep *ep_fid, const void *buf,
 		return ret;
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (!peer_smr->cmd_cnt) {
-		ret = -FI_EAGAIN;
-		goto unlock;
+	cmd_queue = smr_cmd_queue(peer_smr, ep->qid);
+	inject_pool = smr_inject_pool(peer_smr, ep->qid);
+
+	if (len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_inject_pool_pop(inject_pool);
+		if (!tx_buf)
+			return -FI_EAGAIN;
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	cmd = smr_cmd_queue_reserve(cmd_queue, 1, &pos);
+	if (!cmd) {
+		if (tx_buf)
+			smr_inject_pool_push(inject_pool, tx_buf);
+		return -FI_EAGAIN;
+	}
 
 	if (len <= SMR_MSG_DATA_LEN) {
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &msg_iov, 1, op, tag, data, op_flags);
 	} else {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &msg_iov, 1, op, tag, data, op_flags,
 				  peer_smr, tx_buf);
 	}
 
-	peer_smr->cmd_cnt--;
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-unlock:
-	fastlock_release(&peer_smr->lock);
-
+	smr_cmd_queue_commit(cmd_queue, pos, 1);
 	return ret;
 }
 
@@ -367,12 +411,9 @@ smr_proccess_trecv_post(struct smr_ep *ep, struct smr_ep_entry *entry)
 {
 	ssize_t ret;
 
+	ofi_mq_insert(&ep->trecv_queue, &entry->match);
 	ret = smr_progress_unexp(ep, entry);
-	if (!ret || ret == -FI_EAGAIN)
-		return ret;
-
-	dlist_insert_tail(&entry->entry, &ep->trecv_queue.list);
-	return 0;
+	return (ret == -FI_ENOMSG) ? 0 : ret;
 }
 
 ssize_t smr_trecv(struct fid_ep *ep_fid, void *buf, size_t len, void *desc,
@@ -396,9 +437,9 @@ ssize_t smr_trecv(struct fid_ep *ep_fid, void *buf, size_t len, void *desc,
 
 	entry->context = context;
 	entry->flags = smr_ep_rx_flags(ep);
-	entry->addr = src_addr;
-	entry->tag = tag;
-	entry->ignore = ignore;
+	entry->match.addr = src_addr;
+	entry->match.tag = tag;
+	entry->match.ignore = ignore;
 
 	ret = smr_proccess_trecv_post(ep, entry);
 out:
@@ -430,9 +471,9 @@ ssize_t smr_trecvv(struct fid_ep *ep_fid, const struct iovec *iov, void **desc,
 
 	entry->context = context;
 	entry->flags = smr_ep_rx_flags(ep);
-	entry->addr = src_addr;
-	entry->tag = tag;
-	entry->ignore = ignore;
+	entry->match.addr = src_addr;
+	entry->match.tag = tag;
+	entry->match.ignore = ignore;
 
 	ret = smr_proccess_trecv_post(ep, entry);
 out:
@@ -463,9 +504,9 @@ ssize_t smr_trecvmsg(struct fid_ep *ep_fid, const struct fi_msg_tagged *msg,
 
 	entry->context = msg->context;
 	entry->flags = flags;
-	entry->addr = msg->addr;
-	entry->tag = msg->tag;
-	entry->ignore = msg->ignore;
+	entry->match.addr = msg->addr;
+	entry->match.tag = msg->tag;
+	entry->match.ignore = msg->ignore;
 
 	ret = smr_proccess_trecv_post(ep, entry);
 out:
@@ -46,8 +46,6 @@ static int smr_progress_fetch(struct smr_ep *ep, struct smr_cmd *pending,
 	uint8_t *src;
 
 	peer_smr = smr_peer_region(ep->region, pending->msg.hdr.addr);
-	if (fastlock_tryacquire(&peer_smr->lock))
-		return -FI_EAGAIN;
 
 	inj_offset = (size_t) pending->msg.hdr.src_data;
 	tx_buf = (struct smr_inject_buf *) ((char **) peer_smr +
@@ -69,9 +67,7 @@ static int smr_progress_fetch(struct smr_ep *ep, struct smr_cmd *pending,
 	}
 
 out:
-	smr_freestack_push(smr_inject_pool(peer_smr), tx_buf);
-	peer_smr->cmd_cnt++;
-	fastlock_release(&peer_smr->lock);
+	smr_inject_pool_push(smr_inject_pool_buf(peer_smr, tx_buf), tx_buf);
 	return 0;
 }
 
@@ -81,7 +77,6 @@ static void smr_progress_resp(struct smr_ep *ep)
 	struct smr_cmd *pending;
 	int ret;
 
-	fastlock_acquire(&ep->region->lock);
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	while (!ofi_cirque_isempty(smr_resp_queue(ep->region)) &&
 	       !ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -106,7 +101,6 @@ static void smr_progress_resp(struct smr_ep *ep)
 		ofi_cirque_discard(smr_resp_queue(ep->region));
 	}
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-	fastlock_release(&ep->region->lock);
 }
 
 static int smr_progress_inline(struct smr_cmd *cmd, struct iovec *iov,
@@ -144,7 +138,7 @@ static int smr_progress_inject(struct smr_cmd *cmd, struct iovec *iov,
 	}
 
 out:
-	smr_freestack_push(smr_inject_pool(ep->region), tx_buf);
+	smr_inject_pool_push(smr_inject_pool_buf(ep->region, tx_buf), tx_buf);
 	return err;
 }
 
@@ -198,7 +192,226 @@ out:
 	return -ret;
 }
 
-static int smr_progress_multi_recv(struct smr_ep *ep, struct smr_queue *queue,
+/*
+ * Move as many segments through the bounce buffer as the other side has
+ * made available.  Returns true once the whole message has been copied.
+ */
+static int smr_copy_sar(struct smr_sar_entry *sar_entry, int fill)
+{
+	struct smr_sar_seg *seg;
+	size_t size, copied;
+
+	while (sar_entry->bytes_done < sar_entry->cmd.msg.hdr.size) {
+		seg = &sar_entry->sar->seg[sar_entry->next];
+		if (ofi_atomic_get32(&seg->status) !=
+		    (fill ? SMR_SAR_FREE : SMR_SAR_READY))
+			break;
+
+		if (fill) {
+			size = MIN(SMR_SAR_SIZE, sar_entry->cmd.msg.hdr.size -
+				   sar_entry->bytes_done);
+			copied = ofi_copy_from_iov(seg->buf, size, sar_entry->iov,
+						   sar_entry->iov_count,
+						   sar_entry->bytes_done);
+			seg->size = size;
+			ofi_atomic_set32(&seg->status, SMR_SAR_READY);
+		} else {
+			size = seg->size;
+			copied = ofi_copy_to_iov(sar_entry->iov,
+						 sar_entry->iov_count,
+						 sar_entry->bytes_done,
+						 seg->buf, size);
+			ofi_atomic_set32(&seg->status, SMR_SAR_FREE);
+		}
+
+		if (copied != size && !sar_entry->err) {
+			FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+				"sar buffer truncated\n");
+			sar_entry->err = FI_EIO;
+		}
+		sar_entry->bytes_done += size;
+		sar_entry->next = (sar_entry->next + 1) % SMR_SAR_SEGS;
+	}
+
+	return sar_entry->bytes_done == sar_entry->cmd.msg.hdr.size;
+}
+
+static int smr_sar_drained(struct smr_sar_buf *sar)
+{
+	int i;
+
+	for (i = 0; i < SMR_SAR_SEGS; i++) {
+		if (ofi_atomic_get32(&sar->seg[i].status) != SMR_SAR_FREE)
+			return 0;
+	}
+	return 1;
+}
+
+/* The sender fills the bounce buffer unless it is reading from the peer */
+static int smr_copy_sar_tx(struct smr_sar_entry *sar_entry)
+{
+	return smr_copy_sar(sar_entry,
+			    sar_entry->cmd.msg.hdr.op != ofi_op_read_req);
+}
+
+void smr_progress_sar_tx(struct smr_ep *ep, struct smr_sar_entry *sar_entry)
+{
+	if (smr_copy_sar_tx(sar_entry))
+		freestack_push(ep->tx_sar_fs, sar_entry);
+	else
+		dlist_insert_tail(&sar_entry->entry, &ep->tx_sar_list);
+}
+
+/*
+ * The receiver of the cmd owns the bounce buffer and completes the
+ * transfer: it returns the buffer to its pool and then sets the sender's
+ * response status.  When serving a read it waits for the sender to
+ * drain every segment first.
+ */
+static int smr_progress_sar_rx(struct smr_ep *ep,
+			       struct smr_sar_entry *sar_entry)
+{
+	struct smr_cmd *cmd = &sar_entry->cmd;
+	struct smr_region *peer_smr;
+	struct smr_resp *resp;
+	size_t total_len;
+	int fill, msg, ret = 0;
+
+	fill = cmd->msg.hdr.op == ofi_op_read_req;
+	if (!smr_copy_sar(sar_entry, fill) ||
+	    (fill && !smr_sar_drained(sar_entry->sar)))
+		return -FI_EAGAIN;
+
+	msg = cmd->msg.hdr.op == ofi_op_msg || cmd->msg.hdr.op == ofi_op_tagged;
+	if ((msg || cmd->msg.hdr.op_flags & SMR_REMOTE_CQ_DATA) &&
+	    ofi_cirque_isfull(ep->util_ep.rx_cq->cirq))
+		return -FI_EAGAIN;
+
+	total_len = MIN(cmd->msg.hdr.size,
+			ofi_total_iov_len(sar_entry->iov, sar_entry->iov_count));
+
+	peer_smr = smr_peer_region(ep->region, cmd->msg.hdr.addr);
+	resp = (struct smr_resp *) ((char **) peer_smr +
+				    (size_t) cmd->msg.hdr.src_data);
+	smr_sar_pool_push(smr_sar_pool(ep->region), sar_entry->sar);
+
+	//Status must be set last (signals peer: op done, valid resp entry)
+	resp->status = sar_entry->err;
+
+	if (msg) {
+		ret = ep->rx_comp(ep, sar_entry->rx_entry.context,
+				  smr_rx_comp_flags(cmd->msg.hdr.op,
+				  cmd->msg.hdr.op_flags), total_len,
+				  sar_entry->rx_entry.iov[0].iov_base,
+				  &cmd->msg.hdr.addr, cmd->msg.hdr.tag,
+				  cmd->msg.hdr.data, -sar_entry->err);
+		if (!ret && sar_entry->rx_entry.flags & FI_MULTI_RECV)
+			ret = ep->rx_comp(ep, sar_entry->rx_entry.context,
+					  FI_MULTI_RECV, 0, 0,
+					  &cmd->msg.hdr.addr, 0, 0, 0);
+	} else if (cmd->msg.hdr.op_flags & SMR_REMOTE_CQ_DATA) {
+		ret = ep->rx_comp(ep, (void *) cmd->msg.hdr.msg_id,
+				  smr_rx_comp_flags(cmd->msg.hdr.op,
+				  cmd->msg.hdr.op_flags), total_len,
+				  NULL, &cmd->msg.hdr.addr, 0,
+				  cmd->msg.hdr.data, -sar_entry->err);
+	}
+	if (ret) {
+		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+			"unable to process rx completion\n");
+	}
+
+	return 0;
+}
+
+static struct smr_sar_entry *smr_get_sar_entry(struct smr_ep *ep,
+					       struct smr_cmd *cmd,
+					       const struct iovec *iov,
+					       size_t iov_count, int err)
+{
+	struct smr_sar_entry *sar_entry;
+
+	/* one entry per bounce buffer in our region */
+	assert(!freestack_isempty(ep->rx_sar_fs));
+	sar_entry = freestack_pop(ep->rx_sar_fs);
+
+	sar_entry->cmd = *cmd;
+	sar_entry->iov_count = iov_count;
+	memcpy(sar_entry->iov, iov, sizeof(*iov) * iov_count);
+	sar_entry->bytes_done = 0;
+	sar_entry->next = 0;
+	sar_entry->err = err;
+	sar_entry->sar = (struct smr_sar_buf *) ((char **) ep->region +
+						 (size_t) cmd->msg.data.sar);
+	return sar_entry;
+}
+
+static void smr_insert_sar_rx(struct smr_ep *ep,
+			      struct smr_sar_entry *sar_entry)
+{
+	if (smr_progress_sar_rx(ep, sar_entry))
+		dlist_insert_tail(&sar_entry->entry, &ep->rx_sar_list);
+	else
+		freestack_push(ep->rx_sar_fs, sar_entry);
+}
+
+static int smr_start_sar_msg(struct smr_ep *ep, struct smr_cmd *cmd,
+			     struct smr_ep_entry *entry,
+			     struct ofi_mq *queue)
+{
+	struct smr_sar_entry *sar_entry;
+	size_t len;
+
+	sar_entry = smr_get_sar_entry(ep, cmd, entry->iov, entry->iov_count, 0);
+	sar_entry->rx_entry = *entry;
+
+	/* Claim the part of a multi-recv buffer used by this message now,
+	 * so that the rest can be matched while the copy is in flight */
+	if (entry->flags & FI_MULTI_RECV) {
+		len = MIN(cmd->msg.hdr.size, entry->iov[0].iov_len);
+		sar_entry->iov[0].iov_len = len;
+		if (entry->iov[0].iov_len - len >= ep->min_multi_recv_size) {
+			sar_entry->rx_entry.flags &= ~FI_MULTI_RECV;
+			entry->iov[0].iov_base = (void *) ((uintptr_t)
+						 entry->iov[0].iov_base + len);
+			entry->iov[0].iov_len -= len;
+			ofi_mq_reinsert(queue, &entry->match);
+			goto insert;
+		}
+	}
+	freestack_push(ep->recv_fs, entry);
+insert:
+	smr_insert_sar_rx(ep, sar_entry);
+	return 0;
+}
+
+static void smr_progress_sar(struct smr_ep *ep)
+{
+	struct smr_sar_entry *sar_entry;
+	struct dlist_entry *tmp;
+
+	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
+	dlist_foreach_container_safe(&ep->tx_sar_list, struct smr_sar_entry,
+				     sar_entry, entry, tmp) {
+		if (smr_copy_sar_tx(sar_entry)) {
+			dlist_remove(&sar_entry->entry);
+			freestack_push(ep->tx_sar_fs, sar_entry);
+		}
+	}
+	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
+
+	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
+	dlist_foreach_container_safe(&ep->rx_sar_list, struct smr_sar_entry,
+				     sar_entry, entry, tmp) {
+		if (!smr_progress_sar_rx(ep, sar_entry)) {
+			dlist_remove(&sar_entry->entry);
+			freestack_push(ep->rx_sar_fs, sar_entry);
+		}
+	}
+	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
+}
+
+static int smr_progress_multi_recv(struct smr_ep *ep, struct ofi_mq *queue,
 				   struct smr_ep_entry *entry, size_t len)
 {
 	size_t left;
@@ -208,7 +421,7 @@ static int smr_progress_multi_recv(struct smr_ep *ep, struct smr_queue *queue,
 	left = entry->iov[0].iov_len - len;
 	if (left < ep->min_multi_recv_size) {
 		ret = ep->rx_comp(ep, entry->context, FI_MULTI_RECV, 0, 0,
-				  &entry->addr, 0, 0, 0);
+				  &entry->match.addr, 0, 0, 0);
 		freestack_push(ep->recv_fs, entry);
 		return ret;
 	}
@@ -217,7 +430,7 @@ static int smr_progress_multi_recv(struct smr_ep *ep, struct smr_queue *queue,
 	entry->iov[0].iov_len = left;
 	entry->iov[0].iov_base = new_base;
 
-	dlist_insert_head(&entry->entry, &queue->list);
+	ofi_mq_reinsert(queue, &entry->match);
 
 	return 0;
 }
@@ -315,16 +528,17 @@ static int smr_progress_inject_atomic(struct smr_cmd *cmd, struct fi_ioc *ioc,
 
 out:
 	if (!(cmd->msg.hdr.op_flags & SMR_RMA_REQ))
-		smr_freestack_push(smr_inject_pool(ep->region), tx_buf);
+		smr_inject_pool_push(smr_inject_pool_buf(ep->region, tx_buf),
+				     tx_buf);
 
 	return err;
 }
 
-static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
+static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd_queue *queue,
+				struct smr_cmd *cmd)
 {
-	struct smr_queue *recv_queue;
-	struct smr_match_attr match_attr;
-	struct dlist_entry *dlist_entry;
+	struct ofi_mq *recv_queue;
+	struct ofi_mq_entry *match;
 	struct smr_ep_entry *entry;
 	struct smr_unexp_msg *unexp;
 	fi_addr_t addr;
@@ -340,28 +554,34 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 	recv_queue = (cmd->msg.hdr.op == ofi_op_tagged) ?
 		      &ep->trecv_queue : &ep->recv_queue;
 
-	if (dlist_empty(&recv_queue->list)) {
+	if (ofi_mq_empty(recv_queue)) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"no recv entry available\n");
 		return -FI_ENOMSG;
 	}
 
-	match_attr.addr = cmd->msg.hdr.addr;
-	match_attr.tag = cmd->msg.hdr.tag;
-
-	dlist_entry = dlist_remove_first_match(&recv_queue->list,
-					       recv_queue->match_func,
-					       &match_attr);
-	if (!dlist_entry) {
+	match = ofi_mq_find_recv(recv_queue, cmd->msg.hdr.addr,
+				 cmd->msg.hdr.tag);
+	if (!match) {
 		if (freestack_isempty(ep->unexp_fs))
 			return -FI_EAGAIN;
 		unexp = freestack_pop(ep->unexp_fs);
 		memcpy(&unexp->cmd, cmd, sizeof(*cmd));
-		ofi_cirque_discard(smr_cmd_queue(ep->region));
-		dlist_insert_tail(&unexp->entry, &ep->unexp_queue.list);
+		smr_cmd_queue_discard(queue);
+		unexp->match.addr = cmd->msg.hdr.addr;
+		unexp->match.tag = cmd->msg.hdr.tag;
+		unexp->match.ignore = 0;
+		ofi_mq_insert(&ep->unexp_queue, &unexp->match);
+		return ret;
+	}
+	ofi_mq_remove(match);
+	entry = container_of(match, struct smr_ep_entry, match);
+
+	if (cmd->msg.hdr.op_src == smr_src_sar) {
+		ret = smr_start_sar_msg(ep, cmd, entry, recv_queue);
+		smr_cmd_queue_discard(queue);
 		return ret;
 	}
-	entry = container_of(dlist_entry, struct smr_ep_entry, entry);
 
 	switch (cmd->msg.hdr.op_src) {
 	case smr_src_inline:
@@ -389,8 +609,7 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process rx completion\n");
 	}
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
+	smr_cmd_queue_discard(queue);
 
 	if (entry->flags & FI_MULTI_RECV) {
 		ret = smr_progress_multi_recv(ep, recv_queue, entry, total_len);
@@ -402,10 +621,12 @@ static int smr_progress_cmd_msg(struct smr_ep *ep, struct smr_cmd *cmd)
 	return ret;
 }
 
-static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
+static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd_queue *queue,
+				struct smr_cmd *cmd)
 {
 	struct smr_domain *domain;
 	struct smr_cmd *rma_cmd;
+	struct smr_sar_entry *sar_entry;
 	struct iovec iov[SMR_IOV_LIMIT];
 	size_t iov_count;
 	size_t total_len = 0;
@@ -421,9 +642,7 @@ static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
 		return -FI_ENOSPC;
 	}
 
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
-	rma_cmd = ofi_cirque_head(smr_cmd_queue(ep->region));
+	rma_cmd = smr_cmd_queue_peek(queue, 1);
 
 	for (iov_count = 0; iov_count < rma_cmd->rma.rma_count; iov_count++) {
 		ret = ofi_mr_verify(&domain->util_domain.mr_map,
@@ -437,10 +656,17 @@ static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
 		iov[iov_count].iov_base = (void *) rma_cmd->rma.rma_iov[iov_count].addr;
 		iov[iov_count].iov_len = rma_cmd->rma.rma_iov[iov_count].len;
 	}
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
+
+	/* The peer is only released once the bounce buffer is done */
+	if (cmd->msg.hdr.op_src == smr_src_sar) {
+		sar_entry = smr_get_sar_entry(ep, cmd, iov, ret ? 0 : iov_count,
+					      -ret);
+		smr_insert_sar_rx(ep, sar_entry);
+		ret = 0;
+		goto out;
+	}
 	if (ret)
-		return ret;
+		goto out;
 
 	switch (cmd->msg.hdr.op_src) {
 	case smr_src_inline:
@@ -469,10 +695,14 @@ static int smr_progress_cmd_rma(struct smr_ep *ep, struct smr_cmd *cmd)
 		}
 	}
 
+out:
+	smr_cmd_queue_discard(queue);
+	smr_cmd_queue_discard(queue);
 	return ret;
 }
 
-static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
+static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd_queue *queue,
+				struct smr_cmd *cmd)
 {
 	struct smr_region *peer_smr;
 	struct smr_domain *domain;
@@ -486,9 +716,7 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 	domain = container_of(ep->util_ep.domain, struct smr_domain,
 			      util_domain);
 
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	ep->region->cmd_cnt++;
-	rma_cmd = ofi_cirque_head(smr_cmd_queue(ep->region));
+	rma_cmd = smr_cmd_queue_peek(queue, 1);
 
 	for (ioc_count = 0; ioc_count < rma_cmd->rma.rma_count; ioc_count++) {
 		ret = ofi_mr_verify(&domain->util_domain.mr_map,
@@ -504,11 +732,8 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 		ioc[ioc_count].addr = (void *) rma_cmd->rma.rma_ioc[ioc_count].addr;
 		ioc[ioc_count].count = rma_cmd->rma.rma_ioc[ioc_count].count;
 	}
-	ofi_cirque_discard(smr_cmd_queue(ep->region));
-	if (ret) {
-		ep->region->cmd_cnt++;
-		return ret;
-	}
+	if (ret)
+		goto out;
 
 	switch (cmd->msg.hdr.op_src) {
 	case smr_src_inline:
@@ -522,9 +747,7 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 			"unidentified operation type\n");
 		err = -FI_EINVAL;
 	}
-	if (!(cmd->msg.hdr.op_flags & SMR_RMA_REQ)) {
-		ep->region->cmd_cnt++;
-	} else {
+	if (cmd->msg.hdr.op_flags & SMR_RMA_REQ) {
 		peer_smr = smr_peer_region(ep->region, cmd->msg.hdr.addr);
 		resp = (struct smr_resp *) ((char **) peer_smr +
 			    (size_t) cmd->msg.hdr.data);
@@ -535,38 +758,73 @@ static int smr_progress_cmd_atomic(struct smr_ep *ep, struct smr_cmd *cmd)
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"error processing atomic op\n");
 
-	return err; 
+	ret = err;
+out:
+	smr_cmd_queue_discard(queue);
+	smr_cmd_queue_discard(queue);
+	return ret;
 }
 
-static void smr_progress_cmd(struct smr_ep *ep)
+/* RMA and atomic commands are followed by a second slot holding the
+ * target iov/ioc list */
+static void smr_discard_cmd(struct smr_cmd_queue *queue, struct smr_cmd *cmd)
+{
+	switch (cmd->msg.hdr.op) {
+	case ofi_op_write:
+	case ofi_op_read_req:
+	case ofi_op_atomic:
+	case ofi_op_atomic_fetch:
+	case ofi_op_atomic_compare:
+		smr_cmd_queue_discard(queue);
+		/* fall through */
+	default:
+		smr_cmd_queue_discard(queue);
+	}
+}
+
+static void smr_progress_cmd_queue(struct smr_ep *ep,
+				   struct smr_cmd_queue *queue)
 {
 	struct smr_cmd *cmd;
 	int ret = 0;
 
-	fastlock_acquire(&ep->region->lock);
-	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
-
-	while (!ofi_cirque_isempty(smr_cmd_queue(ep->region))) {
-		cmd = ofi_cirque_head(smr_cmd_queue(ep->region));
+	while ((cmd = smr_cmd_queue_head(queue))) {
+		/* Peers are mapped lazily; the sender's region is only
+		 * needed for iov copies and responses */
+		if (cmd->msg.hdr.op_src == smr_src_iov ||
+		    cmd->msg.hdr.op_src == smr_src_sar ||
+		    cmd->msg.hdr.op_flags & SMR_RMA_REQ) {
+			ret = smr_verify_peer(ep, (int) cmd->msg.hdr.addr);
+			if (ret) {
+				/* The sender has no region to respond to;
+				 * drop its command rather than stall the
+				 * commands queued behind it */
+				FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
+					"unable to map peer %" PRIu64
+					", discarding command\n",
+					cmd->msg.hdr.addr);
+				smr_discard_cmd(queue, cmd);
+				continue;
+			}
+		}
 
 		switch (cmd->msg.hdr.op) {
 		case ofi_op_msg:
 		case ofi_op_tagged:
-			ret = smr_progress_cmd_msg(ep, cmd);
+			ret = smr_progress_cmd_msg(ep, queue, cmd);
 			break;
 		case ofi_op_write:
 		case ofi_op_read_req:
-			ret = smr_progress_cmd_rma(ep, cmd);
+			ret = smr_progress_cmd_rma(ep, queue, cmd);
 			break;
 		case ofi_op_write_rsp:
 		case ofi_op_read_rsp:
-			ofi_cirque_discard(smr_cmd_queue(ep->region));
-			ep->region->cmd_cnt++;
+			smr_cmd_queue_discard(queue);
 			break;
 		case ofi_op_atomic:
 		case ofi_op_atomic_fetch:
 		case ofi_op_atomic_compare:
-			ret = smr_progress_cmd_atomic(ep, cmd);
+			ret = smr_progress_cmd_atomic(ep, queue, cmd);
 			break;
 		default:
 			FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
@@ -582,8 +840,17 @@ static void smr_progress_cmd(struct smr_ep *ep)
 			break;
 		}
 	}
+}
+
+static void smr_progress_cmd(struct smr_ep *ep)
+{
+	int i;
+
+	/* The rx cq lock serializes the single consumer of the cmd queues */
+	fastlock_acquire(&ep->util_ep.rx_cq->cq_lock);
+	for (i = 0; i < ep->region->queue_count; i++)
+		smr_progress_cmd_queue(ep, smr_cmd_queue(ep->region, i));
 	fastlock_release(&ep->util_ep.rx_cq->cq_lock);
-	fastlock_release(&ep->region->lock);
 }
 
 void smr_ep_progress(struct util_ep *util_ep)
@@ -592,35 +859,42 @@ void smr_ep_progress(struct util_ep *util_ep)
 
 	ep = container_of(util_ep, struct smr_ep, util_ep);
 
+	smr_progress_sar(ep);
 	smr_progress_resp(ep);
 	smr_progress_cmd(ep);
 }
 
+/* The receive has already been posted to trecv_queue */
 int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry)
 {
-	struct smr_match_attr match_attr;
 	struct smr_unexp_msg *unexp_msg;
-	struct dlist_entry *dlist_entry;
+	struct ofi_mq_entry *match;
 	size_t total_len = 0;
 	int ret = 0;
 
 	if (ofi_cirque_isfull(ep->util_ep.rx_cq->cirq)) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"rx cq full\n");
+		ofi_mq_remove(&entry->match);
 		ret = -FI_EAGAIN;
 		goto push_entry;
 	}
 
-	match_attr.addr = entry->addr;
-	match_attr.ignore = entry->ignore;
-	match_attr.tag = entry->tag;
-	dlist_entry = dlist_remove_first_match(&ep->unexp_queue.list,
-					       ep->unexp_queue.match_func,
-					       &match_attr);
-	if (!dlist_entry)
+	match = ofi_mq_find_msg(&ep->unexp_queue, entry->match.addr,
+				entry->match.tag, entry->match.ignore);
+	if (!match)
 		return -FI_ENOMSG;
 
-	unexp_msg = container_of(dlist_entry, struct smr_unexp_msg, entry);
+	ofi_mq_remove(match);
+	ofi_mq_remove(&entry->match);
+	unexp_msg = container_of(match, struct smr_unexp_msg, match);
+
+	if (unexp_msg->cmd.msg.hdr.op_src == smr_src_sar) {
+		ret = smr_start_sar_msg(ep, &unexp_msg->cmd, entry,
+					&ep->trecv_queue);
+		freestack_push(ep->unexp_fs, unexp_msg);
+		return ret;
+	}
 
 	switch (unexp_msg->cmd.msg.hdr.op_src) {
 	case smr_src_inline:
@@ -645,14 +919,14 @@ int smr_progress_unexp(struct smr_ep *ep, struct smr_ep_entry *entry)
 	ret = ep->rx_comp(ep, entry->context,
 			  smr_rx_comp_flags(unexp_msg->cmd.msg.hdr.op,
 			  unexp_msg->cmd.msg.hdr.op_flags), total_len,
-			  entry->iov[0].iov_base, &entry->addr, entry->tag,
-			  unexp_msg->cmd.msg. hdr.data, entry->err);
+			  entry->iov[0].iov_base, &entry->match.addr,
+			  unexp_msg->cmd.msg.hdr.tag, unexp_msg->cmd.msg.hdr.data,
+			  entry->err);
 	if (ret) {
 		FI_WARN(&smr_prov, FI_LOG_EP_CTRL,
 			"unable to process rx completion\n");
 	}
 
-	ep->region->cmd_cnt++;
 	freestack_push(ep->unexp_fs, unexp_msg);
 
 	if (entry->flags & FI_MULTI_RECV) {
@@ -69,6 +69,10 @@ ssize_t smr_rma_fast(struct smr_region *peer_smr, struct smr_cmd *cmd,
 
 	total_len = ofi_total_iov_len(iov, iov_count);
 
+	smr_format_rma_resp(cmd, peer_id, rma_iov, rma_count, total_len,
+			    (op == ofi_op_write) ? ofi_op_write_rsp :
+			    ofi_op_read_rsp);
+
 	if (op == ofi_op_write) {
 		ret = process_vm_writev(peer_smr->pid, iov, iov_count,
 					rma_iovec, rma_count, 0);
@@ -90,10 +94,6 @@ ssize_t smr_rma_fast(struct smr_region *peer_smr, struct smr_cmd *cmd,
 		return ret;
 	}
 
-	smr_format_rma_resp(cmd, peer_id, rma_iov, rma_count, total_len,
-			    (op == ofi_op_write) ? ofi_op_write_rsp :
-			    ofi_op_read_rsp);
-
 	return 0;
 }
 
@@ -104,9 +104,14 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 {
 	struct smr_domain *domain;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_cmd_queue *cmd_queue;
+	struct smr_inject_pool *inject_pool;
+	struct smr_inject_buf *tx_buf = NULL;
+	struct smr_sar_buf *sar = NULL;
+	struct smr_sar_entry *sar_entry;
 	struct smr_resp *resp;
 	struct smr_cmd *cmd, *pend;
+	int64_t pos;
 	int peer_id, cmds, err = 0, comp = 1;
 	ssize_t ret = 0;
 	size_t total_len;
@@ -122,14 +127,11 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 		return ret;
 
 	cmds = 1 + !(domain->fast_rma && !(op_flags & FI_REMOTE_CQ_DATA) &&
-		     rma_count == 1);
+		     rma_count == 1 && smr_cma_capable(ep->region, peer_id));
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < cmds) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
-	}
+	cmd_queue = smr_cmd_queue(peer_smr, ep->qid);
+	inject_pool = smr_inject_pool(peer_smr, ep->qid);
 
 	fastlock_acquire(&ep->util_ep.tx_cq->cq_lock);
 	if (ofi_cirque_isfull(ep->util_ep.tx_cq->cirq)) {
@@ -137,7 +139,38 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 		goto unlock_cq;
 	}
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	total_len = ofi_total_iov_len(iov, iov_count);
+
+	if (cmds == 2 && op == ofi_op_write && total_len > SMR_MSG_DATA_LEN &&
+	    total_len <= SMR_INJECT_SIZE) {
+		tx_buf = smr_inject_pool_pop(inject_pool);
+		if (!tx_buf) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	} else if (cmds == 2 && (op == ofi_op_read_req ||
+		   total_len > SMR_INJECT_SIZE) &&
+		   !smr_cma_capable(ep->region, peer_id)) {
+		if (!smr_sar_pool(peer_smr)) {
+			ret = -FI_EOPNOTSUPP;
+			goto unlock_cq;
+		}
+		if (freestack_isempty(ep->tx_sar_fs) ||
+		    !(sar = smr_sar_pool_pop(smr_sar_pool(peer_smr)))) {
+			ret = -FI_EAGAIN;
+			goto unlock_cq;
+		}
+	}
+
+	cmd = smr_cmd_queue_reserve(cmd_queue, cmds, &pos);
+	if (!cmd) {
+		if (tx_buf)
+			smr_inject_pool_push(inject_pool, tx_buf);
+		if (sar)
+			smr_sar_pool_push(smr_sar_pool(peer_smr), sar);
+		ret = -FI_EAGAIN;
+		goto unlock_cq;
+	}
 
 	if (cmds == 1) {
 		err = smr_rma_fast(peer_smr, cmd, iov, iov_count, rma_iov,
@@ -145,16 +178,25 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 		goto commit_comp;
 	}
 
-	total_len = ofi_total_iov_len(iov, iov_count);
-
 	if (total_len <= SMR_MSG_DATA_LEN && op == ofi_op_write) {
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  iov, iov_count, op, 0, data, op_flags);
 	} else if (total_len <= SMR_INJECT_SIZE && op == ofi_op_write) {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  iov, iov_count, op, 0, data, op_flags,
 				  peer_smr, tx_buf);
+	} else if (sar) {
+		assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
+		resp = ofi_cirque_tail(smr_resp_queue(ep->region));
+		pend = freestack_pop(ep->pend_fs);
+		sar_entry = freestack_pop(ep->tx_sar_fs);
+		smr_format_sar(cmd, smr_peer_addr(ep->region)[peer_id].addr,
+			       iov, iov_count, total_len, op, 0, data,
+			       op_flags, context, ep->region, resp, pend,
+			       peer_smr, sar, sar_entry);
+		ofi_cirque_commit(smr_resp_queue(ep->region));
+		smr_progress_sar_tx(ep, sar_entry);
+		comp = 0;
 	} else {
 		assert(!ofi_cirque_isfull(smr_resp_queue(ep->region)));
 		resp = ofi_cirque_tail(smr_resp_queue(ep->region));
@@ -166,14 +208,11 @@ ssize_t smr_generic_rma(struct smr_ep *ep, const struct iovec *iov,
 		comp = 0;
 	}
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	cmd = smr_cmd_queue_entry(cmd_queue, pos + 1);
 	smr_format_rma_iov(cmd, rma_iov, rma_count);
 
 commit_comp:
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
+	smr_cmd_queue_commit(cmd_queue, pos, cmds);
 
 	if (!comp)
 		goto unlock_cq;
@@ -186,8 +225,6 @@ commit_comp:
 
 unlock_cq:
 	fastlock_release(&ep->util_ep.tx_cq->cq_lock);
-unlock_region:
-	fastlock_release(&peer_smr->lock);
 	return ret;
 }
 
@@ -301,10 +338,13 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 	struct smr_ep *ep;
 	struct smr_domain *domain;
 	struct smr_region *peer_smr;
-	struct smr_inject_buf *tx_buf;
+	struct smr_cmd_queue *cmd_queue;
+	struct smr_inject_pool *inject_pool;
+	struct smr_inject_buf *tx_buf = NULL;
 	struct smr_cmd *cmd;
 	struct iovec iov;
 	struct fi_rma_iov rma_iov;
+	int64_t pos;
 	int peer_id, cmds;
 	ssize_t ret = 0;
 
@@ -320,10 +360,20 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 	cmds = 1 + !(domain->fast_rma && !(flags & FI_REMOTE_CQ_DATA));
 
 	peer_smr = smr_peer_region(ep->region, peer_id);
-	fastlock_acquire(&peer_smr->lock);
-	if (peer_smr->cmd_cnt < cmds) {
-		ret = -FI_EAGAIN;
-		goto unlock_region;
+	cmd_queue = smr_cmd_queue(peer_smr, ep->qid);
+	inject_pool = smr_inject_pool(peer_smr, ep->qid);
+
+	if (cmds == 2 && len > SMR_MSG_DATA_LEN) {
+		tx_buf = smr_inject_pool_pop(inject_pool);
+		if (!tx_buf)
+			return -FI_EAGAIN;
+	}
+
+	cmd = smr_cmd_queue_reserve(cmd_queue, cmds, &pos);
+	if (!cmd) {
+		if (tx_buf)
+			smr_inject_pool_push(inject_pool, tx_buf);
+		return -FI_EAGAIN;
 	}
 
 	iov.iov_base = (void *) buf;
@@ -332,8 +382,6 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 	rma_iov.len = len;
 	rma_iov.key = key;
 
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
-
 	if (cmds == 1) {
 		ret = smr_rma_fast(peer_smr, cmd, &iov, 1, &rma_iov, 1, NULL,
 				   peer_id, NULL, ofi_op_write);
@@ -344,22 +392,16 @@ ssize_t smr_generic_rma_inject(struct fid_ep *ep_fid, const void *buf,
 		smr_format_inline(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &iov, 1, ofi_op_write, 0, data, flags);
 	} else {
-		tx_buf = smr_freestack_pop(smr_inject_pool(peer_smr));
 		smr_format_inject(cmd, smr_peer_addr(ep->region)[peer_id].addr,
 				  &iov, 1, ofi_op_write, 0, data,
 				  flags, peer_smr, tx_buf);
 	}
 
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-	cmd = ofi_cirque_tail(smr_cmd_queue(peer_smr));
+	cmd = smr_cmd_queue_entry(cmd_queue, pos + 1);
 	smr_format_rma_iov(cmd, &rma_iov, 1);
 
 commit:
-	ofi_cirque_commit(smr_cmd_queue(peer_smr));
-	peer_smr->cmd_cnt--;
-unlock_region:
-	fastlock_release(&peer_smr->lock);
+	smr_cmd_queue_commit(cmd_queue, pos, cmds);
 	return ret;
 }
 
@@ -11,5 +11,9 @@ AC_DEFUN([FI_TCP_CONFIGURE],[
        # Determine if we can support the tcp provider
        tcp_h_happy=0
        AS_IF([test x"$enable_tcp" != x"no"], [tcp_h_happy=1])
+
+       # optional io_uring backend
+       AS_IF([test $tcp_h_happy -eq 1],
+	     [AC_CHECK_HEADERS([linux/io_uring.h])])
        AS_IF([test $tcp_h_happy -eq 1], [$1], [$2])
 ])
@@ -40,6 +40,11 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
+#if HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #include <rdma/fabric.h>
 #include <rdma/fi_atomic.h>
 #include <rdma/fi_cm.h>
@@ -58,6 +63,7 @@
 #include <ofi_signal.h>
 #include <ofi_util.h>
 #include <ofi_proto.h>
+#include <ofi_match.h>
 
 #ifndef _TCP_H_
 #define _TCP_H_
@@ -70,14 +76,56 @@
 #define TCPX_MAX_CM_DATA_SIZE	(1<<8)
 #define TCPX_IOV_LIMIT		(4)
 #define TCPX_MAX_INJECT_SZ	(64)
+#define TCPX_MAX_ATOMIC_SZ	(64)
+#define TCPX_STAGE_BUF_SIZE	(1 << 14)
+#define TCPX_TX_BATCH_IOV	(64)
+#define TCPX_TX_BATCH_SIZE	(1 << 16)
 
 #define MAX_EPOLL_EVENTS 100
+#define TCPX_SHARD_POLL_MS	(1)
+
+#define TCPX_CM_TIMEOUT_MS	(1000)
+#define TCPX_FASTOPEN_QLEN	(256)
+
+#define TCPX_MAX_STRIPES	(8)
+#define TCPX_STRIPE_JOIN_MS	(1000)
+/* ofi_op_hdr flag: the payload follows on the stripe connections */
+#define TCPX_STRIPED		(1U << 31)
+
+#ifdef HAVE_EPOLL
+#define TCPX_EPOLL_ET		EPOLLET
+#else
+#define TCPX_EPOLL_ET		0
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define TCPX_HAVE_ZEROCOPY 1
+#else
+#define TCPX_HAVE_ZEROCOPY 0
+#endif
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+#define TCPX_HAVE_IO_URING 1
+#else
+#define TCPX_HAVE_IO_URING 0
+#endif
 
 extern struct fi_provider	tcpx_prov;
 extern struct util_prov		tcpx_util_prov;
 extern struct fi_info		tcpx_info;
+extern size_t			tcpx_zerocopy_size;
+extern int			tcpx_io_uring;
+extern int			tcpx_progress_threads;
+extern char			*tcpx_progress_affinity;
+extern int			tcpx_busy_poll;
+extern int			tcpx_stripe_cnt;
+extern size_t			tcpx_stripe_size;
+extern int			tcpx_cm_thread;
+extern int			tcpx_fastopen;
 struct tcpx_xfer_entry;
 struct tcpx_ep;
+struct tcpx_uring;
+struct tcpx_shard;
 
 enum tcpx_xfer_op_codes {
 	TCPX_OP_MSG_SEND,
@@ -87,6 +135,11 @@ enum tcpx_xfer_op_codes {
 	TCPX_OP_READ_REQ,
 	TCPX_OP_READ_RSP,
 	TCPX_OP_REMOTE_READ,
+	TCPX_OP_TAGGED_SEND,
+	TCPX_OP_TAGGED_RECV,
+	TCPX_OP_TAGGED_UNEXP,
+	TCPX_OP_ATOMIC,
+	TCPX_OP_REMOTE_ATOMIC,
 	TCPX_OP_CODE_MAX,
 };
 
@@ -94,14 +147,16 @@ enum tcpx_cm_event_type {
 	SERVER_SOCK_ACCEPT,
 	CLIENT_SEND_CONNREQ,
 	SERVER_RECV_CONNREQ,
-	SERVER_SEND_CM_ACCEPT,
 	CLIENT_RECV_CONNRESP,
+	SERVER_STRIPE_JOIN,
 };
 
 struct tcpx_cm_context {
 	fid_t			fid;
 	enum tcpx_cm_event_type	type;
 	size_t			cm_data_sz;
+	/* bytes of the connreq already sent, some maybe in the SYN */
+	size_t			done_len;
 	char			cm_data[TCPX_MAX_CM_DATA_SIZE];
 };
 
@@ -109,11 +164,12 @@ struct tcpx_conn_handle {
 	struct fid		handle;
 	struct tcpx_pep		*pep;
 	SOCKET			conn_fd;
+	uint32_t		stripe_cnt;
 };
 
 struct tcpx_pep {
 	struct util_pep 	util_pep;
-	struct fi_info		info;
+	struct fi_info		*info;
 	SOCKET			sock;
 	struct tcpx_cm_context	cm_ctx;
 };
@@ -139,31 +195,130 @@ struct tcpx_rx_detect {
 	uint64_t		done_len;
 };
 
+/* Receive staging buffer.  Socket data is read into buf in large chunks
+ * so that several headers and small payloads can be parsed out of a
+ * single recv call.  Bytes in [off, len) have been received but not yet
+ * consumed.
+ */
+struct tcpx_stage_buf {
+	uint8_t			buf[TCPX_STAGE_BUF_SIZE];
+	size_t			len;
+	size_t			off;
+};
+
+static inline size_t tcpx_stage_buf_avail(struct tcpx_stage_buf *stage_buf)
+{
+	return stage_buf->len - stage_buf->off;
+}
+
+/* An extra connection carrying the payload of large transfers.  Every
+ * striped transfer is split evenly over the stripes, and each stripe's
+ * byte stream is its share of the striped transfers, in the order their
+ * headers went over conn_fd.  The seq fields count striped transfers in
+ * that order, and the done fields count the bytes of the current share.
+ */
+struct tcpx_stripe {
+	SOCKET			fd;
+	uint32_t		tx_seq;
+	size_t			tx_done;
+	uint32_t		rx_seq;
+	size_t			rx_done;
+	int			rx_blocked;
+	int			tx_blocked;
+	/* connecting side: accept notice read from the stream */
+	struct ofi_ctrl_hdr	ack;
+	size_t			ack_len;
+};
+
 typedef void (*tcpx_ep_progress_func_t)(struct tcpx_ep *ep);
 
 struct tcpx_ep {
 	struct util_ep		util_ep;
 	SOCKET			conn_fd;
 	struct tcpx_rx_detect	rx_detect;
+	struct tcpx_stage_buf	stage_buf;
 	struct tcpx_xfer_entry	*cur_rx_entry;
 	struct dlist_entry	ep_entry;
 	struct slist		rx_queue;
 	struct slist		tx_queue;
 	struct slist		rma_read_queue;
+	/* received atomics waiting to be applied, see tcpx_atomic_flush */
+	struct slist		atomic_queue;
+	/* posted tagged receives and tagged messages that arrived
+	 * before a matching receive was posted */
+	struct ofi_mq		trecv_queue;
+	struct ofi_mq		unexp_queue;
+	/* tx entries fully sent with MSG_ZEROCOPY whose pages the kernel
+	 * has not yet released */
+	struct slist		zc_queue;
+	size_t			zerocopy_size;
+	uint32_t		zc_sent;
+	uint32_t		zc_done;
+	/* set when socket I/O goes through io_uring */
+	struct tcpx_uring	*uring;
+	/* progress shard, and link on its ready_list; protected by the
+	 * shard lock */
+	struct tcpx_shard	*shard;
+	struct dlist_entry	ready_entry;
+	/* last rx/tx attempt found no data or no socket space */
+	int			rx_blocked;
+	int			tx_blocked;
+	/* Transfers of at least stripe_size bytes are striped once all
+	 * stripes have joined (accepting side) or have been acked
+	 * (connecting side).  Their entries wait on the stripe queues
+	 * after the header went over conn_fd, in header order. */
+	struct tcpx_stripe	stripes[TCPX_MAX_STRIPES];
+	int			stripe_cnt;
+	int			stripe_joined;
+	int			stripes_ready;
+	size_t			stripe_size;
+	uint64_t		stripe_key;
+	uint16_t		stripe_port;
+	SOCKET			stripe_listen;
+	struct tcpx_cm_context	*stripe_cm_ctx;
+	struct slist		stripe_tx_queue;
+	struct slist		stripe_rx_queue;
+	uint32_t		stripe_tx_seq;
+	uint32_t		stripe_rx_seq;
 	enum tcpx_cm_state	cm_state;
 	/* lock for protecting tx/rx queues,rma list,cm_state*/
 	fastlock_t		lock;
 	tcpx_ep_progress_func_t progress_func;
 };
 
+/* With a CM thread, connection management sockets go to cm_wait instead
+ * of the EQs' wait sets, and the thread drives them.  All handshake
+ * processing is serialized by cm_lock, which is held across socket calls
+ * and EQ writes, hence a mutex. */
 struct tcpx_fabric {
 	struct util_fabric	util_fabric;
+	struct util_wait	*cm_wait;
+	pthread_t		cm_thread;
+	int			cm_run;
+	pthread_mutex_t		cm_lock;
 };
 
+static inline struct tcpx_fabric *tcpx_eq_fabric(struct util_eq *eq)
+{
+	return container_of(eq->fabric, struct tcpx_fabric, util_fabric);
+}
+
+static inline struct util_wait *tcpx_cm_wait(struct util_eq *eq)
+{
+	struct tcpx_fabric *fabric = tcpx_eq_fabric(eq);
+
+	return fabric->cm_wait ? fabric->cm_wait : eq->wait;
+}
+
 struct tcpx_msg_data {
 	size_t			iov_cnt;
 	struct iovec		iov[TCPX_IOV_LIMIT+1];
-	uint8_t			inject[TCPX_MAX_INJECT_SZ];
+	union {
+		uint8_t		inject[TCPX_MAX_INJECT_SZ];
+		/* atomic operands followed by the compare values; the
+		 * target returns fetched values in place of the operands */
+		uint8_t		atomic_buf[2 * TCPX_MAX_ATOMIC_SZ];
+	};
 };
 
 struct tcpx_xfer_entry {
@@ -174,10 +329,77 @@ struct tcpx_xfer_entry {
 	uint64_t		flags;
 	void			*context;
 	uint64_t		done_len;
+	/* trailing payload bytes that do not fit the posted buffer */
+	uint64_t		discard_len;
+	uint32_t		zc_seq;
+	uint32_t		stripe_seq;
+	int			stripe_parts;
+	struct ofi_mq_entry	match;
+};
+
+/* A tagged message is put on the unexpected queue as soon as its header
+ * is parsed, and its payload is received into buf by a
+ * TCPX_OP_TAGGED_UNEXP entry.  A receive posted before the payload is
+ * complete claims the message and is completed once it arrives.
+ */
+struct tcpx_unexp_msg {
+	struct ofi_mq_entry	match;
+	struct tcpx_xfer_entry	*claim;
+	uint64_t		data;
+	uint32_t		flags;
+	int			done;
+	size_t			len;
+	uint8_t			buf[];
+};
+
+static inline int tcpx_striped(struct tcpx_xfer_entry *xfer_entry)
+{
+	return ntohl(xfer_entry->msg_hdr.hdr.flags) & TCPX_STRIPED;
+}
+
+/* Bytes of a tx entry that go over conn_fd */
+static inline size_t tcpx_tx_conn_len(struct tcpx_xfer_entry *tx_entry)
+{
+	return tcpx_striped(tx_entry) ? sizeof(tx_entry->msg_hdr) :
+					ntohll(tx_entry->msg_hdr.hdr.size);
+}
+
+/* Large sends go out with MSG_ZEROCOPY once enabled on the endpoint */
+static inline int tcpx_tx_zerocopy(struct tcpx_ep *ep,
+				   struct tcpx_xfer_entry *tx_entry)
+{
+	return ep->zerocopy_size && !tcpx_striped(tx_entry) &&
+	       ntohll(tx_entry->msg_hdr.hdr.size) >= ep->zerocopy_size;
+}
+
+/* Connected endpoints are spread over the shards of their domain.  Each
+ * shard watches the endpoints' wait fds with an edge-triggered epoll set,
+ * so an endpoint only shows up there when new data or socket space
+ * arrives.  Endpoints that got an event, or that still have work after
+ * being progressed, are kept on ready_list until their socket I/O would
+ * block.  A shard is progressed by its own thread when progress threads
+ * are configured, and from CQ reads otherwise.
+ */
+struct tcpx_shard {
+	fi_epoll_t		epoll_fd;
+	struct dlist_entry	ready_list;
+	fastlock_t		lock;
+	ofi_atomic32_t		waiters;
+	struct fd_signal	signal;
+	struct tcpx_domain	*domain;
+	pthread_t		thread;
+	int			cpu;
 };
 
 struct tcpx_domain {
 	struct util_domain	util_domain;
+	struct tcpx_shard	*shards;
+	int			shard_cnt;
+	ofi_atomic32_t		next_shard;
+	int			thread_cnt;
+	volatile int		run;
+	/* serializes atomics applied by endpoints of this domain */
+	fastlock_t		atomic_lock;
 };
 
 struct tcpx_buf_pool {
@@ -213,8 +435,55 @@ void tcpx_cq_report_completion(struct util_cq *cq,
 			       int err);
 
 int tcpx_recv_msg_data(struct tcpx_xfer_entry *recv_entry);
-int tcpx_send_msg(struct tcpx_xfer_entry *tx_entry);
-int tcpx_recv_hdr(SOCKET sock, struct tcpx_rx_detect *rx_detect);
+void tcpx_rx_fit_iov(struct tcpx_xfer_entry *rx_entry);
+ssize_t tcpx_send_queued(struct tcpx_ep *ep);
+void tcpx_zerocopy_enable(struct tcpx_ep *ep);
+
+#if TCPX_HAVE_IO_URING
+int tcpx_uring_init(struct tcpx_ep *ep);
+void tcpx_uring_cleanup(struct tcpx_ep *ep);
+ssize_t tcpx_uring_recv(struct tcpx_ep *ep, void *buf, size_t len);
+ssize_t tcpx_uring_readv(struct tcpx_ep *ep, struct iovec *iov, size_t cnt);
+ssize_t tcpx_uring_sendmsg(struct tcpx_ep *ep, const struct msghdr *msg);
+int tcpx_uring_tx_busy(struct tcpx_ep *ep);
+int tcpx_uring_fd(struct tcpx_ep *ep);
+#else
+static inline int tcpx_uring_init(struct tcpx_ep *ep)
+{
+	return -FI_ENOSYS;
+}
+static inline void tcpx_uring_cleanup(struct tcpx_ep *ep) {}
+static inline ssize_t tcpx_uring_recv(struct tcpx_ep *ep, void *buf,
+				      size_t len)
+{
+	return -FI_ENOSYS;
+}
+static inline ssize_t tcpx_uring_readv(struct tcpx_ep *ep,
+				       struct iovec *iov, size_t cnt)
+{
+	return -FI_ENOSYS;
+}
+static inline ssize_t tcpx_uring_sendmsg(struct tcpx_ep *ep,
+					 const struct msghdr *msg)
+{
+	return -FI_ENOSYS;
+}
+static inline int tcpx_uring_tx_busy(struct tcpx_ep *ep)
+{
+	return 0;
+}
+static inline int tcpx_uring_fd(struct tcpx_ep *ep)
+{
+	return INVALID_SOCKET;
+}
+#endif
+
+static inline int tcpx_ep_wait_fd(struct tcpx_ep *ep)
+{
+	return ep->uring ? tcpx_uring_fd(ep) : ep->conn_fd;
+}
+int tcpx_zerocopy_reap(struct tcpx_ep *ep);
+int tcpx_recv_hdr(struct tcpx_ep *ep);
 
 struct tcpx_xfer_entry *tcpx_xfer_entry_alloc(struct tcpx_cq *cq,
 					      enum tcpx_xfer_op_codes type);
@@ -222,11 +491,55 @@ void tcpx_xfer_entry_release(struct tcpx_cq *tcpx_cq,
 			     struct tcpx_xfer_entry *xfer_entry);
 void tcpx_progress(struct util_ep *util_ep);
 void tcpx_ep_progress(struct tcpx_ep *ep);
+int tcpx_domain_progress_init(struct tcpx_domain *domain);
+void tcpx_domain_progress_close(struct tcpx_domain *domain);
+void tcpx_domain_progress(struct tcpx_domain *domain);
+int tcpx_shard_ep_add(struct tcpx_ep *ep);
+void tcpx_shard_ep_del(struct tcpx_ep *ep);
 int tcpx_ep_shutdown_report(struct tcpx_ep *ep, fid_t fid);
 int tcpx_cq_wait_ep_add(struct tcpx_ep *ep);
 void tcpx_cq_wait_ep_del(struct tcpx_ep *ep);
-void process_tx_entry(struct tcpx_xfer_entry *tx_entry);
+void tcpx_process_tx_queue(struct tcpx_ep *ep);
+int tcpx_get_tagged_rx_entry(struct tcpx_ep *ep,
+			     struct tcpx_xfer_entry **new_rx_entry);
+void tcpx_unexp_msg_deliver(struct tcpx_unexp_msg *unexp,
+			    struct tcpx_xfer_entry *rx_entry);
+void tcpx_tagged_queues_release(struct tcpx_ep *ep);
+int tcpx_get_atomic_rx_entry(struct tcpx_ep *ep,
+			     struct tcpx_xfer_entry **new_rx_entry);
+void tcpx_atomic_flush(struct tcpx_ep *ep);
+int tcpx_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
+		      enum fi_op op, struct fi_atomic_attr *attr,
+		      uint64_t flags);
+void tcpx_tx_entry_done(struct tcpx_xfer_entry *tx_entry, int err);
+void tcpx_rx_entry_done(struct tcpx_xfer_entry *rx_entry, int err);
+void tcpx_rx_entry_free(struct tcpx_xfer_entry *rx_entry);
+int tcpx_setup_socket(SOCKET sock);
+
+void tcpx_stripe_init(struct tcpx_ep *ep, uint32_t cnt);
+void tcpx_stripe_cm_hdr(struct tcpx_ep *ep, struct ofi_ctrl_hdr *hdr);
+void tcpx_stripe_listen(struct tcpx_ep *ep, struct util_wait *wait);
+void tcpx_stripe_accept(struct util_wait *wait, struct tcpx_ep *ep);
+void tcpx_stripe_connect(struct tcpx_ep *ep, struct ofi_ctrl_hdr *conn_resp);
+void tcpx_stripe_tx_prep(struct tcpx_ep *ep, struct tcpx_xfer_entry *tx_entry);
+void tcpx_stripe_tx_start(struct tcpx_ep *ep,
+			  struct tcpx_xfer_entry *tx_entry);
+int tcpx_stripe_rx_start(struct tcpx_ep *ep,
+			 struct tcpx_xfer_entry *rx_entry);
+void tcpx_stripe_progress(struct tcpx_ep *ep);
+int tcpx_stripe_has_work(struct tcpx_ep *ep);
+int tcpx_stripe_wait_add(struct tcpx_ep *ep, struct tcpx_stripe *stripe);
+void tcpx_stripe_wait_del(struct tcpx_ep *ep, struct tcpx_stripe *stripe);
+void tcpx_stripe_shutdown(struct tcpx_ep *ep);
+void tcpx_stripe_close(struct tcpx_ep *ep);
+void tcpx_stripe_queues_release(struct tcpx_ep *ep);
 void tcpx_conn_mgr_run(struct util_eq *eq);
+int tcpx_conn_mgr_connect(struct tcpx_ep *ep, const struct sockaddr *addr,
+			  const void *param, size_t paramlen);
+int tcpx_conn_mgr_accept(struct tcpx_ep *ep, const void *param,
+			 size_t paramlen);
+int tcpx_conn_mgr_start(struct tcpx_fabric *fabric);
+void tcpx_conn_mgr_stop(struct tcpx_fabric *fabric);
 int tcpx_eq_wait_try_func(void *arg);
 int tcpx_eq_create(struct fid_fabric *fabric_fid, struct fi_eq_attr *attr,
 		   struct fid_eq **eq_fid, void *context);
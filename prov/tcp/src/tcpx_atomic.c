@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *	   Redistribution and use in source and binary forms, with or
+ *	   without modification, are permitted provided that the following
+ *	   conditions are met:
+ *
+ *		- Redistributions of source code must retain the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer.
+ *
+ *		- Redistributions in binary form must reproduce the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer in the documentation and/or other materials
+ *		  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <rdma/fi_errno.h>
+#include "ofi_iov.h"
+#include <ofi_prov.h>
+#include <ofi_atomic.h>
+#include "tcpx.h"
+
+#include <sys/types.h>
+#include <ofi_util.h>
+#include <string.h>
+
+/* Atomics travel as [msg_hdr][operands][compare values], with the target
+ * iocs in msg_hdr.rma_ioc.  Operands are limited to TCPX_MAX_ATOMIC_SZ
+ * bytes so that both sides can stage them in the entry's atomic_buf.
+ * Fetched values come back as a read response, matched to the request
+ * through the rma_read_queue like RMA reads.
+ */
+static size_t tcpx_copy_ioc_to_buf(uint8_t *buf, const struct fi_ioc *ioc,
+				   size_t ioc_count, size_t dtsize)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < ioc_count; i++) {
+		memcpy(&buf[len], ioc[i].addr, ioc[i].count * dtsize);
+		len += ioc[i].count * dtsize;
+	}
+	return len;
+}
+
+static ssize_t tcpx_atomic_generic(struct fid_ep *ep,
+				   const struct fi_msg_atomic *msg,
+				   const struct fi_ioc *comparev,
+				   size_t compare_count,
+				   const struct fi_ioc *resultv,
+				   size_t result_count,
+				   uint8_t op, uint64_t flags)
+{
+	struct tcpx_ep *tcpx_ep;
+	struct tcpx_cq *tcpx_cq;
+	struct tcpx_xfer_entry *send_entry;
+	struct tcpx_xfer_entry *recv_entry = NULL;
+	size_t dtsize, data_len, i;
+
+	tcpx_ep = container_of(ep, struct tcpx_ep, util_ep.ep_fid);
+	tcpx_cq = container_of(tcpx_ep->util_ep.tx_cq, struct tcpx_cq,
+			       util_cq);
+
+	if (msg->iov_count > TCPX_IOV_LIMIT ||
+	    msg->rma_iov_count > TCPX_IOV_LIMIT ||
+	    result_count > TCPX_IOV_LIMIT)
+		return -FI_EINVAL;
+
+	assert(msg->datatype < FI_DATATYPE_LAST);
+	dtsize = ofi_datatype_size(msg->datatype);
+	data_len = (msg->op == FI_ATOMIC_READ) ? 0 :
+		   ofi_total_ioc_cnt(msg->msg_iov, msg->iov_count) * dtsize;
+	if (data_len > TCPX_MAX_ATOMIC_SZ ||
+	    ofi_total_ioc_cnt(resultv, result_count) * dtsize >
+	    TCPX_MAX_ATOMIC_SZ)
+		return -FI_EINVAL;
+
+	send_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_ATOMIC);
+	if (!send_entry)
+		return -FI_EAGAIN;
+
+	if (op != ofi_op_atomic) {
+		recv_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_READ_RSP);
+		if (!recv_entry) {
+			tcpx_xfer_entry_release(tcpx_cq, send_entry);
+			return -FI_EAGAIN;
+		}
+	}
+
+	if (data_len)
+		tcpx_copy_ioc_to_buf(send_entry->msg_data.atomic_buf,
+				     msg->msg_iov, msg->iov_count, dtsize);
+	if (op == ofi_op_atomic_compare)
+		data_len += tcpx_copy_ioc_to_buf(
+				&send_entry->msg_data.atomic_buf[data_len],
+				comparev, compare_count, dtsize);
+
+	send_entry->msg_hdr.hdr.op = op;
+	send_entry->msg_hdr.hdr.op_data = TCPX_OP_ATOMIC;
+	send_entry->msg_hdr.hdr.flags = 0;
+	send_entry->msg_hdr.hdr.size = htonll(data_len +
+					      sizeof(send_entry->msg_hdr));
+	send_entry->msg_hdr.hdr.atomic.datatype = msg->datatype;
+	send_entry->msg_hdr.hdr.atomic.op = msg->op;
+	send_entry->msg_hdr.hdr.atomic.ioc_count = msg->rma_iov_count;
+
+	memcpy(send_entry->msg_hdr.rma_ioc, msg->rma_iov,
+	       msg->rma_iov_count * sizeof(msg->rma_iov[0]));
+	send_entry->msg_hdr.rma_iov_cnt = msg->rma_iov_count;
+
+	if (flags & FI_REMOTE_CQ_DATA) {
+		send_entry->msg_hdr.hdr.flags |= OFI_REMOTE_CQ_DATA;
+		send_entry->msg_hdr.hdr.data = htonll(msg->data);
+	}
+	send_entry->msg_hdr.hdr.flags = htonl(send_entry->msg_hdr.hdr.flags);
+
+	send_entry->msg_data.iov[0].iov_base = (void *) &send_entry->msg_hdr;
+	send_entry->msg_data.iov[0].iov_len = sizeof(send_entry->msg_hdr);
+	send_entry->msg_data.iov[1].iov_base = send_entry->msg_data.atomic_buf;
+	send_entry->msg_data.iov[1].iov_len = data_len;
+	send_entry->msg_data.iov_cnt = data_len ? 2 : 1;
+	send_entry->ep = tcpx_ep;
+	send_entry->context = msg->context;
+	send_entry->done_len = 0;
+
+	if (recv_entry) {
+		for (i = 0; i < result_count; i++) {
+			recv_entry->msg_data.iov[i].iov_base = resultv[i].addr;
+			recv_entry->msg_data.iov[i].iov_len =
+				resultv[i].count * dtsize;
+		}
+		recv_entry->msg_data.iov_cnt = result_count;
+		recv_entry->ep = tcpx_ep;
+		recv_entry->context = msg->context;
+		recv_entry->done_len = 0;
+		recv_entry->flags = flags | FI_ATOMIC | FI_READ;
+		send_entry->flags = TCPX_NO_COMPLETION;
+	} else {
+		send_entry->flags = flags | FI_ATOMIC | FI_WRITE;
+	}
+
+	fastlock_acquire(&tcpx_ep->lock);
+	if (recv_entry)
+		slist_insert_tail(&recv_entry->entry, &tcpx_ep->rma_read_queue);
+	if (slist_empty(&tcpx_ep->tx_queue)) {
+		slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
+		tcpx_process_tx_queue(tcpx_ep);
+	} else {
+		slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
+	}
+	fastlock_release(&tcpx_ep->lock);
+	return FI_SUCCESS;
+}
+
+static ssize_t tcpx_atomic_writemsg(struct fid_ep *ep,
+				    const struct fi_msg_atomic *msg,
+				    uint64_t flags)
+{
+	return tcpx_atomic_generic(ep, msg, NULL, 0, NULL, 0,
+				   ofi_op_atomic, flags);
+}
+
+static ssize_t tcpx_atomic_writev(struct fid_ep *ep,
+				  const struct fi_ioc *iov, void **desc,
+				  size_t count, fi_addr_t dest_addr,
+				  uint64_t addr, uint64_t key,
+				  enum fi_datatype datatype, enum fi_op op,
+				  void *context)
+{
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = ofi_total_ioc_cnt(iov, count),
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_atomic_writemsg(ep, &msg, 0);
+}
+
+static ssize_t tcpx_atomic_write(struct fid_ep *ep, const void *buf,
+				 size_t count, void *desc, fi_addr_t dest_addr,
+				 uint64_t addr, uint64_t key,
+				 enum fi_datatype datatype, enum fi_op op,
+				 void *context)
+{
+	struct fi_ioc iov = {
+		.addr = (void *) buf,
+		.count = count,
+	};
+
+	return tcpx_atomic_writev(ep, &iov, &desc, 1, dest_addr, addr, key,
+				  datatype, op, context);
+}
+
+static ssize_t tcpx_atomic_inject(struct fid_ep *ep, const void *buf,
+				  size_t count, fi_addr_t dest_addr,
+				  uint64_t addr, uint64_t key,
+				  enum fi_datatype datatype, enum fi_op op)
+{
+	struct fi_ioc iov = {
+		.addr = (void *) buf,
+		.count = count,
+	};
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = count,
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = &iov,
+		.desc = NULL,
+		.iov_count = 1,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = NULL,
+		.data = 0,
+	};
+
+	return tcpx_atomic_writemsg(ep, &msg, FI_INJECT | TCPX_NO_COMPLETION);
+}
+
+static ssize_t tcpx_atomic_readwritemsg(struct fid_ep *ep,
+					const struct fi_msg_atomic *msg,
+					struct fi_ioc *resultv,
+					void **result_desc,
+					size_t result_count, uint64_t flags)
+{
+	return tcpx_atomic_generic(ep, msg, NULL, 0, resultv, result_count,
+				   ofi_op_atomic_fetch, flags);
+}
+
+static ssize_t tcpx_atomic_readwritev(struct fid_ep *ep,
+				      const struct fi_ioc *iov, void **desc,
+				      size_t count, struct fi_ioc *resultv,
+				      void **result_desc, size_t result_count,
+				      fi_addr_t dest_addr, uint64_t addr,
+				      uint64_t key, enum fi_datatype datatype,
+				      enum fi_op op, void *context)
+{
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = ofi_total_ioc_cnt(resultv, result_count),
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_atomic_readwritemsg(ep, &msg, resultv, result_desc,
+					result_count, 0);
+}
+
+static ssize_t tcpx_atomic_readwrite(struct fid_ep *ep, const void *buf,
+				     size_t count, void *desc, void *result,
+				     void *result_desc, fi_addr_t dest_addr,
+				     uint64_t addr, uint64_t key,
+				     enum fi_datatype datatype, enum fi_op op,
+				     void *context)
+{
+	struct fi_ioc iov = {
+		.addr = (void *) buf,
+		.count = count,
+	};
+	struct fi_ioc resultv = {
+		.addr = result,
+		.count = count,
+	};
+
+	return tcpx_atomic_readwritev(ep, &iov, &desc, 1, &resultv,
+				      &result_desc, 1, dest_addr, addr, key,
+				      datatype, op, context);
+}
+
+static ssize_t tcpx_atomic_compwritemsg(struct fid_ep *ep,
+					const struct fi_msg_atomic *msg,
+					const struct fi_ioc *comparev,
+					void **compare_desc,
+					size_t compare_count,
+					struct fi_ioc *resultv,
+					void **result_desc,
+					size_t result_count, uint64_t flags)
+{
+	return tcpx_atomic_generic(ep, msg, comparev, compare_count, resultv,
+				   result_count, ofi_op_atomic_compare, flags);
+}
+
+static ssize_t tcpx_atomic_compwritev(struct fid_ep *ep,
+				      const struct fi_ioc *iov, void **desc,
+				      size_t count,
+				      const struct fi_ioc *comparev,
+				      void **compare_desc,
+				      size_t compare_count,
+				      struct fi_ioc *resultv,
+				      void **result_desc, size_t result_count,
+				      fi_addr_t dest_addr, uint64_t addr,
+				      uint64_t key, enum fi_datatype datatype,
+				      enum fi_op op, void *context)
+{
+	struct fi_rma_ioc rma_iov = {
+		.addr = addr,
+		.count = ofi_total_ioc_cnt(iov, count),
+		.key = key,
+	};
+	struct fi_msg_atomic msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.rma_iov = &rma_iov,
+		.rma_iov_count = 1,
+		.datatype = datatype,
+		.op = op,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_atomic_compwritemsg(ep, &msg, comparev, compare_desc,
+					compare_count, resultv, result_desc,
+					result_count, 0);
+}
+
+static ssize_t tcpx_atomic_compwrite(struct fid_ep *ep, const void *buf,
+				     size_t count, void *desc,
+				     const void *compare, void *compare_desc,
+				     void *result, void *result_desc,
+				     fi_addr_t dest_addr, uint64_t addr,
+				     uint64_t key, enum fi_datatype datatype,
+				     enum fi_op op, void *context)
+{
+	struct fi_ioc iov = {
+		.addr = (void *) buf,
+		.count = count,
+	};
+	struct fi_ioc resultv = {
+		.addr = result,
+		.count = count,
+	};
+	struct fi_ioc comparev = {
+		.addr = (void *) compare,
+		.count = count,
+	};
+
+	return tcpx_atomic_compwritev(ep, &iov, &desc, 1, &comparev,
+				      &compare_desc, 1, &resultv, &result_desc,
+				      1, dest_addr, addr, key, datatype, op,
+				      context);
+}
+
+int tcpx_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
+		      enum fi_op op, struct fi_atomic_attr *attr,
+		      uint64_t flags)
+{
+	int ret;
+
+	if (flags & FI_TAGGED) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+			"tagged atomic op not supported\n");
+		return -FI_EINVAL;
+	}
+
+	ret = ofi_atomic_valid(&tcpx_prov, datatype, op, flags);
+	if (ret || !attr)
+		return ret;
+
+	attr->size = ofi_datatype_size(datatype);
+	attr->count = TCPX_MAX_ATOMIC_SZ / attr->size;
+	return ret;
+}
+
+static int tcpx_atomic_valid(struct fid_ep *ep, enum fi_datatype datatype,
+			     enum fi_op op, size_t *count)
+{
+	struct fi_atomic_attr attr;
+	int ret;
+
+	ret = tcpx_query_atomic(NULL, datatype, op, &attr, 0);
+	if (!ret)
+		*count = attr.count;
+
+	return ret;
+}
+
+static int tcpx_atomic_fetch_valid(struct fid_ep *ep,
+				   enum fi_datatype datatype, enum fi_op op,
+				   size_t *count)
+{
+	struct fi_atomic_attr attr;
+	int ret;
+
+	ret = tcpx_query_atomic(NULL, datatype, op, &attr, FI_FETCH_ATOMIC);
+	if (!ret)
+		*count = attr.count;
+
+	return ret;
+}
+
+static int tcpx_atomic_comp_valid(struct fid_ep *ep,
+				  enum fi_datatype datatype, enum fi_op op,
+				  size_t *count)
+{
+	struct fi_atomic_attr attr;
+	int ret;
+
+	ret = tcpx_query_atomic(NULL, datatype, op, &attr, FI_COMPARE_ATOMIC);
+	if (!ret)
+		*count = attr.count;
+
+	return ret;
+}
+
+struct fi_ops_atomic tcpx_atomic_ops = {
+	.size = sizeof(struct fi_ops_atomic),
+	.write = tcpx_atomic_write,
+	.writev = tcpx_atomic_writev,
+	.writemsg = tcpx_atomic_writemsg,
+	.inject = tcpx_atomic_inject,
+	.readwrite = tcpx_atomic_readwrite,
+	.readwritev = tcpx_atomic_readwritev,
+	.readwritemsg = tcpx_atomic_readwritemsg,
+	.compwrite = tcpx_atomic_compwrite,
+	.compwritev = tcpx_atomic_compwritev,
+	.compwritemsg = tcpx_atomic_compwritemsg,
+	.writevalid = tcpx_atomic_valid,
+	.readwritevalid = tcpx_atomic_fetch_valid,
+	.compwritevalid = tcpx_atomic_comp_valid,
+};
+
+static uint64_t tcpx_atomic_query_flags(uint8_t op)
+{
+	switch (op) {
+	case ofi_op_atomic_fetch:
+		return FI_FETCH_ATOMIC;
+	case ofi_op_atomic_compare:
+		return FI_COMPARE_ATOMIC;
+	default:
+		return 0;
+	}
+}
+
+/* Verify the target iocs and that the payload matches them.  The ioc
+ * addresses are translated in place. */
+static int tcpx_validate_rx_atomic(struct tcpx_xfer_entry *rx_entry)
+{
+	struct ofi_mr_map *map = &rx_entry->ep->util_ep.domain->mr_map;
+	struct tcpx_msg_hdr *msg_hdr = &rx_entry->msg_hdr;
+	struct fi_rma_ioc *ioc = msg_hdr->rma_ioc;
+	uint64_t access;
+	size_t i, dtsize, len, data_len;
+	int ret;
+
+	if (msg_hdr->rma_iov_cnt > TCPX_IOV_LIMIT ||
+	    ofi_atomic_valid(&tcpx_prov, msg_hdr->hdr.atomic.datatype,
+			     msg_hdr->hdr.atomic.op,
+			     tcpx_atomic_query_flags(msg_hdr->hdr.op)))
+		return -FI_EINVAL;
+
+	if (msg_hdr->hdr.atomic.op == FI_ATOMIC_READ)
+		access = FI_REMOTE_READ;
+	else if (msg_hdr->hdr.op == ofi_op_atomic)
+		access = FI_REMOTE_WRITE;
+	else
+		access = FI_REMOTE_READ | FI_REMOTE_WRITE;
+
+	dtsize = ofi_datatype_size(msg_hdr->hdr.atomic.datatype);
+	for (i = 0, len = 0; i < msg_hdr->rma_iov_cnt; i++) {
+		ret = ofi_mr_map_verify(map, (uintptr_t *) &ioc[i].addr,
+					ioc[i].count * dtsize, ioc[i].key,
+					access, NULL);
+		if (ret)
+			return ret;
+		len += ioc[i].count * dtsize;
+	}
+
+	if (msg_hdr->hdr.atomic.op == FI_ATOMIC_READ)
+		data_len = 0;
+	else if (msg_hdr->hdr.op == ofi_op_atomic_compare)
+		data_len = 2 * len;
+	else
+		data_len = len;
+
+	if (len > TCPX_MAX_ATOMIC_SZ ||
+	    ntohll(msg_hdr->hdr.size) != sizeof(*msg_hdr) + data_len)
+		return -FI_EINVAL;
+
+	return FI_SUCCESS;
+}
+
+/* The payload is received into atomic_buf and the entry then waits on
+ * the atomic_queue to be applied. */
+int tcpx_get_atomic_rx_entry(struct tcpx_ep *ep,
+			     struct tcpx_xfer_entry **new_rx_entry)
+{
+	struct tcpx_xfer_entry *rx_entry;
+	struct tcpx_cq *tcpx_cq;
+	int ret;
+
+	tcpx_cq = container_of(ep->util_ep.rx_cq, struct tcpx_cq, util_cq);
+	rx_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_REMOTE_ATOMIC);
+	if (!rx_entry)
+		return -FI_EAGAIN;
+
+	rx_entry->msg_hdr = ep->rx_detect.hdr;
+	rx_entry->msg_hdr.hdr.op_data = TCPX_OP_REMOTE_ATOMIC;
+	rx_entry->ep = ep;
+	rx_entry->context = NULL;
+	rx_entry->done_len = sizeof(rx_entry->msg_hdr);
+
+	if (ntohl(rx_entry->msg_hdr.hdr.flags) & OFI_REMOTE_CQ_DATA)
+		rx_entry->flags = FI_REMOTE_CQ_DATA | FI_ATOMIC |
+				  FI_REMOTE_WRITE;
+	else
+		rx_entry->flags = TCPX_NO_COMPLETION;
+
+	ret = tcpx_validate_rx_atomic(rx_entry);
+	if (ret) {
+		FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+			"invalid atomic data\n");
+		tcpx_xfer_entry_release(tcpx_cq, rx_entry);
+		return -FI_EINVAL;
+	}
+
+	rx_entry->msg_data.iov[0].iov_base = rx_entry->msg_data.atomic_buf;
+	rx_entry->msg_data.iov[0].iov_len = sizeof(rx_entry->msg_data.atomic_buf);
+	rx_entry->msg_data.iov_cnt = 1;
+	*new_rx_entry = rx_entry;
+	return FI_SUCCESS;
+}
+
+static size_t tcpx_atomic_len(struct tcpx_msg_hdr *msg_hdr)
+{
+	size_t i, cnt = 0;
+
+	for (i = 0; i < msg_hdr->rma_iov_cnt; i++)
+		cnt += msg_hdr->rma_ioc[i].count;
+
+	return cnt * ofi_datatype_size(msg_hdr->hdr.atomic.datatype);
+}
+
+/* Fetched values replace the operands in atomic_buf */
+static void tcpx_atomic_apply(struct tcpx_xfer_entry *rx_entry)
+{
+	struct tcpx_msg_hdr *msg_hdr = &rx_entry->msg_hdr;
+	struct fi_rma_ioc *ioc = msg_hdr->rma_ioc;
+	uint8_t result[TCPX_MAX_ATOMIC_SZ];
+	uint8_t *src, *cmp, *res;
+	enum fi_datatype datatype;
+	enum fi_op op;
+	size_t i, len;
+	void *dst;
+
+	datatype = msg_hdr->hdr.atomic.datatype;
+	op = msg_hdr->hdr.atomic.op;
+	src = rx_entry->msg_data.atomic_buf;
+	cmp = &src[tcpx_atomic_len(msg_hdr)];
+	res = result;
+
+	for (i = 0; i < msg_hdr->rma_iov_cnt; i++) {
+		dst = (void *) (uintptr_t) ioc[i].addr;
+		len = ioc[i].count * ofi_datatype_size(datatype);
+		switch (msg_hdr->hdr.op) {
+		case ofi_op_atomic:
+			ofi_atomic_write_handlers[op][datatype](dst, src,
+								ioc[i].count);
+			break;
+		case ofi_op_atomic_fetch:
+			ofi_atomic_readwrite_handlers[op][datatype](dst, src,
+						res, ioc[i].count);
+			break;
+		default:
+			ofi_atomic_swap_handlers[op - OFI_SWAP_OP_START]
+				[datatype](dst, src, cmp, res, ioc[i].count);
+			cmp += len;
+			break;
+		}
+		src += len;
+		res += len;
+	}
+
+	if (msg_hdr->hdr.op != ofi_op_atomic)
+		memcpy(rx_entry->msg_data.atomic_buf, result, res - result);
+}
+
+/* Fetched values go back as a read response, in request order */
+static void tcpx_atomic_done(struct tcpx_xfer_entry *rx_entry)
+{
+	struct tcpx_ep *ep = rx_entry->ep;
+	struct tcpx_cq *tcpx_cq;
+	size_t len;
+
+	tcpx_cq_report_completion(ep->util_ep.rx_cq, rx_entry, FI_SUCCESS);
+	if (rx_entry->msg_hdr.hdr.op == ofi_op_atomic) {
+		tcpx_cq = container_of(ep->util_ep.rx_cq, struct tcpx_cq,
+				       util_cq);
+		tcpx_xfer_entry_release(tcpx_cq, rx_entry);
+		return;
+	}
+
+	len = tcpx_atomic_len(&rx_entry->msg_hdr);
+	rx_entry->msg_hdr.hdr.op = ofi_op_read_rsp;
+	rx_entry->msg_hdr.hdr.flags = 0;
+	rx_entry->msg_hdr.hdr.size = htonll(sizeof(rx_entry->msg_hdr) + len);
+
+	rx_entry->msg_data.iov[0].iov_base = (void *) &rx_entry->msg_hdr;
+	rx_entry->msg_data.iov[0].iov_len = sizeof(rx_entry->msg_hdr);
+	rx_entry->msg_data.iov[1].iov_base = rx_entry->msg_data.atomic_buf;
+	rx_entry->msg_data.iov[1].iov_len = len;
+	rx_entry->msg_data.iov_cnt = 2;
+	rx_entry->flags = TCPX_NO_COMPLETION;
+	rx_entry->done_len = 0;
+
+	slist_insert_tail(&rx_entry->entry, &ep->tx_queue);
+}
+
+/* Atomics received in one progress pass are applied together, taking
+ * the domain's atomic lock once.  The queue is flushed before anything
+ * received after the atomics is processed, which keeps them ordered
+ * with the endpoint's other operations.  Called with the ep lock held.
+ */
+void tcpx_atomic_flush(struct tcpx_ep *ep)
+{
+	struct tcpx_domain *domain;
+	struct tcpx_xfer_entry *rx_entry;
+	struct slist_entry *item;
+	struct slist queue;
+
+	domain = container_of(ep->util_ep.domain, struct tcpx_domain,
+			      util_domain);
+	slist_init(&queue);
+	slist_swap(&queue, &ep->atomic_queue);
+
+	fastlock_acquire(&domain->atomic_lock);
+	/* slist does not terminate the tail's next pointer */
+	for (item = queue.head; item;
+	     item = (item == queue.tail) ? NULL : item->next) {
+		rx_entry = container_of(item, struct tcpx_xfer_entry, entry);
+		tcpx_atomic_apply(rx_entry);
+	}
+	fastlock_release(&domain->atomic_lock);
+
+	while (!slist_empty(&queue)) {
+		item = slist_remove_head(&queue);
+		rx_entry = container_of(item, struct tcpx_xfer_entry, entry);
+		tcpx_atomic_done(rx_entry);
+	}
+}
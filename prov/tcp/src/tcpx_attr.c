@@ -39,7 +39,7 @@
 			FI_ORDER_SAW | FI_ORDER_SAS)
 
 static struct fi_tx_attr tcpx_tx_attr = {
-	.caps = FI_MSG | FI_SEND,
+	.caps = FI_MSG | FI_TAGGED | FI_SEND,
 	.comp_order = FI_ORDER_STRICT,
 	.msg_order = TCPX_MSG_ORDER,
 	.inject_size = 64,
@@ -49,7 +49,7 @@ static struct fi_tx_attr tcpx_tx_attr = {
 };
 
 static struct fi_rx_attr tcpx_rx_attr = {
-	.caps = FI_MSG | FI_RECV,
+	.caps = FI_MSG | FI_TAGGED | FI_RECV,
 	.comp_order = FI_ORDER_STRICT,
 	.msg_order = TCPX_MSG_ORDER,
 	.total_buffered_recv = 0,
@@ -93,9 +93,9 @@ static struct fi_fabric_attr tcpx_fabric_attr = {
 };
 
 struct fi_info tcpx_info = {
-	.caps = FI_MSG | FI_SEND | FI_RECV |
+	.caps = FI_MSG | FI_TAGGED | FI_SEND | FI_RECV |
 		FI_RMA | FI_WRITE | FI_REMOTE_WRITE |
-		FI_READ | FI_REMOTE_READ | TCPX_DOMAIN_CAPS,
+		FI_READ | FI_REMOTE_READ | FI_ATOMIC | TCPX_DOMAIN_CAPS,
 	.addr_format = FI_SOCKADDR,
 	.tx_attr = &tcpx_tx_attr,
 	.rx_attr = &tcpx_rx_attr,
@@ -37,62 +37,273 @@
 #include <ofi_iov.h>
 #include "tcpx.h"
 
-int tcpx_send_msg(struct tcpx_xfer_entry *tx_entry)
+#if TCPX_HAVE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+/* Gather the unsent iovs of consecutive tx_queue entries, starting at the
+ * head, into a single sendmsg call.  The batch stops once it would exceed
+ * TCPX_TX_BATCH_IOV iovs or TCPX_TX_BATCH_SIZE bytes, but always includes
+ * the head entry.  Entries that qualify for MSG_ZEROCOPY are sent on
+ * their own, so that each zerocopy call maps to a single entry, and only
+ * the header of striped entries goes out here.
+ */
+ssize_t tcpx_send_queued(struct tcpx_ep *ep)
 {
+	struct iovec iov[TCPX_TX_BATCH_IOV];
+	struct tcpx_xfer_entry *tx_entry;
+	struct slist_entry *entry;
+	struct msghdr msg = {0};
+	size_t iov_cnt = 0, len = 0, cnt;
 	ssize_t bytes_sent;
+	int flags = MSG_NOSIGNAL;
+
+	if (ep->uring && tcpx_uring_tx_busy(ep))
+		return tcpx_uring_sendmsg(ep, NULL);
+
+	/* slist does not terminate the tail's next pointer */
+	for (entry = ep->tx_queue.head; entry;
+	     entry = (entry == ep->tx_queue.tail) ? NULL : entry->next) {
+		tx_entry = container_of(entry, struct tcpx_xfer_entry, entry);
+		if (!tx_entry->done_len && ep->stripe_cnt)
+			tcpx_stripe_tx_prep(ep, tx_entry);
+
+		if (tcpx_tx_zerocopy(ep, tx_entry)) {
+			if (iov_cnt)
+				break;
+#if TCPX_HAVE_ZEROCOPY
+			flags |= MSG_ZEROCOPY;
+#endif
+		}
+		cnt = tcpx_striped(tx_entry) ? 1 : tx_entry->msg_data.iov_cnt;
+		if ((iov_cnt + cnt > TCPX_TX_BATCH_IOV) ||
+		    (iov_cnt && len >= TCPX_TX_BATCH_SIZE))
+			break;
+
+		memcpy(&iov[iov_cnt], tx_entry->msg_data.iov,
+		       cnt * sizeof(*iov));
+		iov_cnt += cnt;
+		len += tcpx_tx_conn_len(tx_entry) - tx_entry->done_len;
+		if (flags != MSG_NOSIGNAL)
+			break;
+	}
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_cnt;
+
+	if (ep->uring)
+		return tcpx_uring_sendmsg(ep, &msg);
+
+	bytes_sent = ofi_sendmsg_tcp(ep->conn_fd, &msg, flags);
+	if (bytes_sent < 0) {
+		/* The kernel may refuse to pin more pages (ENOBUFS); copy. */
+		if (flags == MSG_NOSIGNAL || ofi_sockerr() != ENOBUFS)
+			return -ofi_sockerr();
+
+		bytes_sent = ofi_sendmsg_tcp(ep->conn_fd, &msg, MSG_NOSIGNAL);
+		return (bytes_sent < 0) ? -ofi_sockerr() : bytes_sent;
+	}
+
+	if (flags != MSG_NOSIGNAL)
+		ep->zc_sent++;
+	return bytes_sent;
+}
+
+void tcpx_zerocopy_enable(struct tcpx_ep *ep)
+{
+#if TCPX_HAVE_ZEROCOPY
+	int optval = 1;
+
+	if (!tcpx_zerocopy_size)
+		return;
+
+	if (setsockopt(ep->conn_fd, SOL_SOCKET, SO_ZEROCOPY,
+		       (char *) &optval, sizeof(optval))) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+			"setsockopt zerocopy failed, using copying sends\n");
+		return;
+	}
+	ep->zerocopy_size = tcpx_zerocopy_size;
+#endif
+}
+
+/* Drain zerocopy notifications from the socket error queue.  Each one
+ * reports an inclusive range of zerocopy sendmsg calls whose pages the
+ * kernel has released; ep->zc_done is advanced past the range.
+ */
+int tcpx_zerocopy_reap(struct tcpx_ep *ep)
+{
+#if TCPX_HAVE_ZEROCOPY
+	struct sock_extended_err *serr;
 	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(*serr) +
+				    sizeof(struct sockaddr_in6))];
+		struct cmsghdr align;
+	} control;
+	int ret;
+
+	for (;;) {
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(ep->conn_fd, &msg, MSG_ERRQUEUE) < 0) {
+			ret = -ofi_sockerr();
+			return OFI_SOCK_TRY_SND_RCV_AGAIN(-ret) ? FI_SUCCESS : ret;
+		}
 
-	msg.msg_iov = tx_entry->msg_data.iov;
-	msg.msg_iovlen = tx_entry->msg_data.iov_cnt;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == IPPROTO_IP &&
+			      cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == IPPROTO_IPV6 &&
+			      cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
 
-	bytes_sent = ofi_sendmsg_tcp(tx_entry->ep->conn_fd,
-	                             &msg, MSG_NOSIGNAL);
-	if (bytes_sent < 0)
-		return -ofi_sockerr();
+			serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (serr->ee_errno ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
 
-	tx_entry->done_len += bytes_sent;
-	if (tx_entry->done_len < ntohll(tx_entry->msg_hdr.hdr.size)) {
-		ofi_consume_iov(tx_entry->msg_data.iov,
-				&tx_entry->msg_data.iov_cnt,
-				bytes_sent);
-		return -FI_EAGAIN;
+			if ((int32_t) (serr->ee_data + 1 - ep->zc_done) > 0)
+				ep->zc_done = serr->ee_data + 1;
+		}
 	}
+#else
 	return FI_SUCCESS;
+#endif
 }
 
-int tcpx_recv_hdr(SOCKET sock, struct tcpx_rx_detect *rx_detect)
+/* A receive that would block means the wait fd reports the next data */
+static ssize_t tcpx_io_recv(struct tcpx_ep *ep, void *buf, size_t len)
 {
-	void *rem_buf;
-	size_t rem_len;
-	ssize_t bytes_recvd;
+	ssize_t ret;
 
-	rem_buf = (uint8_t *) &rx_detect->hdr + rx_detect->done_len;
-	rem_len = sizeof(rx_detect->hdr) - rx_detect->done_len;
+	if (ep->uring) {
+		ret = tcpx_uring_recv(ep, buf, len);
+	} else {
+		ret = ofi_recv_socket(ep->conn_fd, buf, len, 0);
+		if (ret < 0)
+			ret = -ofi_sockerr();
+	}
 
-	bytes_recvd = ofi_recv_socket(sock, rem_buf, rem_len, 0);
-	if (bytes_recvd <= 0)
-		return (bytes_recvd)? -ofi_sockerr(): -FI_ENOTCONN;
+	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+		ep->rx_blocked = 1;
+	return ret;
+}
+
+static ssize_t tcpx_io_readv(struct tcpx_ep *ep, struct iovec *iov,
+			     size_t cnt)
+{
+	ssize_t ret;
+
+	if (ep->uring) {
+		ret = tcpx_uring_readv(ep, iov, cnt);
+	} else {
+		ret = ofi_readv_socket(ep->conn_fd, iov, cnt);
+		if (ret < 0)
+			ret = -ofi_sockerr();
+	}
 
-	rx_detect->done_len += bytes_recvd;
-	return (rem_len == bytes_recvd)? FI_SUCCESS : -FI_EAGAIN;
+	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+		ep->rx_blocked = 1;
+	return ret;
 }
 
-int tcpx_recv_msg_data(struct tcpx_xfer_entry *rx_entry)
+static int tcpx_read_to_buffer(struct tcpx_ep *ep)
 {
+	struct tcpx_stage_buf *stage_buf = &ep->stage_buf;
 	ssize_t bytes_recvd;
 
-	bytes_recvd = ofi_readv_socket(rx_entry->ep->conn_fd,
-				       rx_entry->msg_data.iov,
-				       rx_entry->msg_data.iov_cnt);
+	bytes_recvd = tcpx_io_recv(ep, stage_buf->buf, sizeof(stage_buf->buf));
 	if (bytes_recvd <= 0)
-		return (bytes_recvd)? -ofi_sockerr(): -FI_ENOTCONN;
-
-	rx_entry->done_len += bytes_recvd;
-	if (rx_entry->done_len < ntohll(rx_entry->msg_hdr.hdr.size)) {
-		ofi_consume_iov(rx_entry->msg_data.iov,
-				&rx_entry->msg_data.iov_cnt,
-				bytes_recvd);
-		return -FI_EAGAIN;
+		return (bytes_recvd)? (int) bytes_recvd: -FI_ENOTCONN;
+
+	stage_buf->len = bytes_recvd;
+	stage_buf->off = 0;
+	return FI_SUCCESS;
+}
+
+static size_t tcpx_copy_from_buffer(struct tcpx_stage_buf *stage_buf,
+				    void *buf, size_t len)
+{
+	len = MIN(len, tcpx_stage_buf_avail(stage_buf));
+	memcpy(buf, &stage_buf->buf[stage_buf->off], len);
+	stage_buf->off += len;
+	return len;
+}
+
+int tcpx_recv_hdr(struct tcpx_ep *ep)
+{
+	struct tcpx_stage_buf *stage_buf = &ep->stage_buf;
+	struct tcpx_rx_detect *rx_detect = &ep->rx_detect;
+	void *rem_buf;
+	size_t rem_len;
+	int ret;
+
+	while (rx_detect->done_len < sizeof(rx_detect->hdr)) {
+		if (!tcpx_stage_buf_avail(stage_buf)) {
+			ret = tcpx_read_to_buffer(ep);
+			if (ret)
+				return ret;
+		}
+
+		rem_buf = (uint8_t *) &rx_detect->hdr + rx_detect->done_len;
+		rem_len = sizeof(rx_detect->hdr) - rx_detect->done_len;
+		rx_detect->done_len += tcpx_copy_from_buffer(stage_buf, rem_buf,
+							     rem_len);
 	}
 	return FI_SUCCESS;
 }
+
+/* Payload bytes already staged are copied out first.  Once the staging
+ * buffer is drained, small remainders are read through it (picking up
+ * any following headers in the same call), while large ones are read
+ * directly into the user's iov.  Bytes past the end of a too small
+ * posted buffer are dropped, always through the staging buffer.
+ */
+int tcpx_recv_msg_data(struct tcpx_xfer_entry *rx_entry)
+{
+	struct tcpx_stage_buf *stage_buf = &rx_entry->ep->stage_buf;
+	ssize_t bytes_recvd;
+	size_t rem_len, data_len;
+	int ret;
+
+	rem_len = ntohll(rx_entry->msg_hdr.hdr.size) - rx_entry->done_len;
+	while (rem_len) {
+		data_len = rem_len > rx_entry->discard_len ?
+			   rem_len - rx_entry->discard_len : 0;
+		if (tcpx_stage_buf_avail(stage_buf)) {
+			bytes_recvd = MIN(rem_len,
+					  tcpx_stage_buf_avail(stage_buf));
+			if (data_len)
+				bytes_recvd = ofi_copy_to_iov(
+					rx_entry->msg_data.iov,
+					rx_entry->msg_data.iov_cnt, 0,
+					&stage_buf->buf[stage_buf->off],
+					MIN(data_len, (size_t) bytes_recvd));
+			stage_buf->off += bytes_recvd;
+		} else if (rem_len < sizeof(stage_buf->buf) || !data_len) {
+			ret = tcpx_read_to_buffer(rx_entry->ep);
+			if (ret)
+				return ret;
+			continue;
+		} else {
+			bytes_recvd = tcpx_io_readv(rx_entry->ep,
+						    rx_entry->msg_data.iov,
+						    rx_entry->msg_data.iov_cnt);
+			if (bytes_recvd <= 0)
+				return (bytes_recvd)? (int) bytes_recvd:
+						      -FI_ENOTCONN;
+		}
+
+		rx_entry->done_len += bytes_recvd;
+		rem_len -= bytes_recvd;
+		if (rem_len && data_len)
+			ofi_consume_iov(rx_entry->msg_data.iov,
+					&rx_entry->msg_data.iov_cnt,
+					bytes_recvd);
+	}
+	return rx_entry->discard_len ? -FI_ETRUNC : FI_SUCCESS;
+}
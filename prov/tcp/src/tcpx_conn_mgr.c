@@ -37,16 +37,38 @@
 #include <poll.h>
 #include <sys/types.h>
 #include <ofi_util.h>
+#include <ofi_iov.h>
+
+/* The connecting side's socket is nonblocking during the handshake */
+static int tcpx_cm_recv(SOCKET fd, void *buf, size_t len)
+{
+	size_t done_len = 0;
+	ssize_t ret;
+
+	while (done_len < len) {
+		ret = ofi_recv_socket(fd, (char *) buf + done_len,
+				      len - done_len, MSG_WAITALL);
+		if (ret > 0) {
+			done_len += ret;
+		} else if (ret < 0 &&
+			   OFI_SOCK_TRY_SND_RCV_AGAIN(ofi_sockerr())) {
+			if (fi_poll_fd(fd, TCPX_CM_TIMEOUT_MS) <= 0)
+				return -FI_ETIMEDOUT;
+		} else {
+			return -FI_EIO;
+		}
+	}
+	return FI_SUCCESS;
+}
 
 static int rx_cm_data(SOCKET fd, struct ofi_ctrl_hdr *hdr,
 		      int type, struct tcpx_cm_context *cm_ctx)
 {
-	ssize_t ret;
+	int ret;
 
-	ret = ofi_recv_socket(fd, hdr,
-			      sizeof(*hdr), MSG_WAITALL);
-	if (ret != sizeof(*hdr))
-		return -FI_EIO;
+	ret = tcpx_cm_recv(fd, hdr, sizeof(*hdr));
+	if (ret)
+		return ret;
 
 	if (hdr->type != type)
 		return -FI_ECONNREFUSED;
@@ -59,35 +81,63 @@ static int rx_cm_data(SOCKET fd, struct ofi_ctrl_hdr *hdr,
 		if (cm_ctx->cm_data_sz > TCPX_MAX_CM_DATA_SIZE)
 			return -FI_EINVAL;
 
-		ret = ofi_recv_socket(fd, cm_ctx->cm_data,
-				      cm_ctx->cm_data_sz, MSG_WAITALL);
-		if ((size_t) ret != cm_ctx->cm_data_sz)
-			return -FI_EIO;
+		ret = tcpx_cm_recv(fd, cm_ctx->cm_data, cm_ctx->cm_data_sz);
+		if (ret)
+			return ret;
 	}
 	return FI_SUCCESS;
 }
 
-static int tx_cm_data(SOCKET fd, uint8_t type, struct tcpx_cm_context *cm_ctx)
+/* The header and cm data go out as a single segment.  Given the peer's
+ * address, they are sent in the SYN using TCP fast open, which fails with
+ * FI_EINPROGRESS and nothing sent if the kernel has no cookie for the
+ * peer yet.  If the socket would block, -FI_EAGAIN is returned and the
+ * next call resumes from cm_ctx->done_len.
+ */
+static int tx_cm_data(struct tcpx_ep *ep, uint8_t type,
+		      struct tcpx_cm_context *cm_ctx,
+		      const struct sockaddr *addr)
 {
 	struct ofi_ctrl_hdr hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t iov_cnt = 2;
+	int flags = MSG_NOSIGNAL;
 	ssize_t ret;
 
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.version = OFI_CTRL_VERSION;
 	hdr.type = type;
 	hdr.seg_size = htons((uint16_t) cm_ctx->cm_data_sz);
+	tcpx_stripe_cm_hdr(ep, &hdr);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = cm_ctx->cm_data;
+	iov[1].iov_len = cm_ctx->cm_data_sz;
+	ofi_consume_iov(iov, &iov_cnt, cm_ctx->done_len);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_cnt;
+	if (addr) {
+#ifdef MSG_FASTOPEN
+		msg.msg_name = (void *) addr;
+		msg.msg_namelen = (socklen_t) ofi_sizeofaddr(addr);
+		flags |= MSG_FASTOPEN;
+#else
+		return -FI_EOPNOTSUPP;
+#endif
+	}
 
-	ret = ofi_send_socket(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL);
-	if (ret != sizeof(hdr))
-		return -FI_EIO;
+	ret = ofi_sendmsg_tcp(ep->conn_fd, &msg, flags);
+	if (ret < 0)
+		return OFI_SOCK_TRY_SND_RCV_AGAIN(ofi_sockerr()) ?
+		       -FI_EAGAIN : -ofi_sockerr();
 
-	if (cm_ctx->cm_data_sz) {
-		ret = ofi_send_socket(fd, cm_ctx->cm_data,
-				      cm_ctx->cm_data_sz, MSG_NOSIGNAL);
-		if ((size_t) ret != cm_ctx->cm_data_sz)
-			return -FI_EIO;
-	}
-	return FI_SUCCESS;
+	cm_ctx->done_len += ret;
+	return (cm_ctx->done_len < sizeof(hdr) + cm_ctx->cm_data_sz) ?
+	       -FI_EAGAIN : FI_SUCCESS;
 }
 
 static int tcpx_ep_msg_xfer_enable(struct tcpx_ep *ep)
@@ -104,11 +154,33 @@ static int tcpx_ep_msg_xfer_enable(struct tcpx_ep *ep)
 	if (ret)
 		goto err;
 
+	if (tcpx_io_uring) {
+		ret = tcpx_uring_init(ep);
+		if (ret)
+			FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+				"io_uring unavailable (%s), using sockets\n",
+				fi_strerror(-ret));
+	}
+
+	if (!ep->uring)
+		tcpx_zerocopy_enable(ep);
+
 	ret = tcpx_cq_wait_ep_add(ep);
 	if (ret)
 		goto err;
 
 	ep->cm_state = TCPX_EP_CONNECTED;
+	fastlock_release(&ep->lock);
+
+	/* the shard lock is taken before endpoint locks */
+	ret = tcpx_shard_ep_add(ep);
+	if (ret) {
+		tcpx_cq_wait_ep_del(ep);
+		fastlock_acquire(&ep->lock);
+		ep->cm_state = TCPX_EP_CONNECTING;
+		fastlock_release(&ep->lock);
+	}
+	return ret;
 err:
 	fastlock_release(&ep->lock);
 	return ret;
@@ -126,6 +198,9 @@ static int proc_conn_resp(struct tcpx_cm_context *cm_ctx,
 	if (ret)
 		return ret;
 
+	if (ep->stripe_cnt)
+		tcpx_stripe_connect(ep, &conn_resp);
+
 	cm_entry = calloc(1, sizeof(*cm_entry) + cm_ctx->cm_data_sz);
 	if (!cm_entry)
 		return -FI_ENOMEM;
@@ -189,53 +264,6 @@ err:
 		    &err_entry, sizeof(err_entry), UTIL_FLAG_ERROR);
 }
 
-static void server_send_cm_accept(struct util_wait *wait,
-				  struct tcpx_cm_context *cm_ctx)
-{
-	struct fi_eq_cm_entry cm_entry = {0};
-	struct fi_eq_err_entry err_entry;
-	struct tcpx_ep *ep;
-	int ret;
-
-	assert(cm_ctx->fid->fclass == FI_CLASS_EP);
-	ep = container_of(cm_ctx->fid, struct tcpx_ep, util_ep.ep_fid.fid);
-
-	ret = tx_cm_data(ep->conn_fd, ofi_ctrl_connresp, cm_ctx);
-	if (ret)
-		goto err;
-
-	cm_entry.fid =  cm_ctx->fid;
-	ret = (int) fi_eq_write(&ep->util_ep.eq->eq_fid, FI_CONNECTED,
-				&cm_entry, sizeof(cm_entry), 0);
-	if (ret < 0) {
-		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL, "Error writing to EQ\n");
-	}
-
-	ret = ofi_wait_fd_del(wait, ep->conn_fd);
-	if (ret) {
-		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
-			"Could not remove fd from wait\n");
-		goto err;
-	}
-
-	ret = tcpx_ep_msg_xfer_enable(ep);
-	if (ret)
-		goto err;
-
-	FI_DBG(&tcpx_prov, FI_LOG_EP_CTRL, "Connection Accept Successful\n");
-	free(cm_ctx);
-	return;
-err:
-	memset(&err_entry, 0, sizeof err_entry);
-	err_entry.fid = cm_ctx->fid;
-	err_entry.context = cm_ctx->fid->context;
-	err_entry.err = -ret;
-
-	free(cm_ctx);
-	fi_eq_write(&ep->util_ep.eq->eq_fid, FI_NOTIFY,
-		    &err_entry, sizeof(err_entry), UTIL_FLAG_ERROR);
-}
-
 static void server_recv_connreq(struct util_wait *wait,
 				struct tcpx_cm_context *cm_ctx)
 {
@@ -250,16 +278,26 @@ static void server_recv_connreq(struct util_wait *wait,
 			       struct tcpx_conn_handle,
 			       handle);
 
+	/* the handle belongs to the application once the event is written */
+	if (wait) {
+		ret = ofi_wait_fd_del(wait, handle->conn_fd);
+		if (ret)
+			FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+				"fd deletion from ofi_wait failed\n");
+	}
+
 	ret = rx_cm_data(handle->conn_fd, &conn_req, ofi_ctrl_connreq, cm_ctx);
 	if (ret)
 		goto err1;
 
+	handle->stripe_cnt = ntohl(conn_req.seg_no);
+
 	cm_entry = calloc(1, sizeof(*cm_entry) + cm_ctx->cm_data_sz);
 	if (!cm_entry)
 		goto err1;
 
 	cm_entry->fid = &handle->pep->util_pep.pep_fid.fid;
-	cm_entry->info = fi_dupinfo(&handle->pep->info);
+	cm_entry->info = fi_dupinfo(handle->pep->info);
 	if (!cm_entry->info)
 		goto err2;
 
@@ -272,10 +310,6 @@ static void server_recv_connreq(struct util_wait *wait,
 		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL, "Error writing to EQ\n");
 		goto err3;
 	}
-	ret = ofi_wait_fd_del(wait, handle->conn_fd);
-	if (ret)
-		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
-			"fd deletion from ofi_wait failed\n");
 	free(cm_entry);
 	free(cm_ctx);
 	return;
@@ -284,7 +318,6 @@ err3:
 err2:
 	free(cm_entry);
 err1:
-	ofi_wait_fd_del(wait, handle->conn_fd);
 	ofi_close_socket(handle->conn_fd);
 	free(cm_ctx);
 	free(handle);
@@ -311,8 +344,10 @@ static void client_send_connreq(struct util_wait *wait,
 		goto err;
 	}
 
-	ret = tx_cm_data(ep->conn_fd, ofi_ctrl_connreq, cm_ctx);
-	if (ret)
+	ret = tx_cm_data(ep, ofi_ctrl_connreq, cm_ctx, NULL);
+	if (ret == -FI_EAGAIN)
+		return;
+	else if (ret)
 		goto err;
 
 	ret = ofi_wait_fd_del(wait, ep->conn_fd);
@@ -374,6 +409,12 @@ static void server_sock_accept(struct util_wait *wait,
 	cm_ctx->fid = &handle->handle;
 	cm_ctx->type = SERVER_RECV_CONNREQ;
 
+	/* a fast open connreq came with the SYN, no need to wait for it */
+	if (fi_poll_fd(sock, 0) > 0) {
+		server_recv_connreq(NULL, cm_ctx);
+		return;
+	}
+
 	ret = ofi_wait_fd_add(wait, sock, FI_EPOLL_IN,
 			      tcpx_eq_wait_try_func,
 			      NULL, (void *) cm_ctx);
@@ -402,28 +443,27 @@ static void process_cm_ctx(struct util_wait *wait,
 	case SERVER_RECV_CONNREQ:
 		server_recv_connreq(wait, cm_ctx);
 		break;
-	case SERVER_SEND_CM_ACCEPT:
-		server_send_cm_accept(wait, cm_ctx);
-		break;
 	case CLIENT_RECV_CONNRESP:
 		client_recv_connresp(wait, cm_ctx);
 		break;
+	case SERVER_STRIPE_JOIN:
+		tcpx_stripe_accept(wait, container_of(cm_ctx->fid,
+				   struct tcpx_ep, util_ep.ep_fid.fid));
+		break;
 	default:
 		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
 			"should never end up here\n");
 	}
 }
 
-void tcpx_conn_mgr_run(struct util_eq *eq)
+/* Called with the fabric's cm_lock held */
+static void tcpx_conn_mgr_process(struct util_wait *wait)
 {
 	struct util_wait_fd *wait_fd;
 	void *wait_contexts[MAX_EPOLL_EVENTS];
 	int num_fds = 0, i;
 
-	assert(eq->wait != NULL);
-
-	wait_fd = container_of(eq->wait, struct util_wait_fd,
-			       util_wait);
+	wait_fd = container_of(wait, struct util_wait_fd, util_wait);
 
 	num_fds = fi_epoll_wait(wait_fd->epoll_fd, wait_contexts,
 				MAX_EPOLL_EVENTS, 0);
@@ -436,8 +476,187 @@ void tcpx_conn_mgr_run(struct util_eq *eq)
 		if (&wait_fd->util_wait.wait_fid.fid == wait_contexts[i])
 			continue;
 
-		process_cm_ctx(eq->wait,
+		process_cm_ctx(wait,
 			       (struct tcpx_cm_context *)
 			       wait_contexts[i]);
 	}
 }
+
+void tcpx_conn_mgr_run(struct util_eq *eq)
+{
+	struct tcpx_fabric *fabric = tcpx_eq_fabric(eq);
+
+	assert(eq->wait != NULL);
+
+	/* the CM thread drives the handshakes and writes the events */
+	if (fabric->cm_wait)
+		return;
+
+	pthread_mutex_lock(&fabric->cm_lock);
+	tcpx_conn_mgr_process(eq->wait);
+	pthread_mutex_unlock(&fabric->cm_lock);
+}
+
+int tcpx_conn_mgr_connect(struct tcpx_ep *ep, const struct sockaddr *addr,
+			  const void *param, size_t paramlen)
+{
+	struct tcpx_fabric *fabric = tcpx_eq_fabric(ep->util_ep.eq);
+	struct tcpx_cm_context *cm_ctx;
+	uint32_t events;
+	int ret;
+
+	cm_ctx = calloc(1, sizeof(*cm_ctx));
+	if (!cm_ctx) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+			"cannot allocate memory \n");
+		return -FI_ENOMEM;
+	}
+
+	cm_ctx->fid = &ep->util_ep.ep_fid.fid;
+	if (paramlen) {
+		cm_ctx->cm_data_sz = paramlen;
+		memcpy(cm_ctx->cm_data, param, paramlen);
+	}
+
+	ret = fi_fd_nonblock(ep->conn_fd);
+	if (ret)
+		goto err;
+
+	ret = tcpx_fastopen ?
+	      tx_cm_data(ep, ofi_ctrl_connreq, cm_ctx, addr) : -FI_EOPNOTSUPP;
+	if (ret && ret != -FI_EAGAIN && ret != -FI_EINPROGRESS) {
+		FI_DBG(&tcpx_prov, FI_LOG_EP_CTRL,
+		       "no fast open, connecting (%d)\n", ret);
+		ret = connect(ep->conn_fd, addr,
+			      (socklen_t) ofi_sizeofaddr(addr));
+		if (ret && ofi_sockerr() != FI_EINPROGRESS) {
+			ret = -ofi_sockerr();
+			goto err;
+		}
+		ret = -FI_EINPROGRESS;
+	}
+
+	if (ret) {
+		cm_ctx->type = CLIENT_SEND_CONNREQ;
+		events = FI_EPOLL_OUT;
+	} else {
+		cm_ctx->type = CLIENT_RECV_CONNRESP;
+		events = FI_EPOLL_IN;
+	}
+
+	pthread_mutex_lock(&fabric->cm_lock);
+	ret = ofi_wait_fd_add(tcpx_cm_wait(ep->util_ep.eq), ep->conn_fd,
+			      events, tcpx_eq_wait_try_func, NULL, cm_ctx);
+	pthread_mutex_unlock(&fabric->cm_lock);
+	if (ret)
+		goto err;
+
+	return 0;
+err:
+	free(cm_ctx);
+	return ret;
+}
+
+/* The response goes out right away, so the endpoint is connected once
+ * this returns; only the stripe joins, if any, are left to the CM.
+ */
+int tcpx_conn_mgr_accept(struct tcpx_ep *ep, const void *param,
+			 size_t paramlen)
+{
+	struct tcpx_fabric *fabric = tcpx_eq_fabric(ep->util_ep.eq);
+	struct fi_eq_cm_entry cm_entry = {0};
+	struct tcpx_cm_context cm_ctx = {0};
+	ssize_t len;
+	int ret;
+
+	cm_ctx.fid = &ep->util_ep.ep_fid.fid;
+	if (paramlen) {
+		cm_ctx.cm_data_sz = paramlen;
+		memcpy(cm_ctx.cm_data, param, paramlen);
+	}
+
+	/* the event is written under the lock so that it comes before any
+	 * the CM reports for the peer's next connection */
+	pthread_mutex_lock(&fabric->cm_lock);
+	tcpx_stripe_listen(ep, tcpx_cm_wait(ep->util_ep.eq));
+	ret = tx_cm_data(ep, ofi_ctrl_connresp, &cm_ctx, NULL);
+	if (ret)
+		goto out;
+
+	ret = tcpx_ep_msg_xfer_enable(ep);
+	if (ret)
+		goto out;
+
+	cm_entry.fid = cm_ctx.fid;
+	len = fi_eq_write(&ep->util_ep.eq->eq_fid, FI_CONNECTED,
+			  &cm_entry, sizeof(cm_entry), 0);
+	if (len < 0) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL, "Error writing to EQ\n");
+		ret = (int) len;
+		goto out;
+	}
+	FI_DBG(&tcpx_prov, FI_LOG_EP_CTRL, "Connection Accept Successful\n");
+out:
+	pthread_mutex_unlock(&fabric->cm_lock);
+	return ret == -FI_EAGAIN ? -FI_EIO : ret;
+}
+
+static void *tcpx_conn_mgr_thread(void *arg)
+{
+	struct tcpx_fabric *fabric = arg;
+	struct util_wait_fd *wait_fd;
+	void *context;
+
+	wait_fd = container_of(fabric->cm_wait, struct util_wait_fd,
+			       util_wait);
+
+	while (fabric->cm_run) {
+		/* contexts are only looked at under the lock, where they
+		 * cannot be freed underneath */
+		if (fi_epoll_wait(wait_fd->epoll_fd, &context, 1, -1) < 0)
+			continue;
+
+		pthread_mutex_lock(&fabric->cm_lock);
+		tcpx_conn_mgr_process(fabric->cm_wait);
+		fd_signal_reset(&wait_fd->signal);
+		pthread_mutex_unlock(&fabric->cm_lock);
+	}
+	return NULL;
+}
+
+int tcpx_conn_mgr_start(struct tcpx_fabric *fabric)
+{
+	struct fi_wait_attr wait_attr = {0};
+	struct fid_wait *wait;
+	int ret;
+
+	wait_attr.wait_obj = FI_WAIT_FD;
+	ret = fi_wait_open(&fabric->util_fabric.fabric_fid, &wait_attr, &wait);
+	if (ret)
+		return ret;
+
+	fabric->cm_wait = container_of(wait, struct util_wait, wait_fid);
+	fabric->cm_run = 1;
+	ret = pthread_create(&fabric->cm_thread, NULL,
+			     tcpx_conn_mgr_thread, fabric);
+	if (ret) {
+		FI_WARN(&tcpx_prov, FI_LOG_FABRIC,
+			"unable to start CM thread: %s\n", strerror(ret));
+		fi_close(&wait->fid);
+		fabric->cm_wait = NULL;
+		return -ret;
+	}
+	return 0;
+}
+
+void tcpx_conn_mgr_stop(struct tcpx_fabric *fabric)
+{
+	pthread_mutex_lock(&fabric->cm_lock);
+	fabric->cm_run = 0;
+	fabric->cm_wait->signal(fabric->cm_wait);
+	pthread_mutex_unlock(&fabric->cm_lock);
+
+	pthread_join(fabric->cm_thread, NULL);
+	fi_close(&fabric->cm_wait->wait_fid.fid);
+	fabric->cm_wait = NULL;
+}
@@ -79,6 +79,7 @@ struct tcpx_xfer_entry *tcpx_xfer_entry_alloc(struct tcpx_cq *tcpx_cq,
 		FI_INFO(&tcpx_prov, FI_LOG_DOMAIN,"failed to get buffer\n");
 		return NULL;
 	}
+	xfer_entry->discard_len = 0;
 	tcpx_cq->util_cq.cq_fastlock_release(&tcpx_cq->util_cq.cq_lock);
 	return xfer_entry;
 }
@@ -100,19 +101,28 @@ void tcpx_cq_report_completion(struct util_cq *cq,
 			       int err)
 {
 	struct fi_cq_err_entry err_entry;
+	uint64_t len = 0, tag = 0;
 
 	if (xfer_entry->flags & TCPX_NO_COMPLETION)
 		return;
 
+	if (xfer_entry->flags & FI_RECV) {
+		len = ntohll(xfer_entry->msg_hdr.hdr.size) -
+		      sizeof(xfer_entry->msg_hdr);
+		if (xfer_entry->flags & FI_TAGGED)
+			tag = ntohll(xfer_entry->msg_hdr.hdr.tag);
+	}
+
 	if (err) {
 		err_entry.op_context = xfer_entry->context;
 		err_entry.flags = xfer_entry->flags;
-		err_entry.len = 0;
+		err_entry.len = xfer_entry->discard_len ?
+				len - xfer_entry->discard_len : 0;
 		err_entry.buf = NULL;
 		err_entry.data = ntohll(xfer_entry->msg_hdr.hdr.data);
-		err_entry.tag = 0;
-		err_entry.olen = 0;
-		err_entry.err = err;
+		err_entry.tag = tag;
+		err_entry.olen = xfer_entry->discard_len;
+		err_entry.err = -err;
 		err_entry.prov_errno = ofi_sockerr();
 		err_entry.err_data = NULL;
 		err_entry.err_data_size = 0;
@@ -120,8 +130,8 @@ void tcpx_cq_report_completion(struct util_cq *cq,
 		ofi_cq_write_error(cq, &err_entry);
 	} else {
 		ofi_cq_write(cq, xfer_entry->context,
-			     xfer_entry->flags, 0, NULL,
-			     ntohll(xfer_entry->msg_hdr.hdr.data), 0);
+			     xfer_entry->flags, len, NULL,
+			     ntohll(xfer_entry->msg_hdr.hdr.data), tag);
 
 		if (cq->wait)
 			ofi_cq_signal(&cq->cq_fid);
@@ -197,6 +207,16 @@ static int tcpx_buf_pool_init(void *pool_ctx, void *addr,
 		case TCPX_OP_REMOTE_READ:
 			xfer_entry->flags = TCPX_NO_COMPLETION;
 			break;
+		case TCPX_OP_TAGGED_SEND:
+		case TCPX_OP_TAGGED_RECV:
+			xfer_entry->msg_hdr.hdr.op = ofi_op_tagged;
+			break;
+		case TCPX_OP_TAGGED_UNEXP:
+			xfer_entry->flags = TCPX_NO_COMPLETION;
+			break;
+		case TCPX_OP_ATOMIC:
+		case TCPX_OP_REMOTE_ATOMIC:
+			break;
 		default:
 			assert(0);
 			break;
@@ -233,6 +253,12 @@ err:
 	return -FI_ENOMEM;
 }
 
+static void tcpx_cq_progress(struct util_cq *cq)
+{
+	tcpx_domain_progress(container_of(cq->domain, struct tcpx_domain,
+					  util_domain));
+}
+
 int tcpx_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		 struct fid_cq **cq_fid, void *context)
 {
@@ -251,10 +277,13 @@ int tcpx_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		goto free_cq;
 
 	ret = ofi_cq_init(&tcpx_prov, domain, attr, &tcpx_cq->util_cq,
-			  &ofi_cq_progress, context);
+			  &tcpx_cq_progress, context);
 	if (ret)
 		goto destroy_pool;
 
+	if (tcpx_busy_poll > 0)
+		ofi_cq_busy_poll_init(&tcpx_cq->util_cq, tcpx_busy_poll);
+
 	*cq_fid = &tcpx_cq->util_cq.cq_fid;
 	(*cq_fid)->fid.ops = &tcpx_cq_fi_ops;
 	return 0;
@@ -46,7 +46,7 @@ static struct fi_ops_domain tcpx_domain_ops = {
 	.poll_open = fi_poll_create,
 	.stx_ctx = fi_no_stx_context,
 	.srx_ctx = fi_no_srx_context,
-	.query_atomic = fi_no_query_atomic,
+	.query_atomic = tcpx_query_atomic,
 };
 
 static int tcpx_domain_close(fid_t fid)
@@ -61,6 +61,8 @@ static int tcpx_domain_close(fid_t fid)
 	if (ret)
 		return ret;
 
+	tcpx_domain_progress_close(tcpx_domain);
+	fastlock_destroy(&tcpx_domain->atomic_lock);
 	free(tcpx_domain);
 	return 0;
 }
@@ -98,6 +100,19 @@ int tcpx_domain_open(struct fid_fabric *fabric, struct fi_info *info,
 	if (ret)
 		goto err;
 
+	ret = fastlock_init(&tcpx_domain->atomic_lock);
+	if (ret) {
+		ofi_domain_close(&tcpx_domain->util_domain);
+		goto err;
+	}
+
+	ret = tcpx_domain_progress_init(tcpx_domain);
+	if (ret) {
+		fastlock_destroy(&tcpx_domain->atomic_lock);
+		ofi_domain_close(&tcpx_domain->util_domain);
+		goto err;
+	}
+
 	*domain = &tcpx_domain->util_domain.domain_fid;
 	(*domain)->fid.ops = &tcpx_domain_fi_ops;
 	(*domain)->ops = &tcpx_domain_ops;
@@ -50,6 +50,8 @@
 #include <netdb.h>
 
 extern struct fi_ops_rma tcpx_rma_ops;
+extern struct fi_ops_tagged tcpx_tagged_ops;
+extern struct fi_ops_atomic tcpx_atomic_ops;
 
 static inline struct tcpx_xfer_entry *
 tcpx_alloc_recv_entry(struct tcpx_ep *tcpx_ep)
@@ -172,6 +174,7 @@ static ssize_t tcpx_sendmsg(struct fid_ep *ep, const struct fi_msg *msg,
 	tx_entry->msg_data.iov[0].iov_base = (void *) &tx_entry->msg_hdr;
 	tx_entry->msg_data.iov[0].iov_len = sizeof(tx_entry->msg_hdr);
 	tx_entry->msg_data.iov_cnt = msg->iov_count + 1;
+	tx_entry->msg_hdr.hdr.flags = 0;
 
 	if (flags & FI_INJECT) {
 		ofi_copy_iov_buf(msg->msg_iov, msg->iov_count, 0,
@@ -202,7 +205,7 @@ static ssize_t tcpx_sendmsg(struct fid_ep *ep, const struct fi_msg *msg,
 	fastlock_acquire(&tcpx_ep->lock);
 	if (slist_empty(&tcpx_ep->tx_queue)) {
 		slist_insert_tail(&tx_entry->entry, &tcpx_ep->tx_queue);
-		process_tx_entry(tx_entry);
+		tcpx_process_tx_queue(tcpx_ep);
 	} else {
 		slist_insert_tail(&tx_entry->entry, &tcpx_ep->tx_queue);
 	}
@@ -310,7 +313,7 @@ static struct fi_ops_msg tcpx_msg_ops = {
 	.injectdata = tcpx_injectdata,
 };
 
-static int tcpx_setup_socket(SOCKET sock)
+int tcpx_setup_socket(SOCKET sock)
 {
 	int ret, optval = 1;
 
@@ -328,83 +331,34 @@ static int tcpx_setup_socket(SOCKET sock)
 		return ret;
 	}
 
-	return ret;
+	if (tcpx_busy_poll > 0 && ofi_busy_poll_socket(sock, tcpx_busy_poll))
+		FI_INFO(&tcpx_prov, FI_LOG_EP_CTRL,
+			"socket busy polling unavailable, spinning on CQ "
+			"reads only\n");
+
+	return 0;
 }
 
 static int tcpx_ep_connect(struct fid_ep *ep, const void *addr,
 			   const void *param, size_t paramlen)
 {
 	struct tcpx_ep *tcpx_ep = container_of(ep, struct tcpx_ep, util_ep.ep_fid);
-	struct tcpx_cm_context *cm_ctx;
-	int ret;
 
 	if (!addr || !tcpx_ep->conn_fd || paramlen > TCPX_MAX_CM_DATA_SIZE)
 		return -FI_EINVAL;
 
-	cm_ctx = calloc(1, sizeof(*cm_ctx));
-	if (!cm_ctx) {
-		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
-			"cannot allocate memory \n");
-		return -FI_ENOMEM;
-	}
-
-	ret = connect(tcpx_ep->conn_fd, (struct sockaddr *) addr,
-		      (socklen_t) ofi_sizeofaddr(addr));
-	if (ret && ofi_sockerr() != FI_EINPROGRESS) {
-		ret =  -ofi_sockerr();
-		goto err;
-	}
-
-	cm_ctx->fid = &tcpx_ep->util_ep.ep_fid.fid;
-	cm_ctx->type = CLIENT_SEND_CONNREQ;
-
-	if (paramlen) {
-		cm_ctx->cm_data_sz = paramlen;
-		memcpy(cm_ctx->cm_data, param, paramlen);
-	}
-
-	ret = ofi_wait_fd_add(tcpx_ep->util_ep.eq->wait, tcpx_ep->conn_fd,
-			      FI_EPOLL_OUT, tcpx_eq_wait_try_func, NULL,cm_ctx);
-	if (ret)
-		goto err;
-
-	return 0;
-err:
-	free(cm_ctx);
-	return ret;
+	return tcpx_conn_mgr_connect(tcpx_ep, addr, param, paramlen);
 }
 
 static int tcpx_ep_accept(struct fid_ep *ep, const void *param, size_t paramlen)
 {
 	struct tcpx_ep *tcpx_ep = container_of(ep, struct tcpx_ep, util_ep.ep_fid);
-	struct tcpx_cm_context *cm_ctx;
-	int ret;
 
-	if (tcpx_ep->conn_fd == INVALID_SOCKET)
+	if (tcpx_ep->conn_fd == INVALID_SOCKET ||
+	    paramlen > TCPX_MAX_CM_DATA_SIZE)
 		return -FI_EINVAL;
 
-	cm_ctx = calloc(1, sizeof(*cm_ctx));
-	if (!cm_ctx) {
-		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
-			"cannot allocate memory \n");
-		return -FI_ENOMEM;
-	}
-
-	cm_ctx->fid = &tcpx_ep->util_ep.ep_fid.fid;
-	cm_ctx->type = SERVER_SEND_CM_ACCEPT;
-	if (paramlen) {
-		cm_ctx->cm_data_sz = paramlen;
-		memcpy(cm_ctx->cm_data, param, paramlen);
-	}
-
-	ret = ofi_wait_fd_add(tcpx_ep->util_ep.eq->wait, tcpx_ep->conn_fd,
-			      FI_EPOLL_OUT, tcpx_eq_wait_try_func, NULL, cm_ctx);
-	if (ret) {
-		free(cm_ctx);
-		return ret;
-	}
-
-	return 0;
+	return tcpx_conn_mgr_accept(tcpx_ep, param, paramlen);
 }
 
 static int tcpx_ep_shutdown(struct fid_ep *ep, uint64_t flags)
@@ -420,6 +374,7 @@ static int tcpx_ep_shutdown(struct fid_ep *ep, uint64_t flags)
 	}
 
 	fastlock_acquire(&tcpx_ep->lock);
+	tcpx_stripe_shutdown(tcpx_ep);
 	ret = tcpx_ep_shutdown_report(tcpx_ep, &ep->fid);
 	fastlock_release(&tcpx_ep->lock);
 	if (ret) {
@@ -433,11 +388,11 @@ static int tcpx_pep_sock_create(struct tcpx_pep *pep)
 {
 	int ret, af;
 
-	switch (pep->info.addr_format) {
+	switch (pep->info->addr_format) {
 	case FI_SOCKADDR:
 	case FI_SOCKADDR_IN:
 	case FI_SOCKADDR_IN6:
-		af = ((struct sockaddr *)pep->info.src_addr)->sa_family;
+		af = ((struct sockaddr *)pep->info->src_addr)->sa_family;
 		break;
 	default:
 		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
@@ -458,8 +413,8 @@ static int tcpx_pep_sock_create(struct tcpx_pep *pep)
 		goto err;
 	}
 
-	ret = bind(pep->sock, pep->info.src_addr,
-		   (socklen_t) pep->info.src_addrlen);
+	ret = bind(pep->sock, pep->info->src_addr,
+		   (socklen_t) pep->info->src_addrlen);
 	if (ret) {
 		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
 			"failed to bind listener: %s\n",
@@ -533,17 +488,62 @@ static void tcpx_ep_tx_rx_queues_release(struct tcpx_ep *ep)
 				       struct tcpx_cq, util_cq);
 		tcpx_xfer_entry_release(tcpx_cq, xfer_entry);
 	}
+
+	while (!slist_empty(&ep->atomic_queue)) {
+		entry = ep->atomic_queue.head;
+		xfer_entry = container_of(entry, struct tcpx_xfer_entry, entry);
+		slist_remove_head(&ep->atomic_queue);
+		tcpx_cq = container_of(xfer_entry->ep->util_ep.rx_cq,
+				       struct tcpx_cq, util_cq);
+		tcpx_xfer_entry_release(tcpx_cq, xfer_entry);
+	}
+
+	while (!slist_empty(&ep->zc_queue)) {
+		entry = ep->zc_queue.head;
+		xfer_entry = container_of(entry, struct tcpx_xfer_entry, entry);
+		slist_remove_head(&ep->zc_queue);
+		tcpx_cq = container_of(xfer_entry->ep->util_ep.tx_cq,
+				       struct tcpx_cq, util_cq);
+		tcpx_xfer_entry_release(tcpx_cq, xfer_entry);
+	}
+
+	/* the entry being received into is on no queue */
+	if (ep->cur_rx_entry)
+		tcpx_rx_entry_free(ep->cur_rx_entry);
+
+	tcpx_stripe_queues_release(ep);
+	tcpx_tagged_queues_release(ep);
 	fastlock_release(&ep->lock);
 }
 
+/* A connect still in progress must not be driven any further */
+static void tcpx_ep_cm_del(struct tcpx_ep *ep)
+{
+	struct tcpx_fabric *fabric;
+
+	if (!ep->util_ep.eq || ep->cm_state != TCPX_EP_CONNECTING)
+		return;
+
+	fabric = tcpx_eq_fabric(ep->util_ep.eq);
+	pthread_mutex_lock(&fabric->cm_lock);
+	ofi_wait_fd_del(tcpx_cm_wait(ep->util_ep.eq), ep->conn_fd);
+	pthread_mutex_unlock(&fabric->cm_lock);
+}
+
 static int tcpx_ep_close(struct fid *fid)
 {
 	struct tcpx_ep *ep = container_of(fid, struct tcpx_ep,
 					  util_ep.ep_fid.fid);
 
+	tcpx_ep_cm_del(ep);
+	tcpx_shard_ep_del(ep);
 	tcpx_ep_tx_rx_queues_release(ep);
 	tcpx_cq_wait_ep_del(ep);
+	tcpx_uring_cleanup(ep);
+	tcpx_stripe_close(ep);
 	ofi_close_socket(ep->conn_fd);
+	ofi_mq_close(&ep->trecv_queue);
+	ofi_mq_close(&ep->unexp_queue);
 	ofi_endpoint_close(&ep->util_ep);
 	fastlock_destroy(&ep->lock);
 
@@ -655,6 +655,7 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 	struct tcpx_ep *ep;
 	struct tcpx_pep *pep;
 	struct tcpx_conn_handle *handle;
+	uint32_t stripe_cnt = tcpx_stripe_cnt;
 	int af, ret;
 
 	ep = calloc(1, sizeof(*ep));
@@ -681,6 +682,7 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 			}
 		} else {
 			ep->conn_fd = handle->conn_fd;
+			stripe_cnt = handle->stripe_cnt;
 			free(handle);
 
 			ret = tcpx_setup_socket(ep->conn_fd);
@@ -715,6 +717,20 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 	slist_init(&ep->rx_queue);
 	slist_init(&ep->tx_queue);
 	slist_init(&ep->rma_read_queue);
+	slist_init(&ep->atomic_queue);
+	slist_init(&ep->zc_queue);
+	dlist_init(&ep->ready_entry);
+	tcpx_stripe_init(ep, stripe_cnt);
+
+	ret = ofi_mq_init(&ep->trecv_queue, info->rx_attr->size,
+			  OFI_MQ_TAGGED);
+	if (ret)
+		goto err4;
+
+	ret = ofi_mq_init(&ep->unexp_queue, info->rx_attr->size,
+			  OFI_MQ_TAGGED);
+	if (ret)
+		goto err5;
 
 	*ep_fid = &ep->util_ep.ep_fid;
 	(*ep_fid)->fid.ops = &tcpx_ep_fi_ops;
@@ -722,8 +738,14 @@ int tcpx_endpoint(struct fid_domain *domain, struct fi_info *info,
 	(*ep_fid)->cm = &tcpx_cm_ops;
 	(*ep_fid)->msg = &tcpx_msg_ops;
 	(*ep_fid)->rma = &tcpx_rma_ops;
+	(*ep_fid)->tagged = &tcpx_tagged_ops;
+	(*ep_fid)->atomic = &tcpx_atomic_ops;
 
 	return 0;
+err5:
+	ofi_mq_close(&ep->trecv_queue);
+err4:
+	fastlock_destroy(&ep->lock);
 err3:
 	ofi_close_socket(ep->conn_fd);
 err2:
@@ -735,14 +757,20 @@ err1:
 
 static int tcpx_pep_fi_close(struct fid *fid)
 {
+	struct tcpx_fabric *fabric;
 	struct tcpx_pep *pep;
 
 	pep = container_of(fid, struct tcpx_pep, util_pep.pep_fid.fid);
-	if (pep->util_pep.eq)
-		ofi_wait_fd_del(pep->util_pep.eq->wait, pep->sock);
+	if (pep->util_pep.eq) {
+		fabric = tcpx_eq_fabric(pep->util_pep.eq);
+		pthread_mutex_lock(&fabric->cm_lock);
+		ofi_wait_fd_del(tcpx_cm_wait(pep->util_pep.eq), pep->sock);
+		pthread_mutex_unlock(&fabric->cm_lock);
+	}
 
 	ofi_close_socket(pep->sock);
 	ofi_pep_close(&pep->util_pep);
+	fi_freeinfo(pep->info);
 	free(pep);
 	return 0;
 }
@@ -788,16 +816,17 @@ static int tcpx_pep_setname(fid_t fid, void *addr, size_t addrlen)
 		tcpx_pep->sock = INVALID_SOCKET;
 	}
 
-	if (tcpx_pep->info.src_addr) {
-		free(tcpx_pep->info.src_addr);
-		tcpx_pep->info.src_addrlen = 0;
+	if (tcpx_pep->info->src_addr) {
+		free(tcpx_pep->info->src_addr);
+		tcpx_pep->info->src_addr = NULL;
+		tcpx_pep->info->src_addrlen = 0;
 	}
 
 
-	tcpx_pep->info.src_addr = mem_dup(addr, addrlen);
-	if (!tcpx_pep->info.src_addr)
+	tcpx_pep->info->src_addr = mem_dup(addr, addrlen);
+	if (!tcpx_pep->info->src_addr)
 		return -FI_ENOMEM;
-	tcpx_pep->info.src_addrlen = addrlen;
+	tcpx_pep->info->src_addrlen = addrlen;
 
 	return tcpx_pep_sock_create(tcpx_pep);
 }
@@ -816,21 +845,41 @@ static int tcpx_pep_getname(fid_t fid, void *addr, size_t *addrlen)
 	return (addrlen_in < *addrlen)? -FI_ETOOSMALL: FI_SUCCESS;
 }
 
+static void tcpx_pep_fastopen(struct tcpx_pep *pep)
+{
+#ifdef TCP_FASTOPEN
+	int qlen = TCPX_FASTOPEN_QLEN;
+
+	if (tcpx_fastopen &&
+	    setsockopt(pep->sock, IPPROTO_TCP, TCP_FASTOPEN,
+		       (char *) &qlen, sizeof(qlen)))
+		FI_INFO(&tcpx_prov, FI_LOG_EP_CTRL,
+			"TCP fast open unavailable: %d\n", ofi_sockerr());
+#endif
+}
+
 static int tcpx_pep_listen(struct fid_pep *pep)
 {
 	struct tcpx_pep *tcpx_pep;
+	struct tcpx_fabric *fabric;
+	int ret;
 
 	tcpx_pep = container_of(pep,struct tcpx_pep, util_pep.pep_fid);
 
+	tcpx_pep_fastopen(tcpx_pep);
 	if (listen(tcpx_pep->sock, SOMAXCONN)) {
 		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
 			"socket listen failed\n");
 		return -ofi_sockerr();
 	}
 
-	return ofi_wait_fd_add(tcpx_pep->util_pep.eq->wait, tcpx_pep->sock,
-			       FI_EPOLL_IN, tcpx_eq_wait_try_func,
-			       NULL, &tcpx_pep->cm_ctx);
+	fabric = tcpx_eq_fabric(tcpx_pep->util_pep.eq);
+	pthread_mutex_lock(&fabric->cm_lock);
+	ret = ofi_wait_fd_add(tcpx_cm_wait(tcpx_pep->util_pep.eq),
+			      tcpx_pep->sock, FI_EPOLL_IN,
+			      tcpx_eq_wait_try_func, NULL, &tcpx_pep->cm_ctx);
+	pthread_mutex_unlock(&fabric->cm_lock);
+	return ret;
 }
 
 static int tcpx_pep_reject(struct fid_pep *pep, fid_t handle,
@@ -932,7 +981,12 @@ int tcpx_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 	_pep->util_pep.pep_fid.ops = &tcpx_pep_ops;
 
 
-	_pep->info = *info;
+	_pep->info = fi_dupinfo(info);
+	if (!_pep->info) {
+		ret = -FI_ENOMEM;
+		goto err2;
+	}
+
 	_pep->cm_ctx.fid = &_pep->util_pep.pep_fid.fid;
 	_pep->cm_ctx.type = SERVER_SOCK_ACCEPT;
 	_pep->cm_ctx.cm_data_sz = 0;
@@ -943,9 +997,11 @@ int tcpx_passive_ep(struct fid_fabric *fabric, struct fi_info *info,
 	if (info->src_addr) {
 		ret = tcpx_pep_sock_create(_pep);
 		if (ret)
-			goto err2;
+			goto err3;
 	}
 	return FI_SUCCESS;
+err3:
+	fi_freeinfo(_pep->info);
 err2:
 	ofi_pep_close(&_pep->util_pep);
 err1:
@@ -58,10 +58,18 @@ static int tcpx_fabric_close(fid_t fid)
 	tcpx_fabric = container_of(fid, struct tcpx_fabric,
 				   util_fabric.fabric_fid.fid);
 
+	/* the CM wait set holds a reference of its own */
+	if (tcpx_fabric->cm_wait) {
+		if (ofi_atomic_get32(&tcpx_fabric->util_fabric.ref) > 1)
+			return -FI_EBUSY;
+		tcpx_conn_mgr_stop(tcpx_fabric);
+	}
+
 	ret = ofi_fabric_close(&tcpx_fabric->util_fabric);
 	if (ret)
 		return ret;
 
+	pthread_mutex_destroy(&tcpx_fabric->cm_lock);
 	free(tcpx_fabric);
 	return 0;
 }
@@ -86,14 +94,28 @@ int tcpx_create_fabric(struct fi_fabric_attr *attr, struct fid_fabric **fabric,
 
 	ret = ofi_fabric_init(&tcpx_prov, tcpx_info.fabric_attr, attr,
 			      &tcpx_fabric->util_fabric, context);
-	if (ret) {
-		free(tcpx_fabric);
-		return ret;
-	}
+	if (ret)
+		goto err1;
+
+	ret = -pthread_mutex_init(&tcpx_fabric->cm_lock, NULL);
+	if (ret)
+		goto err2;
 
 	*fabric = &tcpx_fabric->util_fabric.fabric_fid;
 	(*fabric)->fid.ops = &tcpx_fabric_fi_ops;
 	(*fabric)->ops = &tcpx_fabric_ops;
 
+	if (tcpx_cm_thread) {
+		ret = tcpx_conn_mgr_start(tcpx_fabric);
+		if (ret)
+			goto err3;
+	}
 	return 0;
+err3:
+	pthread_mutex_destroy(&tcpx_fabric->cm_lock);
+err2:
+	ofi_fabric_close(&tcpx_fabric->util_fabric);
+err1:
+	free(tcpx_fabric);
+	return ret;
 }
@@ -40,6 +40,16 @@
 #include <net/if.h>
 #include <ofi_util.h>
 
+size_t tcpx_zerocopy_size;
+int tcpx_io_uring;
+int tcpx_progress_threads;
+char *tcpx_progress_affinity;
+int tcpx_busy_poll;
+int tcpx_stripe_cnt;
+size_t tcpx_stripe_size = 262144;
+int tcpx_cm_thread;
+int tcpx_fastopen = 1;
+
 /* TODO: merge with sock_get_list_of_addr() - sock_fabric.c */
 #if HAVE_GETIFADDRS
 static void tcpx_getinfo_ifs(struct fi_info **info)
@@ -166,5 +176,70 @@ TCP_INI
 	fi_param_define(&tcpx_prov, "iface", FI_PARAM_STRING,
 			"Specify interface name");
 
+	fi_param_define(&tcpx_prov, "zerocopy_size", FI_PARAM_SIZE_T,
+			"Send messages of at least this many bytes with "
+			"MSG_ZEROCOPY, completing them only once the kernel "
+			"has released the pages (default: 0, disabled). "
+			"Requires Linux 4.14 or later.");
+
+	fi_param_define(&tcpx_prov, "io_uring", FI_PARAM_BOOL,
+			"Drive connected endpoint sockets through io_uring "
+			"instead of non-blocking calls and epoll (default: "
+			"no). Falls back to sockets when the kernel does not "
+			"support io_uring. Not combined with zerocopy_size.");
+
+	fi_param_define(&tcpx_prov, "progress_threads", FI_PARAM_INT,
+			"Number of progress threads per domain, each "
+			"driving its own share of the connected endpoints "
+			"(default: 0, progress from CQ reads).");
+
+	fi_param_define(&tcpx_prov, "progress_affinity", FI_PARAM_STRING,
+			"Comma separated list of cpus or cpu ranges, such "
+			"as 0-3,8, for the progress threads; thread i is "
+			"pinned to the i-th cpu of the list, wrapping "
+			"around (default: threads are not pinned).");
+
+	fi_param_define(&tcpx_prov, "busy_poll", FI_PARAM_INT,
+			"Maximum time in microseconds a blocking CQ read "
+			"spins before waiting for events; the actual budget "
+			"adapts to the completion arrival rate. Also sets "
+			"SO_BUSY_POLL on connected sockets (default: 0, "
+			"disabled).");
+
+	fi_param_define(&tcpx_prov, "stripes", FI_PARAM_INT,
+			"Number of extra connections opened next to each "
+			"endpoint connection to carry the payload of large "
+			"transfers, up to 8 (default: 0, disabled). Not "
+			"combined with io_uring. Completions of striped "
+			"transfers may follow those of smaller ones posted "
+			"after them.");
+
+	fi_param_define(&tcpx_prov, "stripe_size", FI_PARAM_SIZE_T,
+			"Sends, RMA writes and read responses of at least "
+			"this many bytes are striped (default: 262144).");
+
+	fi_param_define(&tcpx_prov, "cm_thread", FI_PARAM_BOOL,
+			"Run connection setup on a thread per fabric, so "
+			"handshakes progress without EQ reads (default: "
+			"no).");
+
+	fi_param_define(&tcpx_prov, "fastopen", FI_PARAM_BOOL,
+			"Send connection requests in the SYN using TCP fast "
+			"open where the kernel allows it (default: yes). "
+			"Falls back to a plain connect otherwise.");
+
+	fi_param_get_size_t(&tcpx_prov, "zerocopy_size", &tcpx_zerocopy_size);
+	fi_param_get_bool(&tcpx_prov, "io_uring", &tcpx_io_uring);
+	fi_param_get_int(&tcpx_prov, "progress_threads",
+			 &tcpx_progress_threads);
+	fi_param_get_str(&tcpx_prov, "progress_affinity",
+			 &tcpx_progress_affinity);
+	fi_param_get_int(&tcpx_prov, "busy_poll", &tcpx_busy_poll);
+	fi_param_get_int(&tcpx_prov, "stripes", &tcpx_stripe_cnt);
+	fi_param_get_size_t(&tcpx_prov, "stripe_size", &tcpx_stripe_size);
+	fi_param_get_bool(&tcpx_prov, "cm_thread", &tcpx_cm_thread);
+	fi_param_get_bool(&tcpx_prov, "fastopen", &tcpx_fastopen);
+	tcpx_stripe_cnt = MIN(MAX(tcpx_stripe_cnt, 0), TCPX_MAX_STRIPES);
+
 	return &tcpx_prov;
 }
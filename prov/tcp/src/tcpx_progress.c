@@ -39,6 +39,7 @@
 #include <sys/types.h>
 #include <ifaddrs.h>
 #include <net/if.h>
+#include <ctype.h>
 #include <ofi_util.h>
 #include <ofi_iov.h>
 
@@ -73,108 +74,165 @@ int tcpx_ep_shutdown_report(struct tcpx_ep *ep, fid_t fid)
 	return FI_SUCCESS;
 }
 
-void process_tx_entry(struct tcpx_xfer_entry *tx_entry)
+void tcpx_tx_entry_done(struct tcpx_xfer_entry *tx_entry, int err)
 {
 	struct tcpx_cq *tcpx_cq;
-	int ret;
-
-	ret = tcpx_send_msg(tx_entry);
-	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
-		return;
-
-	if (!ret)
-		goto done;
 
-	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg send failed\n");
-
-	if (ret == -FI_ENOTCONN)
-		tcpx_ep_shutdown_report(tx_entry->ep,
-					&tx_entry->ep->util_ep.ep_fid.fid);
-done:
 	tcpx_cq_report_completion(tx_entry->ep->util_ep.tx_cq,
-				  tx_entry, ret);
-	slist_remove_head(&tx_entry->ep->tx_queue);
+				  tx_entry, err);
 	tcpx_cq = container_of(tx_entry->ep->util_ep.tx_cq,
 			       struct tcpx_cq, util_cq);
 	tcpx_xfer_entry_release(tcpx_cq, tx_entry);
 }
 
-static void process_rx_entry(struct tcpx_xfer_entry *rx_entry)
+/* Send as much of the tx_queue as the socket accepts, several entries per
+ * sendmsg call, and complete every entry that went out in full.  Entries
+ * sent with MSG_ZEROCOPY are parked on the zc_queue until the kernel is
+ * done with the user's pages, and striped entries whose header went out
+ * move on to the stripes.
+ */
+void tcpx_process_tx_queue(struct tcpx_ep *ep)
 {
-	struct tcpx_cq *tcpx_cq;
-	int ret;
-
-	ret = tcpx_recv_msg_data(rx_entry);
-	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
-		return;
+	struct tcpx_xfer_entry *tx_entry;
+	ssize_t bytes_sent;
+	size_t rem_len;
+
+	ep->tx_blocked = 0;
+	while (!slist_empty(&ep->tx_queue)) {
+		bytes_sent = tcpx_send_queued(ep);
+		if (OFI_SOCK_TRY_SND_RCV_AGAIN(-bytes_sent)) {
+			ep->tx_blocked = 1;
+			return;
+		}
 
-	if (!ret)
-		goto done;
+		if (bytes_sent < 0) {
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg send failed\n");
 
-	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg recv Failed ret = %d\n", ret);
+			tx_entry = container_of(ep->tx_queue.head,
+						struct tcpx_xfer_entry, entry);
+			if (bytes_sent == -FI_ENOTCONN)
+				tcpx_ep_shutdown_report(ep,
+						&ep->util_ep.ep_fid.fid);
+			slist_remove_head(&ep->tx_queue);
+			tcpx_tx_entry_done(tx_entry, (int) bytes_sent);
+			return;
+		}
 
-	if (ret == -FI_ENOTCONN)
-		tcpx_ep_shutdown_report(rx_entry->ep,
-					&rx_entry->ep->util_ep.ep_fid.fid);
-done:
-	tcpx_cq_report_completion(rx_entry->ep->util_ep.rx_cq,
-				  rx_entry, ret);
-	slist_remove_head(&rx_entry->ep->rx_queue);
-	tcpx_cq = container_of(rx_entry->ep->util_ep.rx_cq,
-			       struct tcpx_cq, util_cq);
-	tcpx_xfer_entry_release(tcpx_cq, rx_entry);
+		while (bytes_sent) {
+			tx_entry = container_of(ep->tx_queue.head,
+						struct tcpx_xfer_entry, entry);
+			rem_len = tcpx_tx_conn_len(tx_entry) -
+				  tx_entry->done_len;
+			if ((size_t) bytes_sent < rem_len) {
+				tx_entry->done_len += bytes_sent;
+				ofi_consume_iov(tx_entry->msg_data.iov,
+						&tx_entry->msg_data.iov_cnt,
+						bytes_sent);
+				break;
+			}
+
+			tx_entry->done_len += rem_len;
+			bytes_sent -= rem_len;
+			slist_remove_head(&ep->tx_queue);
+			if (tcpx_striped(tx_entry)) {
+				tcpx_stripe_tx_start(ep, tx_entry);
+			} else if (tcpx_tx_zerocopy(ep, tx_entry)) {
+				tx_entry->zc_seq = ep->zc_sent;
+				slist_insert_tail(&tx_entry->entry,
+						  &ep->zc_queue);
+			} else {
+				tcpx_tx_entry_done(tx_entry, FI_SUCCESS);
+			}
+		}
+	}
 }
 
-static void process_rx_remote_write_entry(struct tcpx_xfer_entry *rx_entry)
+static void tcpx_process_zc_queue(struct tcpx_ep *ep)
 {
-	struct tcpx_cq *tcpx_cq;
+	struct tcpx_xfer_entry *tx_entry;
 	int ret;
 
-	ret = tcpx_recv_msg_data(rx_entry);
-	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
-		return;
+	ret = tcpx_zerocopy_reap(ep);
+	if (ret)
+		FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+			"zerocopy notification read failed ret = %d\n", ret);
 
-	if (!ret)
-		goto done;
+	while (!slist_empty(&ep->zc_queue)) {
+		tx_entry = container_of(ep->zc_queue.head,
+					struct tcpx_xfer_entry, entry);
+		if ((int32_t) (ep->zc_done - tx_entry->zc_seq) < 0)
+			break;
 
-	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg recv Failed ret = %d\n", ret);
+		slist_remove_head(&ep->zc_queue);
+		tcpx_tx_entry_done(tx_entry, FI_SUCCESS);
+	}
+}
 
-	if (ret == -FI_ENOTCONN)
-		tcpx_ep_shutdown_report(rx_entry->ep,
-					&rx_entry->ep->util_ep.ep_fid.fid);
-done:
-	tcpx_cq_report_completion(rx_entry->ep->util_ep.rx_cq,
-				  rx_entry, ret);
-	tcpx_cq = container_of(rx_entry->ep->util_ep.rx_cq,
-			       struct tcpx_cq, util_cq);
+static void tcpx_rx_unexp_done(struct tcpx_xfer_entry *rx_entry, int err)
+{
+	struct tcpx_unexp_msg *unexp = rx_entry->context;
+	struct tcpx_ep *ep = rx_entry->ep;
+	struct tcpx_cq *tcpx_cq;
+
+	tcpx_cq = container_of(ep->util_ep.rx_cq, struct tcpx_cq, util_cq);
 	tcpx_xfer_entry_release(tcpx_cq, rx_entry);
 
+	if (!err) {
+		unexp->done = 1;
+		if (unexp->claim)
+			tcpx_unexp_msg_deliver(unexp, unexp->claim);
+		return;
+	}
+
+	if (unexp->claim) {
+		tcpx_cq_report_completion(ep->util_ep.rx_cq, unexp->claim, err);
+		tcpx_xfer_entry_release(tcpx_cq, unexp->claim);
+	} else {
+		ofi_mq_remove(&unexp->match);
+	}
+	free(unexp);
 }
 
-static void process_rx_read_entry(struct tcpx_xfer_entry *rx_entry)
+/* Complete an entry whose payload has been received, over conn_fd or
+ * the stripes.  Posted receives and read responses were taken off their
+ * queues once their header arrived. */
+void tcpx_rx_entry_done(struct tcpx_xfer_entry *rx_entry, int err)
 {
-	struct tcpx_cq *tcpx_cq;
-	int ret;
+	struct util_cq *cq;
 
-	ret = tcpx_recv_msg_data(rx_entry);
-	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+	if (rx_entry->msg_hdr.hdr.op_data == TCPX_OP_TAGGED_UNEXP) {
+		tcpx_rx_unexp_done(rx_entry, err);
 		return;
+	}
 
-	if (!ret)
-		goto done;
+	cq = (rx_entry->msg_hdr.hdr.op_data == TCPX_OP_READ_RSP) ?
+	     rx_entry->ep->util_ep.tx_cq : rx_entry->ep->util_ep.rx_cq;
+	tcpx_cq_report_completion(cq, rx_entry, err);
+	tcpx_xfer_entry_release(container_of(cq, struct tcpx_cq, util_cq),
+				rx_entry);
+}
 
-	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN, "msg recv Failed ret = %d\n", ret);
+/* Release an entry that is not on any queue without completing it */
+void tcpx_rx_entry_free(struct tcpx_xfer_entry *rx_entry)
+{
+	struct tcpx_unexp_msg *unexp;
+	struct util_cq *cq;
+
+	if (rx_entry->msg_hdr.hdr.op_data == TCPX_OP_TAGGED_UNEXP) {
+		unexp = rx_entry->context;
+		if (unexp->claim) {
+			tcpx_xfer_entry_release(container_of(
+					rx_entry->ep->util_ep.rx_cq,
+					struct tcpx_cq, util_cq),
+					unexp->claim);
+			free(unexp);
+		}
+	}
 
-	if (ret == -FI_ENOTCONN)
-		tcpx_ep_shutdown_report(rx_entry->ep,
-					&rx_entry->ep->util_ep.ep_fid.fid);
-done:
-	tcpx_cq_report_completion(rx_entry->ep->util_ep.tx_cq,
-				  rx_entry, ret);
-	slist_remove_head(&rx_entry->ep->rma_read_queue);
-	tcpx_cq = container_of(rx_entry->ep->util_ep.tx_cq,
-			       struct tcpx_cq, util_cq);
-	tcpx_xfer_entry_release(tcpx_cq, rx_entry);
+	cq = (rx_entry->msg_hdr.hdr.op_data == TCPX_OP_READ_RSP) ?
+	     rx_entry->ep->util_ep.tx_cq : rx_entry->ep->util_ep.rx_cq;
+	tcpx_xfer_entry_release(container_of(cq, struct tcpx_cq, util_cq),
+				rx_entry);
 }
 
 static void tcpx_copy_rma_iov_to_msg_iov(struct tcpx_xfer_entry *xfer_entry)
@@ -241,6 +299,27 @@ static int tcpx_validate_rx_rma_data(struct tcpx_xfer_entry *rx_entry,
 	return FI_SUCCESS;
 }
 
+/* A message larger than the posted buffer still has to be read off the
+ * stream in full, or the next header would be parsed from the middle of
+ * its payload.  Fill the buffer and count the rest as bytes to discard;
+ * the receive then completes with FI_ETRUNC.
+ */
+void tcpx_rx_fit_iov(struct tcpx_xfer_entry *rx_entry)
+{
+	size_t len;
+
+	len = ntohll(rx_entry->msg_hdr.hdr.size) - sizeof(rx_entry->msg_hdr);
+	if (!ofi_truncate_iov(rx_entry->msg_data.iov,
+			      &rx_entry->msg_data.iov_cnt, len))
+		return;
+
+	FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+		"posted rx buffer size is not big enough\n");
+	rx_entry->discard_len = len -
+		ofi_total_iov_len(rx_entry->msg_data.iov,
+				  rx_entry->msg_data.iov_cnt);
+}
+
 static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 			     struct tcpx_xfer_entry **new_rx_entry)
 {
@@ -263,6 +342,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 		rx_entry = container_of(entry, struct tcpx_xfer_entry,
 					entry);
 
+		slist_remove_head(&tcpx_ep->rx_queue);
 		rx_entry->msg_hdr = rx_detect->hdr;
 		rx_entry->msg_hdr.hdr.op_data = TCPX_OP_MSG_RECV;
 		rx_entry->done_len = sizeof(rx_detect->hdr);
@@ -270,19 +350,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 		if (ntohl(rx_detect->hdr.hdr.flags) & OFI_REMOTE_CQ_DATA)
 			rx_entry->flags |= FI_REMOTE_CQ_DATA;
 
-		ret = ofi_truncate_iov(rx_entry->msg_data.iov,
-				       &rx_entry->msg_data.iov_cnt,
-				       (ntohll(rx_entry->msg_hdr.hdr.size) -
-					sizeof(rx_entry->msg_hdr)));
-		if (ret) {
-			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
-				"posted rx buffer size is not big enough\n");
-			tcpx_cq_report_completion(rx_entry->ep->util_ep.rx_cq,
-						  rx_entry, ret);
-			slist_remove_head(&rx_entry->ep->rx_queue);
-			tcpx_xfer_entry_release(tcpx_cq, rx_entry);
-			return ret;
-		}
+		tcpx_rx_fit_iov(rx_entry);
 		break;
 	case ofi_op_read_req:
 		rx_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_REMOTE_READ);
@@ -330,6 +398,18 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 
 		tcpx_copy_rma_iov_to_msg_iov(rx_entry);
 		break;
+	case ofi_op_tagged:
+		ret = tcpx_get_tagged_rx_entry(tcpx_ep, &rx_entry);
+		if (ret)
+			return ret;
+		break;
+	case ofi_op_atomic:
+	case ofi_op_atomic_fetch:
+	case ofi_op_atomic_compare:
+		ret = tcpx_get_atomic_rx_entry(tcpx_ep, &rx_entry);
+		if (ret)
+			return ret;
+		break;
 	case ofi_op_read_rsp:
 		if (slist_empty(&tcpx_ep->rma_read_queue))
 			return -FI_EINVAL;
@@ -338,6 +418,7 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 		rx_entry = container_of(entry, struct tcpx_xfer_entry,
 					entry);
 
+		slist_remove_head(&tcpx_ep->rma_read_queue);
 		rx_entry->msg_hdr = rx_detect->hdr;
 		rx_entry->msg_hdr.hdr.op_data = TCPX_OP_READ_RSP;
 		rx_entry->done_len = sizeof(rx_detect->hdr);
@@ -354,10 +435,13 @@ static int tcpx_get_rx_entry(struct tcpx_rx_detect *rx_detect,
 
 static void tcpx_process_rx_msg(struct tcpx_ep *ep)
 {
+	struct tcpx_xfer_entry *rx_entry;
 	int ret;
 
+	ep->rx_blocked = 0;
+next_msg:
 	if (!ep->cur_rx_entry) {
-		ret = tcpx_recv_hdr(ep->conn_fd, &ep->rx_detect);
+		ret = tcpx_recv_hdr(ep);
 		if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
 			return;
 
@@ -371,20 +455,64 @@ static void tcpx_process_rx_msg(struct tcpx_ep *ep)
 
 		if (ret)
 			goto err2;
+
+		/* queued atomics are applied before anything received
+		 * after them */
+		if (!slist_empty(&ep->atomic_queue) &&
+		    ep->cur_rx_entry->msg_hdr.hdr.op_data !=
+		    TCPX_OP_REMOTE_ATOMIC)
+			tcpx_atomic_flush(ep);
+
+		/* the payload follows on the stripes */
+		if (tcpx_striped(ep->cur_rx_entry)) {
+			ret = tcpx_stripe_rx_start(ep, ep->cur_rx_entry);
+			if (ret) {
+				tcpx_rx_entry_done(ep->cur_rx_entry, ret);
+				goto err2;
+			}
+			goto next_msg;
+		}
 	}
 
-	switch(ep->cur_rx_entry->msg_hdr.hdr.op_data){
+	rx_entry = ep->cur_rx_entry;
+	switch (rx_entry->msg_hdr.hdr.op_data) {
 	case TCPX_OP_MSG_RECV:
-		process_rx_entry(ep->cur_rx_entry);
-		break;
+	case TCPX_OP_TAGGED_RECV:
+	case TCPX_OP_TAGGED_UNEXP:
 	case TCPX_OP_REMOTE_WRITE:
-		process_rx_remote_write_entry(ep->cur_rx_entry);
-		break;
 	case TCPX_OP_READ_RSP:
-		process_rx_read_entry(ep->cur_rx_entry);
+		ret = tcpx_recv_msg_data(rx_entry);
+		if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+			return;
+
+		if (ret && ret != -FI_ETRUNC) {
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+				"msg recv Failed ret = %d\n", ret);
+			if (ret == -FI_ENOTCONN)
+				tcpx_ep_shutdown_report(ep,
+						&ep->util_ep.ep_fid.fid);
+		}
+		tcpx_rx_entry_done(rx_entry, ret);
+		break;
+	case TCPX_OP_REMOTE_ATOMIC:
+		ret = tcpx_recv_msg_data(rx_entry);
+		if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+			return;
+
+		if (ret) {
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+				"atomic recv Failed ret = %d\n", ret);
+			if (ret == -FI_ENOTCONN)
+				tcpx_ep_shutdown_report(ep,
+						&ep->util_ep.ep_fid.fid);
+			tcpx_rx_entry_done(rx_entry, ret);
+			break;
+		}
+		slist_insert_tail(&rx_entry->entry, &ep->atomic_queue);
+		ep->cur_rx_entry = NULL;
 		break;
  	case TCPX_OP_REMOTE_READ:
-		tcpx_prepare_rx_remote_read_resp(ep->cur_rx_entry);
+		tcpx_prepare_rx_remote_read_resp(rx_entry);
 		ep->cur_rx_entry = NULL;
 		break;
 	default:
@@ -392,7 +520,11 @@ static void tcpx_process_rx_msg(struct tcpx_ep *ep)
 			"invalid op type\n");
 		return;
 	}
-	return;
+
+	/* Staged data does not show up as socket readiness, and the
+	 * shard's epoll set only reports new data, so keep reading until
+	 * the socket has nothing left. */
+	goto next_msg;
 err2:
 	tcpx_report_error(ep, ret);
 	return;
@@ -401,24 +533,16 @@ err1:
 		tcpx_ep_shutdown_report(ep, &ep->util_ep.ep_fid.fid);
 }
 
-static void process_tx_queue(struct tcpx_ep *ep)
-{
-	struct tcpx_xfer_entry *tx_entry;
-	struct slist_entry *entry;
-
-	if (slist_empty(&ep->tx_queue))
-		return;
-
-	entry = ep->tx_queue.head;
-	tx_entry = container_of(entry, struct tcpx_xfer_entry,
-				entry);
-	process_tx_entry(tx_entry);
-}
-
 void tcpx_ep_progress(struct tcpx_ep *ep)
 {
 	tcpx_process_rx_msg(ep);
-	process_tx_queue(ep);
+	if (!slist_empty(&ep->atomic_queue))
+		tcpx_atomic_flush(ep);
+	if (ep->stripe_cnt)
+		tcpx_stripe_progress(ep);
+	tcpx_process_tx_queue(ep);
+	if (!slist_empty(&ep->zc_queue))
+		tcpx_process_zc_queue(ep);
 }
 
 void tcpx_progress(struct util_ep *util_ep)
@@ -434,32 +558,438 @@ void tcpx_progress(struct util_ep *util_ep)
 
 static int tcpx_try_func(void *util_ep)
 {
-	/* nothing to do here. When endpoints
-	   have incoming data, cq drives progress*/
-	return FI_SUCCESS;
+	struct tcpx_ep *ep;
+
+	/* When endpoints have incoming data, cq drives progress.  Data
+	   already pulled into the staging buffer will not wake up the
+	   wait set, so don't let the caller block on it. */
+	ep = container_of(util_ep, struct tcpx_ep, util_ep);
+	return tcpx_stage_buf_avail(&ep->stage_buf) ? -FI_EAGAIN :
+						       FI_SUCCESS;
 }
 
 int tcpx_cq_wait_ep_add(struct tcpx_ep *ep)
 {
+	int i, ret;
+
 	if (!ep->util_ep.rx_cq->wait)
 		return FI_SUCCESS;
 
-	return ofi_wait_fd_add(ep->util_ep.rx_cq->wait,
-			       ep->conn_fd, FI_EPOLL_IN,
-			       tcpx_try_func, (void *)&ep->util_ep,
-			       NULL);
+	ret = ofi_wait_fd_add(ep->util_ep.rx_cq->wait,
+			      tcpx_ep_wait_fd(ep), FI_EPOLL_IN,
+			      tcpx_try_func, (void *)&ep->util_ep,
+			      NULL);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ep->stripes[i].fd == INVALID_SOCKET)
+			continue;
+
+		ret = ofi_wait_fd_add(ep->util_ep.rx_cq->wait,
+				      ep->stripes[i].fd, FI_EPOLL_IN,
+				      tcpx_try_func, (void *)&ep->util_ep,
+				      NULL);
+		if (ret)
+			goto err;
+	}
+	return FI_SUCCESS;
+err:
+	while (i--) {
+		if (ep->stripes[i].fd != INVALID_SOCKET)
+			ofi_wait_fd_del(ep->util_ep.rx_cq->wait,
+					ep->stripes[i].fd);
+	}
+	ofi_wait_fd_del(ep->util_ep.rx_cq->wait, tcpx_ep_wait_fd(ep));
+	return ret;
 }
 
 void tcpx_cq_wait_ep_del(struct tcpx_ep *ep)
 {
+	int i;
+
 	fastlock_acquire(&ep->lock);
 	if (ep->cm_state == TCPX_EP_CONNECTING) {
 		goto out;
 	}
 
 	if (ep->util_ep.rx_cq->wait) {
-		ofi_wait_fd_del(ep->util_ep.rx_cq->wait, ep->conn_fd);
+		ofi_wait_fd_del(ep->util_ep.rx_cq->wait, tcpx_ep_wait_fd(ep));
+		for (i = 0; i < ep->stripe_cnt; i++) {
+			if (ep->stripes[i].fd != INVALID_SOCKET)
+				ofi_wait_fd_del(ep->util_ep.rx_cq->wait,
+						ep->stripes[i].fd);
+		}
 	}
 out:
 	fastlock_release(&ep->lock);
 }
+
+/* Stripes joining an endpoint that is already connected.  Called with
+ * the endpoint lock held, which orders after the shard lock, so the
+ * shard's epoll set is updated without it. */
+int tcpx_stripe_wait_add(struct tcpx_ep *ep, struct tcpx_stripe *stripe)
+{
+	int ret;
+
+	if (ep->util_ep.rx_cq->wait) {
+		ret = ofi_wait_fd_add(ep->util_ep.rx_cq->wait, stripe->fd,
+				      FI_EPOLL_IN, tcpx_try_func,
+				      (void *)&ep->util_ep, NULL);
+		if (ret)
+			return ret;
+	}
+
+	if (ep->shard) {
+		ret = fi_epoll_add(ep->shard->epoll_fd, stripe->fd,
+				   FI_EPOLL_IN | FI_EPOLL_OUT | TCPX_EPOLL_ET,
+				   ep);
+		if (ret) {
+			if (ep->util_ep.rx_cq->wait)
+				ofi_wait_fd_del(ep->util_ep.rx_cq->wait,
+						stripe->fd);
+			return ret;
+		}
+	}
+	return FI_SUCCESS;
+}
+
+void tcpx_stripe_wait_del(struct tcpx_ep *ep, struct tcpx_stripe *stripe)
+{
+	if (ep->util_ep.rx_cq->wait)
+		ofi_wait_fd_del(ep->util_ep.rx_cq->wait, stripe->fd);
+
+	if (ep->shard)
+		fi_epoll_del(ep->shard->epoll_fd, stripe->fd);
+}
+
+static int tcpx_ep_has_work(struct tcpx_ep *ep)
+{
+	return ep->cm_state == TCPX_EP_CONNECTED &&
+	       (!ep->rx_blocked || tcpx_stage_buf_avail(&ep->stage_buf) ||
+		(!slist_empty(&ep->tx_queue) && !ep->tx_blocked) ||
+		!slist_empty(&ep->zc_queue) || tcpx_stripe_has_work(ep));
+}
+
+/* Called with the shard lock held */
+static void tcpx_shard_progress(struct tcpx_shard *shard)
+{
+	void *contexts[MAX_EPOLL_EVENTS];
+	struct dlist_entry *item, *tmp;
+	struct tcpx_ep *ep;
+	int i, cnt, busy;
+
+	cnt = fi_epoll_wait(shard->epoll_fd, contexts, MAX_EPOLL_EVENTS, 0);
+	for (i = 0; i < cnt; i++) {
+		if (contexts[i] == &shard->signal) {
+			fd_signal_reset(&shard->signal);
+			continue;
+		}
+
+		ep = contexts[i];
+		if (dlist_empty(&ep->ready_entry))
+			dlist_insert_tail(&ep->ready_entry, &shard->ready_list);
+	}
+
+	dlist_foreach_safe(&shard->ready_list, item, tmp) {
+		ep = container_of(item, struct tcpx_ep, ready_entry);
+		fastlock_acquire(&ep->lock);
+		ep->progress_func(ep);
+		busy = tcpx_ep_has_work(ep);
+		fastlock_release(&ep->lock);
+
+		if (!busy)
+			dlist_remove_init(&ep->ready_entry);
+	}
+}
+
+/* CQ reads poll the shards back to back and hold the lock across the
+ * socket calls, so the lock is rarely free when a thread preempted by
+ * them gets to run.  Endpoints joining or leaving a shard announce
+ * themselves, and the pollers step aside until they are through. */
+static void tcpx_shard_lock(struct tcpx_shard *shard)
+{
+	ofi_atomic_inc32(&shard->waiters);
+	fastlock_acquire(&shard->lock);
+	ofi_atomic_dec32(&shard->waiters);
+}
+
+void tcpx_domain_progress(struct tcpx_domain *domain)
+{
+	int i;
+
+	for (i = 0; i < domain->shard_cnt; i++) {
+		/* another thread is already progressing this shard, or is
+		 * waiting to update it */
+		if (ofi_atomic_get32(&domain->shards[i].waiters) ||
+		    fastlock_tryacquire(&domain->shards[i].lock))
+			continue;
+
+		tcpx_shard_progress(&domain->shards[i]);
+		fastlock_release(&domain->shards[i].lock);
+	}
+}
+
+int tcpx_shard_ep_add(struct tcpx_ep *ep)
+{
+	struct tcpx_domain *domain;
+	struct tcpx_shard *shard;
+	uint32_t index;
+	int i, ret;
+
+	domain = container_of(ep->util_ep.domain, struct tcpx_domain,
+			      util_domain);
+	index = (uint32_t) ofi_atomic_inc32(&domain->next_shard);
+	shard = &domain->shards[index % domain->shard_cnt];
+
+	tcpx_shard_lock(shard);
+	ret = fi_epoll_add(shard->epoll_fd, tcpx_ep_wait_fd(ep),
+			   FI_EPOLL_IN | FI_EPOLL_OUT | TCPX_EPOLL_ET, ep);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ep->stripes[i].fd == INVALID_SOCKET)
+			continue;
+
+		ret = fi_epoll_add(shard->epoll_fd, ep->stripes[i].fd,
+				   FI_EPOLL_IN | FI_EPOLL_OUT | TCPX_EPOLL_ET,
+				   ep);
+		if (ret) {
+			while (i--) {
+				if (ep->stripes[i].fd != INVALID_SOCKET)
+					fi_epoll_del(shard->epoll_fd,
+						     ep->stripes[i].fd);
+			}
+			fi_epoll_del(shard->epoll_fd, tcpx_ep_wait_fd(ep));
+			goto out;
+		}
+	}
+
+	ep->shard = shard;
+	dlist_insert_tail(&ep->ready_entry, &shard->ready_list);
+out:
+	fastlock_release(&shard->lock);
+	return ret;
+}
+
+void tcpx_shard_ep_del(struct tcpx_ep *ep)
+{
+	struct tcpx_shard *shard = ep->shard;
+	int i;
+
+	if (!shard)
+		return;
+
+	tcpx_shard_lock(shard);
+	fi_epoll_del(shard->epoll_fd, tcpx_ep_wait_fd(ep));
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ep->stripes[i].fd != INVALID_SOCKET)
+			fi_epoll_del(shard->epoll_fd, ep->stripes[i].fd);
+	}
+	dlist_remove_init(&ep->ready_entry);
+	ep->shard = NULL;
+	fastlock_release(&shard->lock);
+}
+
+#ifdef HAVE_EPOLL
+static void *tcpx_shard_thread(void *arg)
+{
+	struct tcpx_shard *shard = arg;
+	char cpu[16];
+	int timeout;
+
+	if (shard->cpu >= 0) {
+		snprintf(cpu, sizeof(cpu), "%d", shard->cpu);
+		if (ofi_set_thread_affinity(cpu))
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+				"unable to pin progress thread to cpu %d\n",
+				shard->cpu);
+	}
+
+	while (shard->domain->run) {
+		/* endpoints waiting on resources rather than on their
+		 * sockets are retried periodically */
+		fastlock_acquire(&shard->lock);
+		timeout = dlist_empty(&shard->ready_list) ?
+			  -1 : TCPX_SHARD_POLL_MS;
+		fastlock_release(&shard->lock);
+
+		/* wait without consuming the events */
+		fi_poll_fd(shard->epoll_fd, timeout);
+
+		fastlock_acquire(&shard->lock);
+		tcpx_shard_progress(shard);
+		fastlock_release(&shard->lock);
+	}
+	return NULL;
+}
+#endif
+
+/* Expands the affinity list, cpus and cpu ranges such as "0-3,8", into
+ * one entry per cpu.  Thread i is pinned to entry i, wrapping around. */
+static int tcpx_parse_affinity(const char *str, int **cpus, int *cnt)
+{
+	long first, last, max_cpu;
+	int *list = NULL, *tmp;
+	char *end;
+
+	max_cpu = ofi_sysconf(_SC_NPROCESSORS_CONF);
+	*cnt = 0;
+	for (;;) {
+		if (!isdigit((unsigned char) *str))
+			goto err;
+		first = last = strtol(str, &end, 10);
+		if (*end == '-') {
+			str = end + 1;
+			if (!isdigit((unsigned char) *str))
+				goto err;
+			last = strtol(str, &end, 10);
+		}
+		if ((*end && *end != ',') || last < first ||
+		    (max_cpu > 0 && last >= max_cpu))
+			goto err;
+
+		tmp = realloc(list, (*cnt + last - first + 1) * sizeof(*list));
+		if (!tmp) {
+			free(list);
+			return -FI_ENOMEM;
+		}
+		list = tmp;
+		while (first <= last)
+			list[(*cnt)++] = (int) first++;
+
+		if (!*end)
+			break;
+		str = end + 1;
+	}
+	*cpus = list;
+	return FI_SUCCESS;
+err:
+	free(list);
+	return -FI_EINVAL;
+}
+
+static int tcpx_shard_init(struct tcpx_domain *domain,
+			   struct tcpx_shard *shard)
+{
+	int ret;
+
+	ret = fi_epoll_create(&shard->epoll_fd);
+	if (ret)
+		return ret;
+
+	ret = fd_signal_init(&shard->signal);
+	if (ret)
+		goto err1;
+
+	ret = fi_epoll_add(shard->epoll_fd, shard->signal.fd[FI_READ_FD],
+			   FI_EPOLL_IN, &shard->signal);
+	if (ret)
+		goto err2;
+
+	ret = fastlock_init(&shard->lock);
+	if (ret)
+		goto err2;
+
+	ofi_atomic_initialize32(&shard->waiters, 0);
+	dlist_init(&shard->ready_list);
+	shard->domain = domain;
+	shard->cpu = -1;
+	return FI_SUCCESS;
+err2:
+	fd_signal_free(&shard->signal);
+err1:
+	fi_epoll_close(shard->epoll_fd);
+	return ret;
+}
+
+static void tcpx_shard_close(struct tcpx_shard *shard)
+{
+	assert(dlist_empty(&shard->ready_list));
+	fastlock_destroy(&shard->lock);
+	fd_signal_free(&shard->signal);
+	fi_epoll_close(shard->epoll_fd);
+}
+
+void tcpx_domain_progress_close(struct tcpx_domain *domain)
+{
+	int i;
+
+	domain->run = 0;
+	for (i = 0; i < domain->thread_cnt; i++) {
+		fd_signal_set(&domain->shards[i].signal);
+		pthread_join(domain->shards[i].thread, NULL);
+	}
+
+	for (i = 0; i < domain->shard_cnt; i++)
+		tcpx_shard_close(&domain->shards[i]);
+	free(domain->shards);
+}
+
+int tcpx_domain_progress_init(struct tcpx_domain *domain)
+{
+	int ret, shard_cnt, cpu_cnt, i;
+	int *cpus;
+
+	shard_cnt = MAX(tcpx_progress_threads, 1);
+	domain->shards = calloc(shard_cnt, sizeof(*domain->shards));
+	if (!domain->shards)
+		return -FI_ENOMEM;
+
+	ofi_atomic_initialize32(&domain->next_shard, 0);
+	domain->run = 1;
+	domain->thread_cnt = 0;
+
+	for (domain->shard_cnt = 0; domain->shard_cnt < shard_cnt;
+	     domain->shard_cnt++) {
+		ret = tcpx_shard_init(domain, &domain->shards[domain->shard_cnt]);
+		if (ret)
+			goto err;
+	}
+
+	if (tcpx_progress_threads && tcpx_progress_affinity &&
+	    *tcpx_progress_affinity) {
+		ret = tcpx_parse_affinity(tcpx_progress_affinity, &cpus,
+					  &cpu_cnt);
+		if (ret) {
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+				"invalid FI_TCP_PROGRESS_AFFINITY: %s\n",
+				tcpx_progress_affinity);
+			goto err;
+		}
+		for (i = 0; i < domain->shard_cnt; i++)
+			domain->shards[i].cpu = cpus[i % cpu_cnt];
+		free(cpus);
+	}
+
+#ifdef HAVE_EPOLL
+	/* Completions are written from the shard threads, so the CQs and
+	 * counters opened on this domain must always take their locks.
+	 */
+	if (tcpx_progress_threads)
+		domain->util_domain.threading = FI_THREAD_SAFE;
+
+	for (; domain->thread_cnt < tcpx_progress_threads;
+	     domain->thread_cnt++) {
+		ret = pthread_create(&domain->shards[domain->thread_cnt].thread,
+				     NULL, tcpx_shard_thread,
+				     &domain->shards[domain->thread_cnt]);
+		if (ret) {
+			FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+				"unable to start progress thread\n");
+			ret = -ret;
+			goto err;
+		}
+	}
+#else
+	if (tcpx_progress_threads)
+		FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+			"progress threads need epoll, progressing from "
+			"CQ reads\n");
+#endif
+	return FI_SUCCESS;
+err:
+	tcpx_domain_progress_close(domain);
+	return ret;
+}
@@ -108,7 +108,12 @@ static ssize_t tcpx_rma_readmsg(struct fid_ep *ep, const struct fi_msg_rma *msg,
 
 	fastlock_acquire(&tcpx_ep->lock);
 	slist_insert_tail(&recv_entry->entry, &tcpx_ep->rma_read_queue);
-	slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
+	if (slist_empty(&tcpx_ep->tx_queue)) {
+		slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
+		tcpx_process_tx_queue(tcpx_ep);
+	} else {
+		slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
+	}
 	fastlock_release(&tcpx_ep->lock);
 	return FI_SUCCESS;
 }
@@ -197,6 +202,7 @@ static ssize_t tcpx_rma_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg
 	send_entry->msg_data.iov[0].iov_base = (void *) &send_entry->msg_hdr;
 	send_entry->msg_data.iov[0].iov_len = sizeof(send_entry->msg_hdr);
 	send_entry->msg_data.iov_cnt = msg->iov_count + 1;
+	send_entry->msg_hdr.hdr.flags = 0;
 
 	if (flags & FI_INJECT) {
 		ofi_copy_iov_buf(msg->msg_iov, msg->iov_count, 0,
@@ -226,7 +232,7 @@ static ssize_t tcpx_rma_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg
 	fastlock_acquire(&tcpx_ep->lock);
 	if (slist_empty(&tcpx_ep->tx_queue)) {
 		slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
-		process_tx_entry(send_entry);
+		tcpx_process_tx_queue(tcpx_ep);
 	} else {
 		slist_insert_tail(&send_entry->entry, &tcpx_ep->tx_queue);
 	}
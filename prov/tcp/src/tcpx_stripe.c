@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *	   Redistribution and use in source and binary forms, with or
+ *	   without modification, are permitted provided that the following
+ *	   conditions are met:
+ *
+ *		- Redistributions of source code must retain the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer.
+ *
+ *		- Redistributions in binary form must reproduce the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer in the documentation and/or other materials
+ *		  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <rdma/fi_errno.h>
+
+#include <ofi_prov.h>
+#include <ofi_iov.h>
+#include "tcpx.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+void tcpx_stripe_init(struct tcpx_ep *ep, uint32_t cnt)
+{
+	int i;
+
+	for (i = 0; i < TCPX_MAX_STRIPES; i++)
+		ep->stripes[i].fd = INVALID_SOCKET;
+
+	ep->stripe_listen = INVALID_SOCKET;
+	ep->stripe_size = tcpx_stripe_size;
+	ep->stripe_cnt = tcpx_io_uring ? 0 :
+			 (int) MIN(cnt, (uint32_t) tcpx_stripe_cnt);
+	slist_init(&ep->stripe_tx_queue);
+	slist_init(&ep->stripe_rx_queue);
+}
+
+/* The connection request carries the number of stripes wanted, and the
+ * response the number granted along with the key and port to join them.
+ */
+void tcpx_stripe_cm_hdr(struct tcpx_ep *ep, struct ofi_ctrl_hdr *hdr)
+{
+	hdr->seg_no = htonl(ep->stripe_cnt);
+	hdr->conn_id = htonll(ep->stripe_key);
+	hdr->ctrl_data = htonll(ep->stripe_port);
+}
+
+static void tcpx_stripe_abort(struct tcpx_ep *ep)
+{
+	int i;
+
+	FI_INFO(&tcpx_prov, FI_LOG_EP_CTRL,
+		"stripes failed to connect, not striping\n");
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ep->stripes[i].fd == INVALID_SOCKET)
+			continue;
+
+		/* connecting stripes are not in the wait sets yet */
+		if (ep->cm_state != TCPX_EP_CONNECTING)
+			tcpx_stripe_wait_del(ep, &ep->stripes[i]);
+		ofi_close_socket(ep->stripes[i].fd);
+		ep->stripes[i].fd = INVALID_SOCKET;
+	}
+	ep->stripe_cnt = 0;
+}
+
+/* Accepting side: open a listener next to conn_fd for the stripes to
+ * join.  Failing that, the connection goes ahead without striping.
+ */
+void tcpx_stripe_listen(struct tcpx_ep *ep, struct util_wait *wait)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	struct tcpx_cm_context *cm_ctx;
+
+	if (!ep->stripe_cnt)
+		return;
+
+	if (ofi_getsockname(ep->conn_fd, (struct sockaddr *) &addr, &len))
+		goto err1;
+
+	ofi_addr_set_port((struct sockaddr *) &addr, 0);
+	ep->stripe_listen = ofi_socket(addr.ss_family, SOCK_STREAM, 0);
+	if (ep->stripe_listen == INVALID_SOCKET)
+		goto err1;
+
+	if (bind(ep->stripe_listen, (struct sockaddr *) &addr, len) ||
+	    listen(ep->stripe_listen, ep->stripe_cnt))
+		goto err2;
+
+	len = sizeof(addr);
+	if (ofi_getsockname(ep->stripe_listen, (struct sockaddr *) &addr,
+			    &len))
+		goto err2;
+
+	cm_ctx = calloc(1, sizeof(*cm_ctx));
+	if (!cm_ctx)
+		goto err2;
+
+	cm_ctx->fid = &ep->util_ep.ep_fid.fid;
+	cm_ctx->type = SERVER_STRIPE_JOIN;
+	if (ofi_wait_fd_add(wait, ep->stripe_listen, FI_EPOLL_IN,
+			    tcpx_eq_wait_try_func, NULL, cm_ctx)) {
+		free(cm_ctx);
+		goto err2;
+	}
+
+	ep->stripe_cm_ctx = cm_ctx;
+	ep->stripe_port = ofi_addr_get_port((struct sockaddr *) &addr);
+	ep->stripe_key = fi_gettime_us() ^ (uintptr_t) ep;
+	return;
+err2:
+	ofi_close_socket(ep->stripe_listen);
+	ep->stripe_listen = INVALID_SOCKET;
+err1:
+	FI_INFO(&tcpx_prov, FI_LOG_EP_CTRL,
+		"unable to listen for stripes, not striping\n");
+	ep->stripe_cnt = 0;
+}
+
+static void tcpx_stripe_listen_close(struct tcpx_ep *ep, struct util_wait *wait)
+{
+	if (ep->stripe_cm_ctx) {
+		ofi_wait_fd_del(wait, ep->stripe_listen);
+		free(ep->stripe_cm_ctx);
+		ep->stripe_cm_ctx = NULL;
+	}
+
+	if (ep->stripe_listen != INVALID_SOCKET) {
+		ofi_close_socket(ep->stripe_listen);
+		ep->stripe_listen = INVALID_SOCKET;
+	}
+}
+
+/* Accepting side: a stripe connects to the listener and names its key and
+ * index.  Once all of them have joined, each one is acked, which allows
+ * the peer to stripe, and so does this side from then on.
+ */
+void tcpx_stripe_accept(struct util_wait *wait, struct tcpx_ep *ep)
+{
+	struct tcpx_stripe *stripe;
+	struct ofi_ctrl_hdr hdr;
+	uint32_t index;
+	SOCKET sock;
+	int i;
+
+	sock = accept(ep->stripe_listen, NULL, 0);
+	if (sock == INVALID_SOCKET) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL,
+			"stripe accept error: %d\n", ofi_sockerr());
+		return;
+	}
+
+	if (fi_poll_fd(sock, TCPX_STRIPE_JOIN_MS) <= 0 ||
+	    ofi_recv_socket(sock, &hdr, sizeof(hdr), MSG_WAITALL) !=
+	    sizeof(hdr))
+		goto err;
+
+	index = ntohl(hdr.seg_no);
+	if (hdr.type != ofi_ctrl_connreq ||
+	    ntohll(hdr.conn_id) != ep->stripe_key ||
+	    index >= (uint32_t) ep->stripe_cnt ||
+	    ep->stripes[index].fd != INVALID_SOCKET)
+		goto err;
+
+	if (tcpx_setup_socket(sock) || fi_fd_nonblock(sock))
+		goto err;
+
+	fastlock_acquire(&ep->lock);
+	stripe = &ep->stripes[index];
+	stripe->fd = sock;
+	stripe->ack_len = sizeof(stripe->ack);
+	if (tcpx_stripe_wait_add(ep, stripe)) {
+		stripe->fd = INVALID_SOCKET;
+		fastlock_release(&ep->lock);
+		goto err;
+	}
+
+	if (++ep->stripe_joined < ep->stripe_cnt) {
+		fastlock_release(&ep->lock);
+		return;
+	}
+
+	hdr.type = ofi_ctrl_connresp;
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ofi_send_socket(ep->stripes[i].fd, &hdr, sizeof(hdr),
+				    MSG_NOSIGNAL) != sizeof(hdr)) {
+			tcpx_stripe_abort(ep);
+			break;
+		}
+	}
+	ep->stripes_ready = (ep->stripe_cnt != 0);
+	fastlock_release(&ep->lock);
+
+	tcpx_stripe_listen_close(ep, wait);
+	return;
+err:
+	FI_WARN(&tcpx_prov, FI_LOG_EP_CTRL, "invalid stripe join\n");
+	ofi_close_socket(sock);
+}
+
+/* Connecting side: join the stripes granted by the peer.  They are added
+ * to the wait sets along with conn_fd, but are only striped over once the
+ * peer's acks have been read from each of them.
+ */
+void tcpx_stripe_connect(struct tcpx_ep *ep, struct ofi_ctrl_hdr *conn_resp)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	struct ofi_ctrl_hdr hdr;
+	uint32_t cnt;
+	SOCKET sock;
+	int i;
+
+	cnt = ntohl(conn_resp->seg_no);
+	if (!cnt || cnt > (uint32_t) ep->stripe_cnt) {
+		ep->stripe_cnt = 0;
+		return;
+	}
+
+	ep->stripe_cnt = cnt;
+	ep->stripe_key = ntohll(conn_resp->conn_id);
+	if (getpeername(ep->conn_fd, (struct sockaddr *) &addr, &len))
+		goto err;
+
+	ofi_addr_set_port((struct sockaddr *) &addr,
+			  (uint16_t) ntohll(conn_resp->ctrl_data));
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = OFI_CTRL_VERSION;
+	hdr.type = ofi_ctrl_connreq;
+	hdr.conn_id = htonll(ep->stripe_key);
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		sock = ofi_socket(addr.ss_family, SOCK_STREAM, 0);
+		if (sock == INVALID_SOCKET)
+			goto err;
+
+		ep->stripes[i].fd = sock;
+		if (tcpx_setup_socket(sock) ||
+		    connect(sock, (struct sockaddr *) &addr, len))
+			goto err;
+
+		hdr.seg_no = htonl(i);
+		if (ofi_send_socket(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL) !=
+		    sizeof(hdr))
+			goto err;
+
+		if (fi_fd_nonblock(sock))
+			goto err;
+	}
+	return;
+err:
+	tcpx_stripe_abort(ep);
+}
+
+static void tcpx_stripe_share(struct tcpx_ep *ep,
+			      struct tcpx_xfer_entry *xfer_entry, int index,
+			      size_t *off, size_t *len)
+{
+	size_t size;
+
+	size = ntohll(xfer_entry->msg_hdr.hdr.size) -
+	       sizeof(xfer_entry->msg_hdr);
+	*off = size * index / ep->stripe_cnt;
+	*len = size * (index + 1) / ep->stripe_cnt - *off;
+}
+
+/* Narrow src down to the len bytes starting at off */
+static int tcpx_stripe_iov(struct iovec *iov, size_t *iov_cnt,
+			   const struct iovec *src, size_t src_cnt,
+			   size_t off, size_t len)
+{
+	memcpy(iov, src, src_cnt * sizeof(*iov));
+	*iov_cnt = src_cnt;
+	if (off)
+		ofi_consume_iov(iov, iov_cnt, off);
+	return ofi_truncate_iov(iov, iov_cnt, len);
+}
+
+static struct tcpx_xfer_entry *tcpx_stripe_find(struct slist *queue,
+						uint32_t seq)
+{
+	struct tcpx_xfer_entry *xfer_entry;
+	struct slist_entry *entry;
+
+	/* slist does not terminate the tail's next pointer */
+	for (entry = queue->head; entry;
+	     entry = (entry == queue->tail) ? NULL : entry->next) {
+		xfer_entry = container_of(entry, struct tcpx_xfer_entry, entry);
+		if (xfer_entry->stripe_seq == seq)
+			return xfer_entry;
+	}
+	return NULL;
+}
+
+void tcpx_stripe_tx_prep(struct tcpx_ep *ep, struct tcpx_xfer_entry *tx_entry)
+{
+	uint32_t flags;
+	size_t size;
+
+	/* atomic operands are staged in the target's atomic_buf */
+	if (tx_entry->msg_hdr.hdr.op_data == TCPX_OP_ATOMIC)
+		return;
+
+	size = ntohll(tx_entry->msg_hdr.hdr.size) - sizeof(tx_entry->msg_hdr);
+	flags = ntohl(tx_entry->msg_hdr.hdr.flags) & ~TCPX_STRIPED;
+	if (ep->stripes_ready && size && size >= ep->stripe_size)
+		flags |= TCPX_STRIPED;
+	tx_entry->msg_hdr.hdr.flags = htonl(flags);
+}
+
+static int tcpx_stripe_send(struct tcpx_ep *ep, int index)
+{
+	struct tcpx_stripe *stripe = &ep->stripes[index];
+	struct iovec iov[TCPX_IOV_LIMIT + 1];
+	struct tcpx_xfer_entry *tx_entry;
+	struct msghdr msg = {0};
+	size_t off, len, iov_cnt;
+	ssize_t ret;
+
+	stripe->tx_blocked = 0;
+	while ((tx_entry = tcpx_stripe_find(&ep->stripe_tx_queue,
+					    stripe->tx_seq))) {
+		tcpx_stripe_share(ep, tx_entry, index, &off, &len);
+		if (stripe->tx_done < len) {
+			ret = tcpx_stripe_iov(iov, &iov_cnt,
+					      &tx_entry->msg_data.iov[1],
+					      tx_entry->msg_data.iov_cnt - 1,
+					      off + stripe->tx_done,
+					      len - stripe->tx_done);
+			if (ret)
+				return (int) ret;
+
+			msg.msg_iov = iov;
+			msg.msg_iovlen = iov_cnt;
+			ret = ofi_sendmsg_tcp(stripe->fd, &msg, MSG_NOSIGNAL);
+			if (ret < 0) {
+				ret = -ofi_sockerr();
+				if (!OFI_SOCK_TRY_SND_RCV_AGAIN(-ret))
+					return (int) ret;
+
+				stripe->tx_blocked = 1;
+				return FI_SUCCESS;
+			}
+
+			stripe->tx_done += ret;
+			if (stripe->tx_done < len)
+				continue;
+		}
+
+		stripe->tx_seq++;
+		stripe->tx_done = 0;
+		if (++tx_entry->stripe_parts < ep->stripe_cnt)
+			continue;
+
+		/* every stripe sends its shares in order, so the last share
+		 * of a transfer completes after those of earlier ones */
+		assert(tx_entry == container_of(ep->stripe_tx_queue.head,
+						struct tcpx_xfer_entry, entry));
+		slist_remove_head(&ep->stripe_tx_queue);
+		tcpx_tx_entry_done(tx_entry, FI_SUCCESS);
+	}
+	return FI_SUCCESS;
+}
+
+static int tcpx_stripe_recv_ack(struct tcpx_ep *ep, struct tcpx_stripe *stripe)
+{
+	ssize_t ret;
+
+	ret = ofi_recv_socket(stripe->fd, (uint8_t *) &stripe->ack +
+			      stripe->ack_len,
+			      sizeof(stripe->ack) - stripe->ack_len, 0);
+	if (ret <= 0)
+		return ret ? -ofi_sockerr() : -FI_ENOTCONN;
+
+	stripe->ack_len += ret;
+	if (stripe->ack_len < sizeof(stripe->ack))
+		return -FI_EAGAIN;
+
+	if (stripe->ack.type != ofi_ctrl_connresp ||
+	    ntohll(stripe->ack.conn_id) != ep->stripe_key)
+		return -FI_EIO;
+
+	if (++ep->stripe_joined == ep->stripe_cnt)
+		ep->stripes_ready = 1;
+	return FI_SUCCESS;
+}
+
+static int tcpx_stripe_recv(struct tcpx_ep *ep, int index)
+{
+	struct tcpx_stripe *stripe = &ep->stripes[index];
+	struct iovec iov[TCPX_IOV_LIMIT + 1];
+	struct tcpx_xfer_entry *rx_entry;
+	size_t off, len, iov_cnt, fit;
+	char trash[1024];
+	ssize_t ret;
+
+	stripe->rx_blocked = 0;
+	if (stripe->ack_len < sizeof(stripe->ack)) {
+		ret = tcpx_stripe_recv_ack(ep, stripe);
+		if (ret)
+			goto err;
+	}
+
+	while ((rx_entry = tcpx_stripe_find(&ep->stripe_rx_queue,
+					    stripe->rx_seq))) {
+		tcpx_stripe_share(ep, rx_entry, index, &off, &len);
+		if (stripe->rx_done < len) {
+			/* payload bytes that fit the posted buffer */
+			fit = ntohll(rx_entry->msg_hdr.hdr.size) -
+			      sizeof(rx_entry->msg_hdr) - rx_entry->discard_len;
+			off += stripe->rx_done;
+			if (off < fit) {
+				ret = tcpx_stripe_iov(iov, &iov_cnt,
+						rx_entry->msg_data.iov,
+						rx_entry->msg_data.iov_cnt, off,
+						MIN(len - stripe->rx_done,
+						    fit - off));
+				if (ret)
+					return (int) ret;
+
+				ret = ofi_readv_socket(stripe->fd, iov,
+						       (int) iov_cnt);
+			} else {
+				ret = ofi_recv_socket(stripe->fd, trash,
+						MIN(len - stripe->rx_done,
+						    sizeof(trash)), 0);
+			}
+			if (ret <= 0) {
+				ret = ret ? -ofi_sockerr() : -FI_ENOTCONN;
+				goto err;
+			}
+
+			stripe->rx_done += ret;
+			if (stripe->rx_done < len)
+				continue;
+		}
+
+		stripe->rx_seq++;
+		stripe->rx_done = 0;
+		if (++rx_entry->stripe_parts < ep->stripe_cnt)
+			continue;
+
+		assert(rx_entry == container_of(ep->stripe_rx_queue.head,
+						struct tcpx_xfer_entry, entry));
+		slist_remove_head(&ep->stripe_rx_queue);
+		tcpx_rx_entry_done(rx_entry, rx_entry->discard_len ?
+				   -FI_ETRUNC : FI_SUCCESS);
+	}
+	return FI_SUCCESS;
+err:
+	if (OFI_SOCK_TRY_SND_RCV_AGAIN(-ret)) {
+		stripe->rx_blocked = 1;
+		return FI_SUCCESS;
+	}
+
+	/* the peer gave up on striping before it started */
+	if (!ep->stripes_ready) {
+		tcpx_stripe_abort(ep);
+		return FI_SUCCESS;
+	}
+	return (int) ret;
+}
+
+void tcpx_stripe_tx_start(struct tcpx_ep *ep, struct tcpx_xfer_entry *tx_entry)
+{
+	int i, ret;
+
+	tx_entry->stripe_seq = ep->stripe_tx_seq++;
+	tx_entry->stripe_parts = 0;
+	slist_insert_tail(&tx_entry->entry, &ep->stripe_tx_queue);
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ep->stripes[i].tx_blocked)
+			continue;
+
+		ret = tcpx_stripe_send(ep, i);
+		if (ret) {
+			FI_WARN(&tcpx_prov, FI_LOG_EP_DATA,
+				"stripe send failed ret = %d\n", ret);
+			tcpx_ep_shutdown_report(ep, &ep->util_ep.ep_fid.fid);
+			return;
+		}
+	}
+}
+
+int tcpx_stripe_rx_start(struct tcpx_ep *ep, struct tcpx_xfer_entry *rx_entry)
+{
+	if (!ep->stripe_cnt)
+		return -FI_EIO;
+
+	rx_entry->stripe_seq = ep->stripe_rx_seq++;
+	rx_entry->stripe_parts = 0;
+	slist_insert_tail(&rx_entry->entry, &ep->stripe_rx_queue);
+	if (ep->cur_rx_entry == rx_entry)
+		ep->cur_rx_entry = NULL;
+	return FI_SUCCESS;
+}
+
+void tcpx_stripe_progress(struct tcpx_ep *ep)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < ep->stripe_cnt && !ret; i++)
+		ret = tcpx_stripe_recv(ep, i);
+
+	for (i = 0; i < ep->stripe_cnt && !ret; i++)
+		ret = tcpx_stripe_send(ep, i);
+
+	if (ret) {
+		FI_WARN(&tcpx_prov, FI_LOG_EP_DATA,
+			"stripe transfer failed ret = %d\n", ret);
+		tcpx_ep_shutdown_report(ep, &ep->util_ep.ep_fid.fid);
+	}
+}
+
+/* A stripe whose next share belongs to a transfer whose header has not
+ * been read yet is picked up again by the conn_fd progress.
+ */
+int tcpx_stripe_has_work(struct tcpx_ep *ep)
+{
+	struct tcpx_stripe *stripe;
+	int i;
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		stripe = &ep->stripes[i];
+		if (stripe->fd == INVALID_SOCKET)
+			continue;
+
+		if (!stripe->rx_blocked &&
+		    (stripe->ack_len < sizeof(stripe->ack) ||
+		     tcpx_stripe_find(&ep->stripe_rx_queue, stripe->rx_seq)))
+			return 1;
+
+		if (!stripe->tx_blocked &&
+		    tcpx_stripe_find(&ep->stripe_tx_queue, stripe->tx_seq))
+			return 1;
+	}
+	return 0;
+}
+
+void tcpx_stripe_shutdown(struct tcpx_ep *ep)
+{
+	int i;
+
+	for (i = 0; i < ep->stripe_cnt; i++) {
+		if (ep->stripes[i].fd != INVALID_SOCKET)
+			ofi_shutdown(ep->stripes[i].fd, SHUT_RDWR);
+	}
+}
+
+void tcpx_stripe_close(struct tcpx_ep *ep)
+{
+	struct tcpx_fabric *fabric;
+	int i;
+
+	if (ep->util_ep.eq) {
+		fabric = tcpx_eq_fabric(ep->util_ep.eq);
+		pthread_mutex_lock(&fabric->cm_lock);
+		tcpx_stripe_listen_close(ep, tcpx_cm_wait(ep->util_ep.eq));
+		pthread_mutex_unlock(&fabric->cm_lock);
+	}
+
+	for (i = 0; i < TCPX_MAX_STRIPES; i++) {
+		if (ep->stripes[i].fd != INVALID_SOCKET)
+			ofi_close_socket(ep->stripes[i].fd);
+	}
+}
+
+/* Called with the endpoint lock held */
+void tcpx_stripe_queues_release(struct tcpx_ep *ep)
+{
+	struct tcpx_xfer_entry *xfer_entry;
+	struct tcpx_cq *tcpx_cq;
+
+	while (!slist_empty(&ep->stripe_tx_queue)) {
+		xfer_entry = container_of(slist_remove_head(&ep->stripe_tx_queue),
+					  struct tcpx_xfer_entry, entry);
+		tcpx_cq = container_of(ep->util_ep.tx_cq, struct tcpx_cq,
+				       util_cq);
+		tcpx_xfer_entry_release(tcpx_cq, xfer_entry);
+	}
+
+	while (!slist_empty(&ep->stripe_rx_queue)) {
+		xfer_entry = container_of(slist_remove_head(&ep->stripe_rx_queue),
+					  struct tcpx_xfer_entry, entry);
+		tcpx_rx_entry_free(xfer_entry);
+	}
+}
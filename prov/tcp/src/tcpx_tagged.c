@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *	   Redistribution and use in source and binary forms, with or
+ *	   without modification, are permitted provided that the following
+ *	   conditions are met:
+ *
+ *		- Redistributions of source code must retain the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer.
+ *
+ *		- Redistributions in binary form must reproduce the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer in the documentation and/or other materials
+ *		  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <rdma/fi_errno.h>
+#include "ofi_iov.h"
+#include <ofi_prov.h>
+#include "tcpx.h"
+
+#include <sys/types.h>
+#include <ofi_util.h>
+#include <string.h>
+
+void tcpx_unexp_msg_deliver(struct tcpx_unexp_msg *unexp,
+			    struct tcpx_xfer_entry *rx_entry)
+{
+	struct tcpx_cq *tcpx_cq;
+	size_t len;
+	int ret = FI_SUCCESS;
+
+	len = ofi_copy_to_iov(rx_entry->msg_data.iov,
+			      rx_entry->msg_data.iov_cnt, 0,
+			      unexp->buf, unexp->len);
+	if (len < unexp->len) {
+		FI_WARN(&tcpx_prov, FI_LOG_DOMAIN,
+			"posted rx buffer size is not big enough\n");
+		rx_entry->discard_len = unexp->len - len;
+		ret = -FI_ETRUNC;
+	}
+
+	rx_entry->msg_hdr.hdr.size = htonll(unexp->len +
+					    sizeof(rx_entry->msg_hdr));
+	rx_entry->msg_hdr.hdr.tag = htonll(unexp->match.tag);
+	rx_entry->msg_hdr.hdr.data = htonll(unexp->data);
+	if (unexp->flags & OFI_REMOTE_CQ_DATA)
+		rx_entry->flags |= FI_REMOTE_CQ_DATA;
+
+	tcpx_cq_report_completion(rx_entry->ep->util_ep.rx_cq, rx_entry, ret);
+	tcpx_cq = container_of(rx_entry->ep->util_ep.rx_cq,
+			       struct tcpx_cq, util_cq);
+	tcpx_xfer_entry_release(tcpx_cq, rx_entry);
+	free(unexp);
+}
+
+static int tcpx_get_unexp_rx_entry(struct tcpx_ep *ep,
+				   struct tcpx_xfer_entry **new_rx_entry)
+{
+	struct tcpx_xfer_entry *rx_entry;
+	struct tcpx_unexp_msg *unexp;
+	struct tcpx_cq *tcpx_cq;
+	size_t len;
+
+	tcpx_cq = container_of(ep->util_ep.rx_cq, struct tcpx_cq, util_cq);
+	rx_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_TAGGED_UNEXP);
+	if (!rx_entry)
+		return -FI_EAGAIN;
+
+	len = ntohll(ep->rx_detect.hdr.hdr.size) - sizeof(ep->rx_detect.hdr);
+	unexp = malloc(sizeof(*unexp) + len);
+	if (!unexp) {
+		rx_entry->ep = ep;
+		tcpx_xfer_entry_release(tcpx_cq, rx_entry);
+		return -FI_ENOMEM;
+	}
+
+	unexp->match.addr = FI_ADDR_UNSPEC;
+	unexp->match.tag = ntohll(ep->rx_detect.hdr.hdr.tag);
+	unexp->match.ignore = 0;
+	unexp->claim = NULL;
+	unexp->data = ntohll(ep->rx_detect.hdr.hdr.data);
+	unexp->flags = ntohl(ep->rx_detect.hdr.hdr.flags);
+	unexp->done = 0;
+	unexp->len = len;
+	ofi_mq_insert(&ep->unexp_queue, &unexp->match);
+
+	rx_entry->msg_hdr = ep->rx_detect.hdr;
+	rx_entry->msg_hdr.hdr.op_data = TCPX_OP_TAGGED_UNEXP;
+	rx_entry->ep = ep;
+	rx_entry->flags = TCPX_NO_COMPLETION;
+	rx_entry->context = unexp;
+	rx_entry->done_len = sizeof(ep->rx_detect.hdr);
+	rx_entry->msg_data.iov[0].iov_base = unexp->buf;
+	rx_entry->msg_data.iov[0].iov_len = len;
+	rx_entry->msg_data.iov_cnt = 1;
+
+	*new_rx_entry = rx_entry;
+	return FI_SUCCESS;
+}
+
+/* Called with the header of an incoming tagged message.  The payload is
+ * received straight into a matching posted receive, if there is one, or
+ * else buffered as an unexpected message.
+ */
+int tcpx_get_tagged_rx_entry(struct tcpx_ep *ep,
+			     struct tcpx_xfer_entry **new_rx_entry)
+{
+	struct tcpx_xfer_entry *rx_entry;
+	struct ofi_mq_entry *match;
+
+	match = ofi_mq_find_recv(&ep->trecv_queue, FI_ADDR_UNSPEC,
+				 ntohll(ep->rx_detect.hdr.hdr.tag));
+	if (!match)
+		return tcpx_get_unexp_rx_entry(ep, new_rx_entry);
+
+	ofi_mq_remove(match);
+	rx_entry = container_of(match, struct tcpx_xfer_entry, match);
+
+	rx_entry->msg_hdr = ep->rx_detect.hdr;
+	rx_entry->msg_hdr.hdr.op_data = TCPX_OP_TAGGED_RECV;
+	rx_entry->done_len = sizeof(ep->rx_detect.hdr);
+
+	if (ntohl(ep->rx_detect.hdr.hdr.flags) & OFI_REMOTE_CQ_DATA)
+		rx_entry->flags |= FI_REMOTE_CQ_DATA;
+
+	tcpx_rx_fit_iov(rx_entry);
+
+	*new_rx_entry = rx_entry;
+	return FI_SUCCESS;
+}
+
+void tcpx_tagged_queues_release(struct tcpx_ep *ep)
+{
+	struct tcpx_xfer_entry *xfer_entry;
+	struct ofi_mq_entry *match;
+	struct tcpx_cq *tcpx_cq;
+
+	tcpx_cq = container_of(ep->util_ep.rx_cq, struct tcpx_cq, util_cq);
+
+	while ((match = ofi_mq_first(&ep->trecv_queue))) {
+		ofi_mq_remove(match);
+		xfer_entry = container_of(match, struct tcpx_xfer_entry, match);
+		tcpx_xfer_entry_release(tcpx_cq, xfer_entry);
+	}
+
+	while ((match = ofi_mq_first(&ep->unexp_queue))) {
+		ofi_mq_remove(match);
+		free(container_of(match, struct tcpx_unexp_msg, match));
+	}
+}
+
+static ssize_t tcpx_tsendmsg(struct fid_ep *ep, const struct fi_msg_tagged *msg,
+			     uint64_t flags)
+{
+	struct tcpx_ep *tcpx_ep;
+	struct tcpx_cq *tcpx_cq;
+	struct tcpx_xfer_entry *tx_entry;
+	uint64_t data_len;
+
+	tcpx_ep = container_of(ep, struct tcpx_ep, util_ep.ep_fid);
+	tcpx_cq = container_of(tcpx_ep->util_ep.tx_cq, struct tcpx_cq,
+			       util_cq);
+
+	tx_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_TAGGED_SEND);
+	if (!tx_entry)
+		return -FI_EAGAIN;
+
+	assert(msg->iov_count <= TCPX_IOV_LIMIT);
+	data_len = ofi_total_iov_len(msg->msg_iov, msg->iov_count);
+	assert(!(flags & FI_INJECT) || (data_len <= TCPX_MAX_INJECT_SZ));
+	tx_entry->msg_hdr.hdr.size = htonll(data_len + sizeof(tx_entry->msg_hdr));
+	tx_entry->msg_hdr.hdr.tag = htonll(msg->tag);
+
+	tx_entry->msg_data.iov[0].iov_base = (void *) &tx_entry->msg_hdr;
+	tx_entry->msg_data.iov[0].iov_len = sizeof(tx_entry->msg_hdr);
+	tx_entry->msg_data.iov_cnt = msg->iov_count + 1;
+
+	if (flags & FI_INJECT) {
+		ofi_copy_iov_buf(msg->msg_iov, msg->iov_count, 0,
+				 tx_entry->msg_data.inject,
+				 data_len,
+				 OFI_COPY_IOV_TO_BUF);
+
+		tx_entry->msg_data.iov[1].iov_base = (void *)tx_entry->msg_data.inject;
+		tx_entry->msg_data.iov[1].iov_len = data_len;
+		tx_entry->msg_data.iov_cnt = 2;
+	} else {
+		memcpy(&tx_entry->msg_data.iov[1], &msg->msg_iov[0],
+		       msg->iov_count * sizeof(struct iovec));
+	}
+
+	if (flags & FI_REMOTE_CQ_DATA) {
+		tx_entry->msg_hdr.hdr.flags = htonl(OFI_REMOTE_CQ_DATA);
+		tx_entry->msg_hdr.hdr.data = htonll(msg->data);
+	} else {
+		tx_entry->msg_hdr.hdr.flags = 0;
+	}
+
+	tx_entry->ep = tcpx_ep;
+	tx_entry->context = msg->context;
+	tx_entry->done_len = 0;
+	tx_entry->flags = flags | FI_TAGGED | FI_SEND;
+
+	fastlock_acquire(&tcpx_ep->lock);
+	if (slist_empty(&tcpx_ep->tx_queue)) {
+		slist_insert_tail(&tx_entry->entry, &tcpx_ep->tx_queue);
+		tcpx_process_tx_queue(tcpx_ep);
+	} else {
+		slist_insert_tail(&tx_entry->entry, &tcpx_ep->tx_queue);
+	}
+	fastlock_release(&tcpx_ep->lock);
+	return FI_SUCCESS;
+}
+
+static ssize_t tcpx_tsend(struct fid_ep *ep, const void *buf, size_t len,
+			  void *desc, fi_addr_t dest_addr, uint64_t tag,
+			  void *context)
+{
+	struct iovec msg_iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+	struct fi_msg_tagged msg = {
+		.msg_iov = &msg_iov,
+		.desc = &desc,
+		.iov_count = 1,
+		.addr = dest_addr,
+		.tag = tag,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_tsendmsg(ep, &msg, 0);
+}
+
+static ssize_t tcpx_tsendv(struct fid_ep *ep, const struct iovec *iov,
+			   void **desc, size_t count, fi_addr_t dest_addr,
+			   uint64_t tag, void *context)
+{
+	struct fi_msg_tagged msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = dest_addr,
+		.tag = tag,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_tsendmsg(ep, &msg, 0);
+}
+
+static ssize_t tcpx_tinject(struct fid_ep *ep, const void *buf, size_t len,
+			    fi_addr_t dest_addr, uint64_t tag)
+{
+	struct iovec msg_iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+	struct fi_msg_tagged msg = {
+		.msg_iov = &msg_iov,
+		.desc = NULL,
+		.iov_count = 1,
+		.addr = dest_addr,
+		.tag = tag,
+		.context = NULL,
+		.data = 0,
+	};
+
+	return tcpx_tsendmsg(ep, &msg, FI_INJECT | TCPX_NO_COMPLETION);
+}
+
+static ssize_t tcpx_tsenddata(struct fid_ep *ep, const void *buf, size_t len,
+			      void *desc, uint64_t data, fi_addr_t dest_addr,
+			      uint64_t tag, void *context)
+{
+	struct iovec msg_iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+	struct fi_msg_tagged msg = {
+		.msg_iov = &msg_iov,
+		.desc = &desc,
+		.iov_count = 1,
+		.addr = dest_addr,
+		.tag = tag,
+		.context = context,
+		.data = data,
+	};
+
+	return tcpx_tsendmsg(ep, &msg, FI_REMOTE_CQ_DATA);
+}
+
+static ssize_t tcpx_tinjectdata(struct fid_ep *ep, const void *buf, size_t len,
+				uint64_t data, fi_addr_t dest_addr, uint64_t tag)
+{
+	struct iovec msg_iov = {
+		.iov_base = (void *)buf,
+		.iov_len = len,
+	};
+	struct fi_msg_tagged msg = {
+		.msg_iov = &msg_iov,
+		.desc = NULL,
+		.iov_count = 1,
+		.addr = dest_addr,
+		.tag = tag,
+		.context = NULL,
+		.data = data,
+	};
+
+	return tcpx_tsendmsg(ep, &msg, FI_REMOTE_CQ_DATA | FI_INJECT |
+			     TCPX_NO_COMPLETION);
+}
+
+static ssize_t tcpx_trecvmsg(struct fid_ep *ep, const struct fi_msg_tagged *msg,
+			     uint64_t flags)
+{
+	struct tcpx_xfer_entry *recv_entry;
+	struct tcpx_unexp_msg *unexp;
+	struct ofi_mq_entry *match;
+	struct tcpx_ep *tcpx_ep;
+	struct tcpx_cq *tcpx_cq;
+
+	tcpx_ep = container_of(ep, struct tcpx_ep, util_ep.ep_fid);
+	tcpx_cq = container_of(tcpx_ep->util_ep.rx_cq, struct tcpx_cq,
+			       util_cq);
+
+	assert(msg->iov_count <= TCPX_IOV_LIMIT);
+
+	recv_entry = tcpx_xfer_entry_alloc(tcpx_cq, TCPX_OP_TAGGED_RECV);
+	if (!recv_entry)
+		return -FI_EAGAIN;
+
+	recv_entry->msg_data.iov_cnt = msg->iov_count;
+	memcpy(&recv_entry->msg_data.iov[0], &msg->msg_iov[0],
+	       msg->iov_count * sizeof(struct iovec));
+
+	recv_entry->ep = tcpx_ep;
+	recv_entry->done_len = 0;
+	recv_entry->flags = flags | FI_TAGGED | FI_RECV;
+	recv_entry->context = msg->context;
+	recv_entry->match.addr = FI_ADDR_UNSPEC;
+	recv_entry->match.tag = msg->tag;
+	recv_entry->match.ignore = msg->ignore;
+
+	fastlock_acquire(&tcpx_ep->lock);
+	match = ofi_mq_find_msg(&tcpx_ep->unexp_queue, FI_ADDR_UNSPEC,
+				msg->tag, msg->ignore);
+	if (!match) {
+		ofi_mq_insert(&tcpx_ep->trecv_queue, &recv_entry->match);
+	} else {
+		ofi_mq_remove(match);
+		unexp = container_of(match, struct tcpx_unexp_msg, match);
+		if (unexp->done)
+			tcpx_unexp_msg_deliver(unexp, recv_entry);
+		else
+			unexp->claim = recv_entry;
+	}
+	fastlock_release(&tcpx_ep->lock);
+	return FI_SUCCESS;
+}
+
+static ssize_t tcpx_trecv(struct fid_ep *ep, void *buf, size_t len, void *desc,
+			  fi_addr_t src_addr, uint64_t tag, uint64_t ignore,
+			  void *context)
+{
+	struct iovec msg_iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	struct fi_msg_tagged msg = {
+		.msg_iov = &msg_iov,
+		.desc = &desc,
+		.iov_count = 1,
+		.addr = src_addr,
+		.tag = tag,
+		.ignore = ignore,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_trecvmsg(ep, &msg, 0);
+}
+
+static ssize_t tcpx_trecvv(struct fid_ep *ep, const struct iovec *iov,
+			   void **desc, size_t count, fi_addr_t src_addr,
+			   uint64_t tag, uint64_t ignore, void *context)
+{
+	struct fi_msg_tagged msg = {
+		.msg_iov = iov,
+		.desc = desc,
+		.iov_count = count,
+		.addr = src_addr,
+		.tag = tag,
+		.ignore = ignore,
+		.context = context,
+		.data = 0,
+	};
+
+	return tcpx_trecvmsg(ep, &msg, 0);
+}
+
+struct fi_ops_tagged tcpx_tagged_ops = {
+	.size = sizeof(struct fi_ops_tagged),
+	.recv = tcpx_trecv,
+	.recvv = tcpx_trecvv,
+	.recvmsg = tcpx_trecvmsg,
+	.send = tcpx_tsend,
+	.sendv = tcpx_tsendv,
+	.sendmsg = tcpx_tsendmsg,
+	.inject = tcpx_tinject,
+	.senddata = tcpx_tsenddata,
+	.injectdata = tcpx_tinjectdata,
+};
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *	   Redistribution and use in source and binary forms, with or
+ *	   without modification, are permitted provided that the following
+ *	   conditions are met:
+ *
+ *		- Redistributions of source code must retain the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer.
+ *
+ *		- Redistributions in binary form must reproduce the above
+ *		  copyright notice, this list of conditions and the following
+ *		  disclaimer in the documentation and/or other materials
+ *		  provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * io_uring backend for endpoint socket I/O.
+ *
+ * Each connected endpoint may own a small ring.  At most one receive and
+ * one send are in flight at a time, mirroring the single rx/tx position
+ * of the socket state machine: the first call for an operation submits
+ * it and returns -FI_EAGAIN, and repeating the call with the same
+ * arguments returns its result once the completion has been reaped.
+ * Reaping only reads the shared completion ring, so polling an idle
+ * endpoint costs no system calls.  The ring fd replaces the socket in the
+ * CQ wait set; it becomes readable when completions are available.
+ */
+
+#include <rdma/fi_errno.h>
+#include <ofi_prov.h>
+#include <sys/types.h>
+#include <ofi_util.h>
+#include "tcpx.h"
+
+#if TCPX_HAVE_IO_URING
+
+#include <sys/mman.h>
+
+#define TCPX_URING_ENTRIES	4
+
+enum {
+	TCPX_URING_IDLE,
+	TCPX_URING_PENDING,
+	TCPX_URING_DONE,
+};
+
+struct tcpx_uring_op {
+	int			state;
+	int			res;
+};
+
+struct tcpx_uring {
+	int			fd;
+	void			*sq_ring;
+	void			*cq_ring;
+	size_t			sq_ring_sz;
+	size_t			cq_ring_sz;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	/* the endpoint staging buffer is registered as fixed buffer 0 */
+	int			fixed_buf;
+
+	struct tcpx_uring_op	rx_op;
+	struct iovec		rx_iov[TCPX_IOV_LIMIT + 1];
+	struct tcpx_uring_op	tx_op;
+	struct msghdr		tx_msg;
+	struct iovec		tx_iov[TCPX_TX_BATCH_IOV];
+};
+
+static int tcpx_uring_enter(struct tcpx_uring *uring, unsigned to_submit,
+			    unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = (int) syscall(__NR_io_uring_enter, uring->fd, to_submit,
+				    min_complete, min_complete ?
+				    IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return (ret < 0) ? -errno : ret;
+}
+
+static void tcpx_uring_reap(struct tcpx_uring *uring)
+{
+	struct tcpx_uring_op *op;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+
+	head = *uring->cq_head;
+	tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &uring->cqes[head & *uring->cq_mask];
+		op = (struct tcpx_uring_op *) (uintptr_t) cqe->user_data;
+		op->res = cqe->res;
+		op->state = TCPX_URING_DONE;
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *tcpx_uring_get_sqe(struct tcpx_uring *uring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *uring->sq_tail;
+	idx = tail & *uring->sq_mask;
+	sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[idx] = idx;
+	return sqe;
+}
+
+static ssize_t tcpx_uring_submit(struct tcpx_uring *uring,
+				 struct io_uring_sqe *sqe,
+				 struct tcpx_uring_op *op)
+{
+	int ret;
+
+	sqe->user_data = (uintptr_t) op;
+	__atomic_store_n(uring->sq_tail, *uring->sq_tail + 1,
+			 __ATOMIC_RELEASE);
+
+	ret = tcpx_uring_enter(uring, 1, 0);
+	if (ret < 0)
+		return ret;
+
+	op->state = TCPX_URING_PENDING;
+	return -FI_EAGAIN;
+}
+
+/* Returns the result of a completed operation, or -FI_EAGAIN while it is
+ * still in flight.  A completion result of 0 is passed through; callers
+ * treat it as the peer closing the connection, as with recv(). */
+static ssize_t tcpx_uring_result(struct tcpx_uring *uring,
+				 struct tcpx_uring_op *op)
+{
+	if (op->state == TCPX_URING_PENDING)
+		tcpx_uring_reap(uring);
+
+	if (op->state != TCPX_URING_DONE)
+		return -FI_EAGAIN;
+
+	op->state = TCPX_URING_IDLE;
+	return op->res;
+}
+
+ssize_t tcpx_uring_recv(struct tcpx_ep *ep, void *buf, size_t len)
+{
+	struct tcpx_uring *uring = ep->uring;
+	struct io_uring_sqe *sqe;
+
+	if (uring->rx_op.state != TCPX_URING_IDLE)
+		return tcpx_uring_result(uring, &uring->rx_op);
+
+	sqe = tcpx_uring_get_sqe(uring);
+	sqe->fd = ep->conn_fd;
+	if (uring->fixed_buf && buf == ep->stage_buf.buf &&
+	    len <= sizeof(ep->stage_buf.buf)) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t) buf;
+		sqe->len = len;
+		sqe->buf_index = 0;
+	} else {
+		uring->rx_iov[0].iov_base = buf;
+		uring->rx_iov[0].iov_len = len;
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr = (uintptr_t) uring->rx_iov;
+		sqe->len = 1;
+	}
+	return tcpx_uring_submit(uring, sqe, &uring->rx_op);
+}
+
+ssize_t tcpx_uring_readv(struct tcpx_ep *ep, struct iovec *iov, size_t cnt)
+{
+	struct tcpx_uring *uring = ep->uring;
+	struct io_uring_sqe *sqe;
+
+	if (uring->rx_op.state != TCPX_URING_IDLE)
+		return tcpx_uring_result(uring, &uring->rx_op);
+
+	assert(cnt <= TCPX_IOV_LIMIT + 1);
+	memcpy(uring->rx_iov, iov, cnt * sizeof(*iov));
+
+	sqe = tcpx_uring_get_sqe(uring);
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = ep->conn_fd;
+	sqe->addr = (uintptr_t) uring->rx_iov;
+	sqe->len = cnt;
+	return tcpx_uring_submit(uring, sqe, &uring->rx_op);
+}
+
+int tcpx_uring_tx_busy(struct tcpx_ep *ep)
+{
+	return ep->uring->tx_op.state != TCPX_URING_IDLE;
+}
+
+/* msg is only read when no send is in flight */
+ssize_t tcpx_uring_sendmsg(struct tcpx_ep *ep, const struct msghdr *msg)
+{
+	struct tcpx_uring *uring = ep->uring;
+	struct io_uring_sqe *sqe;
+
+	if (uring->tx_op.state != TCPX_URING_IDLE)
+		return tcpx_uring_result(uring, &uring->tx_op);
+
+	assert(msg->msg_iovlen <= TCPX_TX_BATCH_IOV);
+	memcpy(uring->tx_iov, msg->msg_iov,
+	       msg->msg_iovlen * sizeof(*msg->msg_iov));
+	memset(&uring->tx_msg, 0, sizeof(uring->tx_msg));
+	uring->tx_msg.msg_iov = uring->tx_iov;
+	uring->tx_msg.msg_iovlen = msg->msg_iovlen;
+
+	sqe = tcpx_uring_get_sqe(uring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = ep->conn_fd;
+	sqe->addr = (uintptr_t) &uring->tx_msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	return tcpx_uring_submit(uring, sqe, &uring->tx_op);
+}
+
+int tcpx_uring_fd(struct tcpx_ep *ep)
+{
+	return ep->uring->fd;
+}
+
+static void tcpx_uring_unmap(struct tcpx_uring *uring)
+{
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_sz);
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_sz);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_sz);
+}
+
+static int tcpx_uring_map(struct tcpx_uring *uring, struct io_uring_params *p)
+{
+	uring->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_ring_sz = p->cq_off.cqes +
+			    p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		uring->sq_ring_sz = MAX(uring->sq_ring_sz, uring->cq_ring_sz);
+		uring->cq_ring_sz = uring->sq_ring_sz;
+	}
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, uring->fd,
+			      IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_sz,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, uring->fd,
+				      IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			return -errno;
+		}
+	}
+
+	uring->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, uring->fd,
+			   IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -errno;
+	}
+
+	uring->sq_tail = (unsigned *) ((char *) uring->sq_ring + p->sq_off.tail);
+	uring->sq_mask = (unsigned *) ((char *) uring->sq_ring +
+				       p->sq_off.ring_mask);
+	uring->sq_array = (unsigned *) ((char *) uring->sq_ring +
+					p->sq_off.array);
+	uring->cq_head = (unsigned *) ((char *) uring->cq_ring + p->cq_off.head);
+	uring->cq_tail = (unsigned *) ((char *) uring->cq_ring + p->cq_off.tail);
+	uring->cq_mask = (unsigned *) ((char *) uring->cq_ring +
+				       p->cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *) ((char *) uring->cq_ring +
+					       p->cq_off.cqes);
+	return FI_SUCCESS;
+}
+
+int tcpx_uring_init(struct tcpx_ep *ep)
+{
+	struct io_uring_params params;
+	struct tcpx_uring *uring;
+	struct iovec iov;
+	int ret;
+
+	uring = calloc(1, sizeof(*uring));
+	if (!uring)
+		return -FI_ENOMEM;
+
+	memset(&params, 0, sizeof(params));
+	uring->fd = (int) syscall(__NR_io_uring_setup, TCPX_URING_ENTRIES,
+				  &params);
+	if (uring->fd < 0) {
+		ret = -errno;
+		goto err1;
+	}
+
+	ret = tcpx_uring_map(uring, &params);
+	if (ret)
+		goto err2;
+
+	iov.iov_base = ep->stage_buf.buf;
+	iov.iov_len = sizeof(ep->stage_buf.buf);
+	uring->fixed_buf = !syscall(__NR_io_uring_register, uring->fd,
+				    IORING_REGISTER_BUFFERS, &iov, 1);
+	if (!uring->fixed_buf)
+		FI_DBG(&tcpx_prov, FI_LOG_EP_CTRL,
+		       "unable to register staging buffer with io_uring\n");
+
+	ep->uring = uring;
+	return FI_SUCCESS;
+err2:
+	tcpx_uring_unmap(uring);
+	close(uring->fd);
+err1:
+	free(uring);
+	return ret;
+}
+
+void tcpx_uring_cleanup(struct tcpx_ep *ep)
+{
+	struct tcpx_uring *uring = ep->uring;
+	unsigned pending;
+
+	if (!uring)
+		return;
+
+	/* Force in-flight operations to complete before the buffers they
+	 * reference go away. */
+	pending = (uring->rx_op.state == TCPX_URING_PENDING) +
+		  (uring->tx_op.state == TCPX_URING_PENDING);
+	if (pending) {
+		shutdown(ep->conn_fd, SHUT_RDWR);
+		while (uring->rx_op.state == TCPX_URING_PENDING ||
+		       uring->tx_op.state == TCPX_URING_PENDING) {
+			if (tcpx_uring_enter(uring, 0, 1) < 0)
+				break;
+			tcpx_uring_reap(uring);
+		}
+	}
+
+	tcpx_uring_unmap(uring);
+	close(uring->fd);
+	free(uring);
+	ep->uring = NULL;
+}
+
+#endif /* TCPX_HAVE_IO_URING */
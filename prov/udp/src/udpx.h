@@ -71,6 +71,7 @@
 extern struct fi_provider udpx_prov;
 extern struct util_prov udpx_util_prov;
 extern struct fi_info udpx_info;
+extern int udpx_busy_poll;
 
 
 int udpx_fabric(struct fi_fabric_attr *attr, struct fid_fabric **fabric,
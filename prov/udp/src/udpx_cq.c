@@ -73,6 +73,9 @@ int udpx_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr,
 		return ret;
 	}
 
+	if (udpx_busy_poll > 0)
+		ofi_cq_busy_poll_init(cq, udpx_busy_poll);
+
 	*cq_fid = &cq->cq_fid;
 	(*cq_fid)->fid.ops = &udpx_cq_fi_ops;
 	return 0;
@@ -742,6 +742,11 @@ static int udpx_ep_init(struct udpx_ep *ep, struct fi_info *info)
 	if (ret)
 		goto err2;
 
+	if (udpx_busy_poll > 0 && ofi_busy_poll_socket(ep->sock, udpx_busy_poll))
+		FI_INFO(&udpx_prov, FI_LOG_EP_CTRL,
+			"socket busy polling unavailable, spinning on CQ "
+			"reads only\n");
+
 	return 0;
 err2:
 	ofi_close_socket(ep->sock);
@@ -39,6 +39,7 @@
 #include <ifaddrs.h>
 #include <net/if.h>
 
+int udpx_busy_poll;
 
 #if HAVE_GETIFADDRS
 static void udpx_getinfo_ifs(struct fi_info **info)
@@ -145,5 +146,13 @@ struct fi_provider udpx_prov = {
 
 UDP_INI
 {
+	fi_param_define(&udpx_prov, "busy_poll", FI_PARAM_INT,
+			"Maximum time in microseconds a blocking CQ read "
+			"spins before waiting for events; the actual budget "
+			"adapts to the completion arrival rate. Also sets "
+			"SO_BUSY_POLL on endpoint sockets (default: 0, "
+			"disabled).");
+
+	fi_param_get_int(&udpx_prov, "busy_poll", &udpx_busy_poll);
 	return &udpx_prov;
 }
@@ -718,8 +718,27 @@ static int ip_av_slot(struct util_av *av, const struct sockaddr *sa)
 	return ((host << 16) | port) % av->hash.slots;
 }
 
+/* AV entries of an AF_INET6 capable AV are sockaddr_in6 sized. Shorter
+ * addresses are zero padded, so that the bytes that follow them in the
+ * caller's buffer don't take part in comparisons */
+static const void *ip_av_pad_addr(struct util_av *av, const void *addr,
+				  struct sockaddr_in6 *buf)
+{
+	size_t len = ofi_sizeofaddr(addr);
+
+	if (len >= av->addrlen)
+		return addr;
+
+	memset(buf, 0, sizeof(*buf));
+	memcpy(buf, addr, len);
+	return buf;
+}
+
 int ip_av_get_index(struct util_av *av, const void *addr)
 {
+	struct sockaddr_in6 buf;
+
+	addr = ip_av_pad_addr(av, addr, &buf);
 	return ofi_av_lookup_index(av, addr, ip_av_slot(av, addr));
 }
 
@@ -771,9 +790,11 @@ static int ip_av_valid_addr(struct util_av *av, const void *addr)
 static int ip_av_insert_addr(struct util_av *av, const void *addr,
 			     fi_addr_t *fi_addr, void *context)
 {
+	struct sockaddr_in6 buf;
 	int ret, index = -1;
 
 	if (ip_av_valid_addr(av, addr)) {
+		addr = ip_av_pad_addr(av, addr, &buf);
 		fastlock_acquire(&av->lock);
 		ret = ofi_av_insert_addr(av, addr, ip_av_slot(av, addr), &index);
 		fastlock_release(&av->lock);
@@ -1384,7 +1405,10 @@ void ofi_cmap_process_shutdown(struct util_cmap *cmap,
 	FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
 		"Processing shutdown for handle: %p\n", handle);
 	fastlock_acquire(&cmap->lock);
-	if (handle->state > CMAP_SHUTDOWN) {
+	if (handle->state == CMAP_CLOSING) {
+		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+		       "Got shutdown for closing connection\n");
+	} else if (handle->state > CMAP_SHUTDOWN) {
 		FI_WARN(cmap->av->prov, FI_LOG_EP_CTRL,
 			"Invalid handle on shutdown event\n");
 	} else if (handle->state != CMAP_SHUTDOWN) {
@@ -1428,6 +1452,7 @@ void ofi_cmap_process_reject(struct util_cmap *cmap,
 	case CMAP_CONNREQ_RECV:
 	case CMAP_CONNECTED:
 	case CMAP_CONNECTED_NOTIFY:
+	case CMAP_CLOSING:
 		/* Handle is being re-used for incoming connection request */
 		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
 			"Connection handle is being re-used. Ignoring reject\n");
@@ -1512,6 +1537,15 @@ int ofi_cmap_process_connreq(struct util_cmap *cmap, void *addr,
 			*handle_ret = handle;
 		}
 		break;
+	case CMAP_CLOSING:
+		/* The peer has already given up the old connection */
+		FI_DBG(cmap->av->prov, FI_LOG_EP_CTRL,
+			"Re-using closing handle: %p to accept remote "
+			"connection\n", handle);
+		handle->cmap->attr.close(handle);
+		handle->state = CMAP_CONNREQ_RECV;
+		*handle_ret = handle;
+		break;
 	case CMAP_IDLE:
 		handle->state = CMAP_CONNREQ_RECV;
 		/* Fall through */
@@ -1555,6 +1589,7 @@ int ofi_cmap_handle_connect(struct util_cmap *cmap, fi_addr_t fi_addr,
 	case CMAP_CONNREQ_SENT:
 	case CMAP_CONNREQ_RECV:
 	case CMAP_ACCEPT:
+	case CMAP_CLOSING:
 	case CMAP_SHUTDOWN:
 		ret = -FI_EAGAIN;
 		break;
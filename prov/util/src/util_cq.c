@@ -375,19 +375,17 @@ unlock:
 	return ret;
 }
 
-ssize_t ofi_cq_sreadfrom(struct fid_cq *cq_fid, void *buf, size_t count,
-			 fi_addr_t *src_addr, const void *cond, int timeout)
+static ssize_t util_cq_wait_readfrom(struct util_cq *cq, void *buf,
+				     size_t count, fi_addr_t *src_addr,
+				     int timeout)
 {
-	struct util_cq *cq;
 	uint64_t start;
 	int ret;
 
-	cq = container_of(cq_fid, struct util_cq, cq_fid);
-	assert(cq->wait && cq->internal_wait);
 	start = (timeout >= 0) ? fi_gettime_ms() : 0;
 
 	do {
-		ret = ofi_cq_readfrom(cq_fid, buf, count, src_addr);
+		ret = ofi_cq_readfrom(&cq->cq_fid, buf, count, src_addr);
 		if (ret != -FI_EAGAIN)
 			break;
 
@@ -408,12 +406,88 @@ ssize_t ofi_cq_sreadfrom(struct fid_cq *cq_fid, void *buf, size_t count,
 	return ret == -FI_ETIMEDOUT ? -FI_EAGAIN : ret;
 }
 
+static void util_busy_poll_update(struct util_busy_poll *busy_poll,
+				  uint64_t wait)
+{
+	if (wait > busy_poll->max_budget) {
+		busy_poll->budget >>= 1;
+		return;
+	}
+
+	busy_poll->avg_wait = (busy_poll->avg_wait * 7 + wait) >> 3;
+	busy_poll->budget = MIN(busy_poll->avg_wait * 2 + 1,
+				busy_poll->max_budget);
+}
+
+static ssize_t util_cq_busy_readfrom(struct util_cq *cq, void *buf,
+				     size_t count, fi_addr_t *src_addr,
+				     int timeout)
+{
+	struct util_busy_poll *busy_poll = &cq->busy_poll;
+	uint64_t start, now, end;
+	ssize_t ret;
+
+	start = fi_gettime_us();
+	end = start + busy_poll->budget;
+	if (timeout >= 0)
+		end = MIN(end, start + (uint64_t) timeout * 1000);
+
+	do {
+		ret = ofi_cq_readfrom(&cq->cq_fid, buf, count, src_addr);
+		now = fi_gettime_us();
+		if (ret != -FI_EAGAIN) {
+			busy_poll->spins++;
+			util_busy_poll_update(busy_poll, now - start);
+			return ret;
+		}
+
+		if (ofi_atomic_get32(&cq->signaled)) {
+			ofi_atomic_set32(&cq->signaled, 0);
+			return -FI_ECANCELED;
+		}
+	} while (now < end);
+
+	if (timeout >= 0) {
+		timeout -= (int) ((now - start) / 1000);
+		if (timeout <= 0)
+			return -FI_EAGAIN;
+	}
+
+	ret = util_cq_wait_readfrom(cq, buf, count, src_addr, timeout);
+	if (ret > 0) {
+		busy_poll->sleeps++;
+		util_busy_poll_update(busy_poll, fi_gettime_us() - start);
+	}
+	return ret;
+}
+
+ssize_t ofi_cq_sreadfrom(struct fid_cq *cq_fid, void *buf, size_t count,
+			 fi_addr_t *src_addr, const void *cond, int timeout)
+{
+	struct util_cq *cq;
+
+	cq = container_of(cq_fid, struct util_cq, cq_fid);
+	assert(cq->wait && cq->internal_wait);
+
+	if (cq->busy_poll.max_budget)
+		return util_cq_busy_readfrom(cq, buf, count, src_addr, timeout);
+
+	return util_cq_wait_readfrom(cq, buf, count, src_addr, timeout);
+}
+
 ssize_t ofi_cq_sread(struct fid_cq *cq_fid, void *buf, size_t count,
 		const void *cond, int timeout)
 {
 	return ofi_cq_sreadfrom(cq_fid, buf, count, NULL, cond, timeout);
 }
 
+void ofi_cq_busy_poll_init(struct util_cq *cq, uint64_t max_budget)
+{
+	memset(&cq->busy_poll, 0, sizeof(cq->busy_poll));
+	cq->busy_poll.max_budget = max_budget;
+	cq->busy_poll.budget = max_budget;
+}
+
 int ofi_cq_signal(struct fid_cq *cq_fid)
 {
 	struct util_cq *cq = container_of(cq_fid, struct util_cq, cq_fid);
@@ -447,6 +521,14 @@ int ofi_cq_cleanup(struct util_cq *cq)
 	if (ofi_atomic_get32(&cq->ref))
 		return -FI_EBUSY;
 
+	if (cq->busy_poll.max_budget) {
+		FI_INFO(cq->domain->prov, FI_LOG_CQ,
+			"busy poll: %" PRIu64 " blocking reads completed "
+			"spinning, %" PRIu64 " after waiting, final budget %"
+			PRIu64 " usec\n", cq->busy_poll.spins,
+			cq->busy_poll.sleeps, cq->busy_poll.budget);
+	}
+
 	while (!slist_empty(&cq->oflow_err_list)) {
 		entry = slist_remove_head(&cq->oflow_err_list);
 		err = container_of(entry, struct util_cq_oflow_err_entry, list_entry);
@@ -600,6 +682,7 @@ int ofi_cq_init(const struct fi_provider *prov, struct fid_domain *domain,
 	cq->cq_fid.fid.ops = &util_cq_fi_ops;
 	cq->cq_fid.ops = &util_cq_ops;
 	cq->progress = progress;
+	memset(&cq->busy_poll, 0, sizeof(cq->busy_poll));
 
 	switch (attr->format) {
 	case FI_CQ_FORMAT_UNSPEC:
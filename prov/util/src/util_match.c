@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2018 Intel Corporation. All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <ofi.h>
+#include <ofi_util.h>
+#include <ofi_match.h>
+
+
+static inline fi_addr_t ofi_mq_addr(struct ofi_mq *mq, fi_addr_t addr)
+{
+	return (mq->flags & OFI_MQ_DIRECTED) ? addr : FI_ADDR_UNSPEC;
+}
+
+static inline uint64_t ofi_mq_tag(struct ofi_mq *mq, uint64_t tag)
+{
+	return (mq->flags & OFI_MQ_TAGGED) ? tag : 0;
+}
+
+static inline size_t ofi_mq_hash(struct ofi_mq *mq, fi_addr_t addr,
+				 uint64_t tag)
+{
+	uint64_t key;
+
+	key = tag ^ (addr * 0x9e3779b97f4a7c15ULL);
+	key ^= key >> 32;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 29;
+	return key & mq->bucket_mask;
+}
+
+static inline struct dlist_entry *
+ofi_mq_bucket(struct ofi_mq *mq, fi_addr_t addr, uint64_t tag)
+{
+	return &mq->bucket[ofi_mq_hash(mq, addr, tag)];
+}
+
+static inline struct dlist_entry *
+ofi_mq_head(struct ofi_mq *mq, struct ofi_mq_entry *entry)
+{
+	if (ofi_mq_tag(mq, entry->ignore))
+		return &mq->wild_list;
+
+	return ofi_mq_bucket(mq, ofi_mq_addr(mq, entry->addr),
+			     ofi_mq_tag(mq, entry->tag));
+}
+
+/* Tag bucket of a fully specified entry, NULL if it is not indexed by tag */
+static inline struct dlist_entry *
+ofi_mq_tag_head(struct ofi_mq *mq, struct ofi_mq_entry *entry)
+{
+	if (!mq->tag_bucket || entry->ignore)
+		return NULL;
+
+	return &mq->tag_bucket[ofi_mq_hash(mq, 0, entry->tag)];
+}
+
+/* Oldest entry with a fully specified (addr, tag) equal to the given one */
+static struct ofi_mq_entry *
+ofi_mq_find_exact(struct ofi_mq *mq, fi_addr_t addr, uint64_t tag)
+{
+	struct ofi_mq_entry *entry;
+
+	dlist_foreach_container(ofi_mq_bucket(mq, addr, tag),
+				struct ofi_mq_entry, entry, entry) {
+		if (ofi_mq_addr(mq, entry->addr) == addr &&
+		    ofi_mq_tag(mq, entry->tag) == tag)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Oldest fully specified entry with the given tag, from any source */
+static struct ofi_mq_entry *ofi_mq_find_tag(struct ofi_mq *mq, uint64_t tag)
+{
+	struct ofi_mq_entry *entry;
+
+	dlist_foreach_container(&mq->tag_bucket[ofi_mq_hash(mq, 0, tag)],
+				struct ofi_mq_entry, entry, tag_entry) {
+		if (entry->tag == tag)
+			return entry;
+	}
+	return NULL;
+}
+
+int ofi_mq_init(struct ofi_mq *mq, size_t size, uint64_t flags)
+{
+	size_t i;
+
+	mq->bucket_mask = roundup_power_of_two(MAX(size, 1)) - 1;
+	mq->bucket = calloc(mq->bucket_mask + 1, sizeof(*mq->bucket));
+	if (!mq->bucket)
+		return -FI_ENOMEM;
+
+	mq->tag_bucket = NULL;
+	if ((flags & OFI_MQ_TAGGED) && (flags & OFI_MQ_DIRECTED)) {
+		mq->tag_bucket = calloc(mq->bucket_mask + 1,
+					sizeof(*mq->tag_bucket));
+		if (!mq->tag_bucket) {
+			free(mq->bucket);
+			mq->bucket = NULL;
+			return -FI_ENOMEM;
+		}
+		for (i = 0; i <= mq->bucket_mask; i++)
+			dlist_init(&mq->tag_bucket[i]);
+	}
+
+	for (i = 0; i <= mq->bucket_mask; i++)
+		dlist_init(&mq->bucket[i]);
+	dlist_init(&mq->wild_list);
+	dlist_init(&mq->list);
+	mq->seq = 0;
+	mq->flags = flags;
+	return 0;
+}
+
+void ofi_mq_close(struct ofi_mq *mq)
+{
+	free(mq->bucket);
+	free(mq->tag_bucket);
+	mq->bucket = NULL;
+	mq->tag_bucket = NULL;
+}
+
+void ofi_mq_insert(struct ofi_mq *mq, struct ofi_mq_entry *entry)
+{
+	struct dlist_entry *tag_head;
+
+	entry->seq = mq->seq++;
+	dlist_insert_tail(&entry->list_entry, &mq->list);
+	dlist_insert_tail(&entry->entry, ofi_mq_head(mq, entry));
+
+	tag_head = ofi_mq_tag_head(mq, entry);
+	if (tag_head)
+		dlist_insert_tail(&entry->tag_entry, tag_head);
+	else
+		dlist_init(&entry->tag_entry);
+}
+
+static void ofi_mq_insert_ordered(struct dlist_entry *head,
+				  struct dlist_entry *item, size_t offset,
+				  uint64_t seq)
+{
+	struct dlist_entry *prev;
+
+	for (prev = head->prev; prev != head; prev = prev->prev) {
+		if (((struct ofi_mq_entry *) ((char *) prev - offset))->seq < seq)
+			break;
+	}
+	dlist_insert_after(item, prev);
+}
+
+/*
+ * Put back a removed entry at the position given by its sequence number,
+ * e.g. a multi-recv buffer with space left or an entry whose addr changed.
+ */
+void ofi_mq_reinsert(struct ofi_mq *mq, struct ofi_mq_entry *entry)
+{
+	struct dlist_entry *tag_head;
+
+	ofi_mq_insert_ordered(&mq->list, &entry->list_entry,
+			      offsetof(struct ofi_mq_entry, list_entry),
+			      entry->seq);
+	ofi_mq_insert_ordered(ofi_mq_head(mq, entry), &entry->entry,
+			      offsetof(struct ofi_mq_entry, entry), entry->seq);
+
+	tag_head = ofi_mq_tag_head(mq, entry);
+	if (tag_head)
+		ofi_mq_insert_ordered(tag_head, &entry->tag_entry,
+				      offsetof(struct ofi_mq_entry, tag_entry),
+				      entry->seq);
+	else
+		dlist_init(&entry->tag_entry);
+}
+
+struct ofi_mq_entry *ofi_mq_find_recv(struct ofi_mq *mq, fi_addr_t addr,
+				      uint64_t tag)
+{
+	struct ofi_mq_entry *match, *entry;
+
+	addr = ofi_mq_addr(mq, addr);
+	tag = ofi_mq_tag(mq, tag);
+
+	match = ofi_mq_find_exact(mq, addr, tag);
+	if (addr != FI_ADDR_UNSPEC) {
+		entry = ofi_mq_find_exact(mq, FI_ADDR_UNSPEC, tag);
+		if (entry && (!match || entry->seq < match->seq))
+			match = entry;
+	}
+
+	dlist_foreach_container(&mq->wild_list, struct ofi_mq_entry,
+				entry, entry) {
+		if (match && entry->seq > match->seq)
+			break;
+		if (ofi_match_addr(ofi_mq_addr(mq, entry->addr), addr) &&
+		    ofi_match_tag(entry->tag, entry->ignore, tag))
+			return entry;
+	}
+	return match;
+}
+
+struct ofi_mq_entry *ofi_mq_find_msg(struct ofi_mq *mq, fi_addr_t addr,
+				     uint64_t tag, uint64_t ignore)
+{
+	struct ofi_mq_entry *entry;
+
+	addr = ofi_mq_addr(mq, addr);
+	tag = ofi_mq_tag(mq, tag);
+	ignore = ofi_mq_tag(mq, ignore);
+
+	if (!ignore) {
+		if (addr != FI_ADDR_UNSPEC || !(mq->flags & OFI_MQ_DIRECTED))
+			return ofi_mq_find_exact(mq, addr, tag);
+		/* Any source: every entry matches an untagged receive */
+		if (!mq->tag_bucket)
+			return ofi_mq_first(mq);
+		return ofi_mq_find_tag(mq, tag);
+	}
+
+	dlist_foreach_container(&mq->list, struct ofi_mq_entry,
+				entry, list_entry) {
+		if (ofi_match_addr(addr, ofi_mq_addr(mq, entry->addr)) &&
+		    ofi_match_tag(tag, ignore, ofi_mq_tag(mq, entry->tag)))
+			return entry;
+	}
+	return NULL;
+}
+
+struct ofi_mq_entry *ofi_mq_find(struct ofi_mq *mq, ofi_mq_match_func *match,
+				 const void *arg)
+{
+	struct ofi_mq_entry *entry;
+
+	dlist_foreach_container(&mq->list, struct ofi_mq_entry,
+				entry, list_entry) {
+		if (match(entry, arg))
+			return entry;
+	}
+	return NULL;
+}
@@ -41,31 +41,158 @@
 #include <fcntl.h>
 
 #include <ofi_shm.h>
+#include <fasthash.h>
 
 
+#define SMR_HASH_EMPTY	-1
+#define SMR_HASH_DELETED	-2
+
 static void smr_peer_addr_init(struct smr_addr *peer)
 {
 	memset(peer->name, 0, SMR_NAME_SIZE);
 	peer->addr = FI_ADDR_UNSPEC;
 }
 
+/*
+ * Each region carries an open addressed hash of the names in its peer
+ * table, so that a peer can locate its own entry without scanning.
+ */
+static int smr_peer_hash_slot(struct smr_region *region, const char *name)
+{
+	return (int) (fasthash32(name, strnlen(name, SMR_NAME_SIZE), 0) &
+		      (region->peer_hash_size - 1));
+}
+
+static int smr_peer_hash_lookup(struct smr_region *region, const char *name)
+{
+	int *hash = smr_peer_hash(region);
+	int i, slot, id;
+
+	slot = smr_peer_hash_slot(region, name);
+	for (i = 0; i < region->peer_hash_size; i++) {
+		id = hash[(slot + i) & (region->peer_hash_size - 1)];
+		if (id == SMR_HASH_EMPTY)
+			break;
+		if (id >= 0 && !strncmp(smr_peer_addr(region)[id].name,
+					name, SMR_NAME_SIZE))
+			return id;
+	}
+	return -1;
+}
+
+/*
+ * Removed entries leave tombstones behind so that probe chains stay
+ * intact.  Once they make up a quarter of the table, lookups for absent
+ * names degrade toward a full scan, so the table is rebuilt from the peer
+ * names.  Peers that look us up during the rebuild may miss; the mapping
+ * is completed from our side when we map them.
+ */
+static void smr_peer_hash_rebuild(struct smr_region *region)
+{
+	struct smr_addr *peers = smr_peer_addr(region);
+	int *hash = smr_peer_hash(region);
+	int i, slot;
+
+	for (i = 0; i < region->peer_hash_size; i++)
+		hash[i] = SMR_HASH_EMPTY;
+	region->peer_hash_deleted = 0;
+
+	for (i = 0; i < region->max_peers; i++) {
+		if (!peers[i].name[0])
+			continue;
+		slot = smr_peer_hash_slot(region, peers[i].name);
+		while (hash[slot] != SMR_HASH_EMPTY)
+			slot = (slot + 1) & (region->peer_hash_size - 1);
+		hash[slot] = i;
+	}
+}
+
+static void smr_peer_hash_insert(struct smr_region *region, int id)
+{
+	int *hash = smr_peer_hash(region);
+	int i, slot, free_slot = -1;
+
+	if (region->peer_hash_deleted > region->peer_hash_size / 4)
+		smr_peer_hash_rebuild(region);
+
+	slot = smr_peer_hash_slot(region, smr_peer_addr(region)[id].name);
+	for (i = 0; i < region->peer_hash_size; i++, slot++) {
+		slot &= region->peer_hash_size - 1;
+		if (hash[slot] == id)
+			return;
+		if (hash[slot] < 0 && free_slot < 0)
+			free_slot = slot;
+		if (hash[slot] == SMR_HASH_EMPTY)
+			break;
+	}
+
+	/* table holds twice max_peers entries and cannot fill */
+	assert(free_slot >= 0);
+	if (hash[free_slot] == SMR_HASH_DELETED)
+		region->peer_hash_deleted--;
+	hash[free_slot] = id;
+}
+
+static void smr_peer_hash_remove(struct smr_region *region, int id)
+{
+	int *hash = smr_peer_hash(region);
+	int i, slot;
+
+	slot = smr_peer_hash_slot(region, smr_peer_addr(region)[id].name);
+	for (i = 0; i < region->peer_hash_size; i++, slot++) {
+		slot &= region->peer_hash_size - 1;
+		if (hash[slot] == SMR_HASH_EMPTY)
+			return;
+		if (hash[slot] == id) {
+			hash[slot] = SMR_HASH_DELETED;
+			region->peer_hash_deleted++;
+			return;
+		}
+	}
+}
+
 /* TODO: Determine if aligning SMR data helps performance */
 int smr_create(const struct fi_provider *prov, struct smr_map *map,
 	       const struct smr_attr *attr, struct smr_region **smr)
 {
 	size_t total_size, cmd_queue_offset, peer_addr_offset;
 	size_t resp_queue_offset, inject_pool_offset, name_offset;
-	int fd, ret, i;
+	size_t peer_hash_offset, sar_pool_offset;
+	size_t queue_count, queue_size, cmd_queue_size;
+	size_t inject_pool_size, inject_count;
+	size_t sar_pool_size = 0;
+	int fd, ret, i, peer_hash_size;
 	void *mapped_addr;
 
-	cmd_queue_offset = sizeof(**smr);
-	resp_queue_offset = cmd_queue_offset + sizeof(struct smr_cmd_queue) +
-			sizeof(struct smr_cmd) * attr->rx_count;
-	inject_pool_offset = resp_queue_offset + sizeof(struct smr_resp_queue) +
-			sizeof(struct smr_resp) * attr->tx_count;
-	peer_addr_offset = inject_pool_offset + sizeof(struct smr_inject_pool) +
-			sizeof(struct smr_inject_pool_entry) * attr->rx_count;
-	name_offset = peer_addr_offset + sizeof(struct smr_addr) * SMR_MAX_PEERS;
+	peer_hash_size = roundup_power_of_two(map->max_peers * 2);
+
+	/* The cmd entries and inject buffers are split between the queues,
+	 * keeping room in each queue for a two entry command */
+	queue_count = roundup_power_of_two(MAX(attr->queue_count, 1));
+	queue_size = MAX(roundup_power_of_two(attr->rx_count) / queue_count, 2);
+	inject_count = MAX(roundup_power_of_two(attr->rx_count) / queue_count, 1);
+
+	cmd_queue_size = fi_get_aligned_sz(sizeof(struct smr_cmd_queue) +
+			sizeof(struct smr_cmd_queue_entry) * queue_size,
+			SMR_CACHE_LINE_SIZE);
+	inject_pool_size = fi_get_aligned_sz(sizeof(struct smr_inject_pool) +
+			sizeof(struct smr_inject_pool_entry) * inject_count,
+			SMR_CACHE_LINE_SIZE);
+
+	cmd_queue_offset = fi_get_aligned_sz(sizeof(**smr), SMR_CACHE_LINE_SIZE);
+	resp_queue_offset = cmd_queue_offset + cmd_queue_size * queue_count;
+	inject_pool_offset = fi_get_aligned_sz(resp_queue_offset +
+			sizeof(struct smr_resp_queue) +
+			sizeof(struct smr_resp) * attr->tx_count,
+			SMR_CACHE_LINE_SIZE);
+	sar_pool_offset = inject_pool_offset + inject_pool_size * queue_count;
+	if (attr->flags & SMR_FLAG_SAR)
+		sar_pool_size = sizeof(struct smr_sar_pool) +
+			sizeof(struct smr_sar_pool_entry) * SMR_SAR_COUNT;
+	peer_addr_offset = sar_pool_offset + sar_pool_size;
+	peer_hash_offset = peer_addr_offset +
+			sizeof(struct smr_addr) * map->max_peers;
+	name_offset = peer_hash_offset + sizeof(int) * peer_hash_size;
 	total_size = name_offset + strlen(attr->name) + 1;
 	total_size = roundup_power_of_two(total_size);
 
@@ -92,30 +219,43 @@ int smr_create(const struct fi_provider *prov, struct smr_map *map,
 	close(fd);
 
 	*smr = mapped_addr;
-	fastlock_init(&(*smr)->lock);
-	fastlock_acquire(&(*smr)->lock);
 
 	(*smr)->map = map;
+	(*smr)->base_addr = mapped_addr;
 	(*smr)->version = SMR_VERSION;
-	(*smr)->flags = SMR_FLAG_ATOMIC | SMR_FLAG_DEBUG;
-	(*smr)->pid = getpid();
+	(*smr)->flags = SMR_FLAG_ATOMIC | SMR_FLAG_DEBUG | attr->flags;
 
 	(*smr)->total_size = total_size;
 	(*smr)->cmd_queue_offset = cmd_queue_offset;
 	(*smr)->resp_queue_offset = resp_queue_offset;
 	(*smr)->inject_pool_offset = inject_pool_offset;
+	(*smr)->sar_pool_offset = sar_pool_offset;
 	(*smr)->peer_addr_offset = peer_addr_offset;
+	(*smr)->peer_hash_offset = peer_hash_offset;
 	(*smr)->name_offset = name_offset;
-	(*smr)->cmd_cnt = attr->rx_count;
-
-	smr_cmd_queue_init(smr_cmd_queue(*smr), attr->rx_count);
+	(*smr)->max_peers = map->max_peers;
+	(*smr)->peer_hash_size = peer_hash_size;
+	(*smr)->peer_hash_deleted = 0;
+	(*smr)->queue_count = (int) queue_count;
+	(*smr)->cmd_queue_size = cmd_queue_size;
+	(*smr)->inject_pool_size = inject_pool_size;
+
+	for (i = 0; i < queue_count; i++) {
+		smr_cmd_queue_init(smr_cmd_queue(*smr, i), queue_size);
+		smr_inject_pool_init(smr_inject_pool(*smr, i), inject_count);
+	}
 	smr_resp_queue_init(smr_resp_queue(*smr), attr->tx_count);
-	smr_inject_pool_init(smr_inject_pool(*smr), attr->rx_count);
-	for (i = 0; i < SMR_MAX_PEERS; i++)
+	if (attr->flags & SMR_FLAG_SAR)
+		smr_sar_pool_init(smr_sar_pool(*smr), SMR_SAR_COUNT);
+	for (i = 0; i < map->max_peers; i++)
 		smr_peer_addr_init(&smr_peer_addr(*smr)[i]);
+	for (i = 0; i < peer_hash_size; i++)
+		smr_peer_hash(*smr)[i] = SMR_HASH_EMPTY;
 
 	strncpy((char *) smr_name(*smr), attr->name, total_size - name_offset);
-	fastlock_release(&(*smr)->lock);
+
+	/* A non-zero pid marks the region as initialized to peers */
+	(*smr)->pid = getpid();
 
 	return 0;
 
@@ -134,7 +274,10 @@ void smr_free(struct smr_region *smr)
 int smr_map_create(const struct fi_provider *prov, int peer_count,
 		   struct smr_map **map)
 {
-	int i;
+	if (peer_count <= 0 || peer_count > SMR_MAX_PEERS) {
+		FI_WARN(prov, FI_LOG_DOMAIN, "invalid SHM peer count\n");
+		return -FI_EINVAL;
+	}
 
 	(*map) = calloc(1, sizeof(struct smr_map));
 	if (!*map) {
@@ -142,9 +285,8 @@ int smr_map_create(const struct fi_provider *prov, int peer_count,
 		return -FI_ENOMEM;
 	}
 
-	for (i = 0; i < peer_count; i++)
-		smr_peer_addr_init(&(*map)->peers[i].peer);
-
+	(*map)->max_peers = peer_count;
+	dlist_init(&(*map)->peer_list);
 	fastlock_init(&(*map)->lock);
 
 	return 0;
@@ -181,6 +323,11 @@ int smr_map_to_region(const struct fi_provider *prov, struct smr_peer *peer_buf)
 	munmap(peer, sizeof(*peer));
 
 	peer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (peer == MAP_FAILED) {
+		FI_WARN(prov, FI_LOG_AV, "mmap error\n");
+		ret = -errno;
+		goto out;
+	}
 	peer_buf->region = peer;
 
 out:
@@ -192,24 +339,28 @@ void smr_map_to_endpoint(struct smr_region *region, int index)
 {
 	struct smr_region *peer_smr;
 	struct smr_addr *local_peers, *peer_peers;
+	struct smr_peer *peer;
 	int peer_index;
 
+	peer = smr_map_get(region->map, index);
+	if (!peer)
+		return;
+
 	local_peers = smr_peer_addr(region);
 
-	strncpy(smr_peer_addr(region)[index].name,
-		region->map->peers[index].peer.name, SMR_NAME_SIZE);
-	if (region->map->peers[index].peer.addr == FI_ADDR_UNSPEC)
+	if (strncmp(local_peers[index].name, peer->peer.name, SMR_NAME_SIZE)) {
+		strncpy(local_peers[index].name, peer->peer.name,
+			SMR_NAME_SIZE);
+		smr_peer_hash_insert(region, index);
+	}
+	if (peer->peer.addr == FI_ADDR_UNSPEC)
 		return;
 
-	peer_smr = smr_peer_region(region, index);
+	peer_smr = peer->region;
 	peer_peers = smr_peer_addr(peer_smr);
 
-	for (peer_index = 0; peer_index < SMR_MAX_PEERS; peer_index++) {
-		if (!strncmp(smr_name(region),
-		    peer_peers[peer_index].name, SMR_NAME_SIZE))
-			break;
-	}
-	if (peer_index != SMR_MAX_PEERS) {
+	peer_index = smr_peer_hash_lookup(peer_smr, smr_name(region));
+	if (peer_index >= 0) {
 		peer_peers[peer_index].addr = index;
 		local_peers[index].addr = peer_index;
 	}
@@ -219,16 +370,21 @@ void smr_unmap_from_endpoint(struct smr_region *region, int index)
 {
 	struct smr_region *peer_smr;
 	struct smr_addr *local_peers, *peer_peers;
-	int peer_index;
+	struct smr_peer *peer;
+	fi_addr_t peer_index;
 
 	local_peers = smr_peer_addr(region);
+	peer_index = local_peers[index].addr;
 
-	memset(local_peers[index].name, 0, SMR_NAME_SIZE);
-	peer_index = region->map->peers[index].peer.addr;
-	if (peer_index == FI_ADDR_UNSPEC)
+	smr_peer_hash_remove(region, index);
+	smr_peer_addr_init(&local_peers[index]);
+
+	peer = smr_map_get(region->map, index);
+	if (!peer || peer->peer.addr == FI_ADDR_UNSPEC ||
+	    peer_index == FI_ADDR_UNSPEC)
 		return;
 
-	peer_smr = smr_peer_region(region, index);
+	peer_smr = peer->region;
 	peer_peers = smr_peer_addr(peer_smr);
 
 	peer_peers[peer_index].addr = FI_ADDR_UNSPEC;
@@ -236,51 +392,91 @@ void smr_unmap_from_endpoint(struct smr_region *region, int index)
 
 void smr_exchange_all_peers(struct smr_region *region)
 {
-	int i;
-	for (i = 0; i < SMR_MAX_PEERS; i++)
-		smr_map_to_endpoint(region, i);
+	struct smr_map *map = region->map;
+	struct smr_peer *peer;
+
+	fastlock_acquire(&map->lock);
+	dlist_foreach_container(&map->peer_list, struct smr_peer, peer, entry)
+		smr_map_to_endpoint(region, peer->id);
+	fastlock_release(&map->lock);
 }
 
 int smr_map_add(const struct fi_provider *prov, struct smr_map *map,
 		const char *name, int id)
 {
+	struct smr_peer *peer;
 	int ret = 0;
 
+	if (id < 0 || id >= map->max_peers)
+		return -FI_EINVAL;
+
 	fastlock_acquire(&map->lock);
-	strncpy(map->peers[id].peer.name, name, SMR_NAME_SIZE);
-	map->peers[id].peer.name[SMR_NAME_SIZE - 1] = '\0';
-	ret = smr_map_to_region(prov, &map->peers[id]);
-	if (!ret)
-		map->peers[id].peer.addr = id;
+	peer = ofi_idm_lookup(&map->peers, id);
+	if (!peer) {
+		peer = calloc(1, sizeof(*peer));
+		if (!peer) {
+			ret = -FI_ENOMEM;
+			goto out;
+		}
+		if (ofi_idm_set(&map->peers, id, peer) < 0) {
+			free(peer);
+			ret = -FI_ENOMEM;
+			goto out;
+		}
+		peer->id = id;
+		dlist_insert_tail(&peer->entry, &map->peer_list);
+	}
+
+	smr_peer_addr_init(&peer->peer);
+	strncpy(peer->peer.name, name, SMR_NAME_SIZE);
+	peer->peer.name[SMR_NAME_SIZE - 1] = '\0';
+out:
 	fastlock_release(&map->lock);
+	return ret;
+}
 
-	return ret == -ENOENT ? 0 : ret;
+static void smr_map_release(struct smr_map *map, struct smr_peer *peer)
+{
+	if (peer->peer.addr != FI_ADDR_UNSPEC)
+		munmap(peer->region, peer->region->total_size);
+	dlist_remove(&peer->entry);
+	ofi_idm_clear(&map->peers, peer->id);
+	free(peer);
 }
 
 void smr_map_del(struct smr_map *map, int id)
 {
-	if (id >= SMR_MAX_PEERS || id < 0 ||
-	    map->peers[id].peer.addr == FI_ADDR_UNSPEC)
+	struct smr_peer *peer;
+
+	if (id >= map->max_peers || id < 0)
 		return;
 
-	munmap(map->peers[id].region, map->peers[id].region->total_size);
-	map->peers[id].peer.addr = FI_ADDR_UNSPEC;
+	fastlock_acquire(&map->lock);
+	peer = ofi_idm_lookup(&map->peers, id);
+	if (peer)
+		smr_map_release(map, peer);
+	fastlock_release(&map->lock);
 }
 
 void smr_map_free(struct smr_map *map)
 {
-	int i;
+	struct smr_peer *peer;
 
-	for (i = 0; i < SMR_MAX_PEERS; i++)
-		smr_map_del(map, i);
+	while (!dlist_empty(&map->peer_list)) {
+		peer = container_of(map->peer_list.next, struct smr_peer,
+				    entry);
+		smr_map_release(map, peer);
+	}
 
+	ofi_idm_reset(&map->peers);
+	fastlock_destroy(&map->lock);
 	free(map);
 }
 
-struct smr_region *smr_map_get(struct smr_map *map, int id)
+struct smr_peer *smr_map_get(struct smr_map *map, int id)
 {
-	if (id < 0 || id >= SMR_MAX_PEERS)
+	if (id < 0 || id >= map->max_peers)
 		return NULL;
 
-	return map->peers[id].region;
+	return ofi_idm_lookup(&map->peers, id);
 }